@@ -0,0 +1,118 @@
+#include "bringup.h"
+#include "lgp.h"
+
+#include <string.h>
+#include <time.h>
+
+static const char *statenames[BRINGUP_STATES] = {
+    "enumerate", "configure", "firmware", "video-ready", "streaming", "running", "failed"
+};
+
+static void bringup_sleep(unsigned int ms) {
+    struct timespec ts = {ms / 1000, (ms % 1000) * 1000000L};
+    nanosleep(&ts, NULL);
+}
+
+void bringup_init(struct bringup *b) {
+    memset(b, 0, sizeof (struct bringup));
+    b->started = lgp_now_ns();
+    b->entered = b->started;
+    b->state = BRINGUP_ENUMERATE;
+}
+
+void bringup_enter(struct bringup *b, enum bringup_state state) {
+    uint64_t now = lgp_now_ns();
+    b->timeinstate[b->state] += now - b->entered;
+    fprintf(stderr, "Bring-up: %s -> %s after %.2f ms\n", statenames[b->state], statenames[state], (now - b->entered) / 1e6);
+    b->state = state;
+    b->entered = now;
+}
+
+int bringup_poll(struct bringup *b, struct transport *transport, uint32_t address, uint32_t mask, uint32_t expected, unsigned int deadline) {
+    // Register read: 01 00 <count16> <addr32>
+    unsigned char command[8] = {0x01, 0x00, 0x01, 0x00, address & 0xff, (address >> 8) & 0xff, (address >> 16) & 0xff, (address >> 24) & 0xff};
+    unsigned char response[USB_BULK_MAX_PACKET_SIZE];
+    uint64_t end = lgp_now_ns() + deadline * 1000000ULL;
+    unsigned int backoff = BRINGUP_POLL_MIN;
+    int transferred = 0;
+
+    for (;;) {
+        uint64_t now = lgp_now_ns();
+        if (now >= end)
+            break;
+        unsigned int remaining = (end - now + 999999) / 1000000;
+
+        b->polls[b->state]++;
+        int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_CONTROL, command, sizeof (command), &transferred, TIMEOUT);
+        if (err != 0) {
+            fprintf(stderr, "Error while polling register 0x%.4x: '%s' - '%s'\n", address, libusb_error_name(err), libusb_strerror(err));
+            return -1;
+        }
+
+        err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, response, sizeof (response), &transferred,
+                remaining < TIMEOUT ? remaining : TIMEOUT);
+        if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
+            fprintf(stderr, "Error while reading register 0x%.4x: '%s' - '%s'\n", address, libusb_error_name(err), libusb_strerror(err));
+            return -1;
+        }
+        if (err == 0 && transferred >= 4) {
+            uint32_t value = response[0] | (response[1] << 8) | (response[2] << 16) | ((uint32_t) response[3] << 24);
+            if ((value & mask) == expected)
+                return 0;
+        }
+
+        // Not there yet, back off a little more every time without sleeping past the deadline
+        now = lgp_now_ns();
+        if (now >= end)
+            break;
+        remaining = (end - now + 999999) / 1000000;
+        bringup_sleep(backoff < remaining ? backoff : remaining);
+        backoff = backoff * 2 < BRINGUP_POLL_MAX ? backoff * 2 : BRINGUP_POLL_MAX;
+    }
+
+    fprintf(stderr, "Register 0x%.4x did not read 0x%.8x within %u ms in state %s!\n", address, expected, deadline, statenames[b->state]);
+    return -1;
+}
+
+int bringup_waitresponsive(struct bringup *b, struct transport *transport) {
+    return bringup_poll(b, transport, CAMERA_REGISTER_VIDEO_READY, 0, 0, BRINGUP_RESPONSE_DEADLINE);
+}
+
+int bringup_waitvideoready(struct bringup *b, struct transport *transport) {
+    return bringup_poll(b, transport, CAMERA_REGISTER_VIDEO_READY, 0xffffffff, CAMERA_VIDEO_READY_VALUE, BRINGUP_VIDEOREADY_DEADLINE);
+}
+
+void bringup_firstframe(struct bringup *b, uint64_t when) {
+    if (b->state != BRINGUP_STREAMING)
+        return;
+    // The completion may predate the check, account up to it
+    uint64_t now = lgp_now_ns();
+    if (when < b->entered || when > now)
+        when = now;
+    b->timeinstate[BRINGUP_STREAMING] += when - b->entered;
+    fprintf(stderr, "Bring-up: first frame %.2f ms after the start\n", (when - b->started) / 1e6);
+    b->state = BRINGUP_RUNNING;
+    b->entered = when;
+}
+
+const char *bringup_statename(enum bringup_state state) {
+    return state < BRINGUP_STATES ? statenames[state] : "unknown";
+}
+
+void bringup_report(struct bringup *b, FILE *out) {
+    fprintf(out, "Bring-up:");
+    for (int i = BRINGUP_ENUMERATE; i <= BRINGUP_STREAMING; i++) {
+        uint64_t elapsed = b->timeinstate[i];
+        if ((enum bringup_state) i == b->state)
+            elapsed += lgp_now_ns() - b->entered;
+        fprintf(out, " %s %.2f ms", statenames[i], elapsed / 1e6);
+        if (b->polls[i] > 0)
+            fprintf(out, " (%zu polls)", b->polls[i]);
+        if (i < BRINGUP_STREAMING)
+            fputc(',', out);
+    }
+    if (b->state == BRINGUP_RUNNING)
+        fprintf(out, "; time to first frame %.2f ms\n", (b->entered - b->started) / 1e6);
+    else
+        fprintf(out, "; stuck in %s\n", statenames[b->state]);
+}
@@ -0,0 +1,56 @@
+#ifndef BRINGUP_H
+#define BRINGUP_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "transport.h"
+
+// Deadlines of the states waiting on the device, ms
+#define BRINGUP_RESPONSE_DEADLINE		2000
+#define BRINGUP_VIDEOREADY_DEADLINE		10000
+#define BRINGUP_FIRSTFRAME_DEADLINE		5000
+
+// Backoff between two polls, doubled after every miss, ms
+#define BRINGUP_POLL_MIN		1
+#define BRINGUP_POLL_MAX		100
+
+enum bringup_state {
+    BRINGUP_ENUMERATE,		// finding, configuring and claiming the camera
+    BRINGUP_CONFIGURE,		// LED and init sequence, until the device answers register reads
+    BRINGUP_FIRMWARE,
+    BRINGUP_VIDEOREADY,		// until register 0x0800 reads 07 00 01 00
+    BRINGUP_STREAMING,		// until the first data on EP. 81
+    BRINGUP_RUNNING,
+    BRINGUP_FAILED,
+    BRINGUP_STATES
+};
+
+// Tracks bring-up from the process start to the first frame. Waits on the device
+// are register reads answered on EP. 83, polled with a short backoff until a deadline.
+struct bringup {
+    enum bringup_state state;
+    uint64_t started;		// ns
+    uint64_t entered;		// ns, when the current state was entered
+    uint64_t timeinstate[BRINGUP_STATES];
+    size_t polls[BRINGUP_STATES];
+};
+
+void bringup_init(struct bringup *b);
+// Accounts the time spent in the current state, entering BRINGUP_FAILED keeps it as the last one.
+void bringup_enter(struct bringup *b, enum bringup_state state);
+
+// Polls a register until (value & mask) == expected, -1 once deadline ms are over.
+int bringup_poll(struct bringup *b, struct transport *transport, uint32_t address, uint32_t mask, uint32_t expected, unsigned int deadline);
+
+// Configure is over once the device answers a register read at all.
+int bringup_waitresponsive(struct bringup *b, struct transport *transport);
+int bringup_waitvideoready(struct bringup *b, struct transport *transport);
+
+// Leaves BRINGUP_STREAMING at the time of the first EP. 81 completion carrying data.
+void bringup_firstframe(struct bringup *b, uint64_t when);
+
+const char *bringup_statename(enum bringup_state state);
+void bringup_report(struct bringup *b, FILE *out);
+
+#endif
@@ -0,0 +1,338 @@
+#include "capture.h"
+#include "lgp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+static void capture_transfer_done(struct libusb_transfer *transfer) {
+    struct capture_slot *slot = (struct capture_slot*) transfer->user_data;
+    struct capture *cap = slot->cap;
+    uint64_t now = lgp_now_ns();
+
+    cap->inflight--;
+    transport_record(cap->transport, transfer, slot->submitted, now);
+
+    // Gap between two completions, the first one is measured from the start
+    uint64_t previous = cap->stats.last_completion ? cap->stats.last_completion : cap->stats.started;
+    uint64_t gap = now - previous;
+    if (gap > cap->stats.max_gap)
+        cap->stats.max_gap = gap;
+    if (gap > cap->gap_threshold)
+        cap->stats.gaps++;
+    cap->stats.last_completion = now;
+
+    switch (transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            cap->stats.completions++;
+            if (transfer->actual_length > 0) {
+                cap->stats.bytes += transfer->actual_length;
+                if (cap->stats.first_data == 0)
+                    cap->stats.first_data = now;
+                if (cap->stats.resumed != 0 && cap->stats.resumed_data == 0)
+                    cap->stats.resumed_data = now;
+                cap->stats.last_data = now;
+                slot->buffer->length = transfer->actual_length;
+                slot->buffer->timestamp = now;
+                slot->buffer->sequence = cap->sequence++;
+                if (cap->callback != NULL)
+                    slot->buffer = cap->callback(cap->userdata, slot->buffer);
+                transfer->buffer = slot->buffer->data;
+            } else {
+                cap->stats.empty++;
+            }
+            break;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            // Nothing on the stream yet, keep the transfer queued
+            cap->stats.timeouts++;
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            // Every transfer in flight ends like this, one message is enough
+            cap->stats.errors++;
+            if (!cap->disconnected)
+                fprintf(stderr, "Capture device went away, stopping!\n");
+            cap->disconnected = 1;
+            cap->failed = 1;
+            cap->running = 0;
+            return;
+        default:
+            cap->stats.errors++;
+            fprintf(stderr, "Capture transfer failed with status %i on endpoint 0x81, stopping!\n", transfer->status);
+            cap->failed = 1;
+            cap->running = 0;
+            return;
+    }
+
+    if (!cap->running)
+        return;
+
+    slot->submitted = now;
+    cap->inflight++;
+    int err = transport_submit_transfer(cap->transport, transfer);
+    if (err != 0) {
+        cap->inflight--;
+        fprintf(stderr, "Error while resubmitting capture transfer: '%s' - '%s'\n", libusb_error_name(err), libusb_strerror(err));
+        cap->stats.errors++;
+        if (err == LIBUSB_ERROR_NO_DEVICE)
+            cap->disconnected = 1;
+        cap->failed = 1;
+        cap->running = 0;
+        return;
+    }
+}
+
+static void *capture_event_thread(void *arg) {
+    struct capture *cap = (struct capture*) arg;
+
+    // Keep pumping events until every transfer came back, even after a stop request
+    while (cap->running || cap->inflight > 0) {
+        struct timeval tv = {0, 100000};
+        int err = transport_handle_events(cap->transport, &tv);
+        if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Error while handling USB events: '%s' - '%s'\n", libusb_error_name(err), libusb_strerror(err));
+            cap->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+// Pumps the events of every capture of the loop until they all stopped and got their transfers back.
+static void *capture_loop_thread(void *arg) {
+    struct capture_loop *loop = (struct capture_loop*) arg;
+
+    while (1) {
+        int busy = loop->running;
+        for (size_t i = 0; i < loop->count && !busy; i++)
+            busy = loop->captures[i]->inflight > 0;
+        if (!busy)
+            break;
+
+        struct timeval tv = {0, 100000};
+        int err = transport_handle_events(loop->transport, &tv);
+        if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Error while handling USB events: '%s' - '%s'\n", libusb_error_name(err), libusb_strerror(err));
+            loop->failed = 1;
+            for (size_t i = 0; i < loop->count; i++)
+                loop->captures[i]->failed = 1;
+            break;
+        }
+    }
+    return NULL;
+}
+
+void capture_loop_init(struct capture_loop *loop, struct transport *transport) {
+    memset(loop, 0, sizeof (struct capture_loop));
+    loop->transport = transport;
+}
+
+int capture_loop_add(struct capture_loop *loop, struct capture *cap) {
+    if (loop->count == CAPTURE_LOOP_MAX || loop->running) {
+        fprintf(stderr, "No more captures can join the event loop!\n");
+        return -1;
+    }
+    loop->captures[loop->count++] = cap;
+    cap->loop = loop;
+    return 0;
+}
+
+int capture_loop_start(struct capture_loop *loop) {
+    loop->running = 1;
+    if (pthread_create(&loop->thread, NULL, capture_loop_thread, loop) != 0) {
+        fprintf(stderr, "Failed to start the USB event thread!\n");
+        loop->running = 0;
+        return -1;
+    }
+    loop->started = 1;
+    // From now on the callbacks of every device run on the loop thread only
+    for (size_t i = 0; i < loop->count; i++)
+        atomic_store(&loop->captures[i]->transport->pumped, 1);
+    return 0;
+}
+
+void capture_loop_stop(struct capture_loop *loop) {
+    if (!loop->started)
+        return;
+    loop->running = 0;
+    pthread_join(loop->thread, NULL);
+    loop->started = 0;
+    for (size_t i = 0; i < loop->count; i++)
+        atomic_store(&loop->captures[i]->transport->pumped, 0);
+}
+
+int capture_init(struct capture *cap, struct transport *transport, size_t depth, size_t transfersize,
+        struct streambuffer **buffers, capture_callback callback, void *userdata) {
+    memset(cap, 0, sizeof (struct capture));
+    cap->transport = transport;
+    cap->depth = depth > 0 ? depth : CAPTURE_DEFAULT_DEPTH;
+    cap->transfersize = transfersize > 0 ? transfersize : VIDEO_TRANSFER_SIZE;
+    cap->gap_threshold = CAPTURE_DEFAULT_GAP_THRESHOLD;
+    cap->callback = callback;
+    cap->userdata = userdata;
+
+    cap->slots = (struct capture_slot*) calloc(cap->depth, sizeof (struct capture_slot));
+    if (cap->slots == NULL)
+        goto error;
+
+    if (buffers == NULL) {
+        cap->ownbuffers = (struct streambuffer*) calloc(cap->depth, sizeof (struct streambuffer));
+        if (cap->ownbuffers == NULL)
+            goto error;
+    }
+
+    for (size_t i = 0; i < cap->depth; i++) {
+        struct capture_slot *slot = &cap->slots[i];
+        slot->cap = cap;
+
+        if (buffers != NULL) {
+            slot->buffer = buffers[i];
+        } else {
+            slot->buffer = &cap->ownbuffers[i];
+            slot->buffer->data = transport_alloc_buffer(transport, cap->transfersize);
+            slot->buffer->capacity = cap->transfersize;
+            if (slot->buffer->data == NULL)
+                goto error;
+        }
+
+        slot->transfer = transport_alloc_transfer(transport);
+        if (slot->transfer == NULL)
+            goto error;
+
+        transport_fill_bulk_transfer(transport, slot->transfer, CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE, slot->buffer->data, cap->transfersize, capture_transfer_done, slot, TIMEOUT);
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "Failed to allocate %zu capture transfers of %zu bytes!\n", cap->depth, cap->transfersize);
+    capture_free(cap);
+    return -1;
+}
+
+// Queues every transfer, the event thread may already complete the first ones meanwhile.
+static void capture_submitall(struct capture *cap) {
+    for (size_t i = 0; i < cap->depth; i++) {
+        cap->slots[i].submitted = lgp_now_ns();
+        cap->inflight++;
+        int err = transport_submit_transfer(cap->transport, cap->slots[i].transfer);
+        if (err != 0) {
+            cap->inflight--;
+            fprintf(stderr, "Error while submitting capture transfer %zu: '%s' - '%s'\n", i, libusb_error_name(err), libusb_strerror(err));
+            // Let the event thread collect the transfers already queued
+            cap->running = 0;
+            cap->failed = 1;
+            if (err == LIBUSB_ERROR_NO_DEVICE)
+                cap->disconnected = 1;
+            for (size_t j = 0; j < i; j++)
+                transport_cancel_transfer(cap->transport, cap->slots[j].transfer);
+            break;
+        }
+    }
+}
+
+int capture_start(struct capture *cap) {
+    cap->running = 1;
+    cap->failed = 0;
+    cap->stats.started = lgp_now_ns();
+
+    capture_submitall(cap);
+
+    if (cap->loop != NULL)
+        return cap->failed ? -1 : 0;
+    if (pthread_create(&cap->eventthread, NULL, capture_event_thread, cap) != 0) {
+        fprintf(stderr, "Failed to start the USB event thread!\n");
+        // The transfers are queued already, capture_stop() collects them without the thread
+        cap->running = 0;
+        return -1;
+    }
+    cap->threadstarted = 1;
+    atomic_store(&cap->transport->pumped, 1);
+    return cap->failed ? -1 : 0;
+}
+
+int capture_stop(struct capture *cap) {
+    cap->running = 0;
+    for (size_t i = 0; i < cap->depth; i++)
+        transport_cancel_transfer(cap->transport, cap->slots[i].transfer);
+
+    if (cap->threadstarted) {
+        pthread_join(cap->eventthread, NULL);
+        cap->threadstarted = 0;
+        atomic_store(&cap->transport->pumped, 0);
+    } else if (cap->loop != NULL && cap->loop->started) {
+        // The shared thread collects the cancelled transfers
+        while (cap->inflight > 0 && !cap->loop->failed)
+            usleep(1000);
+    } else {
+        // Nobody handles the events, the loop is not started yet or the event thread failed to start
+        while (cap->inflight > 0) {
+            struct timeval tv = {0, 100000};
+            if (transport_handle_events(cap->transport, &tv) != 0)
+                break;
+        }
+    }
+    return cap->failed ? -1 : 0;
+}
+
+int capture_resume(struct capture *cap) {
+    if (cap->inflight > 0) {
+        fprintf(stderr, "Capture transfers still in flight, cannot resume!\n");
+        return -1;
+    }
+    cap->running = 1;
+    cap->failed = 0;
+    cap->disconnected = 0;
+    cap->stats.resumed = lgp_now_ns();
+    cap->stats.resumed_data = 0;
+
+    // The slots may hold other buffers than at the start, the writer swapped them
+    for (size_t i = 0; i < cap->depth; i++) {
+        struct capture_slot *slot = &cap->slots[i];
+        transport_fill_bulk_transfer(cap->transport, slot->transfer, CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE, slot->buffer->data, cap->transfersize, capture_transfer_done, slot, TIMEOUT);
+    }
+    capture_submitall(cap);
+
+    if (cap->loop != NULL)
+        return cap->failed ? -1 : 0;
+    if (pthread_create(&cap->eventthread, NULL, capture_event_thread, cap) != 0) {
+        fprintf(stderr, "Failed to start the USB event thread!\n");
+        // The transfers are queued already, capture_stop() collects them without the thread
+        cap->running = 0;
+        return -1;
+    }
+    cap->threadstarted = 1;
+    atomic_store(&cap->transport->pumped, 1);
+    return cap->failed ? -1 : 0;
+}
+
+void capture_free(struct capture *cap) {
+    if (cap->slots != NULL) {
+        for (size_t i = 0; i < cap->depth; i++) {
+            if (cap->slots[i].transfer != NULL)
+                transport_free_transfer(cap->transport, cap->slots[i].transfer);
+        }
+    }
+    if (cap->ownbuffers != NULL) {
+        for (size_t i = 0; i < cap->depth; i++)
+            transport_free_buffer(cap->transport, cap->ownbuffers[i].data, cap->ownbuffers[i].capacity);
+    }
+    free(cap->slots);
+    free(cap->ownbuffers);
+    cap->slots = NULL;
+    cap->ownbuffers = NULL;
+    cap->depth = 0;
+}
+
+void capture_report(struct capture *cap, FILE *out) {
+    uint64_t elapsed = lgp_now_ns() - cap->stats.started;
+    double seconds = elapsed / 1e9;
+    double mbps = seconds > 0 ? cap->stats.bytes / seconds / (1024.0 * 1024.0) : 0;
+
+    fprintf(out, "Capture: %.1f s, %llu bytes, %.2f MB/s, %llu completions (%llu empty, %llu timeouts, %llu errors), %llu gaps > %.1f ms, max gap %.2f ms, depth %zu x %zu bytes\n",
+            seconds, (unsigned long long) cap->stats.bytes, mbps,
+            (unsigned long long) cap->stats.completions, (unsigned long long) cap->stats.empty,
+            (unsigned long long) cap->stats.timeouts, (unsigned long long) cap->stats.errors,
+            (unsigned long long) cap->stats.gaps, cap->gap_threshold / 1e6, cap->stats.max_gap / 1e6,
+            cap->depth, cap->transfersize);
+}
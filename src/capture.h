@@ -0,0 +1,119 @@
+#ifndef CAPTURE_H
+#define CAPTURE_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "transport.h"
+
+#define CAPTURE_DEFAULT_DEPTH			8
+#define CAPTURE_DEFAULT_GAP_THRESHOLD	(20 * 1000000ULL)	// 20 ms
+#define CAPTURE_LOOP_MAX				16
+
+// One transfer worth of stream data
+struct streambuffer {
+    unsigned char *data;
+    size_t capacity;
+    size_t length;
+    uint64_t timestamp;		// ns, host time of the completion
+    uint64_t sequence;		// completion counter, not incremented for empty transfers
+};
+
+// Called from the event thread for every completed transfer on EP. 81 carrying data.
+// Returns the buffer to resubmit the transfer with: the same one when the data was
+// consumed in place, or a spare one when the callback kept the completed buffer.
+typedef struct streambuffer *(*capture_callback)(void *userdata, struct streambuffer *buffer);
+
+struct capture_stats {
+    uint64_t bytes;
+    uint64_t completions;
+    uint64_t empty;			// completions with no payload
+    uint64_t timeouts;
+    uint64_t errors;
+    uint64_t gaps;			// time between two completions above gap_threshold
+    uint64_t max_gap;		// ns
+    uint64_t started;		// ns
+    uint64_t first_data;	// ns, first completion carrying data, 0 until then
+    uint64_t last_data;		// ns
+    uint64_t last_completion;	// ns
+    uint64_t resumed;		// ns, last capture_resume(), 0 if never
+    uint64_t resumed_data;	// ns, first completion carrying data after it
+};
+
+struct capture_slot {
+    struct capture *cap;
+    struct libusb_transfer *transfer;
+    struct streambuffer *buffer;
+    uint64_t submitted;		// ns
+};
+
+struct capture_loop;
+
+struct capture {
+    struct transport *transport;
+    struct capture_loop *loop;	// shared event thread, NULL for one of its own
+
+    size_t depth;			// number of transfers kept in flight
+    size_t transfersize;
+    uint64_t gap_threshold;	// ns
+
+    struct capture_slot *slots;
+    struct streambuffer *ownbuffers;	// only when no buffers were given to capture_init
+    uint64_t sequence;
+
+    capture_callback callback;
+    void *userdata;
+
+    pthread_t eventthread;
+    int threadstarted;		// eventthread is to be joined
+    volatile int running;
+    volatile int failed;	// set when a transfer ends with an unrecoverable status
+    volatile int disconnected;	// the device went away, see capture_resume()
+    atomic_int inflight;	// resubmitted on the event thread, queued again from the main thread on resume
+
+    struct capture_stats stats;
+};
+
+// buffers can hold depth caller owned buffers of at least transfersize bytes, or be NULL
+// to let the engine allocate its own (the callback must then always hand them back).
+int capture_init(struct capture *cap, struct transport *transport, size_t depth, size_t transfersize,
+        struct streambuffer **buffers, capture_callback callback, void *userdata);
+int capture_start(struct capture *cap);
+int capture_stop(struct capture *cap);
+// Queues the transfers again once the device that went away is back, after
+// capture_stop(). The buffers stay those of the capture, so the stream goes
+// on to the same consumer; the transfers are filled again with the handle
+// the transport has by then.
+int capture_resume(struct capture *cap);
+void capture_free(struct capture *cap);
+
+// One event thread for the captures of several devices on the same USB context
+// (or emulator bus): handling the events of any of their transports completes
+// the transfers of all, so devices are added without adding threads.
+struct capture_loop {
+    struct transport *transport;	// any transport of the context
+    struct capture *captures[CAPTURE_LOOP_MAX];
+    size_t count;
+
+    pthread_t thread;
+    int started;
+    volatile int running;
+    volatile int failed;
+};
+
+// Captures join and are started before the loop starts, capture_start() then
+// leaves the events to it and capture_stop() waits for it to collect the transfers.
+// While it runs, their transports wait for it in transport_await() instead of
+// handling events themselves.
+void capture_loop_init(struct capture_loop *loop, struct transport *transport);
+int capture_loop_add(struct capture_loop *loop, struct capture *cap);
+int capture_loop_start(struct capture_loop *loop);
+// Once every capture of the loop is stopped.
+void capture_loop_stop(struct capture_loop *loop);
+
+// Prints the sustained throughput and the completion gaps since the capture started.
+void capture_report(struct capture *cap, FILE *out);
+
+#endif
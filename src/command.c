@@ -0,0 +1,144 @@
+#include "command.h"
+#include "lgp.h"
+
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// The payload only with DEBUG, formatted in one go; the transfers themselves are in the -t trace.
+static void printstatus(const unsigned char *buffer, int transferred) {
+    static const char digits[] = "0123456789abcdef";
+    char hex[USB_BULK_MAX_PACKET_SIZE * 3 + 1];
+    size_t length = 0;
+
+    if (DEBUG) {
+        for (int i = 0; i < transferred && i < USB_BULK_MAX_PACKET_SIZE; i++) {
+            hex[length++] = digits[buffer[i] >> 4];
+            hex[length++] = digits[buffer[i] & 0x0f];
+            hex[length++] = ' ';
+        }
+    }
+    hex[length] = '\0';
+    fprintf(stderr, "Received Status Control : bytes %i!, value :%s\n", transferred, hex);
+}
+
+int writecommand(struct transport *transport, unsigned char* commandbuffer, size_t size) {
+    static int transferred = 0;
+
+    int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_CONTROL, commandbuffer, size, &transferred, TIMEOUT);
+    if (err != 0) {
+        fprintf(stderr, "Error while sending command: '%s' - '%s', data sent: %i, data transferred: %i, on endpoint 0x04, crashing!\n", libusb_error_name(err), libusb_strerror(err), USB_BULK_MAX_PACKET_SIZE, transferred);
+        exit(-5);
+    } else {
+        return 0;
+    }
+}
+
+int writecommand_va(struct transport *transport, size_t count, ...) {
+    va_list bytelist;
+
+    if (count > USB_BULK_MAX_PACKET_SIZE) {
+        fprintf(stderr, "Command of %zu bytes does not fit in a packet!\n", count);
+        return -1;
+    }
+    unsigned char *buffer = transport_alloc_buffer(transport, USB_BULK_MAX_PACKET_SIZE);
+    if (buffer == NULL)
+        return -1;
+    va_start(bytelist, count);
+    for (size_t i = 0; i < count; i++) {
+        buffer[i] = (unsigned char) va_arg(bytelist, int);
+    }
+    va_end(bytelist);
+
+    int err = writecommand(transport, buffer, count);
+    transport_free_buffer(transport, buffer, USB_BULK_MAX_PACKET_SIZE);
+    return err;
+}
+
+int writevideocommand(struct transport *transport, unsigned char* commandbuffer, size_t size) {
+    static int transferred = 0;
+    int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL, commandbuffer, size, &transferred, TIMEOUT);
+    if (err != 0) {
+        fprintf(stderr, "Error while sending command: '%s' - '%s', data sent: %i, data transferred: %i, on endpoint 0x02, crashing!\n", libusb_error_name(err), libusb_strerror(err), USB_BULK_MAX_PACKET_SIZE, transferred);
+        exit(-5);
+    } else {
+        return 0;
+    }
+}
+
+int readstatus(struct transport *transport) {
+    unsigned char *buffer = transport_alloc_buffer(transport, USB_BULK_MAX_PACKET_SIZE);
+    if (buffer == NULL)
+        return -1;
+    memset(buffer, 0, USB_BULK_MAX_PACKET_SIZE);
+    static int transferred = 0;
+
+    int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, buffer, USB_BULK_MAX_PACKET_SIZE, &transferred, TIMEOUT);
+
+    if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
+        fprintf(stderr, "Error while reading command: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
+        exit(-5);
+    }
+
+    if (transferred == 0) {
+        fprintf(stderr, "Status NOT received (EP. 83); TIMEOUT!\n");
+    } else {
+        printstatus(buffer, transferred);
+    }
+    transport_free_buffer(transport, buffer, USB_BULK_MAX_PACKET_SIZE);
+    return 0;
+}
+
+int readstatus_data(struct transport *transport, unsigned char *response_buffer) {
+    unsigned char *buffer = transport_alloc_buffer(transport, USB_BULK_MAX_PACKET_SIZE);
+    if (buffer == NULL)
+        return -1;
+    memset(buffer, 0, USB_BULK_MAX_PACKET_SIZE);
+    static int transferred = 0;
+
+    int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, buffer, USB_BULK_MAX_PACKET_SIZE, &transferred, TIMEOUT);
+
+    if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
+        fprintf(stderr, "Error while reading command: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
+        exit(-5);
+    }
+
+    if (transferred == 0) {
+        fprintf(stderr, "Status NOT received (EP. 83); TIMEOUT!\n");
+    } else {
+        printstatus(buffer, transferred);
+        memcpy(response_buffer, buffer, transferred);
+        fprintf(stderr, "Data copied to returned buffer.\n");
+    }
+    transport_free_buffer(transport, buffer, USB_BULK_MAX_PACKET_SIZE);
+    return 0;
+}
+
+int readvideostatus(struct transport *transport) {
+    unsigned char *buffer = transport_alloc_buffer(transport, VIDEO_TRANSFER_SIZE);
+    if (buffer == NULL)
+        return -1;
+    memset(buffer, 0, VIDEO_TRANSFER_SIZE);
+    static int transferred = 0;
+
+    int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE, buffer, VIDEO_TRANSFER_SIZE, &transferred, TIMEOUT);
+
+    if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
+        fprintf(stderr, "Error while reading command: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
+        exit(-5);
+    }
+
+    if (transferred == 0) {
+        fprintf(stderr, "Status NOT received (EP. 81); TIMEOUT!\n");
+    } else {
+        fprintf(stderr, "Received Status Video Control : bytes %i!, value :", transferred);
+        //for(size_t i = 0; i < transferred; i++)
+        //	fprintf(stderr,"%.2x ", buffer[i]);
+
+
+        fprintf(stderr, "\n");
+    }
+    transport_free_buffer(transport, buffer, VIDEO_TRANSFER_SIZE);
+    return 0;
+}
@@ -0,0 +1,25 @@
+#ifndef COMMAND_H
+#define COMMAND_H
+
+#include <stddef.h>
+
+#include "transport.h"
+
+// Blocking command helpers used by the bring-up. Failed transfers end the
+// process, a status read that times out only prints it.
+
+// Sends a command on EP. 04.
+int writecommand(struct transport *transport, unsigned char* commandbuffer, size_t size);
+// Sends the count bytes given as arguments on EP. 04.
+int writecommand_va(struct transport *transport, size_t count, ...);
+// Sends a command on EP. 02.
+int writevideocommand(struct transport *transport, unsigned char* commandbuffer, size_t size);
+
+// Reads and prints a status on EP. 83.
+int readstatus(struct transport *transport);
+// Same, copying the status to response_buffer, USB_BULK_MAX_PACKET_SIZE bytes.
+int readstatus_data(struct transport *transport, unsigned char *response_buffer);
+// Reads one transfer of EP. 81 and prints its size.
+int readvideostatus(struct transport *transport);
+
+#endif
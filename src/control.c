@@ -0,0 +1,167 @@
+#include "control.h"
+#include "bringup.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+// All of length bytes, -1 if the peer hangs up or goes quiet for timeout ms
+static int control_read(int fd, void *data, size_t length, int timeout) {
+    struct pollfd pfd = { .fd = fd, .events = POLLIN };
+    size_t done = 0;
+
+    while (done < length) {
+        if (poll(&pfd, 1, timeout) != 1)
+            return -1;
+        ssize_t got = read(fd, (unsigned char*) data + done, length - done);
+        if (got <= 0)
+            return -1;
+        done += got;
+    }
+    return 0;
+}
+
+static int control_write(int fd, struct control_header *header, const void *payload) {
+    struct iovec iov[2] = {
+        { .iov_base = header, .iov_len = sizeof (struct control_header) },
+        { .iov_base = (void*) payload, .iov_len = header->length }
+    };
+    size_t total = sizeof (struct control_header) + header->length;
+
+    // Small enough to go out in one piece on a local socket
+    return writev(fd, iov, header->length > 0 ? 2 : 1) == (ssize_t) total ? 0 : -1;
+}
+
+static void control_answerframe(struct control *c, int client) {
+    struct control_header header;
+    unsigned char payload[CONTROL_MAX_PAYLOAD];
+    unsigned char reply[CONTROL_MAX_PAYLOAD];
+    size_t replylength = 0;
+    int status = CONTROL_MALFORMED;
+
+    if (control_read(client, &header, sizeof (header), 1000) != 0)
+        return;
+    if (header.length <= sizeof (payload) && control_read(client, payload, header.length, 1000) == 0) {
+        if (c->framehandler != NULL)
+            status = c->framehandler(c->userdata, header.command, payload, header.length, reply, &replylength);
+        else
+            status = CONTROL_UNKNOWN;
+    }
+
+    header.status = (uint8_t) status;
+    header.reserved = 0;
+    header.length = replylength <= sizeof (reply) ? (uint32_t) replylength : 0;
+    if (control_write(client, &header, reply) != 0)
+        fprintf(stderr, "Failed to answer on the control socket: %s\n", strerror(errno));
+}
+
+// Reads one command line or frame, a client that sends nothing within a second is dropped.
+static void control_answer(struct control *c, int client) {
+    char command[CONTROL_MAX_COMMAND];
+    char reply[CONTROL_MAX_REPLY];
+    struct pollfd pfd = { .fd = client, .events = POLLIN };
+    unsigned char first;
+    size_t length = 0;
+
+    if (poll(&pfd, 1, 1000) != 1 || recv(client, &first, 1, MSG_PEEK) != 1)
+        return;
+    if (first == CONTROL_MAGIC) {
+        control_answerframe(c, client);
+        return;
+    }
+
+    while (length < sizeof (command) - 1 && poll(&pfd, 1, 1000) == 1) {
+        ssize_t got = read(client, command + length, sizeof (command) - 1 - length);
+        if (got <= 0)
+            break;
+        length += got;
+        if (memchr(command, '\n', length) != NULL)
+            break;
+    }
+    command[length] = '\0';
+    command[strcspn(command, "\r\n")] = '\0';
+    if (command[0] == '\0')
+        return;
+
+    reply[0] = '\0';
+    if (c->handler != NULL)
+        c->handler(c->userdata, command, reply, sizeof (reply) - 1);
+    else
+        snprintf(reply, sizeof (reply) - 1, "error: binary commands only, see lgp_ctl");
+    size_t replylength = strlen(reply);
+    reply[replylength++] = '\n';
+    if (write(client, reply, replylength) != (ssize_t) replylength)
+        fprintf(stderr, "Failed to answer on the control socket: %s\n", strerror(errno));
+}
+
+static void control_client(void *userdata, int client) {
+    control_answer((struct control*) userdata, client);
+}
+
+void control_init(struct control *c) {
+    memset(c, 0, sizeof (struct control));
+    unixserver_init(&c->server);
+}
+
+int control_serve(struct control *c, const char *socketpath, control_handler handler, control_framehandler framehandler, void *userdata) {
+    c->handler = handler;
+    c->framehandler = framehandler;
+    c->userdata = userdata;
+    return unixserver_start(&c->server, socketpath, "control socket", control_client, c);
+}
+
+void control_stop(struct control *c) {
+    unixserver_stop(&c->server);
+}
+
+int control_request(const char *socketpath, uint8_t command, const void *argument, size_t length,
+        struct control_header *reply, unsigned char *payload, size_t size, int timeout) {
+    struct sockaddr_un address;
+    struct control_header header = { .magic = CONTROL_MAGIC, .command = command, .length = (uint32_t) length };
+    int fd = -1;
+
+    if (strlen(socketpath) >= sizeof (address.sun_path) || length > CONTROL_MAX_PAYLOAD) {
+        fprintf(stderr, "Socket path %s or request too long!\n", socketpath);
+        return -1;
+    }
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketpath);
+
+    fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || connect(fd, (struct sockaddr*) &address, sizeof (address)) != 0) {
+        fprintf(stderr, "Failed to reach the daemon on %s: %s\n", socketpath, strerror(errno));
+        goto error;
+    }
+    if (control_write(fd, &header, argument) != 0 || control_read(fd, reply, sizeof (struct control_header), timeout) != 0
+            || reply->magic != CONTROL_MAGIC || reply->length > size || control_read(fd, payload, reply->length, timeout) != 0) {
+        fprintf(stderr, "No valid answer from the daemon on %s!\n", socketpath);
+        goto error;
+    }
+    close(fd);
+    return 0;
+
+error:
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+void control_formatstatus(const struct control_devicestatus *status, char *line, size_t size) {
+    int length = snprintf(line, size, "device %u: %s%s, %.1f MiB captured, %u of %u kbit/s", status->index, bringup_statename((enum bringup_state) status->state),
+            status->detached ? " (gone)" : "", status->captured / 1048576.0, status->measuredbitrate, status->bitrate);
+    if (length < 0 || (size_t) length >= size)
+        return;
+    if (status->recording)
+        snprintf(line + length, size - length, ", recording %s for %.1f s, %.1f MiB, %llu marks, started in %.1f ms",
+                status->output, status->duration / 1e9, status->recorded / 1048576.0, (unsigned long long) status->marks, status->startlatency / 1e6);
+    else if (status->output[0] != '\0')
+        snprintf(line + length, size - length, ", idle, last recording %s", status->output);
+    else
+        snprintf(line + length, size - length, ", idle");
+}
@@ -0,0 +1,91 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "unixserver.h"
+
+// Commands on a Unix socket, one per connection, answered once. Either a
+// line, answered with one line:
+//   echo dump | socat - UNIX-CONNECT:<socket>
+// or a binary frame, told apart by its first byte: a header and length
+// bytes of payload, answered with a frame the same way (see lgp_ctl).
+
+#define CONTROL_MAX_COMMAND		256
+#define CONTROL_MAX_REPLY		1024
+
+#define CONTROL_MAGIC			0xc8
+#define CONTROL_MAX_PAYLOAD		4096
+
+enum control_command {
+    CONTROL_START = 1,		// payload: name of the recording, optional
+    CONTROL_STOP,
+    CONTROL_MARK,			// payload: label, optional
+    CONTROL_ROTATE,			// payload: name of the next recording, optional
+    CONTROL_STATUS,			// reply: a control_devicestatus per device
+    CONTROL_DUMP,
+    CONTROL_PROFILE			// payload: preset or <width>x<height>@<fps>,<kbit/s>[,<keyframe interval>]
+};
+
+enum control_status {
+    CONTROL_OK,
+    CONTROL_FAILED,			// reply: what went wrong
+    CONTROL_UNKNOWN,		// no such command
+    CONTROL_MALFORMED
+};
+
+// Host byte order, both ends are on the same machine
+struct control_header {
+    uint8_t magic;
+    uint8_t command;		// enum control_command, echoed in the reply
+    uint8_t status;			// enum control_status, replies only
+    uint8_t reserved;
+    uint32_t length;		// payload bytes after the header
+} __attribute__((packed));
+
+struct control_devicestatus {
+    uint32_t index;
+    uint8_t state;			// enum bringup_state
+    uint8_t recording;
+    uint8_t detached;
+    uint8_t reserved;
+    uint64_t captured;		// bytes since the bring-up
+    uint64_t recorded;		// bytes of the current recording
+    uint64_t duration;		// ns, of the current recording
+    uint64_t startlatency;	// ns, last start request to the first byte of its recording
+    uint64_t marks;
+    char output[128];		// current or last recording
+    uint32_t bitrate;		// kbit/s asked of the encoder
+    uint32_t measuredbitrate;	// kbit/s of the stream, over the last second
+} __attribute__((packed));
+
+// Called on the control thread. Fills reply, without the newline.
+typedef void (*control_handler)(void *userdata, const char *command, char *reply, size_t replysize);
+// Called on the control thread. Fills up to CONTROL_MAX_PAYLOAD bytes of reply, returns an enum control_status.
+typedef int (*control_framehandler)(void *userdata, uint8_t command, const unsigned char *payload, size_t length,
+        unsigned char *reply, size_t *replylength);
+
+struct control {
+    struct unixserver server;
+
+    control_handler handler;
+    control_framehandler framehandler;
+    void *userdata;
+};
+
+void control_init(struct control *c);
+// Either handler may be NULL, those commands are then refused.
+int control_serve(struct control *c, const char *socketpath, control_handler handler, control_framehandler framehandler, void *userdata);
+void control_stop(struct control *c);
+
+// Client side: sends one frame and waits up to timeout ms for the reply. payload gets up to
+// size bytes of it, the header says how many. -1 when the daemon could not be reached.
+int control_request(const char *socketpath, uint8_t command, const void *argument, size_t length,
+        struct control_header *reply, unsigned char *payload, size_t size, int timeout);
+
+// One line about a device, without the newline.
+void control_formatstatus(const struct control_devicestatus *status, char *line, size_t size);
+
+#endif
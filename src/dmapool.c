@@ -0,0 +1,167 @@
+#include "dmapool.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// libusb_dev_mem_alloc() came with libusb 1.0.21
+#if defined(LIBUSB_API_VERSION) && LIBUSB_API_VERSION >= 0x01000105
+#define DMAPOOL_HAVE_DEVMEM 1
+#else
+#define DMAPOOL_HAVE_DEVMEM 0
+#endif
+
+static size_t pagesize(void) {
+    long size = sysconf(_SC_PAGESIZE);
+    return size > 0 ? (size_t) size : 4096;
+}
+
+static size_t roundup(size_t size, size_t alignment) {
+    return (size + alignment - 1) / alignment * alignment;
+}
+
+// Anonymous pages faulted in now and locked if the limits allow it
+static unsigned char *dmapool_map(size_t size, int *locked) {
+    void *memory = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE, -1, 0);
+    if (memory == MAP_FAILED)
+        return NULL;
+    *locked = mlock(memory, size) == 0;
+    return (unsigned char*) memory;
+}
+
+static int dmapool_classinit(struct dmapool_class *c, unsigned char *base, size_t blocksize, size_t count) {
+    c->blocksize = blocksize;
+    c->count = count;
+    c->base = base;
+    c->free = (size_t*) calloc(count > 0 ? count : 1, sizeof (size_t));
+    if (c->free == NULL)
+        return -1;
+    // Lowest addresses first out
+    for (size_t i = 0; i < count; i++)
+        c->free[i] = count - 1 - i;
+    c->freecount = count;
+    return 0;
+}
+
+int dmapool_init(struct dmapool *pool, libusb_device_handle *handle, size_t blocksize, size_t blockcount) {
+    size_t smallsize = DMAPOOL_SMALL_SIZE * DMAPOOL_SMALL_BLOCKS;
+    int locked = 0;
+
+    memset(pool, 0, sizeof (struct dmapool));
+    pthread_mutex_init(&pool->lock, NULL);
+    blocksize = roundup(blocksize, DMAPOOL_SMALL_SIZE);
+    pool->regionsize = roundup(smallsize + blocksize * blockcount, pagesize());
+
+#if DMAPOOL_HAVE_DEVMEM
+    if (handle != NULL) {
+        pool->region = libusb_dev_mem_alloc(handle, pool->regionsize);
+        if (pool->region != NULL) {
+            pool->handle = handle;
+            pool->kind = DMAPOOL_DEVMEM;
+        } else {
+            fprintf(stderr, "DMA pool: no usbfs memory for %zu KiB (old kernel or usbfs_memory_mb too low), locking pages instead\n", pool->regionsize >> 10);
+        }
+    }
+#else
+    (void) handle;
+#endif
+    if (pool->region == NULL) {
+        pool->region = dmapool_map(pool->regionsize, &locked);
+        check(pool->region != NULL, "Failed to map the %zu KiB DMA pool: %s", pool->regionsize >> 10, strerror(errno));
+        pool->kind = locked ? DMAPOOL_LOCKED : DMAPOOL_HEAP;
+        if (!locked)
+            fprintf(stderr, "DMA pool: %zu KiB could not be locked (RLIMIT_MEMLOCK), pages may be swapped out\n", pool->regionsize >> 10);
+    }
+
+    check(dmapool_classinit(&pool->classes[0], pool->region, DMAPOOL_SMALL_SIZE, DMAPOOL_SMALL_BLOCKS) == 0
+            && dmapool_classinit(&pool->classes[1], pool->region + smallsize, blocksize, blockcount) == 0, "Failed to allocate the DMA pool lists!");
+    return 0;
+
+error:
+    dmapool_destroy(pool);
+    return -1;
+}
+
+void dmapool_detach(struct dmapool *pool) {
+    pthread_mutex_lock(&pool->lock);
+    pool->handle = NULL;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+void dmapool_destroy(struct dmapool *pool) {
+    if (pool->region != NULL) {
+#if DMAPOOL_HAVE_DEVMEM
+        if (pool->kind == DMAPOOL_DEVMEM && pool->handle != NULL)
+            libusb_dev_mem_free(pool->handle, pool->region, pool->regionsize);
+        else
+#endif
+        // usbfs memory whose handle is gone is a plain mapping as well
+        munmap(pool->region, pool->regionsize);
+    }
+    for (size_t i = 0; i < 2; i++)
+        free(pool->classes[i].free);
+    pthread_mutex_destroy(&pool->lock);
+    memset(pool, 0, sizeof (struct dmapool));
+}
+
+unsigned char *dmapool_get(struct dmapool *pool, size_t size) {
+    unsigned char *buffer = NULL;
+    int locked;
+
+    pthread_mutex_lock(&pool->lock);
+    for (size_t i = 0; i < 2 && buffer == NULL; i++) {
+        struct dmapool_class *c = &pool->classes[i];
+        if (size > c->blocksize)
+            continue;
+        if (c->freecount == 0) {
+            pool->stats.exhausted++;
+            continue;
+        }
+        buffer = c->base + c->free[--c->freecount] * c->blocksize;
+        pool->stats.hits++;
+        if (++pool->stats.inuse > pool->stats.maxinuse)
+            pool->stats.maxinuse = pool->stats.inuse;
+    }
+    if (buffer == NULL)
+        pool->stats.fallbacks++;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (buffer == NULL)
+        buffer = dmapool_map(roundup(size, pagesize()), &locked);
+    return buffer;
+}
+
+void dmapool_put(struct dmapool *pool, unsigned char *buffer, size_t size) {
+    if (buffer == NULL)
+        return;
+    if (buffer < pool->region || buffer >= pool->region + pool->regionsize) {
+        munmap(buffer, roundup(size, pagesize()));
+        return;
+    }
+
+    pthread_mutex_lock(&pool->lock);
+    struct dmapool_class *c = buffer >= pool->classes[1].base ? &pool->classes[1] : &pool->classes[0];
+    c->free[c->freecount++] = (size_t) (buffer - c->base) / c->blocksize;
+    pool->stats.inuse--;
+    pthread_mutex_unlock(&pool->lock);
+}
+
+const char *dmapool_kindname(enum dmapool_kind kind) {
+    switch (kind) {
+        case DMAPOOL_DEVMEM:
+            return "usbfs";
+        case DMAPOOL_LOCKED:
+            return "locked";
+        default:
+            return "unlocked";
+    }
+}
+
+void dmapool_report(struct dmapool *pool, FILE *out) {
+    fprintf(out, "DMA pool (%s): %zu x %zu B and %zu x %zu KiB, %llu hits, %llu exhausted, %llu fallback allocations, %zu in use (max %zu)\n",
+            dmapool_kindname(pool->kind), pool->classes[0].count, pool->classes[0].blocksize, pool->classes[1].count, pool->classes[1].blocksize >> 10,
+            (unsigned long long) pool->stats.hits, (unsigned long long) pool->stats.exhausted, (unsigned long long) pool->stats.fallbacks,
+            pool->stats.inuse, pool->stats.maxinuse);
+}
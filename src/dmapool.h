@@ -0,0 +1,69 @@
+#ifndef DMAPOOL_H
+#define DMAPOOL_H
+
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "lgp.h"
+
+// Transfer buffers of one device, carved out of a single region. Where
+// the kernel supports it the region is usbfs memory from
+// libusb_dev_mem_alloc(), which the host controller reads and writes in
+// place instead of usbfs copying every payload to and from buffers of
+// its own. Otherwise it is page aligned memory locked in RAM, so at least
+// no transfer waits on a page fault. Two block sizes: command and status
+// packets, and bulk transfers. Asking for more than the pool holds still
+// works, from a locked allocation of its own.
+
+#define DMAPOOL_SMALL_SIZE		USB_BULK_MAX_PACKET_SIZE
+#define DMAPOOL_SMALL_BLOCKS	16
+
+enum dmapool_kind {
+    DMAPOOL_DEVMEM,		// usbfs memory
+    DMAPOOL_LOCKED,		// mlock()ed pages
+    DMAPOOL_HEAP		// mlock() refused, page aligned and touched only
+};
+
+struct dmapool_class {
+    size_t blocksize;
+    size_t count;
+    unsigned char *base;
+    size_t *free;			// indices of the free blocks
+    size_t freecount;
+};
+
+struct dmapool_stats {
+    uint64_t hits;			// served from the pool
+    uint64_t exhausted;		// the class had no block left
+    uint64_t fallbacks;		// allocations of their own, pool exhausted or size too large
+    size_t inuse;			// blocks
+    size_t maxinuse;
+};
+
+struct dmapool {
+    libusb_device_handle *handle;	// the region belongs to it, NULL once it is gone
+    enum dmapool_kind kind;
+    unsigned char *region;
+    size_t regionsize;
+    struct dmapool_class classes[2];	// packets, transfers
+
+    pthread_mutex_t lock;
+    struct dmapool_stats stats;
+};
+
+// handle is NULL when there is no usbfs behind the transport, like with the emulator.
+int dmapool_init(struct dmapool *pool, libusb_device_handle *handle, size_t blocksize, size_t blockcount);
+void dmapool_destroy(struct dmapool *pool);
+// The handle the region came from is closed, the region stays usable as plain memory.
+void dmapool_detach(struct dmapool *pool);
+
+unsigned char *dmapool_get(struct dmapool *pool, size_t size);
+// size as asked for in dmapool_get().
+void dmapool_put(struct dmapool *pool, unsigned char *buffer, size_t size);
+
+const char *dmapool_kindname(enum dmapool_kind kind);
+void dmapool_report(struct dmapool *pool, FILE *out);
+
+#endif
@@ -0,0 +1,824 @@
+#include "emulator.h"
+#include "encoder.h"
+#include "hotplug.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define EMULATOR_STATUS_QUEUE		64
+#define EMULATOR_MAX_READ_WORDS		(USB_BULK_MAX_PACKET_SIZE / 4)
+
+struct emulator_status {
+    int length;
+    unsigned char data[USB_BULK_MAX_PACKET_SIZE];
+};
+
+struct emulator_pending {
+    struct libusb_transfer *transfer;
+    uint64_t deadline;		// ns, only used for EP. 83 reads
+    int cancelled;
+};
+
+struct emulator_queue {
+    struct emulator_pending *items;
+    size_t count;
+    size_t capacity;
+};
+
+// Every emulated device of a bus shares its lock, and handling the events of
+// one of them completes the transfers of all, as on a libusb context.
+struct emulator_bus {
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    struct emulator *devices[EMULATOR_MAX_DEVICES];
+    size_t count;
+    uint8_t lastdevnum;
+    struct hotplug *hotplug;	// NULL when nobody listens
+};
+
+struct emulator {
+    struct emulator_config config;
+    struct emulator_bus *bus;
+    int ownsbus;				// opened without a bus, it goes with the device
+    uint8_t devnum;
+
+    int attached;
+    uint64_t streamstart;		// ns, first EP. 81 data since plugged, 0 until then
+    uint64_t unpluggedat;		// ns
+
+    uint32_t registers[EMULATOR_REGISTER_SPACE / 4];
+    int videoready;
+    uint64_t firmwarestart;		// ns, 0 until the first bytes on EP. 02
+
+    struct emulator_status statuses[EMULATOR_STATUS_QUEUE];
+    size_t statushead;
+    size_t statuscount;
+
+    // EP. 81 source, replayed in a loop
+    unsigned char *stream;
+    size_t streamlength;
+    size_t streamposition;
+    uint64_t rate;				// bytes per second, 0 for unthrottled
+    uint64_t bitrate;			// bits per second the encoder is configured for
+    uint64_t pacingstart;		// ns
+    uint64_t pacingbytes;
+
+    struct emulator_queue streamqueue;	// EP. 81, completed in order as the stream is paced
+    struct emulator_queue otherqueue;	// everything else
+
+    struct emulator_stats stats;
+};
+
+void emulator_defaults(struct emulator_config *config) {
+    memset(config, 0, sizeof (struct emulator_config));
+    config->ratescale = 1.0;
+    config->statustimeout = 10;
+    config->readydelay = 50;
+    config->fps = 30;
+    config->gop = 30;
+    config->width = 1920;
+    config->height = 1080;
+}
+
+// Synthetic H.264 stream
+
+struct bitwriter {
+    unsigned char data[64];
+    size_t bits;
+};
+
+static void bits_put(struct bitwriter *bw, uint32_t value, int count) {
+    for (int i = count - 1; i >= 0; i--) {
+        if ((value >> i) & 1)
+            bw->data[bw->bits / 8] |= 0x80 >> (bw->bits % 8);
+        bw->bits++;
+    }
+}
+
+static void bits_ue(struct bitwriter *bw, uint32_t value) {
+    uint32_t v = value + 1;
+    int length = 0;
+    while ((v >> length) > 1)
+        length++;
+    bits_put(bw, 0, length);
+    bits_put(bw, v, length + 1);
+}
+
+static void bits_trailing(struct bitwriter *bw) {
+    bits_put(bw, 1, 1);
+    while (bw->bits % 8)
+        bits_put(bw, 0, 1);
+}
+
+// Appends a NAL with a 4 byte start code, inserting emulation prevention bytes.
+static size_t emit_nal(unsigned char *out, unsigned char header, const unsigned char *rbsp, size_t length) {
+    size_t o = 0;
+    int zeros = 0;
+    out[o++] = 0; out[o++] = 0; out[o++] = 0; out[o++] = 1;
+    out[o++] = header;
+    for (size_t i = 0; i < length; i++) {
+        if (zeros >= 2 && rbsp[i] <= 3) {
+            out[o++] = 3;
+            zeros = 0;
+        }
+        out[o++] = rbsp[i];
+        zeros = rbsp[i] == 0 ? zeros + 1 : 0;
+    }
+    return o;
+}
+
+static size_t emit_sps(unsigned char *out, unsigned int width, unsigned int height) {
+    struct bitwriter bw;
+    memset(&bw, 0, sizeof (bw));
+    unsigned int mbwidth = (width + 15) / 16;
+    unsigned int mbheight = (height + 15) / 16;
+
+    bits_put(&bw, 100, 8);	// profile_idc, High
+    bits_put(&bw, 0, 8);	// constraint flags
+    bits_put(&bw, 40, 8);	// level_idc 4.0
+    bits_ue(&bw, 0);		// seq_parameter_set_id
+    bits_ue(&bw, 1);		// chroma_format_idc 4:2:0
+    bits_ue(&bw, 0);		// bit_depth_luma_minus8
+    bits_ue(&bw, 0);		// bit_depth_chroma_minus8
+    bits_put(&bw, 0, 1);	// qpprime_y_zero_transform_bypass_flag
+    bits_put(&bw, 0, 1);	// seq_scaling_matrix_present_flag
+    bits_ue(&bw, 0);		// log2_max_frame_num_minus4
+    bits_ue(&bw, 2);		// pic_order_cnt_type
+    bits_ue(&bw, 1);		// max_num_ref_frames
+    bits_put(&bw, 0, 1);	// gaps_in_frame_num_value_allowed_flag
+    bits_ue(&bw, mbwidth - 1);
+    bits_ue(&bw, mbheight - 1);
+    bits_put(&bw, 1, 1);	// frame_mbs_only_flag
+    bits_put(&bw, 1, 1);	// direct_8x8_inference_flag
+    if (mbwidth * 16 != width || mbheight * 16 != height) {
+        bits_put(&bw, 1, 1);	// frame_cropping_flag, in 2 pixel units for 4:2:0
+        bits_ue(&bw, 0);
+        bits_ue(&bw, (mbwidth * 16 - width) / 2);
+        bits_ue(&bw, 0);
+        bits_ue(&bw, (mbheight * 16 - height) / 2);
+    } else {
+        bits_put(&bw, 0, 1);
+    }
+    bits_put(&bw, 0, 1);	// vui_parameters_present_flag
+    bits_trailing(&bw);
+    return emit_nal(out, 0x67, bw.data, bw.bits / 8);
+}
+
+static size_t emit_pps(unsigned char *out) {
+    struct bitwriter bw;
+    memset(&bw, 0, sizeof (bw));
+    bits_ue(&bw, 0);		// pic_parameter_set_id
+    bits_ue(&bw, 0);		// seq_parameter_set_id
+    bits_put(&bw, 0, 1);	// entropy_coding_mode_flag
+    bits_put(&bw, 0, 1);	// bottom_field_pic_order_in_frame_present_flag
+    bits_ue(&bw, 0);		// num_slice_groups_minus1
+    bits_ue(&bw, 0);		// num_ref_idx_l0_default_active_minus1
+    bits_ue(&bw, 0);		// num_ref_idx_l1_default_active_minus1
+    bits_put(&bw, 0, 3);	// weighted_pred_flag, weighted_bipred_idc
+    bits_ue(&bw, 0);		// pic_init_qp_minus26 (se 0)
+    bits_ue(&bw, 0);		// pic_init_qs_minus26 (se 0)
+    bits_ue(&bw, 0);		// chroma_qp_index_offset (se 0)
+    bits_put(&bw, 1, 1);	// deblocking_filter_control_present_flag
+    bits_put(&bw, 0, 2);	// constrained_intra_pred_flag, redundant_pic_cnt_present_flag
+    bits_trailing(&bw);
+    return emit_nal(out, 0x68, bw.data, bw.bits / 8);
+}
+
+// One GOP of fake slices sized for the configured bitrate. Slice payloads never
+// contain zero bytes so no start code can show up inside them.
+static int emulator_synthesize(struct emulator *em) {
+    struct emulator_config *c = &em->config;
+    size_t framebytes = em->bitrate / 8 / (c->fps ? c->fps : 30);
+    size_t gop = c->gop ? c->gop : 30;
+
+    em->streamlength = 0;
+    em->stream = (unsigned char*) malloc(gop * (framebytes + 64) + 256);
+    if (em->stream == NULL)
+        return -1;
+
+    unsigned char *out = em->stream;
+    out += emit_sps(out, c->width, c->height);
+    out += emit_pps(out);
+
+    unsigned char *slice = (unsigned char*) malloc(framebytes);
+    if (slice == NULL)
+        return -1;
+    for (size_t f = 0; f < gop; f++) {
+        // first_mb_in_slice = 0, slice_type 7 (I) or 5 (P)
+        slice[0] = f == 0 ? 0x88 : 0x9a;
+        for (size_t i = 1; i < framebytes; i++)
+            slice[i] = 0x55 + (unsigned char) ((i + f) % 0x80);
+        out += emit_nal(out, f == 0 ? 0x65 : 0x41, slice, framebytes);
+    }
+    free(slice);
+
+    em->streamlength = out - em->stream;
+    return 0;
+}
+
+static int emulator_loadreplay(struct emulator *em) {
+    FILE *f = fopen(em->config.replayfile, "rb");
+    if (f == NULL) {
+        fprintf(stderr, "Emulator: failed to open replay file %s!\n", em->config.replayfile);
+        return -1;
+    }
+    fseek(f, 0L, SEEK_END);
+    long size = ftell(f);
+    rewind(f);
+
+    em->stream = size > 0 ? (unsigned char*) malloc(size) : NULL;
+    if (em->stream == NULL || fread(em->stream, size, 1, f) != 1) {
+        fprintf(stderr, "Emulator: failed to read replay file %s!\n", em->config.replayfile);
+        fclose(f);
+        return -1;
+    }
+    em->streamlength = size;
+    fclose(f);
+    return 0;
+}
+
+// Device side, called with the lock held
+
+static void emulator_pushstatus(struct emulator *em, const unsigned char *data, int length) {
+    if (em->statuscount == EMULATOR_STATUS_QUEUE) {
+        // Drop the oldest, the host stopped reading
+        em->statushead = (em->statushead + 1) % EMULATOR_STATUS_QUEUE;
+        em->statuscount--;
+    }
+    struct emulator_status *status = &em->statuses[(em->statushead + em->statuscount) % EMULATOR_STATUS_QUEUE];
+    status->length = length;
+    memcpy(status->data, data, length);
+    em->statuscount++;
+    pthread_cond_broadcast(&em->bus->changed);
+}
+
+static int emulator_popstatus(struct emulator *em, unsigned char *data, int length) {
+    struct emulator_status *status = &em->statuses[em->statushead];
+    int size = status->length < length ? status->length : length;
+    memcpy(data, status->data, size);
+    em->statushead = (em->statushead + 1) % EMULATOR_STATUS_QUEUE;
+    em->statuscount--;
+    em->stats.statuses++;
+    return size;
+}
+
+static void emulator_updateready(struct emulator *em, uint64_t now) {
+    if (!em->videoready && em->firmwarestart != 0 && now - em->firmwarestart >= em->config.readydelay * 1000000ULL) {
+        em->videoready = 1;
+        em->registers[EMULATOR_REG_VIDEO_READY / 4] = EMULATOR_VIDEO_READY_VALUE;
+    }
+}
+
+// Drops the device off the bus once it streamed for unplugafter ms and brings
+// it back unplugfor ms later, *next is lowered to when that is due.
+static void emulator_updateplug(struct emulator *em, uint64_t now, uint64_t *next) {
+    const struct emulator_config *c = &em->config;
+    uint64_t due;
+
+    if (c->unplugafter == 0)
+        return;
+    if (em->attached) {
+        if (em->streamstart == 0)
+            return;
+        due = em->streamstart + c->unplugafter * 1000000ULL;
+        if (now < due) {
+            if (next != NULL && due < *next)
+                *next = due;
+            return;
+        }
+        em->attached = 0;
+        em->unpluggedat = now;
+        em->stats.unplugs++;
+        if (em->bus->hotplug != NULL)
+            hotplug_post(em->bus->hotplug, HOTPLUG_LEFT, NULL, NULL, 0, em->devnum);
+    }
+
+    due = em->unpluggedat + c->unplugfor * 1000000ULL;
+    if (now < due) {
+        if (next != NULL && due < *next)
+            *next = due;
+        return;
+    }
+    em->attached = 1;
+    em->streamstart = 0;
+    em->pacingstart = 0;
+    if (c->unplugcold) {
+        // Powered down meanwhile, the firmware has to be sent again
+        memset(em->registers, 0, sizeof (em->registers));
+        em->videoready = 0;
+        em->firmwarestart = 0;
+        em->statushead = 0;
+        em->statuscount = 0;
+    }
+    if (em->bus->hotplug != NULL)
+        hotplug_post(em->bus->hotplug, HOTPLUG_ARRIVED, NULL, NULL, 0, em->devnum);
+}
+
+static uint32_t readle32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// A mailbox command was rung. The configure command sets the pace of the stream
+// and the synthetic one is made again to match, the others are simply taken.
+static void emulator_mailbox(struct emulator *em) {
+    struct emulator_config *c = &em->config;
+    uint32_t size = em->registers[ENCODER_REGISTER_SIZE / 4];
+    uint32_t rate = em->registers[ENCODER_REGISTER_RATE / 4];
+    uint32_t timing = em->registers[ENCODER_REGISTER_TIMING / 4];
+
+    em->registers[ENCODER_REGISTER_DOORBELL / 4] = 0;
+    if (em->registers[ENCODER_REGISTER_COMMAND / 4] != ENCODER_COMMAND_CONFIGURE || (rate & 0xffff) == 0)
+        return;
+
+    em->bitrate = (rate & 0xffff) * 1000ULL;
+    em->rate = (uint64_t) (c->ratescale * em->bitrate / 8);
+    em->pacingstart = 0;
+    if (c->replayfile != NULL)
+        return;
+
+    // New parameters start with a new GOP, as on the device
+    c->width = size & 0xffff;
+    c->height = size >> 16;
+    c->fps = timing & 0xffff;
+    c->gop = rate >> 16;
+    free(em->stream);
+    em->stream = NULL;
+    em->streamposition = 0;
+    if (emulator_synthesize(em) != 0)
+        em->streamlength = 0;
+}
+
+static void emulator_command(struct emulator *em, const unsigned char *data, int length) {
+    em->stats.commands++;
+    emulator_updateready(em, lgp_now_ns());
+
+    if (length >= 8 && data[0] == 0x01 && (data[1] == 0x00 || data[1] == 0x01)) {
+        unsigned int count = data[2] | (data[3] << 8);
+        uint32_t address = readle32(data + 4) % EMULATOR_REGISTER_SPACE;
+
+        if (data[1] == 0x00) {
+            // Register read: 01 00 <count16> <addr32>, answered with count words on EP. 83
+            unsigned char response[EMULATOR_MAX_READ_WORDS * 4];
+            if (count > EMULATOR_MAX_READ_WORDS)
+                count = EMULATOR_MAX_READ_WORDS;
+            for (unsigned int i = 0; i < count; i++) {
+                uint32_t value = em->registers[(address / 4 + i) % (EMULATOR_REGISTER_SPACE / 4)];
+                response[i * 4] = value & 0xff;
+                response[i * 4 + 1] = (value >> 8) & 0xff;
+                response[i * 4 + 2] = (value >> 16) & 0xff;
+                response[i * 4 + 3] = (value >> 24) & 0xff;
+            }
+            emulator_pushstatus(em, response, count * 4);
+        } else {
+            // Register write: 01 01 <count16> <addr32> <value32>..., no answer
+            for (unsigned int i = 0; i < count && 8 + (int) (i + 1) * 4 <= length; i++)
+                em->registers[(address / 4 + i) % (EMULATOR_REGISTER_SPACE / 4)] = readle32(data + 8 + i * 4);
+            if (em->registers[ENCODER_REGISTER_DOORBELL / 4] != 0)
+                emulator_mailbox(em);
+        }
+        return;
+    }
+
+    // LED, I2C and other vendor commands are simply acknowledged with their header
+    emulator_pushstatus(em, data, length < 4 ? length : 4);
+}
+
+static int emulator_fillstream(struct emulator *em, unsigned char *data, int length) {
+    int filled = 0;
+    while (filled < length && em->streamlength > 0) {
+        size_t chunk = em->streamlength - em->streamposition;
+        if (chunk > (size_t) (length - filled))
+            chunk = length - filled;
+        memcpy(data + filled, em->stream + em->streamposition, chunk);
+        filled += chunk;
+        em->streamposition = (em->streamposition + chunk) % em->streamlength;
+    }
+    if (em->streamstart == 0)
+        em->streamstart = lgp_now_ns();
+    em->pacingbytes += filled;
+    em->stats.stream_bytes += filled;
+    em->stats.stream_transfers++;
+    return filled;
+}
+
+static uint64_t emulator_bytestons(struct emulator *em, uint64_t bytes) {
+    return bytes / em->rate * 1000000000ULL + bytes % em->rate * 1000000000ULL / em->rate;
+}
+
+// When the next length bytes of the stream are due
+static uint64_t emulator_streamdue(struct emulator *em, int length, uint64_t now) {
+    if (em->rate == 0)
+        return now;
+    if (em->pacingstart == 0) {
+        em->pacingstart = now;
+        em->pacingbytes = 0;
+    }
+    uint64_t due = em->pacingstart + emulator_bytestons(em, em->pacingbytes + length);
+    // The host stopped reading for a while, restart the pacing instead of bursting
+    if (due + 1000000000ULL < now) {
+        em->pacingstart = now - emulator_bytestons(em, em->pacingbytes);
+        due = now;
+    }
+    return due;
+}
+
+static int emulator_wait(struct emulator_bus *bus, uint64_t until) {
+    struct timespec ts;
+    // The condition variable uses CLOCK_MONOTONIC, see emulator_bus_create()
+    ts.tv_sec = until / 1000000000ULL;
+    ts.tv_nsec = until % 1000000000ULL;
+    return pthread_cond_timedwait(&bus->changed, &bus->lock, &ts);
+}
+
+// Synchronous transfers
+
+static int emulator_bulk_transfer(struct transport *t, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    struct emulator *em = (struct emulator*) t->priv;
+    int err = 0;
+    *transferred = 0;
+
+    pthread_mutex_lock(&em->bus->lock);
+    uint64_t now = lgp_now_ns();
+    uint64_t wait = (timeout == 0 || timeout > em->config.statustimeout) ? em->config.statustimeout : timeout;
+
+    emulator_updateplug(em, now, NULL);
+    if (!em->attached) {
+        pthread_mutex_unlock(&em->bus->lock);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+
+    switch (endpoint) {
+        case CAMERA_ENDPOINT_ADDRESS_CONTROL:
+            emulator_command(em, data, length);
+            *transferred = length;
+            break;
+        case CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL:
+            if (em->firmwarestart == 0)
+                em->firmwarestart = now;
+            em->stats.firmware_bytes += length;
+            *transferred = length;
+            break;
+        case CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE: {
+            uint64_t deadline = now + wait * 1000000ULL;
+            while (em->statuscount == 0 && err != ETIMEDOUT)
+                err = emulator_wait(em->bus, deadline);
+            if (em->statuscount == 0) {
+                em->stats.status_timeouts++;
+                err = LIBUSB_ERROR_TIMEOUT;
+            } else {
+                *transferred = emulator_popstatus(em, data, length);
+                err = 0;
+            }
+            break;
+        }
+        case CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE: {
+            uint64_t due = emulator_streamdue(em, length, now);
+            uint64_t deadline = timeout == 0 ? due : now + timeout * 1000000ULL;
+            while (lgp_now_ns() < due && lgp_now_ns() < deadline)
+                emulator_wait(em->bus, due < deadline ? due : deadline);
+            if (lgp_now_ns() < due) {
+                err = LIBUSB_ERROR_TIMEOUT;
+            } else {
+                *transferred = emulator_fillstream(em, data, length);
+            }
+            break;
+        }
+        default:
+            err = LIBUSB_ERROR_NOT_FOUND;
+            break;
+    }
+
+    pthread_mutex_unlock(&em->bus->lock);
+    return err;
+}
+
+// Asynchronous transfers
+
+static struct libusb_transfer *emulator_alloc_transfer(struct transport *t) {
+    (void) t;
+    return (struct libusb_transfer*) calloc(1, sizeof (struct libusb_transfer));
+}
+
+static void emulator_free_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    (void) t;
+    free(transfer);
+}
+
+static int queue_push(struct emulator_queue *q, struct libusb_transfer *transfer, uint64_t deadline) {
+    if (q->count == q->capacity) {
+        size_t capacity = q->capacity ? q->capacity * 2 : 16;
+        struct emulator_pending *items = (struct emulator_pending*) realloc(q->items, capacity * sizeof (struct emulator_pending));
+        if (items == NULL)
+            return -1;
+        q->items = items;
+        q->capacity = capacity;
+    }
+    q->items[q->count].transfer = transfer;
+    q->items[q->count].deadline = deadline;
+    q->items[q->count].cancelled = 0;
+    q->count++;
+    return 0;
+}
+
+static void queue_remove(struct emulator_queue *q, size_t index) {
+    memmove(&q->items[index], &q->items[index + 1], (q->count - index - 1) * sizeof (struct emulator_pending));
+    q->count--;
+}
+
+static int emulator_submit_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    struct emulator *em = (struct emulator*) t->priv;
+    int err;
+
+    pthread_mutex_lock(&em->bus->lock);
+    emulator_updateplug(em, lgp_now_ns(), NULL);
+    if (!em->attached) {
+        pthread_mutex_unlock(&em->bus->lock);
+        return LIBUSB_ERROR_NO_DEVICE;
+    }
+    if (transfer->endpoint == CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE) {
+        err = queue_push(&em->streamqueue, transfer, 0);
+    } else {
+        uint64_t wait = (transfer->timeout == 0 || transfer->timeout > em->config.statustimeout) ? em->config.statustimeout : transfer->timeout;
+        err = queue_push(&em->otherqueue, transfer, lgp_now_ns() + wait * 1000000ULL);
+    }
+    pthread_cond_broadcast(&em->bus->changed);
+    pthread_mutex_unlock(&em->bus->lock);
+    return err == 0 ? 0 : LIBUSB_ERROR_NO_MEM;
+}
+
+static int emulator_cancel_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    struct emulator *em = (struct emulator*) t->priv;
+    int err = LIBUSB_ERROR_NOT_FOUND;
+
+    pthread_mutex_lock(&em->bus->lock);
+    struct emulator_queue *queues[2] = {&em->streamqueue, &em->otherqueue};
+    for (int q = 0; q < 2; q++) {
+        for (size_t i = 0; i < queues[q]->count; i++) {
+            if (queues[q]->items[i].transfer == transfer) {
+                queues[q]->items[i].cancelled = 1;
+                err = 0;
+            }
+        }
+    }
+    pthread_cond_broadcast(&em->bus->changed);
+    pthread_mutex_unlock(&em->bus->lock);
+    return err;
+}
+
+// Takes the next transfer ready to complete out of the queues, or returns NULL
+// and the time the next one will be ready in *next.
+static struct libusb_transfer *emulator_nextcompletion(struct emulator *em, uint64_t now, uint64_t *next) {
+    // Off the bus, whatever was queued fails at once
+    if (!em->attached) {
+        struct emulator_queue *q = em->otherqueue.count > 0 ? &em->otherqueue : &em->streamqueue;
+        if (q->count == 0)
+            return NULL;
+        struct libusb_transfer *transfer = q->items[0].transfer;
+        transfer->status = q->items[0].cancelled ? LIBUSB_TRANSFER_CANCELLED : LIBUSB_TRANSFER_NO_DEVICE;
+        transfer->actual_length = 0;
+        queue_remove(q, 0);
+        return transfer;
+    }
+
+    for (size_t i = 0; i < em->otherqueue.count; i++) {
+        struct emulator_pending *p = &em->otherqueue.items[i];
+        struct libusb_transfer *transfer = p->transfer;
+
+        if (p->cancelled) {
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+        } else if (transfer->endpoint == CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE) {
+            if (em->statuscount > 0) {
+                transfer->actual_length = emulator_popstatus(em, transfer->buffer, transfer->length);
+                transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            } else if (now >= p->deadline) {
+                em->stats.status_timeouts++;
+                transfer->actual_length = 0;
+                transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+            } else {
+                if (p->deadline < *next)
+                    *next = p->deadline;
+                continue;
+            }
+        } else if (transfer->endpoint == CAMERA_ENDPOINT_ADDRESS_CONTROL) {
+            emulator_command(em, transfer->buffer, transfer->length);
+            transfer->actual_length = transfer->length;
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        } else if (transfer->endpoint == CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL) {
+            if (em->firmwarestart == 0)
+                em->firmwarestart = now;
+            em->stats.firmware_bytes += transfer->length;
+            transfer->actual_length = transfer->length;
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        } else {
+            transfer->actual_length = 0;
+            transfer->status = LIBUSB_TRANSFER_STALL;
+        }
+        queue_remove(&em->otherqueue, i);
+        return transfer;
+    }
+
+    if (em->streamqueue.count > 0) {
+        struct emulator_pending *p = &em->streamqueue.items[0];
+        struct libusb_transfer *transfer = p->transfer;
+
+        if (p->cancelled) {
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+        } else {
+            uint64_t due = emulator_streamdue(em, transfer->length, now);
+            if (due > now) {
+                if (due < *next)
+                    *next = due;
+                // Cancelled transfers further down the queue complete right away
+                for (size_t i = 1; i < em->streamqueue.count; i++) {
+                    if (em->streamqueue.items[i].cancelled) {
+                        transfer = em->streamqueue.items[i].transfer;
+                        transfer->status = LIBUSB_TRANSFER_CANCELLED;
+                        transfer->actual_length = 0;
+                        queue_remove(&em->streamqueue, i);
+                        return transfer;
+                    }
+                }
+                return NULL;
+            }
+            transfer->actual_length = emulator_fillstream(em, transfer->buffer, transfer->length);
+            transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        }
+        queue_remove(&em->streamqueue, 0);
+        return transfer;
+    }
+    return NULL;
+}
+
+static int emulator_handle_events(struct transport *t, struct timeval *tv) {
+    struct emulator_bus *bus = ((struct emulator*) t->priv)->bus;
+    uint64_t deadline = lgp_now_ns() + (tv != NULL ? tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL : 1000000000ULL);
+    int completed = 0;
+
+    pthread_mutex_lock(&bus->lock);
+    while (1) {
+        uint64_t now = lgp_now_ns();
+        uint64_t next = deadline;
+        struct libusb_transfer *transfer = NULL;
+
+        for (size_t i = 0; i < bus->count && transfer == NULL; i++) {
+            emulator_updateplug(bus->devices[i], now, &next);
+            emulator_updateready(bus->devices[i], now);
+            transfer = emulator_nextcompletion(bus->devices[i], now, &next);
+        }
+        if (transfer != NULL) {
+            // Callbacks may submit again, which takes the lock
+            pthread_mutex_unlock(&bus->lock);
+            transfer->callback(transfer);
+            pthread_mutex_lock(&bus->lock);
+            completed++;
+            continue;
+        }
+
+        if (completed > 0 || now >= deadline)
+            break;
+        emulator_wait(bus, next);
+    }
+    // Wakes whoever waits for the completions in emulator_wait_events()
+    if (completed > 0)
+        pthread_cond_broadcast(&bus->changed);
+    pthread_mutex_unlock(&bus->lock);
+    return 0;
+}
+
+static int emulator_wait_events(struct transport *t, struct timeval *tv) {
+    struct emulator_bus *bus = ((struct emulator*) t->priv)->bus;
+    uint64_t deadline = lgp_now_ns() + (tv != NULL ? tv->tv_sec * 1000000000ULL + tv->tv_usec * 1000ULL : 1000000000ULL);
+
+    pthread_mutex_lock(&bus->lock);
+    emulator_wait(bus, deadline);
+    pthread_mutex_unlock(&bus->lock);
+    return 0;
+}
+
+struct emulator_bus *emulator_bus_create(void) {
+    struct emulator_bus *bus = (struct emulator_bus*) calloc(1, sizeof (struct emulator_bus));
+    if (bus == NULL)
+        return NULL;
+
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&bus->changed, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_mutex_init(&bus->lock, NULL);
+    return bus;
+}
+
+void emulator_bus_sethotplug(struct emulator_bus *bus, struct hotplug *hotplug) {
+    pthread_mutex_lock(&bus->lock);
+    bus->hotplug = hotplug;
+    pthread_mutex_unlock(&bus->lock);
+}
+
+void emulator_bus_destroy(struct emulator_bus *bus) {
+    if (bus == NULL)
+        return;
+    pthread_cond_destroy(&bus->changed);
+    pthread_mutex_destroy(&bus->lock);
+    free(bus);
+}
+
+static void emulator_close(struct transport *t) {
+    struct emulator *em = (struct emulator*) t->priv;
+    if (em == NULL)
+        return;
+
+    struct emulator_bus *bus = em->bus;
+    pthread_mutex_lock(&bus->lock);
+    for (size_t i = 0; i < bus->count; i++) {
+        if (bus->devices[i] == em) {
+            bus->devices[i] = bus->devices[--bus->count];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&bus->lock);
+    if (em->ownsbus)
+        emulator_bus_destroy(bus);
+
+    free(em->streamqueue.items);
+    free(em->otherqueue.items);
+    free(em->stream);
+    free(em);
+    t->priv = NULL;
+}
+
+static const struct transport_ops emulator_ops = {
+    .bulk_transfer = emulator_bulk_transfer,
+    .alloc_transfer = emulator_alloc_transfer,
+    .free_transfer = emulator_free_transfer,
+    .submit_transfer = emulator_submit_transfer,
+    .cancel_transfer = emulator_cancel_transfer,
+    .handle_events = emulator_handle_events,
+    .wait_events = emulator_wait_events,
+    .close = emulator_close,
+};
+
+int transport_open_emulated(struct transport *t, const struct emulator_config *config, struct emulator_bus *bus) {
+    memset(t, 0, sizeof (struct transport));
+
+    struct emulator *em = (struct emulator*) calloc(1, sizeof (struct emulator));
+    if (em == NULL)
+        return -1;
+    em->config = *config;
+    em->bitrate = EMULATOR_BASE_BITRATE;
+    em->rate = (uint64_t) (config->ratescale * em->bitrate / 8);
+    em->attached = 1;
+
+    if (bus == NULL) {
+        bus = emulator_bus_create();
+        if (bus == NULL) {
+            free(em);
+            return -1;
+        }
+        em->ownsbus = 1;
+    }
+    pthread_mutex_lock(&bus->lock);
+    if (bus->count == EMULATOR_MAX_DEVICES) {
+        pthread_mutex_unlock(&bus->lock);
+        fprintf(stderr, "No more than %i emulated devices on a bus!\n", EMULATOR_MAX_DEVICES);
+        free(em);
+        return -1;
+    }
+    bus->devices[bus->count++] = em;
+    em->bus = bus;
+    em->devnum = ++bus->lastdevnum;
+    pthread_mutex_unlock(&bus->lock);
+
+    t->ops = &emulator_ops;
+    t->name = "emulator";
+    t->priv = em;
+    t->devnum = em->devnum;
+
+    int err = config->replayfile != NULL ? emulator_loadreplay(em) : emulator_synthesize(em);
+    if (err != 0) {
+        transport_close(t);
+        return -1;
+    }
+
+    fprintf(stderr, "Emulator: %zu bytes of %s stream, %.2f MB/s\n", em->streamlength,
+            config->replayfile != NULL ? config->replayfile : "synthetic", em->rate / (1024.0 * 1024.0));
+    return 0;
+}
+
+int transport_open_emulator(struct transport *t, const struct emulator_config *config) {
+    return transport_open_emulated(t, config, NULL);
+}
+
+void emulator_getstats(struct transport *t, struct emulator_stats *stats) {
+    struct emulator *em = (struct emulator*) t->priv;
+    pthread_mutex_lock(&em->bus->lock);
+    *stats = em->stats;
+    pthread_mutex_unlock(&em->bus->lock);
+}
@@ -0,0 +1,63 @@
+#ifndef EMULATOR_H
+#define EMULATOR_H
+
+#include "transport.h"
+
+// Bitrate the device streams at with the UTL005 configuration (0x06EC = 30000 kbit/s),
+// until the configure command of the encoder mailbox sets another one
+#define EMULATOR_BASE_BITRATE		30000000ULL
+
+#define EMULATOR_REGISTER_SPACE		0x10000
+
+#define EMULATOR_MAX_DEVICES		16
+
+// Register 0x0800 is the video ready handshake, 07 00 01 00 once the encoder runs
+#define EMULATOR_REG_VIDEO_READY	0x0800
+#define EMULATOR_VIDEO_READY_VALUE	0x00010007
+
+struct emulator_config {
+    double ratescale;			// multiple of the configured bitrate, 0 for unthrottled
+    const char *replayfile;		// raw EP. 81 stream to replay in a loop, NULL for a synthetic H.264 stream
+    unsigned int statustimeout;	// ms, cap on how long an empty EP. 83 read blocks
+    unsigned int readydelay;	// ms between the first firmware bytes and video ready
+    unsigned int fps;			// synthetic stream only
+    unsigned int gop;			// synthetic stream only, frames per IDR
+    unsigned int width;			// synthetic stream only
+    unsigned int height;		// synthetic stream only
+    unsigned int unplugafter;	// ms of streaming before the device drops off the bus, 0 to stay plugged
+    unsigned int unplugfor;		// ms until it is back
+    int unplugcold;				// it comes back powered down, without firmware or configuration
+};
+
+struct emulator_stats {
+    unsigned long long commands;		// EP. 04
+    unsigned long long statuses;		// EP. 83
+    unsigned long long status_timeouts;
+    unsigned long long firmware_bytes;	// EP. 02
+    unsigned long long stream_bytes;	// EP. 81
+    unsigned long long stream_transfers;
+    unsigned long long unplugs;
+};
+
+// Emulated devices plugged together, handling the events of any of their
+// transports completes the transfers of all of them, as on a libusb context.
+struct emulator_bus;
+struct hotplug;
+
+void emulator_defaults(struct emulator_config *config);
+
+struct emulator_bus *emulator_bus_create(void);
+// Only once every device on it is closed.
+void emulator_bus_destroy(struct emulator_bus *bus);
+// Devices leaving and coming back are posted to hotplug, from the event thread.
+void emulator_bus_sethotplug(struct emulator_bus *bus, struct hotplug *hotplug);
+
+// Emulated C875 implementing EP. 02/04/81/83 of descriptor/lsusb_usb_descriptor.
+int transport_open_emulator(struct transport *t, const struct emulator_config *config);
+// Same, on a bus shared with other emulated devices.
+int transport_open_emulated(struct transport *t, const struct emulator_config *config, struct emulator_bus *bus);
+
+// Only valid on an emulator transport
+void emulator_getstats(struct transport *t, struct emulator_stats *stats);
+
+#endif
@@ -0,0 +1,181 @@
+#include "encoder.h"
+#include "lgp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ARGUMENT(address)	((ENCODER_REGISTER_SIZE - (address)) / 4)
+
+// Arguments of the configure command as UTL005 sends them, 0x06F4 first
+static const uint32_t captured[ENCODER_ARGUMENTS] = {
+    0x04380780,		// 0x06F4
+    0x0f7c0609,
+    0x00787530,		// 0x06EC
+    0x1f4007d0,
+    0x00002000,
+    0xf199001e,		// 0x06E0
+    0x04380780,		// 0x06DC
+    0x00000010,
+    0x21161080,
+    0x520840f4,		// 0x06D0
+};
+
+const struct encoder_profile encoder_presets[] = {
+    { "max", 1920, 1080, 30, 30000, 120 },
+    { "1080p", 1920, 1080, 30, 12000, 60 },
+    { "720p", 1280, 720, 30, 6000, 60 },
+    { "720p-low", 1280, 720, 30, 3000, 60 },
+    { "480p", 848, 480, 30, 2000, 60 },
+    { "360p", 640, 360, 30, 1000, 60 },
+};
+const size_t encoder_presetcount = sizeof (encoder_presets) / sizeof (encoder_presets[0]);
+
+static uint32_t readle32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void writele32(unsigned char *p, uint32_t value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+int encoder_validate(const struct encoder_profile *p, char *why, size_t size) {
+    if (p->width < ENCODER_MIN_WIDTH || p->width > ENCODER_MAX_WIDTH || p->height < ENCODER_MIN_HEIGHT || p->height > ENCODER_MAX_HEIGHT)
+        snprintf(why, size, "%ux%u is outside %ux%u to %ux%u", p->width, p->height, ENCODER_MIN_WIDTH, ENCODER_MIN_HEIGHT, ENCODER_MAX_WIDTH, ENCODER_MAX_HEIGHT);
+    else if (p->width % 8 != 0 || p->height % 8 != 0)
+        snprintf(why, size, "%ux%u is not a multiple of 8 both ways", p->width, p->height);
+    else if (p->fps == 0 || p->fps > ENCODER_MAX_FPS)
+        snprintf(why, size, "%u fps is not between 1 and %u", p->fps, ENCODER_MAX_FPS);
+    else if ((uint64_t) p->width * p->height * p->fps > ENCODER_MAX_PIXELRATE)
+        snprintf(why, size, "%ux%u at %u fps is more than the encoder does at 1080p30", p->width, p->height, p->fps);
+    else if (p->bitrate < ENCODER_MIN_BITRATE || p->bitrate > ENCODER_MAX_BITRATE)
+        snprintf(why, size, "%u kbit/s is not between %u and %u", p->bitrate, ENCODER_MIN_BITRATE, ENCODER_MAX_BITRATE);
+    else if (p->keyframeinterval == 0 || p->keyframeinterval > p->fps * ENCODER_MAX_KEYFRAME)
+        snprintf(why, size, "a keyframe every %u frames is not between 1 and %u s at %u fps", p->keyframeinterval, ENCODER_MAX_KEYFRAME, p->fps);
+    else
+        return 0;
+    return -1;
+}
+
+int encoder_parse(struct encoder_profile *profile, const char *text, char *why, size_t size) {
+    unsigned int width, height, fps, bitrate, keyframeinterval;
+    char names[128];
+    size_t length = 0;
+
+    memset(profile, 0, sizeof (struct encoder_profile));
+    for (size_t i = 0; i < encoder_presetcount; i++) {
+        if (strcmp(text, encoder_presets[i].name) == 0) {
+            *profile = encoder_presets[i];
+            return encoder_validate(profile, why, size);
+        }
+        length += snprintf(names + length, sizeof (names) - length, "%s%s", i > 0 ? ", " : "", encoder_presets[i].name);
+        if (length >= sizeof (names))
+            length = sizeof (names) - 1;
+    }
+
+    int fields = sscanf(text, "%ux%u@%u,%u,%u", &width, &height, &fps, &bitrate, &keyframeinterval);
+    if (fields < 4) {
+        snprintf(why, size, "'%s' is neither a preset (%s) nor <width>x<height>@<fps>,<kbit/s>[,<keyframe interval>]", text, names);
+        return -1;
+    }
+    profile->width = width;
+    profile->height = height;
+    profile->fps = fps;
+    profile->bitrate = bitrate;
+    profile->keyframeinterval = fields == 5 ? keyframeinterval : fps;
+    snprintf(profile->name, sizeof (profile->name), "%ux%u@%u", width, height, fps);
+    return encoder_validate(profile, why, size);
+}
+
+int encoder_compatible(const struct encoder_profile *a, const struct encoder_profile *b) {
+    return a->width == b->width && a->height == b->height && a->fps == b->fps;
+}
+
+void encoder_build(const struct encoder_profile *profile, uint32_t arguments[ENCODER_ARGUMENTS]) {
+    uint32_t size = profile->width | (uint32_t) profile->height << 16;
+
+    memcpy(arguments, captured, sizeof (captured));
+    arguments[ARGUMENT(ENCODER_REGISTER_SIZE)] = size;
+    arguments[ARGUMENT(ENCODER_REGISTER_OUTPUT)] = size;
+    arguments[ARGUMENT(ENCODER_REGISTER_RATE)] = (profile->bitrate & 0xffff) | (uint32_t) profile->keyframeinterval << 16;
+    arguments[ARGUMENT(ENCODER_REGISTER_TIMING)] = (captured[ARGUMENT(ENCODER_REGISTER_TIMING)] & 0xffff0000) | (profile->fps & 0xffff);
+}
+
+int encoder_patchsequence(const struct sequence *seq, const struct encoder_profile *profile, struct sequence *patched) {
+    uint32_t arguments[ENCODER_ARGUMENTS];
+    uint32_t command = 0;
+    size_t found = 0;
+
+    encoder_build(profile, arguments);
+    if (sequence_copy(patched, seq) != 0) {
+        fprintf(stderr, "Failed to copy the init sequence!\n");
+        return -1;
+    }
+
+    // Register writes, 01 01 <count16> <addr32> <value32>..., on EP. 04
+    for (size_t i = 0; i < patched->count; i++) {
+        const struct sequence_entry *entry = &patched->entries[i];
+        unsigned char *c = (unsigned char*) sequence_command(patched, i);
+        if (entry->endpoint != CAMERA_ENDPOINT_ADDRESS_CONTROL || entry->size < 12 || c[0] != 0x01 || c[1] != 0x01)
+            continue;
+
+        uint32_t address = readle32(c + 4);
+        size_t count = c[2] | (c[3] << 8);
+        if (count > (entry->size - 8) / 4)
+            count = (entry->size - 8) / 4;
+        for (size_t j = 0; j < count; j++, address += 4) {
+            unsigned char *value = c + 8 + j * 4;
+            if (address == ENCODER_REGISTER_COMMAND) {
+                command = readle32(value);
+            } else if (command == ENCODER_COMMAND_CONFIGURE && address >= ENCODER_REGISTER_LAST && address <= ENCODER_REGISTER_SIZE) {
+                writele32(value, arguments[ARGUMENT(address)]);
+                found++;
+            }
+        }
+    }
+
+    if (found == 0) {
+        fprintf(stderr, "No encoder configuration in the init sequence to set up!\n");
+        sequence_close(patched);
+        return -1;
+    }
+    return 0;
+}
+
+int encoder_apply(struct regcache *rc, const struct encoder_profile *profile) {
+    uint32_t arguments[ENCODER_ARGUMENTS];
+    struct regwrite writes[ENCODER_ARGUMENTS];
+    uint32_t doorbell = 1;
+    uint32_t rate = 0;
+    useconds_t backoff = 200;
+
+    // Lowest address first, the arguments go out as a single command
+    encoder_build(profile, arguments);
+    for (size_t i = 0; i < ENCODER_ARGUMENTS; i++)
+        writes[i] = (struct regwrite) { ENCODER_REGISTER_LAST + i * 4, arguments[ENCODER_ARGUMENTS - 1 - i] };
+
+    check(write_reg(rc, ENCODER_REGISTER_COMMAND, ENCODER_COMMAND_CONFIGURE) == 0 && write_regs(rc, writes, ENCODER_ARGUMENTS) == 0
+            && write_reg(rc, ENCODER_REGISTER_DOORBELL, 1) == 0 && write_reg(rc, ENCODER_REGISTER_SIGNAL, 1) == 0, "Failed to send the encoder configuration!");
+
+    uint64_t deadline = lgp_now_ns() + ENCODER_DOORBELL_DEADLINE * 1000000ULL;
+    while (read_reg(rc, ENCODER_REGISTER_DOORBELL, &doorbell) == 0 && doorbell != 0 && lgp_now_ns() < deadline) {
+        usleep(backoff);
+        if (backoff < 20000)
+            backoff *= 2;
+    }
+    check(doorbell == 0, "The encoder did not take its configuration within %u ms!", ENCODER_DOORBELL_DEADLINE);
+    check(read_reg(rc, ENCODER_REGISTER_RATE, &rate) == 0 && rate == arguments[ARGUMENT(ENCODER_REGISTER_RATE)],
+            "The encoder rate register reads %.8x instead of %.8x!", rate, arguments[ARGUMENT(ENCODER_REGISTER_RATE)]);
+    return 0;
+
+error:
+    return -1;
+}
+
+void encoder_describe(const struct encoder_profile *profile, char *text, size_t size) {
+    snprintf(text, size, "%s (%ux%u, %u fps, %u kbit/s, keyframe every %u frames)", profile->name,
+            profile->width, profile->height, profile->fps, profile->bitrate, profile->keyframeinterval);
+}
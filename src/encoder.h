@@ -0,0 +1,75 @@
+#ifndef ENCODER_H
+#define ENCODER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "regcache.h"
+#include "sequence.h"
+
+// Encoder configuration of the C875. The UTL005 sequence sends it as a
+// mailbox command like every other one: the command word in 0x06F8, its
+// arguments from 0x06F4 down to 0x06D0, then 0x06CC = 1 rings the device,
+// which clears it once done. The configure command carries, as far as the
+// captured values tell:
+//   0x06F4  width | height << 16              80 07 38 04, 1920x1080
+//   0x06EC  kbit/s | keyframe interval << 16  30 75 78 00, 30000 kbit/s, 120 frames
+//   0x06E0  frames per second in the low half 1E 00 99 F1, 30
+//   0x06DC  output width | height << 16      the same as 0x06F4
+// The other arguments are sent as captured.
+
+#define ENCODER_REGISTER_COMMAND	0x06f8
+#define ENCODER_REGISTER_DOORBELL	0x06cc
+#define ENCODER_REGISTER_SIGNAL		0x06fc		// written after the doorbell, 0x01 for this command
+#define ENCODER_REGISTER_SIZE		0x06f4
+#define ENCODER_REGISTER_RATE		0x06ec
+#define ENCODER_REGISTER_TIMING		0x06e0
+#define ENCODER_REGISTER_OUTPUT		0x06dc
+#define ENCODER_REGISTER_LAST		0x06d0
+#define ENCODER_COMMAND_CONFIGURE	0x2101c219
+#define ENCODER_ARGUMENTS			10			// 0x06F4 down to 0x06D0
+
+#define ENCODER_DOORBELL_DEADLINE	500			// ms for the device to take a command
+
+// Limits of what the capture configured, nothing above is known to work
+#define ENCODER_MAX_WIDTH			1920
+#define ENCODER_MAX_HEIGHT			1080
+#define ENCODER_MIN_WIDTH			320
+#define ENCODER_MIN_HEIGHT			180
+#define ENCODER_MAX_FPS				60
+#define ENCODER_MAX_PIXELRATE		(1920ULL * 1080 * 30)
+#define ENCODER_MIN_BITRATE			250			// kbit/s
+#define ENCODER_MAX_BITRATE			30000		// kbit/s
+#define ENCODER_MAX_KEYFRAME		10			// s between keyframes
+
+struct encoder_profile {
+    char name[32];
+    unsigned int width;
+    unsigned int height;
+    unsigned int fps;
+    unsigned int bitrate;			// kbit/s
+    unsigned int keyframeinterval;	// frames from one IDR to the next
+};
+
+// "max" is what UTL005 configures.
+extern const struct encoder_profile encoder_presets[];
+extern const size_t encoder_presetcount;
+
+// A preset name, or <width>x<height>@<fps>,<kbit/s>[,<keyframe interval>] with
+// the interval one second if left out. Validated, -1 with the reason in why.
+int encoder_parse(struct encoder_profile *profile, const char *text, char *why, size_t size);
+int encoder_validate(const struct encoder_profile *profile, char *why, size_t size);
+// Same size and frame rate: what can change while the stream runs.
+int encoder_compatible(const struct encoder_profile *a, const struct encoder_profile *b);
+
+// Arguments of the configure command, 0x06F4 first.
+void encoder_build(const struct encoder_profile *profile, uint32_t arguments[ENCODER_ARGUMENTS]);
+// Writable copy of seq with the configure command set up for profile, -1 if seq has none.
+int encoder_patchsequence(const struct sequence *seq, const struct encoder_profile *profile, struct sequence *patched);
+// Sends the configure command to a running device and waits for it to take it.
+int encoder_apply(struct regcache *rc, const struct encoder_profile *profile);
+
+void encoder_describe(const struct encoder_profile *profile, char *text, size_t size);
+
+#endif
@@ -0,0 +1,259 @@
+#include "firmware.h"
+#include "lgp.h"
+
+#include <fcntl.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Completions come on whichever thread handles the events: on a resume the
+// capture loop is already running
+struct firmware_upload {
+    struct transport *transport;
+    struct libusb_transfer *transfers[FIRMWARE_DEPTH];
+    atomic_int busy[FIRMWARE_DEPTH];
+    uint64_t submitted[FIRMWARE_DEPTH];	// ns
+    unsigned char *blocks[FIRMWARE_DEPTH];	// usbfs memory the chunks are staged in, if the device has a pool of it
+    atomic_size_t inflight;
+    atomic_size_t confirmed;	// bytes the device took
+    atomic_int failed;
+};
+
+static uint64_t firmware_hash(const unsigned char *data, size_t size) {
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (size_t i = 0; i < size; i++) {
+        hash ^= data[i];
+        hash *= 0x100000001b3ULL;
+    }
+    return hash;
+}
+
+static const char *firmware_name(const char *path) {
+    const char *slash = strrchr(path, '/');
+    return slash != NULL ? slash + 1 : path;
+}
+
+// Returns 1 when the state file has this hash for the device and image.
+static int firmware_isloaded(const char *statefile, const char *devicekey, const char *name, uint64_t hash) {
+    char key[256], image[256];
+    unsigned long long recorded;
+    int found = 0;
+
+    FILE *f = fopen(statefile, "r");
+    if (f == NULL)
+        return 0;
+    while (fscanf(f, "%255s %255s %llx", key, image, &recorded) == 3) {
+        if (strcmp(key, devicekey) == 0 && strcmp(image, name) == 0 && recorded == hash) {
+            found = 1;
+            break;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+// Length of the location part of a device key, "<location>#<devnum>@<connect time>".
+static size_t firmware_location(const char *devicekey) {
+    return strcspn(devicekey, "#");
+}
+
+// Rewrites the state file with the line of this device and image replaced; the lines an
+// earlier enumeration of the device at the same location left go too.
+static int firmware_record(const char *statefile, const char *devicekey, const char *name, uint64_t hash) {
+    char key[256], image[256];
+    unsigned long long recorded;
+    char temppath[4096];
+    size_t location = firmware_location(devicekey);
+
+    snprintf(temppath, sizeof (temppath), "%s.tmp", statefile);
+    FILE *out = fopen(temppath, "w");
+    if (out == NULL)
+        return -1;
+
+    FILE *in = fopen(statefile, "r");
+    if (in != NULL) {
+        while (fscanf(in, "%255s %255s %llx", key, image, &recorded) == 3) {
+            int elsewhere = firmware_location(key) != location || strncmp(key, devicekey, location) != 0;
+            if (elsewhere || (strcmp(key, devicekey) == 0 && strcmp(image, name) != 0))
+                fprintf(out, "%s %s %016llx\n", key, image, recorded);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %s %016llx\n", devicekey, name, (unsigned long long) hash);
+
+    if (fclose(out) != 0 || rename(temppath, statefile) != 0) {
+        unlink(temppath);
+        return -1;
+    }
+    return 0;
+}
+
+static void firmware_transfer_done(struct libusb_transfer *transfer) {
+    struct firmware_upload *upload = (struct firmware_upload*) transfer->user_data;
+
+    for (size_t i = 0; i < FIRMWARE_DEPTH; i++) {
+        if (upload->transfers[i] == transfer) {
+            transport_record(upload->transport, transfer, upload->submitted[i], lgp_now_ns());
+            if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+                fprintf(stderr, "Firmware chunk failed: status %i, %i of %i bytes sent!\n", transfer->status, transfer->actual_length, transfer->length);
+                upload->failed = 1;
+            } else {
+                upload->confirmed += transfer->actual_length;
+            }
+            // Last, the slot is reused as soon as it is free
+            upload->busy[i] = 0;
+            upload->inflight--;
+            break;
+        }
+    }
+}
+
+// Lets chunks complete until at most target are left in flight.
+static int firmware_wait(struct firmware_upload *upload, size_t target) {
+    while (upload->inflight > target) {
+        struct timeval tv = {1, 0};
+        int err = transport_await(upload->transport, &tv);
+        if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Error while handling USB events: '%s' - '%s'\n", libusb_error_name(err), libusb_strerror(err));
+            return -1;
+        }
+    }
+    return upload->failed ? -1 : 0;
+}
+
+static int firmware_upload(struct transport *transport, const unsigned char *image, size_t size, struct firmware_stats *stats) {
+    struct firmware_upload upload;
+    size_t offset = 0;
+    int err = 0;
+
+    memset(&upload, 0, sizeof (upload));
+    upload.transport = transport;
+    for (size_t i = 0; i < FIRMWARE_DEPTH; i++) {
+        upload.transfers[i] = transport_alloc_transfer(transport);
+        check(upload.transfers[i] != NULL, "Failed to allocate the firmware transfers!");
+        // Copied in here the kernel does not copy them again; plain memory would gain nothing over the mapped image
+        if (transport->pool != NULL && transport->pool->kind == DMAPOOL_DEVMEM)
+            upload.blocks[i] = transport_alloc_buffer(transport, FIRMWARE_CHUNK_SIZE);
+    }
+
+    while (offset < size) {
+        if (upload.inflight == FIRMWARE_DEPTH && firmware_wait(&upload, FIRMWARE_DEPTH - 1) != 0)
+            goto error;
+        if (upload.failed)
+            goto error;
+
+        size_t length = size - offset;
+        if (length > FIRMWARE_CHUNK_SIZE)
+            length = FIRMWARE_CHUNK_SIZE;
+
+        size_t slot = 0;
+        while (upload.busy[slot])
+            slot++;
+        struct libusb_transfer *transfer = upload.transfers[slot];
+
+        // The image is mapped read only, the transfer never writes to it
+        unsigned char *chunk = (unsigned char*) image + offset;
+        if (upload.blocks[slot] != NULL) {
+            memcpy(upload.blocks[slot], chunk, length);
+            chunk = upload.blocks[slot];
+        }
+        transport_fill_bulk_transfer(transport, transfer, CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL, chunk, length, firmware_transfer_done, &upload, TIMEOUT);
+        upload.submitted[slot] = lgp_now_ns();
+        // Before the submission, it may complete before that returns
+        upload.busy[slot] = 1;
+        upload.inflight++;
+        err = transport_submit_transfer(transport, transfer);
+        if (err != 0) {
+            upload.busy[slot] = 0;
+            upload.inflight--;
+            fprintf(stderr, "Error while sending firmware chunk at %zu: '%s' - '%s'\n", offset, libusb_error_name(err), libusb_strerror(err));
+            goto error;
+        }
+        stats->transfers++;
+        offset += length;
+    }
+
+    // Everything queued has to come back before the transfers go away
+    if (firmware_wait(&upload, 0) != 0)
+        goto error;
+    check(upload.confirmed == size, "Firmware upload incomplete, %zu of %zu bytes confirmed!", upload.confirmed, size);
+
+    for (size_t i = 0; i < FIRMWARE_DEPTH; i++) {
+        transport_free_transfer(transport, upload.transfers[i]);
+        if (upload.blocks[i] != NULL)
+            transport_free_buffer(transport, upload.blocks[i], FIRMWARE_CHUNK_SIZE);
+    }
+    return 0;
+
+error:
+    for (size_t i = 0; i < FIRMWARE_DEPTH; i++) {
+        if (upload.busy[i])
+            transport_cancel_transfer(transport, upload.transfers[i]);
+    }
+    firmware_wait(&upload, 0);
+    for (size_t i = 0; i < FIRMWARE_DEPTH; i++) {
+        if (upload.transfers[i] != NULL)
+            transport_free_transfer(transport, upload.transfers[i]);
+        if (upload.blocks[i] != NULL)
+            transport_free_buffer(transport, upload.blocks[i], FIRMWARE_CHUNK_SIZE);
+    }
+    return -1;
+}
+
+int firmware_load(struct transport *transport, const char *path, const char *statefile, const char *devicekey, int force, struct firmware_stats *stats) {
+    uint64_t start = lgp_now_ns();
+    unsigned char *image = MAP_FAILED;
+    struct stat st;
+    int err = -1;
+
+    memset(stats, 0, sizeof (struct firmware_stats));
+    stats->path = path;
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0 || st.st_size == 0) {
+        fprintf(stderr, "Failed to open firmware %s!\n", path);
+        goto done;
+    }
+    stats->size = st.st_size;
+
+    image = (unsigned char*) mmap(NULL, stats->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (image == MAP_FAILED) {
+        fprintf(stderr, "Failed to map firmware %s!\n", path);
+        goto done;
+    }
+    madvise(image, stats->size, MADV_SEQUENTIAL);
+
+    stats->hash = firmware_hash(image, stats->size);
+    if (!force && statefile != NULL && devicekey != NULL && firmware_isloaded(statefile, devicekey, firmware_name(path), stats->hash)) {
+        stats->skipped = 1;
+        err = 0;
+        goto done;
+    }
+
+    err = firmware_upload(transport, image, stats->size, stats);
+    if (err == 0 && statefile != NULL && devicekey != NULL && firmware_record(statefile, devicekey, firmware_name(path), stats->hash) != 0)
+        fprintf(stderr, "Failed to record firmware %s in %s, it will be sent again next time.\n", path, statefile);
+
+done:
+    if (image != MAP_FAILED)
+        munmap(image, stats->size);
+    if (fd >= 0)
+        close(fd);
+    stats->elapsed = lgp_now_ns() - start;
+    return err;
+}
+
+void firmware_report(const struct firmware_stats *stats, FILE *out) {
+    if (stats->skipped) {
+        fprintf(out, "Firmware %s: %zu bytes, hash %016llx already loaded, upload skipped (%.2f ms)\n",
+                stats->path, stats->size, (unsigned long long) stats->hash, stats->elapsed / 1e6);
+        return;
+    }
+    double seconds = stats->elapsed / 1e9;
+    double mbps = seconds > 0 ? stats->size / seconds / (1024.0 * 1024.0) : 0;
+    fprintf(out, "Firmware %s: %zu bytes in %zu transfers, %.2f ms, %.2f MB/s, hash %016llx\n",
+            stats->path, stats->size, stats->transfers, stats->elapsed / 1e6, mbps, (unsigned long long) stats->hash);
+}
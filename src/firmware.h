@@ -0,0 +1,34 @@
+#ifndef FIRMWARE_H
+#define FIRMWARE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "transport.h"
+
+// Firmware goes out on EP. 02 in chunks of this size, several of them queued
+#define FIRMWARE_CHUNK_SIZE		32768
+#define FIRMWARE_DEPTH			8
+
+// Where the hashes of the images already uploaded are kept, one line per device and image
+#define FIRMWARE_DEFAULT_STATEFILE	"lgp_firmware.state"
+
+struct firmware_stats {
+    const char *path;
+    size_t size;
+    size_t transfers;
+    uint64_t hash;			// FNV-1a of the image
+    uint64_t elapsed;		// ns, mapping and hashing included
+    int skipped;			// the device already had this image
+};
+
+// Uploads the image at path, mapped read only, with FIRMWARE_DEPTH transfers in flight.
+// When statefile and devicekey are given, a successful upload is recorded and an
+// image whose hash is already recorded for that device is not sent again, unless forced.
+// devicekey names one enumeration of the device (see hotplug_instance()), so a camera
+// replugged or power cycled since, blank again, gets the image.
+int firmware_load(struct transport *transport, const char *path, const char *statefile, const char *devicekey, int force, struct firmware_stats *stats);
+
+void firmware_report(const struct firmware_stats *stats, FILE *out);
+
+#endif
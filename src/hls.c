@@ -0,0 +1,461 @@
+#include "hls.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// CRC of the PSI sections, MSB first and not reflected
+static uint32_t crc32mpeg(const unsigned char *data, size_t length) {
+    uint32_t crc = 0xffffffff;
+
+    for (size_t i = 0; i < length; i++) {
+        crc ^= (uint32_t) data[i] << 24;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 0x80000000 ? (crc << 1) ^ 0x04c11db7 : crc << 1;
+    }
+    return crc;
+}
+
+static void hls_segmentpath(struct hls *h, unsigned int number, char *path, size_t size) {
+    snprintf(path, size, "%s/%s-%u.ts", h->directory, h->stem, number);
+}
+
+static int hls_flush(struct hls *h) {
+    size_t written = 0;
+
+    while (written < h->outlength) {
+        ssize_t n = write(h->fd, h->out + written, h->outlength - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            fprintf(stderr, "HLS: failed to write segment %u: %s\n", h->segments[h->segmentcount - 1].number, strerror(errno));
+            h->stats.errors++;
+            h->failed = 1;
+            h->outlength = 0;
+            return -1;
+        }
+        written += n;
+    }
+    h->stats.bytes += h->outlength;
+    h->outlength = 0;
+    return 0;
+}
+
+static unsigned char *hls_packet(struct hls *h) {
+    if (h->outlength + HLS_TS_PACKET > HLS_OUTPUT_SIZE)
+        hls_flush(h);
+    unsigned char *p = h->out + h->outlength;
+    h->outlength += HLS_TS_PACKET;
+    h->segmentlength += HLS_TS_PACKET;
+    return p;
+}
+
+static void hls_header(unsigned char *p, uint16_t pid, int start, int adaptation, unsigned char *continuity) {
+    p[0] = 0x47;
+    p[1] = (start ? 0x40 : 0x00) | (pid >> 8);
+    p[2] = pid & 0xff;
+    p[3] = (adaptation ? 0x30 : 0x10) | *continuity;
+    *continuity = (*continuity + 1) & 0x0f;
+}
+
+// One PSI section in a packet of its own
+static void hls_section(struct hls *h, uint16_t pid, unsigned char *continuity, const unsigned char *section, size_t length) {
+    unsigned char *p = hls_packet(h);
+    uint32_t crc = crc32mpeg(section, length);
+
+    hls_header(p, pid, 1, 0, continuity);
+    p[4] = 0;		// pointer field
+    memcpy(p + 5, section, length);
+    p[5 + length] = crc >> 24;
+    p[6 + length] = crc >> 16;
+    p[7 + length] = crc >> 8;
+    p[8 + length] = crc;
+    memset(p + 9 + length, 0xff, HLS_TS_PACKET - 9 - length);
+}
+
+// PAT and PMT, ahead of every IDR so that every segment and independent part starts with them
+static void hls_tables(struct hls *h) {
+    static const unsigned char pat[] = {
+        0x00, 0xb0, 0x0d, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0x00, 0x01, 0xe0 | (HLS_PID_PMT >> 8), HLS_PID_PMT & 0xff,
+    };
+    // One H.264 stream carrying the PCR
+    static const unsigned char pmt[] = {
+        0x02, 0xb0, 0x12, 0x00, 0x01, 0xc1, 0x00, 0x00,
+        0xe0 | (HLS_PID_VIDEO >> 8), HLS_PID_VIDEO & 0xff, 0xf0, 0x00,
+        0x1b, 0xe0 | (HLS_PID_VIDEO >> 8), HLS_PID_VIDEO & 0xff, 0xf0, 0x00,
+    };
+
+    hls_section(h, 0x0000, &h->continuity[0], pat, sizeof (pat));
+    hls_section(h, HLS_PID_PMT, &h->continuity[1], pmt, sizeof (pmt));
+}
+
+// The access unit as one PES, PCR in the first packet, the last one padded with stuffing
+static void hls_pes(struct hls *h, const unsigned char *data, size_t length, uint64_t pts, int keyframe) {
+    unsigned char header[20] = { 0x00, 0x00, 0x01, 0xe0, 0x00, 0x00, 0x80, 0x80, 0x05 };
+    size_t headerlength = 14;
+
+    pts &= 0x1ffffffffULL;
+    header[9] = 0x21 | ((pts >> 29) & 0x0e);
+    header[10] = pts >> 22;
+    header[11] = ((pts >> 14) & 0xfe) | 0x01;
+    header[12] = pts >> 7;
+    header[13] = ((pts << 1) & 0xfe) | 0x01;
+    // Players want every access unit to open with a delimiter, the camera does not send them
+    if (length < 4 || (data[3] & 0x1f) != 9) {
+        static const unsigned char aud[] = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xf0 };
+        memcpy(header + headerlength, aud, sizeof (aud));
+        headerlength += sizeof (aud);
+    }
+
+    size_t total = headerlength + length;
+    size_t done = 0;
+    for (int first = 1; done < total; first = 0) {
+        unsigned char *p = hls_packet(h);
+        size_t adaptation = first ? 8 : 0;
+        if (total - done < 184 - adaptation)
+            adaptation = 184 - (total - done);
+
+        hls_header(p, HLS_PID_VIDEO, first, adaptation > 0, &h->continuity[2]);
+        if (adaptation > 0) {
+            p[4] = adaptation - 1;
+            if (adaptation > 1) {
+                size_t used = 2;
+                p[5] = 0x00;
+                if (first) {
+                    uint64_t pcr = (pts - HLS_PCR_DELAY) & 0x1ffffffffULL;
+                    p[5] = 0x10 | (keyframe ? 0x40 : 0x00);		// PCR, random access
+                    p[6] = pcr >> 25;
+                    p[7] = pcr >> 17;
+                    p[8] = pcr >> 9;
+                    p[9] = pcr >> 1;
+                    p[10] = ((pcr & 1) << 7) | 0x7e;
+                    p[11] = 0x00;
+                    used = 8;
+                }
+                memset(p + 4 + used, 0xff, adaptation - used);
+            }
+        }
+
+        size_t at = 4 + adaptation;
+        size_t payload = HLS_TS_PACKET - at;
+        if (done < headerlength) {
+            size_t n = headerlength - done < payload ? headerlength - done : payload;
+            memcpy(p + at, header + done, n);
+            at += n;
+            payload -= n;
+            done += n;
+        }
+        memcpy(p + at, data + (done - headerlength), payload);
+        done += payload;
+    }
+}
+
+// Follows the host clock, access units that came in the same transfer are spaced by the frame duration
+static uint64_t hls_pts(struct hls *h, uint64_t timestamp) {
+    if (!h->timing) {
+        h->timing = 1;
+        h->firsttimestamp = timestamp;
+        h->lasthost = timestamp;
+        h->sincehost = 1;
+        h->frameduration = HLS_CLOCK / 30;
+        h->lastpts = HLS_PTS_OFFSET;
+        return h->lastpts;
+    }
+
+    if (timestamp > h->lasthost) {
+        uint64_t observed = (timestamp - h->lasthost) * 9 / 100000 / h->sincehost;
+        h->frameduration = (h->frameduration * 7 + observed) / 8;
+        h->lasthost = timestamp;
+        h->sincehost = 0;
+    }
+    h->sincehost++;
+
+    uint64_t host = HLS_PTS_OFFSET + (timestamp - h->firsttimestamp) * 9 / 100000;
+    uint64_t pts = h->lastpts + (h->frameduration > 0 ? h->frameduration : 1);
+    // Behind the host clock after a gap in the stream, caught up at once
+    if (host > pts)
+        pts = host;
+    h->lastpts = pts;
+    return pts;
+}
+
+static void hls_writeplaylist(struct hls *h, int ended) {
+    char temporary[sizeof (h->playlist) + 4];
+    uint64_t target = (h->config.segmentms + 999) / 1000;
+    double parttarget = h->config.partms / 1000.0;
+
+    // Rounded as players round the durations, and never lowered
+    for (size_t i = 0; i < h->segmentcount; i++) {
+        uint64_t rounded = (h->segments[i].duration + HLS_CLOCK / 2) / HLS_CLOCK;
+        if (rounded > target)
+            target = rounded;
+    }
+    if (target > h->targetduration)
+        h->targetduration = target;
+
+    snprintf(temporary, sizeof (temporary), "%s.tmp", h->playlist);
+    FILE *f = fopen(temporary, "w");
+    if (f == NULL) {
+        fprintf(stderr, "HLS: failed to write %s: %s\n", temporary, strerror(errno));
+        h->stats.errors++;
+        return;
+    }
+
+    fprintf(f, "#EXTM3U\n#EXT-X-VERSION:6\n#EXT-X-TARGETDURATION:%llu\n#EXT-X-MEDIA-SEQUENCE:%u\n#EXT-X-INDEPENDENT-SEGMENTS\n",
+            (unsigned long long) h->targetduration, h->segmentcount > 0 ? h->segments[0].number : h->nextnumber);
+    if (h->config.partms > 0)
+        fprintf(f, "#EXT-X-PART-INF:PART-TARGET=%.3f\n#EXT-X-SERVER-CONTROL:PART-HOLD-BACK=%.3f\n", parttarget, 3 * parttarget);
+
+    for (size_t i = 0; i < h->segmentcount; i++) {
+        struct hls_segment *s = &h->segments[i];
+        // Parts of the last two segments and of the open one, older ones are whole segments only
+        if (h->config.partms > 0 && i + 3 >= h->segmentcount) {
+            for (size_t j = 0; j < s->partcount; j++) {
+                struct hls_part *part = &s->parts[j];
+                fprintf(f, "#EXT-X-PART:DURATION=%.5f,URI=\"%s-%u.ts\",BYTERANGE=\"%llu@%llu\"%s\n",
+                        (double) part->duration / HLS_CLOCK, h->stem, s->number, (unsigned long long) part->length,
+                        (unsigned long long) part->offset, part->independent ? ",INDEPENDENT=YES" : "");
+            }
+        }
+        if (s->duration > 0)
+            fprintf(f, "#EXTINF:%.5f,\n%s-%u.ts\n", (double) s->duration / HLS_CLOCK, h->stem, s->number);
+    }
+    if (ended)
+        fprintf(f, "#EXT-X-ENDLIST\n");
+
+    // Players never see half a playlist
+    if (fclose(f) != 0 || rename(temporary, h->playlist) != 0) {
+        fprintf(stderr, "HLS: failed to write %s: %s\n", h->playlist, strerror(errno));
+        h->stats.errors++;
+        unlink(temporary);
+        return;
+    }
+    h->stats.playlists++;
+}
+
+static int hls_opensegment(struct hls *h, uint64_t pts) {
+    char path[sizeof (h->directory) + sizeof (h->stem) + 16];
+    struct hls_segment *s = &h->segments[h->segmentcount];
+
+    memset(s, 0, sizeof (struct hls_segment));
+    s->number = h->nextnumber++;
+    hls_segmentpath(h, s->number, path, sizeof (path));
+    h->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (h->fd < 0) {
+        fprintf(stderr, "HLS: failed to open %s: %s\n", path, strerror(errno));
+        h->stats.errors++;
+        h->failed = 1;
+        return -1;
+    }
+    h->segmentcount++;
+    h->open = 1;
+    h->segmentlength = 0;
+    h->segmentstart = pts;
+    h->partstart = pts;
+    h->partoffset = 0;
+    return 0;
+}
+
+// Ends the part at pts, the start of the next one
+static void hls_closepart(struct hls *h, uint64_t pts) {
+    struct hls_segment *s = &h->segments[h->segmentcount - 1];
+
+    if (h->segmentlength == h->partoffset || s->partcount == HLS_MAX_PARTS)
+        return;
+    hls_flush(h);
+    struct hls_part *part = &s->parts[s->partcount++];
+    part->offset = h->partoffset;
+    part->length = h->segmentlength - h->partoffset;
+    part->duration = pts > h->partstart ? pts - h->partstart : 1;
+    part->independent = h->partindependent;
+    h->stats.parts++;
+
+    h->partoffset = h->segmentlength;
+    h->partstart = pts;
+}
+
+static void hls_closesegment(struct hls *h, uint64_t pts) {
+    struct hls_segment *s = &h->segments[h->segmentcount - 1];
+    char path[sizeof (h->directory) + sizeof (h->stem) + 16];
+
+    if (h->config.partms > 0)
+        hls_closepart(h, pts);
+    else
+        hls_flush(h);
+    close(h->fd);
+    h->fd = -1;
+    h->open = 0;
+    s->duration = pts > h->segmentstart ? pts - h->segmentstart : 1;
+    h->stats.segments++;
+
+    if (h->segmentcount <= h->config.window)
+        return;
+    // Out of the playlist, the file stays until the next one leaves as players may still be reading it
+    if (h->expired > 0) {
+        hls_segmentpath(h, h->expired - 1, path, sizeof (path));
+        unlink(path);
+    }
+    h->expired = h->segments[0].number + 1;
+    memmove(&h->segments[0], &h->segments[1], (h->segmentcount - 1) * sizeof (struct hls_segment));
+    h->segmentcount--;
+}
+
+static void hls_onau(void *userdata, const struct nalscan_au *au) {
+    struct hls *h = (struct hls*) userdata;
+    int keyframe = (au->flags & NALSCAN_IDR) != 0;
+
+    if (h->failed)
+        return;
+    if (au->offset < h->pendingoffset || au->offset + au->size > h->pendingoffset + h->pendinglength) {
+        // Did not fit in the pending bytes, the next IDR is decodable again
+        h->stats.dropped++;
+        h->waitidr = 1;
+        return;
+    }
+    if (h->waitidr) {
+        if (!keyframe || (au->flags & NALSCAN_SPS) == 0) {
+            h->stats.skipped++;
+            return;
+        }
+        h->waitidr = 0;
+    }
+
+    uint64_t pts = hls_pts(h, au->timestamp);
+    uint64_t listed = 0;
+    if (!h->open) {
+        if (hls_opensegment(h, pts) != 0)
+            return;
+    } else if (keyframe && pts + h->frameduration / 2 >= h->segmentstart + h->config.segmentms * 90ULL) {
+        listed = h->partoldest;
+        hls_closesegment(h, pts);
+        if (hls_opensegment(h, pts) != 0)
+            return;
+    } else if (h->config.partms > 0 && h->segments[h->segmentcount - 1].partcount < HLS_MAX_PARTS - 1
+            && pts + h->frameduration > h->partstart + h->config.partms * 90ULL) {
+        listed = h->partoldest;
+        hls_closepart(h, pts);
+    }
+    // The segment or part just closed is in the playlist from now on
+    if (listed != 0) {
+        hls_writeplaylist(h, 0);
+        metrics_latency(&h->stats.latency, lgp_now_ns() - listed);
+    }
+
+    if (h->segmentlength == h->partoffset) {
+        h->partoldest = au->timestamp;
+        h->partindependent = keyframe;
+    }
+    if (keyframe)
+        hls_tables(h);
+    hls_pes(h, h->pending + (au->offset - h->pendingoffset), au->size, pts, keyframe);
+    h->stats.accessunits++;
+}
+
+int hls_open(struct hls *h, const struct hls_config *config, const char *stem) {
+    memset(h, 0, sizeof (struct hls));
+    h->config = *config;
+    h->fd = -1;
+    h->waitidr = 1;
+    if (h->config.segmentms == 0)
+        h->config.segmentms = HLS_DEFAULT_SEGMENT;
+    if (h->config.window == 0)
+        h->config.window = HLS_DEFAULT_WINDOW;
+    if (h->config.window > HLS_MAX_WINDOW)
+        h->config.window = HLS_MAX_WINDOW;
+    if (h->config.partms >= h->config.segmentms)
+        h->config.partms = 0;
+    snprintf(h->directory, sizeof (h->directory), "%s", config->directory);
+    snprintf(h->stem, sizeof (h->stem), "%s", stem);
+    snprintf(h->playlist, sizeof (h->playlist), "%s/%s.m3u8", h->directory, h->stem);
+
+    if (mkdir(h->directory, 0755) != 0 && errno != EEXIST) {
+        fprintf(stderr, "HLS: failed to create %s: %s\n", h->directory, strerror(errno));
+        return -1;
+    }
+    h->pending = (unsigned char*) malloc(HLS_PENDING_SIZE);
+    h->out = (unsigned char*) malloc(HLS_OUTPUT_SIZE);
+    if (h->pending == NULL || h->out == NULL) {
+        fprintf(stderr, "Failed to allocate the HLS buffers!\n");
+        free(h->pending);
+        free(h->out);
+        return -1;
+    }
+    // Touched now, the writer thread never faults on them
+    memset(h->pending, 0, HLS_PENDING_SIZE);
+    memset(h->out, 0, HLS_OUTPUT_SIZE);
+
+    nalscan_init(&h->scanner, hls_onau, h);
+    return 0;
+}
+
+// Drops what was packetized already, the access unit in progress moves to the front
+static void hls_compact(struct hls *h) {
+    // A start code and NAL header split with the next transfer may still open an access unit
+    uint64_t keep = h->scanner.offset > 8 ? h->scanner.offset - 8 : 0;
+    if (h->scanner.auopen && h->scanner.au.offset < keep)
+        keep = h->scanner.au.offset;
+    if (keep <= h->pendingoffset)
+        return;
+
+    size_t drop = keep - h->pendingoffset;
+    memmove(h->pending, h->pending + drop, h->pendinglength - drop);
+    h->pendinglength -= drop;
+    h->pendingoffset = keep;
+}
+
+void hls_push(struct hls *h, const unsigned char *data, size_t length, uint64_t timestamp) {
+    if (h->pendinglength + length > HLS_PENDING_SIZE)
+        hls_compact(h);
+    // Still no room, the access unit in progress is given up
+    if (h->pendinglength + length > HLS_PENDING_SIZE) {
+        h->pendingoffset += h->pendinglength;
+        h->pendinglength = 0;
+    }
+    if (length <= HLS_PENDING_SIZE) {
+        memcpy(h->pending + h->pendinglength, data, length);
+        h->pendinglength += length;
+    }
+    nalscan_push(&h->scanner, data, length, timestamp);
+    if (length > HLS_PENDING_SIZE)
+        h->pendingoffset = h->scanner.offset;
+}
+
+int hls_close(struct hls *h) {
+    char path[sizeof (h->directory) + sizeof (h->stem) + 16];
+
+    if (h->pending == NULL)
+        return -1;
+    nalscan_finish(&h->scanner);
+    if (h->open && !h->failed) {
+        hls_closesegment(h, h->lastpts + h->frameduration);
+        hls_writeplaylist(h, 1);
+    } else if (h->open) {
+        close(h->fd);
+    }
+    if (h->expired > 0) {
+        hls_segmentpath(h, h->expired - 1, path, sizeof (path));
+        unlink(path);
+    }
+    free(h->pending);
+    free(h->out);
+    h->pending = NULL;
+    h->out = NULL;
+    return h->failed ? -1 : 0;
+}
+
+void hls_report(struct hls *h, FILE *out) {
+    struct metrics_histogram *l = &h->stats.latency;
+    uint64_t count = atomic_load_explicit(&l->count, memory_order_relaxed);
+
+    fprintf(out, "HLS: %llu segments, %llu parts, %llu access units (%llu skipped, %llu dropped), %llu MiB of MPEG-TS, %llu playlists, %.2f ms frames, glass to playlist p50 %.1f ms p99 %.1f ms max %.1f ms\n",
+            (unsigned long long) h->stats.segments, (unsigned long long) h->stats.parts, (unsigned long long) h->stats.accessunits,
+            (unsigned long long) h->stats.skipped, (unsigned long long) h->stats.dropped, (unsigned long long) (h->stats.bytes >> 20),
+            (unsigned long long) h->stats.playlists, h->frameduration / 90.0,
+            count > 0 ? metrics_quantile(l, 0.5) / 1e6 : 0.0, count > 0 ? metrics_quantile(l, 0.99) / 1e6 : 0.0,
+            atomic_load_explicit(&l->max, memory_order_relaxed) / 1e6);
+}
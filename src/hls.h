@@ -0,0 +1,122 @@
+#ifndef HLS_H
+#define HLS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+#include "nalscan.h"
+
+// Live HLS of the Annex-B stream of EP. 81: access units are packetized in
+// MPEG-TS as they complete, segments are cut at the first IDR once they are
+// long enough, and a rolling m3u8 playlist is rewritten (write and rename)
+// every time there is something new in it. With partial segments the open
+// segment is also listed part by part as byte ranges of its file, for
+// low-latency players.
+//
+// Host timestamps are per transfer, the PTS follows them but access units
+// sharing one are spaced by the measured frame duration. There are no
+// B-frames from the camera, DTS is the PTS.
+
+#define HLS_DEFAULT_SEGMENT		2000		// ms
+#define HLS_DEFAULT_WINDOW		6			// segments listed
+#define HLS_MAX_WINDOW			32
+#define HLS_MAX_PARTS			64			// per segment, the last one gets longer once reached
+#define HLS_PENDING_SIZE		(4 * 1024 * 1024)	// largest access unit held
+#define HLS_OUTPUT_SIZE			(1024 * 1024)
+
+#define HLS_TS_PACKET		188
+#define HLS_PID_PMT			0x1000
+#define HLS_PID_VIDEO		0x0100
+#define HLS_CLOCK			90000
+// Start of the PTS and how far behind it the PCR goes, as most muxers do
+#define HLS_PTS_OFFSET		126000
+#define HLS_PCR_DELAY		63000
+
+struct hls_config {
+    const char *directory;	// NULL for no HLS
+    unsigned int segmentms;
+    unsigned int partms;	// 0 for whole segments only
+    unsigned int window;
+};
+
+struct hls_part {
+    uint64_t offset;		// in the segment file
+    uint64_t length;
+    uint64_t duration;		// HLS_CLOCK
+    int independent;		// starts with an IDR
+};
+
+struct hls_segment {
+    unsigned int number;
+    uint64_t duration;		// HLS_CLOCK, 0 while it is open
+    struct hls_part parts[HLS_MAX_PARTS];
+    size_t partcount;
+};
+
+struct hls_stats {
+    uint64_t segments;
+    uint64_t parts;
+    uint64_t accessunits;
+    uint64_t bytes;			// MPEG-TS written
+    uint64_t skipped;		// access units before the first IDR, or after a dropped one
+    uint64_t dropped;		// access units larger than HLS_PENDING_SIZE
+    uint64_t playlists;
+    uint64_t errors;
+    struct metrics_histogram latency;	// host time of the first transfer of the oldest frame to the playlist listing it
+};
+
+struct hls {
+    struct hls_config config;
+    char directory[128];
+    char stem[64];
+    char playlist[256];
+
+    struct nalscan scanner;
+    // Stream bytes of the access unit in progress, from pendingoffset
+    unsigned char *pending;
+    size_t pendinglength;
+    uint64_t pendingoffset;
+    int waitidr;
+
+    // MPEG-TS not written to the segment yet
+    unsigned char *out;
+    size_t outlength;
+    unsigned char continuity[3];	// PAT, PMT, video
+
+    int fd;
+    uint64_t segmentlength;		// bytes of the open segment, written or in out
+    struct hls_segment segments[HLS_MAX_WINDOW + 1];	// oldest first, the last one is open
+    size_t segmentcount;
+    unsigned int nextnumber;
+    unsigned int expired;		// number + 1 of the segment last out of the playlist, 0 for none
+    uint64_t targetduration;	// s, never lowered once a playlist went out
+    uint64_t segmentstart;		// PTS
+    uint64_t partstart;			// PTS
+    uint64_t partoffset;		// segmentlength at the part start
+    uint64_t partoldest;		// ns, host time of its first access unit
+    int partindependent;
+    int open;
+
+    // PTS of the host timestamps
+    uint64_t firsttimestamp;
+    uint64_t lastpts;
+    uint64_t lasthost;			// last distinct host timestamp, ns
+    uint64_t sincehost;			// access units since it
+    uint64_t frameduration;		// HLS_CLOCK, estimated
+    int timing;
+
+    int failed;
+    struct hls_stats stats;
+};
+
+// stem names the playlist, stem.m3u8, and the segments, stem-<n>.ts. The directory is created if needed.
+int hls_open(struct hls *h, const struct hls_config *config, const char *stem);
+// Stream data as it comes, from the writer thread.
+void hls_push(struct hls *h, const unsigned char *data, size_t length, uint64_t timestamp);
+// Ends the last segment and the playlist.
+int hls_close(struct hls *h);
+
+void hls_report(struct hls *h, FILE *out);
+
+#endif
@@ -0,0 +1,112 @@
+#include "hotplug.h"
+#include "lgp.h"
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+// Runs on whichever thread handles the libusb events, nothing but queueing here
+static int LIBUSB_CALL hotplug_callback(libusb_context *context, libusb_device *device, libusb_hotplug_event event, void *userdata) {
+    struct hotplug *h = (struct hotplug*) userdata;
+    char key[64];
+    (void) context;
+
+    hotplug_location(device, key, sizeof (key));
+    hotplug_post(h, event == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED ? HOTPLUG_ARRIVED : HOTPLUG_LEFT, device, key,
+            libusb_get_bus_number(device), libusb_get_device_address(device));
+    return 0;
+}
+
+void hotplug_init(struct hotplug *h) {
+    memset(h, 0, sizeof (struct hotplug));
+    pthread_mutex_init(&h->lock, NULL);
+}
+
+int hotplug_register(struct hotplug *h, libusb_context *context) {
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        fprintf(stderr, "No hotplug support, a camera going away ends its capture.\n");
+        return -1;
+    }
+
+    int err = libusb_hotplug_register_callback(context, LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+            LIBUSB_HOTPLUG_NO_FLAGS, CAMERA_VENDOR, CAMERA_PRODUCT, LIBUSB_HOTPLUG_MATCH_ANY, hotplug_callback, h, &h->handle);
+    if (err != 0) {
+        fprintf(stderr, "Failed to watch for hotplug events: '%s' - '%s'\n", libusb_error_name(err), libusb_strerror(err));
+        return -1;
+    }
+    h->context = context;
+    h->registered = 1;
+    return 0;
+}
+
+void hotplug_free(struct hotplug *h) {
+    struct hotplug_event event;
+
+    if (h->registered)
+        libusb_hotplug_deregister_callback(h->context, h->handle);
+    h->registered = 0;
+    while (hotplug_next(h, &event)) {
+        if (event.device != NULL)
+            libusb_unref_device(event.device);
+    }
+    pthread_mutex_destroy(&h->lock);
+}
+
+void hotplug_post(struct hotplug *h, enum hotplug_kind kind, libusb_device *device, const char *key, uint16_t busnum, uint8_t devnum) {
+    pthread_mutex_lock(&h->lock);
+    if (h->count == HOTPLUG_QUEUE) {
+        // Nobody takes them, the oldest matter least
+        struct hotplug_event *oldest = &h->events[h->head];
+        if (oldest->device != NULL)
+            libusb_unref_device(oldest->device);
+        h->head = (h->head + 1) % HOTPLUG_QUEUE;
+        h->count--;
+        h->dropped++;
+    }
+
+    struct hotplug_event *event = &h->events[(h->head + h->count) % HOTPLUG_QUEUE];
+    event->kind = kind;
+    event->device = device != NULL ? libusb_ref_device(device) : NULL;
+    snprintf(event->key, sizeof (event->key), "%s", key != NULL ? key : "");
+    event->busnum = busnum;
+    event->devnum = devnum;
+    h->count++;
+    pthread_mutex_unlock(&h->lock);
+}
+
+int hotplug_next(struct hotplug *h, struct hotplug_event *event) {
+    int taken = 0;
+
+    pthread_mutex_lock(&h->lock);
+    if (h->count > 0) {
+        *event = h->events[h->head];
+        h->head = (h->head + 1) % HOTPLUG_QUEUE;
+        h->count--;
+        taken = 1;
+    }
+    pthread_mutex_unlock(&h->lock);
+    return taken;
+}
+
+void hotplug_location(libusb_device *device, char *key, size_t size) {
+    uint8_t ports[8];
+    int count = libusb_get_port_numbers(device, ports, sizeof (ports));
+
+    int length = snprintf(key, size, "usb-%u-", libusb_get_bus_number(device));
+    for (int i = 0; i < count && length < (int) size; i++)
+        length += snprintf(key + length, size - length, i == 0 ? "%u" : ".%u", ports[i]);
+}
+
+void hotplug_instance(libusb_device *device, const char *location, char *key, size_t size) {
+    char node[64];
+    struct stat st;
+    unsigned int bus = libusb_get_bus_number(device);
+    unsigned int address = libusb_get_device_address(device);
+
+    // The node is made when the device enumerates, its change time is when it connected
+    snprintf(node, sizeof (node), "/dev/bus/usb/%03u/%03u", bus, address);
+    if (stat(node, &st) == 0)
+        snprintf(key, size, "%s#%u@%lld.%09ld", location, address, (long long) st.st_ctim.tv_sec, st.st_ctim.tv_nsec);
+    else
+        snprintf(key, size, "%s#%u", location, address);
+}
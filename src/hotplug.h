@@ -0,0 +1,56 @@
+#ifndef HOTPLUG_H
+#define HOTPLUG_H
+
+#include <libusb-1.0/libusb.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Arrivals and departures of cameras, queued by the libusb hotplug callback
+// (or the emulator) on the event thread and taken by the main thread, which
+// is the only one opening devices and talking to them synchronously.
+
+#define HOTPLUG_QUEUE		32
+
+enum hotplug_kind {
+    HOTPLUG_ARRIVED,
+    HOTPLUG_LEFT
+};
+
+struct hotplug_event {
+    enum hotplug_kind kind;
+    libusb_device *device;		// referenced until taken, NULL for the emulator
+    char key[64];				// "usb-<bus>-<port>...", empty for the emulator
+    uint16_t busnum;
+    uint8_t devnum;
+};
+
+struct hotplug {
+    pthread_mutex_t lock;
+    struct hotplug_event events[HOTPLUG_QUEUE];
+    size_t head;
+    size_t count;
+    size_t dropped;
+
+    libusb_context *context;
+    libusb_hotplug_callback_handle handle;
+    int registered;
+};
+
+void hotplug_init(struct hotplug *h);
+// Watches for the C875 coming and going, -1 when libusb cannot tell on this platform.
+int hotplug_register(struct hotplug *h, libusb_context *context);
+void hotplug_free(struct hotplug *h);
+
+// Queues an event, takes a reference on device. Safe from any thread.
+void hotplug_post(struct hotplug *h, enum hotplug_kind kind, libusb_device *device, const char *key, uint16_t busnum, uint8_t devnum);
+// 1 with the oldest event, whose device reference goes to the caller, 0 when there is none.
+int hotplug_next(struct hotplug *h, struct hotplug_event *event);
+
+// Where the device is plugged, "usb-<bus>-<port>.<port>...", stays the same across a replug.
+void hotplug_location(libusb_device *device, char *key, size_t size);
+// Which enumeration of the device at location it is, "<location>#<devnum>@<connect time>":
+// a replug or a power cycle of the device gives another one.
+void hotplug_instance(libusb_device *device, const char *location, char *key, size_t size);
+
+#endif
@@ -0,0 +1,227 @@
+#include "initexec.h"
+#include "lgp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static uint32_t readle32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+// Register read or write on EP. 04, 01 00|01 <count16> <addr32>, returns 1 for reads, 0 for writes, -1 otherwise.
+static int initexec_register(const struct sequence_entry *entry, const unsigned char *command, uint32_t *address, size_t *count) {
+    if (entry->endpoint != CAMERA_ENDPOINT_ADDRESS_CONTROL || entry->size < 8 || command[0] != 0x01 || command[1] > 0x01)
+        return -1;
+    *address = readle32(command + 4);
+    *count = command[2] | (command[3] << 8);
+    if (command[1] == 0x01 && *count > (entry->size - 8) / 4)
+        *count = (entry->size - 8) / 4;
+    return command[1] == 0x00;
+}
+
+static void initexec_done(struct libusb_transfer *transfer) {
+    struct initexec *ex = (struct initexec*) transfer->user_data;
+
+    for (size_t i = 0; i < ex->maxinflight; i++) {
+        if (ex->transfers[i] == transfer) {
+            transport_record(ex->transport, transfer, ex->submitted[i], lgp_now_ns());
+            if (transfer->status != LIBUSB_TRANSFER_COMPLETED || transfer->actual_length != transfer->length) {
+                fprintf(stderr, "Queued command failed on endpoint 0x%.2x: status %i, %i of %i bytes sent!\n",
+                        transfer->endpoint, transfer->status, transfer->actual_length, transfer->length);
+                ex->failed = 1;
+            }
+            // Last, the slot is reused as soon as it is free
+            ex->busy[i] = 0;
+            ex->inflight--;
+            break;
+        }
+    }
+}
+
+// Lets transfers complete until at most target are left in flight.
+static int initexec_wait(struct initexec *ex, size_t target) {
+    while (ex->inflight > target) {
+        struct timeval tv = {1, 0};
+        int err = transport_await(ex->transport, &tv);
+        if (err != 0 && err != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "Error while handling USB events: '%s' - '%s'\n", libusb_error_name(err), libusb_strerror(err));
+            return -1;
+        }
+    }
+    return ex->failed ? -1 : 0;
+}
+
+static int initexec_queue(struct initexec *ex, unsigned char endpoint, const unsigned char *command, size_t size) {
+    if (ex->inflight == ex->maxinflight && initexec_wait(ex, ex->maxinflight - 1) != 0)
+        return -1;
+
+    size_t slot = 0;
+    while (ex->busy[slot])
+        slot++;
+
+    // The command is never written to, sequences can stay mapped read only
+    transport_fill_bulk_transfer(ex->transport, ex->transfers[slot], endpoint, (unsigned char*) command, size, initexec_done, ex, TIMEOUT);
+    ex->submitted[slot] = lgp_now_ns();
+    // Before the submission, it may complete before that returns
+    ex->busy[slot] = 1;
+    ex->inflight++;
+    int err = transport_submit_transfer(ex->transport, ex->transfers[slot]);
+    if (err != 0) {
+        ex->busy[slot] = 0;
+        ex->inflight--;
+        fprintf(stderr, "Error while queuing command on endpoint 0x%.2x: '%s' - '%s'\n", endpoint, libusb_error_name(err), libusb_strerror(err));
+        return -1;
+    }
+    return 0;
+}
+
+// Sends a command once everything queued before it went through, and reads its answer.
+static int initexec_sync(struct initexec *ex, struct initexec_phase *phase, const struct sequence_entry *entry, const unsigned char *command, int *answered) {
+    int transferred = 0;
+    int err;
+
+    if (initexec_wait(ex, 0) != 0)
+        return -1;
+
+    if (entry->size > 0 && !(entry->endpoint & 0x80)) {
+        err = transport_bulk_transfer(ex->transport, entry->endpoint, (unsigned char*) command, entry->size, &transferred, TIMEOUT);
+        if (err != 0) {
+            fprintf(stderr, "Error while sending command: '%s' - '%s', on endpoint 0x%.2x!\n", libusb_error_name(err), libusb_strerror(err), entry->endpoint);
+            return -1;
+        }
+    }
+
+    if (!entry->expectanswer)
+        return 0;
+
+    // Video control commands are answered on the video endpoint, like reads listed on their own
+    unsigned char endpoint = CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE;
+    if (entry->endpoint == CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL || entry->endpoint == CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE)
+        endpoint = CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE;
+    int length = endpoint == CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE ? USB_BULK_MAX_PACKET_SIZE : VIDEO_TRANSFER_SIZE;
+
+    phase->syncs++;
+    err = transport_bulk_transfer(ex->transport, endpoint, ex->response, length, &transferred, TIMEOUT);
+    if (err == LIBUSB_ERROR_TIMEOUT) {
+        phase->timeouts++;
+    } else if (err != 0) {
+        fprintf(stderr, "Error while reading status: '%s' - '%s', on endpoint 0x%.2x!\n", libusb_error_name(err), libusb_strerror(err), endpoint);
+        return -1;
+    } else {
+        *answered = transferred;
+    }
+    return 0;
+}
+
+int initexec_init(struct initexec *ex, struct transport *transport, size_t maxinflight) {
+    memset(ex, 0, sizeof (struct initexec));
+    ex->transport = transport;
+    ex->maxinflight = maxinflight > 0 && maxinflight <= INITEXEC_MAX_INFLIGHT ? maxinflight : INITEXEC_MAX_INFLIGHT;
+
+    ex->response = transport_alloc_buffer(transport, VIDEO_TRANSFER_SIZE);
+    if (ex->response == NULL) {
+        fprintf(stderr, "Failed to allocate the init response buffer!\n");
+        return -1;
+    }
+
+    for (size_t i = 0; i < ex->maxinflight; i++) {
+        ex->transfers[i] = transport_alloc_transfer(transport);
+        if (ex->transfers[i] == NULL) {
+            fprintf(stderr, "Failed to allocate the init transfers!\n");
+            initexec_free(ex);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+void initexec_setregcache(struct initexec *ex, struct regcache *regcache) {
+    ex->regcache = regcache;
+}
+
+void initexec_free(struct initexec *ex) {
+    for (size_t i = 0; i < ex->maxinflight; i++) {
+        if (ex->transfers[i] != NULL)
+            transport_free_transfer(ex->transport, ex->transfers[i]);
+        ex->transfers[i] = NULL;
+    }
+    if (ex->response != NULL)
+        transport_free_buffer(ex->transport, ex->response, VIDEO_TRANSFER_SIZE);
+    ex->response = NULL;
+}
+
+struct initexec_phase *initexec_begin(struct initexec *ex, const char *name) {
+    if (ex->phasecount == INITEXEC_MAX_PHASES)
+        ex->phasecount--;
+    struct initexec_phase *phase = &ex->phases[ex->phasecount++];
+    memset(phase, 0, sizeof (struct initexec_phase));
+    phase->name = name;
+    ex->phasestart = lgp_now_ns();
+    return phase;
+}
+
+void initexec_end(struct initexec *ex) {
+    if (ex->phasecount > 0)
+        ex->phases[ex->phasecount - 1].elapsed = lgp_now_ns() - ex->phasestart;
+}
+
+int initexec_run(struct initexec *ex, const char *name, const struct sequence *seq) {
+    struct initexec_phase *phase = initexec_begin(ex, name);
+    int err = 0;
+
+    ex->failed = 0;
+    for (size_t i = 0; i < seq->count && err == 0; i++) {
+        const struct sequence_entry *entry = &seq->entries[i];
+        const unsigned char *command = sequence_command(seq, i);
+
+        if (entry->size == 0 && !entry->expectanswer)
+            continue;
+        phase->commands++;
+
+        uint32_t address = 0, value;
+        size_t count = 0;
+        int kind = ex->regcache != NULL ? initexec_register(entry, command, &address, &count) : -1;
+
+        // Nothing in a sequence looks at what a read returns, one the cache can answer is simply dropped
+        if (kind == 1 && count == 1 && entry->expectanswer && regcache_lookup(ex->regcache, address, &value) == 0) {
+            phase->cached++;
+            continue;
+        }
+
+        if (!entry->expectanswer && !(entry->endpoint & 0x80)) {
+            err = initexec_queue(ex, entry->endpoint, command, entry->size);
+            phase->pipelined++;
+        } else {
+            int answered = 0;
+            err = initexec_sync(ex, phase, entry, command, &answered);
+            if (kind == 1 && count > 0 && (size_t) answered >= count * 4)
+                regcache_update(ex->regcache, address, count, ex->response);
+        }
+        // Queued writes go out in order, the cache can take the value right away
+        if (err == 0 && kind == 0)
+            regcache_update(ex->regcache, address, count, command + 8);
+    }
+
+    // Whatever is still queued has to go through before the phase is over
+    if (initexec_wait(ex, 0) != 0)
+        err = -1;
+
+    initexec_end(ex);
+    if (err != 0)
+        fprintf(stderr, "Init phase '%s' failed!\n", name);
+    return err;
+}
+
+void initexec_report(struct initexec *ex, FILE *out) {
+    uint64_t total = 0;
+    for (size_t i = 0; i < ex->phasecount; i++) {
+        struct initexec_phase *phase = &ex->phases[i];
+        total += phase->elapsed;
+        fprintf(out, "Init phase '%s': %.2f ms", phase->name, phase->elapsed / 1e6);
+        if (phase->commands > 0)
+            fprintf(out, ", %zu commands (%zu pipelined, %zu waited for a status, %zu status timeouts, %zu register reads cached)",
+                    phase->commands, phase->pipelined, phase->syncs, phase->timeouts, phase->cached);
+        fprintf(out, "\n");
+    }
+    fprintf(out, "Init total: %.2f ms\n", total / 1e6);
+}
@@ -0,0 +1,59 @@
+#ifndef INITEXEC_H
+#define INITEXEC_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "regcache.h"
+#include "sequence.h"
+#include "transport.h"
+
+#define INITEXEC_MAX_PHASES		16
+#define INITEXEC_MAX_INFLIGHT	32
+
+struct initexec_phase {
+    const char *name;
+    uint64_t elapsed;		// ns
+    size_t commands;
+    size_t pipelined;		// sent as queued async transfers
+    size_t syncs;			// commands waiting for a status on EP. 83
+    size_t timeouts;		// status reads that got nothing
+    size_t cached;			// register reads answered by the register cache
+};
+
+// Runs command sequences during bring-up. Runs of commands that need no answer
+// are queued as async transfers, the executor only waits for them when a
+// command needs its status read on EP. 83.
+struct initexec {
+    struct transport *transport;
+    size_t maxinflight;
+    struct regcache *regcache;	// optional, register reads it can answer are not sent
+    unsigned char *response;	// answers of the synchronous commands, VIDEO_TRANSFER_SIZE
+
+    // Completed on whichever thread handles the events, the capture loop's on a resume
+    struct libusb_transfer *transfers[INITEXEC_MAX_INFLIGHT];
+    atomic_int busy[INITEXEC_MAX_INFLIGHT];
+    uint64_t submitted[INITEXEC_MAX_INFLIGHT];	// ns
+    atomic_size_t inflight;
+    atomic_int failed;
+
+    struct initexec_phase phases[INITEXEC_MAX_PHASES];
+    size_t phasecount;
+    uint64_t phasestart;
+};
+
+int initexec_init(struct initexec *ex, struct transport *transport, size_t maxinflight);
+void initexec_free(struct initexec *ex);
+// Keeps regcache up to date with the register traffic of the sequences, NULL to stop.
+void initexec_setregcache(struct initexec *ex, struct regcache *regcache);
+
+// Phases only measure time, initexec_run() opens and closes its own.
+struct initexec_phase *initexec_begin(struct initexec *ex, const char *name);
+void initexec_end(struct initexec *ex);
+
+int initexec_run(struct initexec *ex, const char *name, const struct sequence *seq);
+
+void initexec_report(struct initexec *ex, FILE *out);
+
+#endif
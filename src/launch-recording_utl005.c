@@ -1,213 +0,0 @@
-// Sequence UTL005
-// Uncleaned, from start of sequence until first data on EP81. 
-
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 9, 0x0C, 0x01, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2B);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x0B, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2B, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x0B, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2C, 0x0B);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x0B, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2C, 0x03);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x0B, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2C, 0x05);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 14, 0x0B, 0x01, 0x06, 0x00, 0x15, 0x00, 0x00, 0x00, 0x0E, 0x00, 0x00, 0xAF, 0x01, 0x01);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 9, 0x0C, 0x01, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00, 0x13);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 14, 0x0B, 0x01, 0x06, 0x00, 0x15, 0x00, 0x00, 0x00, 0x0E, 0x00, 0x00, 0xAC, 0x01, 0x01);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 9, 0x0C, 0x01, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00, 0x13);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 14, 0x0B, 0x01, 0x06, 0x00, 0x15, 0x00, 0x00, 0x00, 0x0E, 0x00, 0x00, 0xB0, 0x01, 0x01);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 9, 0x0C, 0x01, 0x01, 0x00, 0x15, 0x00, 0x00, 0x00, 0x13);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x0A, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x11, 0x00, 0x00, 0x80);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0xF1, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00, 0x07, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x00, 0x01, 0x00, 0x01);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0xF2, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x18, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x05, 0x01, 0x02, 0x00, 0x35, 0x00, 0x00, 0x00, 0x14, 0x1F);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x05, 0x01, 0x02, 0x00, 0x35, 0x00, 0x00, 0x00, 0x15, 0xEC);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x05, 0x01, 0x02, 0x00, 0x35, 0x00, 0x00, 0x00, 0x1C, 0x49);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x05, 0x01, 0x02, 0x00, 0x35, 0x00, 0x00, 0x00, 0x1D, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 10, 0x05, 0x01, 0x02, 0x00, 0x35, 0x00, 0x00, 0x00, 0x5A, 0x01);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x0F, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xEC, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x12, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x13, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x78, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xEC, 0x06, 0x00, 0x00, 0x08, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x14, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0x38, 0x4A, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x16, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x17, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x02, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0xDA, 0xF1, 0xF1, 0xF1);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0xB6, 0xF1, 0xF1, 0xB6);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x19, 0xC2, 0x01, 0x21);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF4, 0x06, 0x00, 0x00, 0x80, 0x07, 0x38, 0x04);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF0, 0x06, 0x00, 0x00, 0x09, 0x06, 0x7C, 0x0F);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xEC, 0x06, 0x00, 0x00, 0x30, 0x75, 0x78, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xE8, 0x06, 0x00, 0x00, 0xD0, 0x07, 0x40, 0x1F);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xE4, 0x06, 0x00, 0x00, 0x00, 0x20, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xE0, 0x06, 0x00, 0x00, 0x1E, 0x00, 0x99, 0xF1);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xD8, 0x06, 0x00, 0x00, 0x10, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xDC, 0x06, 0x00, 0x00, 0x80, 0x07, 0x38, 0x04);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xD4, 0x06, 0x00, 0x00, 0x80, 0x10, 0x16, 0x21);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xD0, 0x06, 0x00, 0x00, 0xF4, 0x40, 0x08, 0x52);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xF8, 0x06, 0x00, 0x00, 0x06, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xCC, 0x06, 0x00, 0x00, 0x01, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xFC, 0x06, 0x00, 0x00, 0x0A, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x10, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00, 0x07, 0x00, 0x01, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x07, 0x00, 0xB0, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xC8, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 16, 0x09, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x8F, 0x66, 0x00, 0x00, 0x80, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00, 0x07, 0x00, 0x01, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x07, 0x00, 0xB0, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xC8, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00, 0x07, 0x00, 0x01, 0x00);
-writecommand_va(camerahandle, 8, 0x01, 0x00, 0x07, 0x00, 0xB0, 0x06, 0x00, 0x00);
-readstatus(camerahandle);
-writecommand_va(camerahandle, 12, 0x01, 0x01, 0x01, 0x00, 0xC8, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00);
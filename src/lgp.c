@@ -4,281 +4,601 @@
 #include <memory.h>
 #include <unistd.h>
 #include <stdarg.h>
+#include <signal.h>
+#include <sys/resource.h>
+
+#include "lgp.h"
+#include "bringup.h"
+#include "capture.h"
+#include "control.h"
+#include "emulator.h"
+#include "encoder.h"
+#include "hotplug.h"
+#include "metrics.h"
+#include "scheduler.h"
+#include "sequence.h"
+#include "session.h"
+#include "transport.h"
+#include "tuning.h"
+#include "usbtrace.h"
+
+// Generated from utl005_sequence by lgp_seqc at build time
+#include "utl005_sequence.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static volatile sig_atomic_t dumprequested = 0;
+
+static void onsignal(int sig) {
+    (void) sig;
+    interrupted = 1;
+}
 
-#define check(A, M, ...) \
-		do { \
-			if(!(A)) { \
-				fprintf(stderr, "Check failed at %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
-				goto error; \
-			} \
-		} while(0)
-
-#define USB_BULK_MAX_PACKET_SIZE	512
-
-#define CAMERA_VENDOR				0x07ca
-#define CAMERA_PRODUCT				0x0875
-#define CAMERA_CONFIGURATION		1
-#define CAMERA_INTERACE				0
-
-#define CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE		0x81
-#define CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL		0x02
-#define CAMERA_ENDPOINT_ADDRESS_CONTROL				0x04
-#define CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE		0x83
-
-#define TIMEOUT		1000
-
-#define DEBUG		1
+// SIGUSR1, the dump itself is queued from the main loop
+static void ondumpsignal(int sig) {
+    (void) sig;
+    dumprequested = 1;
+}
 
-struct commandframe {
-    size_t expectanswer;
-    size_t endpoint;
-    size_t size;
-    unsigned char command[32768];
+struct sessionlist {
+    struct session *sessions;
+    size_t count;
+    unsigned int takes;		// recordings started without a name, numbers the next one
 };
 
-static const char *captureconfigfile = NULL;
+static const struct {
+    const char *name;
+    uint8_t command;
+    enum session_request request;
+} commands[] = {
+    { "start", CONTROL_START, SESSION_REQUEST_START },
+    { "stop", CONTROL_STOP, SESSION_REQUEST_STOP },
+    { "mark", CONTROL_MARK, SESSION_REQUEST_MARK },
+    { "rotate", CONTROL_ROTATE, SESSION_REQUEST_ROTATE },
+    { "status", CONTROL_STATUS, SESSION_REQUEST_NONE },
+    { "dump", CONTROL_DUMP, SESSION_REQUEST_NONE },
+    { "profile", CONTROL_PROFILE, SESSION_REQUEST_NONE },
+};
 
-int writecommand(libusb_device_handle *camerahandle, unsigned char* commandbuffer, size_t size) {
-    static int transferred = 0;
+// Replay ring of every session written out, the names of the files they go to in reply
+static int dumpall(struct sessionlist *list, char *reply, size_t size) {
+    size_t length = 0;
+    int dumping = 0;
 
-    // Debug only
-    if (DEBUG) {
-        fprintf(stderr, "Sending : ");
-        for (size_t j = 0; j < sizeof (commandbuffer); j++)
-            fprintf(stderr, "%.2x ", commandbuffer[j]);
-        fprintf(stderr, "\n");
+    for (size_t i = 0; i < list->count && length < size; i++) {
+        char path[192];
+        if (session_dump(&list->sessions[i], path, sizeof (path)) != 0)
+            continue;
+        length += snprintf(reply + length, size - length, dumping ? " %s" : "dumping %s", path);
+        dumping = 1;
     }
-    // End Debug only
-
-    int err = libusb_bulk_transfer(camerahandle, CAMERA_ENDPOINT_ADDRESS_CONTROL, commandbuffer, size, &transferred, TIMEOUT);
-    if (err != 0) {
-        fprintf(stderr, "Error while sending command: '%s' - '%s', data sent: %i, data transferred: %i, on endpoint 0x04, crashing!\n", libusb_error_name(err), libusb_strerror(err), USB_BULK_MAX_PACKET_SIZE, transferred);
-        exit(-5);
-    } else {
-        return 0;
+    if (!dumping) {
+        snprintf(reply, size, "error: no replay to dump, not in replay mode or too many dumps queued");
+        return -1;
     }
+    return 0;
 }
 
-int writecommand_va(libusb_device_handle *camerahandle, size_t count, ...) {
-    va_list bytelist;
+// The same request to every session, their replies one per line
+static int requestall(struct sessionlist *list, enum session_request request, const char *name, char *reply, size_t size) {
+    char stem[32];
+    size_t length = 0;
+    int err = 0;
 
-    unsigned char *buffer = (unsigned char*) malloc(sizeof (unsigned char) * count);
-    va_start(bytelist, count);
-    for (size_t i = 0; i < count; i++) {
-        buffer[i] = (unsigned char) va_arg(bytelist, int);
+    // Unnamed recordings are numbered, the same on every device. The count starts
+    // over with the daemon, numbers with files from an earlier run are skipped.
+    if ((request == SESSION_REQUEST_START || request == SESSION_REQUEST_ROTATE) && name[0] == '\0') {
+        int taken;
+        do {
+            snprintf(stem, sizeof (stem), "capture-%.4u", ++list->takes);
+            taken = 0;
+            for (size_t i = 0; i < list->count && !taken; i++)
+                taken = session_nametaken(&list->sessions[i], stem);
+        } while (taken);
+        name = stem;
     }
-    va_end(bytelist);
-
-    int ret = writecommand(camerahandle, buffer, count);
-    free(buffer);
-    return ret;
-}
-
-int writevideocommand(libusb_device_handle *camerahandle, unsigned char* commandbuffer, size_t size) {
-    static int transferred = 0;
-    int err = libusb_bulk_transfer(camerahandle, CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL, commandbuffer, size, &transferred, TIMEOUT);
-    if (err != 0) {
-        fprintf(stderr, "Error while sending command: '%s' - '%s', data sent: %i, data transferred: %i, on endpoint 0x02, crashing!\n", libusb_error_name(err), libusb_strerror(err), USB_BULK_MAX_PACKET_SIZE, transferred);
-        exit(-5);
-    } else {
-        return 0;
+    // A file name in the working directory, not a path to anywhere else
+    if ((request == SESSION_REQUEST_START || request == SESSION_REQUEST_ROTATE)
+            && (strchr(name, '/') != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)) {
+        snprintf(reply, size, "error: %s is not a plain file name", name);
+        return -1;
+    }
+    reply[0] = '\0';
+    for (size_t i = 0; i < list->count && length < size; i++) {
+        char line[192];
+        if (session_request(&list->sessions[i], request, name, line, sizeof (line)) != 0)
+            err = -1;
+        length += snprintf(reply + length, size - length, "%s%s", length > 0 ? "\n" : "", line);
     }
+    return err;
 }
 
-int readstatus(libusb_device_handle *camerahandle) {
-    static unsigned char buffer[USB_BULK_MAX_PACKET_SIZE];
-    memset(buffer, 0, USB_BULK_MAX_PACKET_SIZE);
-    static int transferred = 0;
+// Encoder of every session switched, their replies one per line
+static int profileall(struct sessionlist *list, const char *text, char *reply, size_t size) {
+    struct encoder_profile profile;
+    char why[192];
+    size_t length = 0;
+    int err = 0;
 
-    int err = libusb_bulk_transfer(camerahandle, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, buffer, USB_BULK_MAX_PACKET_SIZE, &transferred, TIMEOUT);
+    if (encoder_parse(&profile, text, why, sizeof (why)) != 0) {
+        snprintf(reply, size, "error: %s", why);
+        return -1;
+    }
+    reply[0] = '\0';
+    for (size_t i = 0; i < list->count && length < size; i++) {
+        char line[192];
+        if (session_setprofile(&list->sessions[i], &profile, line, sizeof (line)) != 0)
+            err = -1;
+        length += snprintf(reply + length, size - length, "%s%s", length > 0 ? "\n" : "", line);
+    }
+    return err;
+}
 
-    if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
-        fprintf(stderr, "Error while reading command: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
-        exit(-5);
+static size_t statusall(struct sessionlist *list, struct control_devicestatus *statuses, size_t count) {
+    size_t i;
+
+    for (i = 0; i < list->count && i < count; i++) {
+        struct session *s = &list->sessions[i];
+        struct control_devicestatus *status = &statuses[i];
+
+        memset(status, 0, sizeof (struct control_devicestatus));
+        status->index = (uint32_t) s->index;
+        status->state = (uint8_t) s->bringup.state;
+        status->recording = (uint8_t) session_recording(s, status->output, sizeof (status->output));
+        status->detached = (uint8_t) s->detached;
+        status->captured = s->cap.stats.bytes;
+        status->recorded = s->recording.bytes;
+        status->duration = status->recording ? lgp_now_ns() - s->recording.startedat : 0;
+        status->startlatency = s->startlatency;
+        status->marks = s->recording.markcount;
+        status->bitrate = s->profile.bitrate;
+        status->measuredbitrate = s->measuredbitrate;
     }
+    return i;
+}
 
-    if (transferred == 0) {
-        fprintf(stderr, "Status NOT received (EP. 83); TIMEOUT!\n");
-    } else {
-        fprintf(stderr, "Received Status Control : bytes %i!, value :", transferred);
-        for (size_t i = 0; i < transferred; i++)
-            fprintf(stderr, "%.2x ", buffer[i]);
-        fprintf(stderr, "\n");
+// Command i of the table, the reply as text
+static int runcommand(struct sessionlist *list, size_t i, const char *argument, char *reply, size_t size) {
+    if (commands[i].command == CONTROL_DUMP)
+        return dumpall(list, reply, size);
+    if (commands[i].command == CONTROL_PROFILE)
+        return profileall(list, argument, reply, size);
+    if (commands[i].command != CONTROL_STATUS)
+        return requestall(list, commands[i].request, argument, reply, size);
+
+    struct control_devicestatus statuses[SESSION_MAX_DEVICES];
+    size_t count = statusall(list, statuses, SESSION_MAX_DEVICES);
+    size_t length = 0;
+    reply[0] = '\0';
+    for (size_t j = 0; j < count && length < size; j++) {
+        char line[256];
+        control_formatstatus(&statuses[j], line, sizeof (line));
+        length += snprintf(reply + length, size - length, "%s%s", length > 0 ? "\n" : "", line);
     }
     return 0;
 }
 
-int readstatus_data(libusb_device_handle *camerahandle, unsigned char *response_buffer) {
-    static unsigned char buffer[USB_BULK_MAX_PACKET_SIZE];
-    memset(buffer, 0, USB_BULK_MAX_PACKET_SIZE);
-    static int transferred = 0;
-
-    int err = libusb_bulk_transfer(camerahandle, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, buffer, USB_BULK_MAX_PACKET_SIZE, &transferred, TIMEOUT);
+static void oncontrol(void *userdata, const char *command, char *reply, size_t size) {
+    struct sessionlist *list = (struct sessionlist*) userdata;
 
-    if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
-        fprintf(stderr, "Error while reading command: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
-        exit(-5);
-    }
-
-    if (transferred == 0) {
-        fprintf(stderr, "Status NOT received (EP. 83); TIMEOUT!\n");
-    } else {
-        fprintf(stderr, "Received Status Control : bytes %i!, value :", transferred);
-        for (size_t i = 0; i < transferred; i++) {
-            fprintf(stderr, "%.2x ", buffer[i]);
+    // A word, then what goes with it: start [name], mark [label], rotate [name], profile <profile>
+    size_t word = strcspn(command, " ");
+    const char *argument = command + word + strspn(command + word, " ");
+    for (size_t i = 0; i < sizeof (commands) / sizeof (commands[0]); i++) {
+        if (strlen(commands[i].name) == word && strncmp(command, commands[i].name, word) == 0) {
+            runcommand(list, i, argument, reply, size);
+            return;
         }
-        fprintf(stderr, "\n");
-        memcpy(response_buffer, buffer, transferred);
-        fprintf(stderr, "Data copied to returned buffer.\n");
     }
-    return 0;
+    snprintf(reply, size, "error: unknown command '%s', try start, stop, mark, rotate, status, dump or profile", command);
 }
 
-int readvideostatus(libusb_device_handle *camerahandle) {
-    static unsigned char buffer[32768];
-    memset(buffer, 0, 32768);
-    static int transferred = 0;
-
-    int err = libusb_bulk_transfer(camerahandle, CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE, buffer, 32768, &transferred, TIMEOUT);
+static int onframe(void *userdata, uint8_t command, const unsigned char *payload, size_t length, unsigned char *reply, size_t *replylength) {
+    struct sessionlist *list = (struct sessionlist*) userdata;
+    char argument[96];
 
-    if (err != 0 && err != LIBUSB_ERROR_TIMEOUT) {
-        fprintf(stderr, "Error while reading command: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
-        exit(-5);
+    if (command == CONTROL_STATUS) {
+        size_t count = statusall(list, (struct control_devicestatus*) reply, CONTROL_MAX_PAYLOAD / sizeof (struct control_devicestatus));
+        *replylength = count * sizeof (struct control_devicestatus);
+        return CONTROL_OK;
     }
+    if (length >= sizeof (argument) || memchr(payload, '\0', length) != NULL)
+        return CONTROL_MALFORMED;
+    memcpy(argument, payload, length);
+    argument[length] = '\0';
 
-    if (transferred == 0) {
-        fprintf(stderr, "Status NOT received (EP. 81); TIMEOUT!\n");
-    } else {
-        fprintf(stderr, "Received Status Video Control : bytes %i!, value :", transferred);
-        //for(size_t i = 0; i < transferred; i++)
-        //	fprintf(stderr,"%.2x ", buffer[i]);
+    for (size_t i = 0; i < sizeof (commands) / sizeof (commands[0]); i++) {
+        if (commands[i].command != command)
+            continue;
+        int err = runcommand(list, i, argument, (char*) reply, CONTROL_MAX_PAYLOAD);
+        *replylength = strlen((char*) reply);
+        return err == 0 ? CONTROL_OK : CONTROL_FAILED;
+    }
+    return CONTROL_UNKNOWN;
+}
 
+// 4. Configure the camera
+// 5. Claim interfaces
+static int opencamera(libusb_device *dev, libusb_device_handle **camerahandle) {
+    if (libusb_open(dev, camerahandle) != 0) {
+        fprintf(stderr, "Error getting the handle!\n");
+        return -1;
+    }
 
-        fprintf(stderr, "\n");
+    if (libusb_set_configuration(*camerahandle, CAMERA_CONFIGURATION) != 0) {
+        fprintf(stderr, "Failed to set configuration!\n");
+    } else if (libusb_claim_interface(*camerahandle, CAMERA_INTERACE) != 0) {
+        fprintf(stderr, "Failed to claim interface!\n");
+    } else {
+        return 0;
     }
-    return 0;
+    libusb_close(*camerahandle);
+    *camerahandle = NULL;
+    return -1;
 }
 
-int readvideostream(libusb_device_handle *camerahandle, FILE *outputfile) {
-    static unsigned char buffer[32768];
-    memset(buffer, 0, 32768);
-    static int transferred = 0;
+// Steps 1 to 5: find every camera on the bus, configure them and claim their interface.
+static int opencameras(libusb_context **usbcontext, libusb_device ***devicelist, libusb_device_handle **camerahandles, size_t *cameracount) {
+    *cameracount = 0;
 
-    int err = 0;
-lelabel:
-    err = libusb_bulk_transfer(camerahandle, CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE, buffer, 32768, &transferred, TIMEOUT);
+    // 1. Grab USB context
+    check(libusb_init(usbcontext) == 0, "We DONT have the context");
+    fprintf(stderr, "We got the context\n");
 
-    if (err != 0) {
-        if (err == LIBUSB_ERROR_TIMEOUT) {
-            fprintf(stderr, "Timeout!\n");
-            goto lelabel;
-        }
-        fprintf(stderr, "Error while reading capture stream: '%s' - '%s' , data received: %i, crashing!\n", libusb_error_name(err), libusb_strerror(err), transferred);
-        return -1;
+    libusb_set_debug(*usbcontext, LIBUSB_LOG_LEVEL_WARNING);
+
+    // 2. Query system devices
+    ssize_t devicecount = libusb_get_device_list(*usbcontext, devicelist);
+    check(devicecount > 0, "Error when counting devices!");
+
+    // 3. Figure out which ones are cameras
+    for (ssize_t i = 0; i < devicecount && *cameracount < SESSION_MAX_DEVICES; i++) {
+        libusb_device *dev = (*devicelist)[i];
+        libusb_device_handle *camerahandle = NULL;
+        struct libusb_device_descriptor desc;
+        libusb_get_device_descriptor(dev, &desc);
+
+        if (desc.idVendor != CAMERA_VENDOR || desc.idProduct != CAMERA_PRODUCT)
+            continue;
+        fprintf(stderr, "Found camera!\n");
+        if (opencamera(dev, &camerahandle) == 0)
+            camerahandles[(*cameracount)++] = camerahandle;
     }
 
-    fwrite(buffer, transferred, transferred, outputfile);
+    check(*cameracount > 0, "Couldn't obtain camera handle.");
     return 0;
+
+error:
+    return -1;
 }
 
-int readcapturesequence(struct commandframe **capturepackets, size_t *capturepacketcount) {
-    fprintf(stderr, "Reading capture sequence...\n");
-    FILE *f = fopen(captureconfigfile, "r");
-    if (f == NULL) {
-        fprintf(stderr, "Failed to open file: capture_sequence!\n");
-        return -1;
-    }
+// Process CPU time against what was captured, the cost of the buffers and sinks in use
+static void reportcpu(struct session *sessions, size_t count, int dmapool) {
+    struct rusage usage;
+    uint64_t bytes = 0;
+
+    for (size_t i = 0; i < count; i++)
+        bytes += sessions[i].cap.stats.bytes;
+    if (bytes == 0 || getrusage(RUSAGE_SELF, &usage) != 0)
+        return;
+    double cpu = usage.ru_utime.tv_sec * 1e3 + usage.ru_utime.tv_usec / 1e3 + usage.ru_stime.tv_sec * 1e3 + usage.ru_stime.tv_usec / 1e3;
+    fprintf(stderr, "CPU: %.0f ms user and system for %llu MiB captured, %.3f ms per MiB (%s transfer buffers)\n",
+            cpu, (unsigned long long) (bytes >> 20), cpu / (bytes / 1048576.0), dmapool ? "DMA pool" : "heap");
+}
 
-    size_t linebuffersize = 2048;
-    char *line = (char*) malloc(linebuffersize);
-    size_t linesize;
-    size_t linecount = 0;
-    while ((linesize = getline(&line, &linebuffersize, f)) != -1) {
-        // Just count the lines to begin with
-        linecount++;
-    }
-    *capturepacketcount = linecount;
-
-    // Parse
-    fseek(f, 0, SEEK_SET);
-    *capturepackets = (struct commandframe*) malloc(sizeof (struct commandframe) * linecount);
-    struct commandframe *cp = *capturepackets;
-    memset(cp, 0, sizeof (struct commandframe) * linecount);
-    size_t commandi = 0;
-    while ((linesize = getline(&line, &linebuffersize, f)) != -1) {
-        char *tok = line;
-        tok = strtok(tok, " ");
-        cp[commandi].expectanswer = atoi(tok);
-
-        // Added to support destination Endpoint for the sequence capture file
-        tok = strtok(NULL, " ");
-        cp[commandi].endpoint = atoi(tok);
-        // fprintf(stderr, "Endpoint : %zu ", cp[commandi].endpoint);
-
-        // Read bytes
-        while ((tok = strtok(NULL, " \n")) != NULL) {
-            // Skip leading zero because it seems strtol gets lost
-            //if(*tok == '0')
-            //	tok++;
-            int byte = strtol(tok, NULL, 16);
-            //fprintf(stderr, "Byte: %.2x\n", byte);
-            cp[commandi].command[cp[commandi].size] = byte;
-            cp[commandi].size++;
+// Transfer size and depth of every device as last tuned for its controller, those given on the command line aside
+static void loadtuning(struct session *sessions, size_t count, const char *path, int depthchosen, int sizechosen) {
+    struct tuning_entry entry;
+    char host[64], controller[128];
 
-        }
-        commandi++;
+    for (size_t i = 0; i < count; i++) {
+        struct session *s = &sessions[i];
+        tuning_identify(&s->transport, host, sizeof (host), controller, sizeof (controller));
+        if (tuning_load(path, host, controller, &entry) != 0)
+            continue;
+        if (!depthchosen)
+            s->capturedepth = entry.depth;
+        if (!sizechosen)
+            s->transfersize = entry.transfersize;
+        fprintf(stderr, "Device %zu: %zu transfers of %zu bytes in flight, as tuned for %s on %s\n", i, s->capturedepth, s->transfersize, controller, host);
     }
-
-    free(line);
-    fclose(f);
-
-    return 0;
 }
 
-int load_firmware(libusb_device_handle *camerahandle, const char *file) {
-    int transfer;
+// Sweeps transfer size and depth on the first device of every controller, the best setting goes to path
+static int tuneall(struct session *sessions, size_t count, const char *path, unsigned int dwell) {
+    char controllers[SESSION_MAX_DEVICES][128];
+    size_t tuned = 0;
+    struct tuning tuning;
+    int err = 0;
 
-    FILE *bin;
-    bin = fopen(file, "rb");
+    for (size_t i = 0; i < count && !interrupted; i++) {
+        struct session *s = &sessions[i];
+        struct tuning_entry entry;
+        int seen = 0;
 
-    /* get filesize */
-    fseek(bin, 0L, SEEK_END);
-    long filesize = ftell(bin);
-    rewind(bin);
+        if (s->bringup.state != BRINGUP_VIDEOREADY)
+            continue;
+        memset(&entry, 0, sizeof (entry));
+        tuning_identify(&s->transport, entry.host, sizeof (entry.host), entry.controller, sizeof (entry.controller));
+        for (size_t j = 0; j < tuned; j++)
+            seen |= strcmp(controllers[j], entry.controller) == 0;
+        if (seen) {
+            fprintf(stderr, "Device %zu: on %s as well, tuned already\n", i, entry.controller);
+            continue;
+        }
+        snprintf(controllers[tuned++], sizeof (controllers[0]), "%s", entry.controller);
 
-    /* read firmware from file to buffer and bulk transfer to device */
-    for (int i = 0; i <= filesize; i += USB_BULK_MAX_PACKET_SIZE) {
-        unsigned char data[USB_BULK_MAX_PACKET_SIZE] = {0};
-        int bytes_remain = filesize - i;
+        tuning_init(&tuning);
+        fprintf(stderr, "Device %zu: tuning for %s on %s, %zu settings of %u ms\n", i, entry.controller, entry.host, tuning.count, dwell);
+        for (size_t j = 0; j < tuning.count && !interrupted; j++) {
+            tuning_measure(&tuning.results[j], &s->transport, dwell);
+            tuning_print(&tuning.results[j], stderr);
+        }
+        if (interrupted)
+            break;
+        if (tuning_pick(&tuning) < 0) {
+            fprintf(stderr, "Device %zu: no setting streamed, nothing stored for %s\n", i, entry.controller);
+            err = -1;
+            continue;
+        }
 
-        if ((bytes_remain) > USB_BULK_MAX_PACKET_SIZE) {
-            bytes_remain = USB_BULK_MAX_PACKET_SIZE;
+        const struct tuning_result *best = &tuning.results[tuning.best];
+        entry.transfersize = best->transfersize;
+        entry.depth = best->depth;
+        entry.throughput = best->throughput / (1024.0 * 1024.0);
+        entry.jitter = best->jitter / 1e6;
+        entry.cpu = best->cpu * 100;
+        if (tuning_store(path, &entry) != 0) {
+            fprintf(stderr, "Failed to store the tuning of %s in %s!\n", entry.controller, path);
+            err = -1;
+            continue;
         }
+        fprintf(stderr, "Device %zu: %zu transfers of %zu bytes in flight from now on for %s, stored in %s\n", i, best->depth, best->transfersize,
+                entry.controller, path);
+    }
+    return interrupted ? -1 : err;
+}
 
-        fread(data, bytes_remain, 1, bin);
+// A camera that went away came back, or left: taken back by its session if it has one.
+static void handleplug(struct session *sessions, size_t count, struct hotplug_event *event) {
+    struct session *s = NULL;
+    for (size_t i = 0; i < count && s == NULL; i++) {
+        if (session_matches(&sessions[i], event))
+            s = &sessions[i];
+    }
 
-        libusb_bulk_transfer(camerahandle, 0x02, data, bytes_remain, &transfer, 0);
+    if (s == NULL) {
+        fprintf(stderr, "Camera %s %s, not one of ours\n", event->key[0] != '\0' ? event->key : "(emulated)",
+                event->kind == HOTPLUG_ARRIVED ? "plugged in" : "unplugged");
+    } else if (event->kind == HOTPLUG_LEFT) {
+        // The capture finds out on its own, its transfers fail
+        fprintf(stderr, "Device %zu: unplugged\n", s->index);
+    } else if (!s->detached) {
+        fprintf(stderr, "Device %zu: plugged in while still capturing, ignored\n", s->index);
+    } else if (event->device == NULL) {
+        session_resume(s, NULL);
+    } else {
+        libusb_device_handle *camerahandle = NULL;
+        if (opencamera(event->device, &camerahandle) == 0)
+            session_resume(s, camerahandle);
     }
 
-    fclose(bin);
-    return 0;
+    if (event->device != NULL)
+        libusb_unref_device(event->device);
 }
 
 int main(int argc, char **argv) {
-    FILE *outputfile = NULL;
     libusb_context *usbcontext = NULL;
-    libusb_device **devicelist;
-    libusb_device_handle *camerahandle = NULL;
-    struct commandframe *capturepackets = NULL;
-    size_t capturepacketcount = 0;
+    libusb_device **devicelist = NULL;
+    libusb_device_handle *camerahandles[SESSION_MAX_DEVICES];
+    struct emulator_config emulatorconfig;
+    struct emulator_bus *emulatorbus = NULL;
+    struct hotplug hotplug;
+    struct hotplug_event plugevent;
+    size_t emulatedcount = 1;
+    int emulate = 0;
+    const char *publishsocket = NULL;
+    const char *metricssocket = NULL;
+    struct metrics metrics;
+    struct scheduler scheduler;
+    const char *controlsocket = NULL;
+    int daemon = 0;
+    struct control control;
+    struct sessionlist sessionlist;
+    const char *tracefile = NULL;
+    const char *tuningfile = TUNING_DEFAULT_FILE;
+    unsigned int tunedwell = 0;
+    int depthchosen = 0;
+    int sizechosen = 0;
+    struct usbtrace trace;
+    int tracing = 0;
+    const char *initsequencefile = NULL;
+    struct sequence initsequence;
+    struct sequence encodersequence;
+    struct encoder_profile profile;
+    int profilechosen = 0;
+    char why[192];
+    struct session_config config;
+    struct session *sessions = NULL;
+    size_t sessioncount = 0;
+    struct bringup enumeration;
+    struct capture_loop loop;
+    int looping = 0;
     int err = 0;
+    int failed = 1;			// exit status, cleared once the capture ran or the tuning completed
+    int opt;
+
+    bringup_init(&enumeration);
+    hotplug_init(&hotplug);
+    metrics_init(&metrics);
+    scheduler_init(&scheduler, NULL);
+    control_init(&control);
+    memset(&initsequence, 0, sizeof (struct sequence));
+    memset(&encodersequence, 0, sizeof (struct sequence));
+    profile = encoder_presets[0];
+    memset(&loop, 0, sizeof (struct capture_loop));
+    emulator_defaults(&emulatorconfig);
+
+    memset(&config, 0, sizeof (struct session_config));
+    config.firmwarefile = "qpaudfw.bin";
+    config.capturedepth = CAPTURE_DEFAULT_DEPTH;
+    config.transfersize = VIDEO_TRANSFER_SIZE;
+    config.writerbacklog = WRITER_DEFAULT_BACKLOG;
+    config.dmapool = 1;
+    config.pollperiod = SESSION_POLL_PERIOD;
+    storage_defaults(&config.storage);
+
+    while ((opt = getopt(argc, argv, "d:s:b:e:n:r:u:i:FNf:w:R:y:c:D:H:p:m:t:P:k:T:g:")) != -1) {
+        switch (opt) {
+            case 'd':
+                config.capturedepth = strtoul(optarg, NULL, 0);
+                depthchosen = 1;
+                break;
+            case 's':
+                config.transfersize = strtoul(optarg, NULL, 0);
+                sizechosen = 1;
+                break;
+            case 'b':
+                config.writerbacklog = strtoul(optarg, NULL, 0);
+                break;
+            case 'e':
+                // Use the emulator instead of a real device, streaming at a multiple of the real bitrate
+                emulate = 1;
+                emulatorconfig.ratescale = strtod(optarg, NULL);
+                break;
+            case 'n':
+                // Several emulated devices, as several capture units on one host
+                emulatedcount = strtoul(optarg, NULL, 0);
+                break;
+            case 'r':
+                emulatorconfig.replayfile = optarg;
+                break;
+            case 'u':
+                // Emulated devices drop off the bus after streaming for a while: after[,back after[,cold]], ms
+                emulatorconfig.unplugfor = 500;
+                sscanf(optarg, "%u,%u", &emulatorconfig.unplugafter, &emulatorconfig.unplugfor);
+                emulatorconfig.unplugcold = strstr(optarg, "cold") != NULL;
+                break;
+            case 'i':
+                initsequencefile = optarg;
+                break;
+            case 'F':
+                // Upload the firmware even if the device is known to have it already
+                config.forcefirmware = 1;
+                break;
+            case 'N':
+                // Transfer buffers from the heap, no DMA pool
+                config.dmapool = 0;
+                break;
+            case 'f':
+                // mp4 by default, h264 for the bare stream with its access unit index
+                config.rawstream = strcmp(optarg, "h264") == 0;
+                break;
+            case 'w':
+                // How the bare stream is written: io_uring (default), pwrite, or pwrite through the page cache
+                if (strcmp(optarg, "uring") != 0 && strcmp(optarg, "pwrite") != 0 && strcmp(optarg, "buffered") != 0) {
+                    fprintf(stderr, "Storage backend: %s is none of uring, pwrite and buffered\n", optarg);
+                    return -1;
+                }
+                config.storage.backend = strcmp(optarg, "uring") == 0 ? STORAGE_URING : STORAGE_PWRITE;
+                config.storage.direct = strcmp(optarg, "buffered") != 0;
+                break;
+            case 'R': {
+                // Cut the bare stream in segments: MiB[,seconds]
+                unsigned int megabytes = 0, seconds = 0;
+                sscanf(optarg, "%u,%u", &megabytes, &seconds);
+                config.storage.segmentbytes = (uint64_t) megabytes << 20;
+                config.storage.segmentduration = seconds * 1000000000ULL;
+                break;
+            }
+            case 'y': {
+                // Instant replay instead of a recording: ring MiB[,seconds dumped]
+                unsigned int megabytes = 0, seconds = 0;
+                sscanf(optarg, "%u,%u", &megabytes, &seconds);
+                config.replaybytes = megabytes > 0 ? (size_t) megabytes << 20 : REPLAY_DEFAULT_BYTES;
+                config.replaywindow = seconds * 1000000000ULL;
+                break;
+            }
+            case 'c':
+                // Commands, a line or a frame each: dump, see oncontrol
+                controlsocket = optarg;
+                break;
+            case 'D':
+                // Stay up with the devices streaming, recordings started and stopped on the control socket
+                daemon = 1;
+                config.daemon = 1;
+                controlsocket = optarg;
+                break;
+            case 'H': {
+                // Live HLS: directory[,segment ms[,part ms]], parts for low-latency players
+                char *options = strchr(optarg, ',');
+                if (options != NULL) {
+                    *options++ = '\0';
+                    sscanf(options, "%u,%u", &config.hls.segmentms, &config.hls.partms);
+                }
+                config.hls.directory = optarg;
+                break;
+            }
+            case 'p':
+                // Share the stream with local consumers, see lgp_shmcat
+                publishsocket = optarg;
+                break;
+            case 'm':
+                // Prometheus metrics of every endpoint
+                metricssocket = optarg;
+                break;
+            case 't':
+                // pcapng trace of every transfer, written on exit
+                tracefile = optarg;
+                break;
+            case 'P':
+                // Encoder profile: a preset, or <width>x<height>@<fps>,<kbit/s>[,<keyframe interval>]
+                if (encoder_parse(&profile, optarg, why, sizeof (why)) != 0) {
+                    fprintf(stderr, "Encoder profile: %s\n", why);
+                    return -1;
+                }
+                profilechosen = 1;
+                break;
+            case 'k':
+                // Commands while streaming: keyframe sync ms[,LED ms[,status poll ms]], 0 for none
+                sscanf(optarg, "%u,%u,%u", &config.syncperiod, &config.ledperiod, &config.pollperiod);
+                break;
+            case 'T':
+                // Sweep transfer sizes and depths instead of recording, ms per setting, 0 for the default
+                tunedwell = strtoul(optarg, NULL, 0);
+                if (tunedwell == 0)
+                    tunedwell = TUNING_DEFAULT_DWELL;
+                break;
+            case 'g':
+                // Where the tuning of every host and controller is kept
+                tuningfile = optarg;
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-d transfers in flight] [-s transfer size] [-b writer backlog buffers] [-e emulator rate scale] [-n emulated devices] [-r emulator replay file] [-u emulator unplug after[,back after[,cold]] ms] [-i init sequence] [-F force firmware upload] [-N no DMA buffer pool] [-f mp4|h264] [-w uring|pwrite|buffered] [-R segment MiB[,seconds]] [-y replay ring MiB[,seconds]] [-c control socket] [-D daemon control socket] [-H HLS directory[,segment ms[,part ms]]] [-p shared ring socket] [-m metrics socket] [-t pcapng trace file] [-P encoder profile] [-k keyframe sync ms[,LED ms[,status poll ms]]] [-T tune transfers, ms per setting] [-g tuning file]\n", argv[0]);
+                return -1;
+        }
+    }
 
-    check(argc >= 2, "You need to specify capture config file.");
-    captureconfigfile = argv[1];
-
-    err = readcapturesequence(&capturepackets, &capturepacketcount);
-    check(err == 0, "Error reading config packets!");
-    fprintf(stderr, "Config done, %zu packets read; sending the capture command packets...\n", capturepacketcount);
+    // Compiled sequences are mapped as is, text ones are compiled on the fly;
+    // without a file the sequence built into the binary is used in place
+    if (initsequencefile != NULL)
+        err = sequence_open(&initsequence, initsequencefile);
+    else
+        err = sequence_embedded(&initsequence, utl005_sequence_entries, utl005_sequence_count, utl005_sequence_arena, utl005_sequence_arenasize);
+    check(err == 0, "Error reading init sequence %s!", initsequencefile != NULL ? initsequencefile : "utl005_sequence");
+    config.initsequence = &initsequence;
+
+    // The configure command of the sequence rewritten for the profile; a sequence
+    // of its own without one is sent as is, unless a profile was asked for
+    encoder_describe(&profile, why, sizeof (why));
+    if (encoder_patchsequence(&initsequence, &profile, &encodersequence) == 0) {
+        config.initsequence = &encodersequence;
+        fprintf(stderr, "Encoder: %s\n", why);
+    } else {
+        check(!profilechosen, "Cannot set up the encoder for %s!", why);
+        fprintf(stderr, "Encoder: left as the init sequence sets it up\n");
+    }
+    config.profile = &profile;
 
     // Process:
     // 1. Grab USB context
@@ -289,102 +609,92 @@ int main(int argc, char **argv) {
     // 6. Initialization
     // 7. Capture
     // 8. Cleanup
+    //
+    // Every camera found gets its own session, brought up one after the other;
+    // they all stream at the same time on a single event thread.
+
+    // Steps 1 to 5, unless the emulator stands in for the cameras
+    size_t devicecount = emulatedcount;
+    if (emulate) {
+        check(devicecount > 0 && devicecount <= SESSION_MAX_DEVICES, "Between 1 and %i emulated devices!", SESSION_MAX_DEVICES);
+        emulatorbus = emulator_bus_create();
+        check(emulatorbus != NULL, "Failed to start the emulator!");
+    } else {
+        check(opencameras(&usbcontext, &devicelist, camerahandles, &devicecount) == 0, "Couldn't open the camera.");
+    }
 
-
-
-    // 1. Grab USB context
-    check(libusb_init(&usbcontext) == 0, "We DONT have the context");
-    fprintf(stderr, "We got the context\n");
-
-    libusb_set_debug(usbcontext, LIBUSB_LOG_LEVEL_WARNING);
-
-    // 2. Query system devices
-    size_t devicecount = libusb_get_device_list(usbcontext, &devicelist);
-    check(devicecount != 0, "Error when counting devices!");
-
-    // 3. Figure out which one is the camera
+    sessions = (struct session*) calloc(devicecount, sizeof (struct session));
+    check(sessions != NULL, "Failed to allocate the device sessions!");
     for (size_t i = 0; i < devicecount; i++) {
-        libusb_device *dev = devicelist[i];
-        struct libusb_device_descriptor desc;
-        libusb_get_device_descriptor(dev, &desc);
-
-        if (desc.idVendor == CAMERA_VENDOR && desc.idProduct == CAMERA_PRODUCT) {
-            fprintf(stderr, "Found camera!\n");
-            if (libusb_open(dev, &camerahandle) != 0) {
-                fprintf(stderr, "Error getting the handle!\n");
-                camerahandle = NULL;
-            }
+        struct session *s = &sessions[sessioncount];
+        session_init(s, i, devicecount, &config, &enumeration, publishsocket);
+        if (emulate) {
+            check(transport_open_emulated(&s->transport, &emulatorconfig, emulatorbus) == 0, "Failed to start the emulator!");
+        } else {
+            s->handle = camerahandles[i];
+            transport_open_libusb(&s->transport, usbcontext, s->handle);
+            hotplug_location(libusb_get_device(s->handle), s->key, sizeof (s->key));
+            s->transport.busnum = libusb_get_bus_number(libusb_get_device(s->handle));
+            s->transport.devnum = libusb_get_device_address(libusb_get_device(s->handle));
         }
+        s->transportopen = 1;
+        sessioncount++;
     }
 
-    check(camerahandle != NULL, "Couldn't obtain camera handle.");
-
-    // 4. Configure the camera
-    check(libusb_set_configuration(camerahandle, CAMERA_CONFIGURATION) == 0, "Failed to set configuration!");
-
-    // 5. Claim interfaces
-    check(libusb_claim_interface(camerahandle, CAMERA_INTERACE) == 0, "Failed to claim interface!");
+    if (tunedwell > 0) {
+        // Room in the DMA pool for the largest setting of the sweep, nothing is written
+        config.writerbacklog = 1;
+        for (size_t i = 0; i < sessioncount; i++) {
+            sessions[i].capturedepth = TUNING_MAX_DEPTH;
+            sessions[i].transfersize = TUNING_MAX_TRANSFER;
+        }
+    } else if (!depthchosen || !sizechosen) {
+        loadtuning(sessions, sessioncount, tuningfile, depthchosen, sizechosen);
+    }
 
-    // 6. Initialization sequence
-	
-	fprintf(stderr,"Init procedure started...\n");
-	
-	// Make the LED blink
-	fprintf(stderr,"Blinking LED...\n");
-
-    writecommand_va(camerahandle, 10, 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x0b);
-	readstatus(camerahandle);
-    sleep(1);
-	writecommand_va(camerahandle, 10, 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x03);
-    readstatus(camerahandle);
-	sleep(1);
-	writecommand_va(camerahandle, 10, 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x05);
-    readstatus(camerahandle);
-	sleep(1);
-	
-	fprintf(stderr, "End of LED Blinking...\n")
-	
-	// Sequence initiating the device -- experimental
+    // A camera going away is waited for, as long as its coming back can be told
+    if (emulate) {
+        emulator_bus_sethotplug(emulatorbus, &hotplug);
+        config.resume = 1;
+    } else {
+        config.resume = hotplug_register(&hotplug, usbcontext) == 0;
+    }
 
-	init_sequence();
-	fprintf(stderr, "End of Device Init - pre-firmware \n")
-	sleep(5);
-	
-	// Loading the firmware to the device.
-	load_firmware(camerahandle, 'qpaudfw.bin');
-	
-	
-	
-	
+    if (metricssocket != NULL && metrics_serve(&metrics, metricssocket) != 0)
+        metricssocket = NULL;
+    if (metricssocket != NULL)
+        scheduler.metrics = &metrics;
+    sessionlist.sessions = sessions;
+    sessionlist.count = sessioncount;
+    sessionlist.takes = 0;
+    if (controlsocket != NULL && control_serve(&control, controlsocket, oncontrol, onframe, &sessionlist) != 0)
+        check(!daemon, "A daemon nobody can reach is of no use!");
+    if (tracefile != NULL && usbtrace_init(&trace, USBTRACE_DEFAULT_RECORDS) == 0)
+        tracing = 1;
+    for (size_t i = 0; i < sessioncount; i++) {
+        if (metricssocket != NULL)
+            sessions[i].transport.metrics = &metrics;
+        if (tracing)
+            sessions[i].transport.trace = &trace;
+    }
 
-    // Send the initialization sequence	
-	// Init Sequence from file (capture_sequence) - deprecated.
-	/*
-    for (size_t i = 0; i < capturepacketcount; i++) {
-        // Check if we want to send a request or just listen to one.
-        if (capturepackets[i].size > 0) {
-            fprintf(stderr, "Sending : step %zu on endpoint %zu with size %zu :", i, capturepackets[i].endpoint, capturepackets[i].size);
-            for (size_t j = 0; j < capturepackets[i].size && j < 64; j++)
-                fprintf(stderr, "%.2x ", capturepackets[i].command[j]);
-            fprintf(stderr, "\n");
-
-            if (capturepackets[i].endpoint == 2) {
-                writevideocommand(camerahandle, capturepackets[i].command, capturepackets[i].size);
-                if (capturepackets[i].expectanswer)
-                    readvideostatus(camerahandle);
-            } else {
-                writecommand(camerahandle, capturepackets[i].command, capturepackets[i].size);
-                if (capturepackets[i].expectanswer)
-                    readstatus(camerahandle);
-            }
-        } else {
-            if (capturepackets[i].endpoint == 81 && capturepackets[i].expectanswer)
-                readvideostatus(camerahandle);
-            if (capturepackets[i].endpoint == 83 && capturepackets[i].expectanswer)
-                readstatus(camerahandle);
-        }
-	}
-	*/
+    // 6. Initialization, a device failing it is left out
+    size_t ready = 0;
+    for (size_t i = 0; i < sessioncount; i++) {
+        if (session_bringup(&sessions[i]) == 0)
+            ready++;
+    }
+    check(ready > 0, "No device made it through the bring-up!");
+
+    // Tuning instead of recording, the devices only stream for the sweep
+    if (tunedwell > 0) {
+        signal(SIGINT, onsignal);
+        signal(SIGTERM, onsignal);
+        failed = tuneall(sessions, sessioncount, tuningfile, tunedwell) != 0;
+        if (failed)
+            fprintf(stderr, "Tuning not complete, %s left as it was for the controllers not done\n", tuningfile);
+        goto error;
+    }
 
     // 7. Capturing video
     
@@ -421,8 +731,8 @@ int main(int argc, char **argv) {
     //int do_next = 0;
     while (videoready_received == 0) {
         fprintf(stderr, "Sending data video handshake...\n");
-        writecommand(camerahandle, id_40001, id_40001_s);
-        readstatus_data(camerahandle, response_buffer);
+        writecommand(&transport, id_40001, id_40001_s);
+        readstatus_data(&transport, response_buffer);
 
         // Compare the received signal with the one expected
         int is_identical = 1;
@@ -436,8 +746,8 @@ int main(int argc, char **argv) {
 
             // Reset the video is ready signal
             fprintf(stderr, "Reset videoready signal\n");
-            writecommand(camerahandle, resetvideo, resetvideo_s);
-            readstatus(camerahandle); // no status expected
+            writecommand(&transport, resetvideo, resetvideo_s);
+            readstatus(&transport); // no status expected
         }
         // Avoid flooding the device
         sleep(1);
@@ -459,8 +769,8 @@ int main(int argc, char **argv) {
 
         // Ask for Frame key data
         fprintf(stderr, "Requesting Video Key Frame data\n");
-        writecommand(camerahandle, id_40007, id_40007_s);
-        readstatus_data(camerahandle, response_buffer);
+        writecommand(&transport, id_40007, id_40007_s);
+        readstatus_data(&transport, response_buffer);
 
         // Extract part of the data we want :
         // part one
@@ -479,16 +789,16 @@ int main(int argc, char **argv) {
 
         // Debug only
         fprintf(stderr, "Blinking... Not dead!\n");
-        writecommand(camerahandle, id_00100, id_00100_s);
-        readstatus(camerahandle);
+        writecommand(&transport, id_00100, id_00100_s);
+        readstatus(&transport);
         sleep(1);
         // End Debug
 
 
         // Send frame to prepare for data sync.
         fprintf(stderr, "Static frame\n");
-        writecommand(camerahandle, id_40025, id_40025_s);
-        readstatus(camerahandle);
+        writecommand(&transport, id_40025, id_40025_s);
+        readstatus(&transport);
 
 
         // Sending the sync command
@@ -504,13 +814,13 @@ int main(int argc, char **argv) {
 
             // First time send semi-fixed data
             fprintf(stderr, "Send Video Key Frame info (first time) \n");
-            writecommand(camerahandle, videosync_info, 16);
-            readstatus(camerahandle);
+            writecommand(&transport, videosync_info, 16);
+            readstatus(&transport);
 
             // Debug only
             fprintf(stderr, "Blinking... Not dead!\n");
-            writecommand(camerahandle, id_00101, id_00101_s);
-            readstatus(camerahandle);
+            writecommand(&transport, id_00101, id_00101_s);
+            readstatus(&transport);
             sleep(1);
             // End Debug
 
@@ -526,8 +836,8 @@ int main(int argc, char **argv) {
         videosync_info[13] = videokeyframe_data2[1];
 
         fprintf(stderr, "Send Video Key Frame info \n");
-        writecommand(camerahandle, videosync_info, 16);
-        readstatus(camerahandle);
+        writecommand(&transport, videosync_info, 16);
+        readstatus(&transport);
 
         // listen to video stream input EP.
 
@@ -536,41 +846,112 @@ int main(int argc, char **argv) {
     }
 	*/
 
-
     // Capture video in file
     fprintf(stderr, "Capture stream sent, will try to capture stuff on other endpoint now...\n");
-    outputfile = fopen("capture.h264", "w+b");
-    if (outputfile != NULL) {
-        int running = 1;
-        while (running) {
-            err = readvideostream(camerahandle, outputfile);
-            if (err != 0) {
-                running = 0;
-                fprintf(stderr, "ERROR WITH STREAM CAPTURE, ABORT!\n");
-            }
+    signal(SIGINT, onsignal);
+    signal(SIGTERM, onsignal);
+    signal(SIGUSR1, ondumpsignal);
+
+    // Events of every device on the same context come through one thread
+    for (size_t i = 0; i < sessioncount; i++) {
+        struct session *s = &sessions[i];
+        if (s->bringup.state != BRINGUP_VIDEOREADY)
+            continue;
+        if (!looping) {
+            capture_loop_init(&loop, &s->transport);
+            looping = 1;
         }
-    } else {
-        fprintf(stderr, "Failed to open capture file, obviously - aborting!\n");
+        session_start(s, &loop, &scheduler);
+    }
+    check(capture_loop_start(&loop) == 0, "Failed to start the capture!");
+    // Commands of every device from now on, next to the stream
+    check(scheduler_start(&scheduler) == 0, "Failed to start the command scheduler!");
+
+    // Short polls until the first frames, time to first frame is what bring-up is measured by
+    int waiting = 1;
+    while (waiting && !interrupted) {
+        waiting = 0;
+        for (size_t i = 0; i < sessioncount; i++)
+            waiting |= session_waitfirstframe(&sessions[i]);
+        if (waiting)
+            usleep(1000);
     }
+    if (daemon && !interrupted)
+        fprintf(stderr, "Daemon: %zu devices streaming, recording on request on %s\n", ready, controlsocket);
+
+    // Polled often enough for the recovery time to be measured, reported every second
+    int running = 1;
+    uint64_t nextreport = lgp_now_ns() + 1000000000ULL;
+    while (running && !interrupted) {
+        usleep(10000);
+        for (size_t i = 0; i < sessioncount; i++)
+            session_checkdetached(&sessions[i]);
+        while (hotplug_next(&hotplug, &plugevent))
+            handleplug(sessions, sessioncount, &plugevent);
+        if (dumprequested) {
+            char reply[CONTROL_MAX_REPLY];
+            dumprequested = 0;
+            dumpall(&sessionlist, reply, sizeof (reply));
+            fprintf(stderr, "Replay: %s\n", reply);
+        }
+
+        running = 0;
+        for (size_t i = 0; i < sessioncount; i++) {
+            session_checkresumed(&sessions[i]);
+            running |= session_running(&sessions[i]);
+        }
+        if (lgp_now_ns() < nextreport)
+            continue;
+        nextreport += 1000000000ULL;
+
+        for (size_t i = 0; i < sessioncount; i++) {
+            if (!session_running(&sessions[i]))
+                continue;
+            if (sessioncount > 1)
+                fprintf(stderr, "Device %zu:\n", i);
+            session_report(&sessions[i], stderr);
+        }
+        scheduler_report(&scheduler, stderr);
+    }
+    failed = 0;
 
     // 8. Cleanup
 error:
-    if (outputfile != NULL) {
-        fprintf(stderr, "Closing capture file...\n");
-        fclose(outputfile);
+    // Its commands reach into the sessions
+    control_stop(&control);
+    // And so do the periodic ones
+    scheduler_stop(&scheduler);
+    scheduler_report(&scheduler, stderr);
+    // The event thread collects the cancelled transfers of every session before it ends
+    for (size_t i = 0; i < sessioncount; i++)
+        session_stop(&sessions[i]);
+    reportcpu(sessions, sessioncount, config.dmapool);
+    if (looping)
+        capture_loop_stop(&loop);
+    for (size_t i = 0; i < sessioncount; i++)
+        session_close(&sessions[i]);
+    free(sessions);
+    scheduler_destroy(&scheduler);
+    emulator_bus_destroy(emulatorbus);
+    // Events are posted from the event thread, gone by now
+    hotplug_free(&hotplug);
+
+    sequence_close(&encodersequence);
+    sequence_close(&initsequence);
+
+    metrics_stop(&metrics);
+    if (tracing) {
+        usbtrace_report(&trace, stderr);
+        usbtrace_writepcapng(&trace, tracefile);
+        usbtrace_free(&trace);
     }
 
-    free(capturepackets);
-
     fprintf(stderr, "Closing handles...\n");
-    if (camerahandle != NULL) {
-        libusb_release_interface(camerahandle, CAMERA_INTERACE);
-        libusb_close(camerahandle);
-    }
     if (devicelist != NULL)
         libusb_free_device_list(devicelist, 1); // 1 = unref devices
 
     fprintf(stderr, "Bye\n");
-    libusb_exit(usbcontext);
-    return 0;
+    if (usbcontext != NULL)
+        libusb_exit(usbcontext);
+    return failed ? EXIT_FAILURE : EXIT_SUCCESS;
 }
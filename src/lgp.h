@@ -0,0 +1,52 @@
+#ifndef LGP_H
+#define LGP_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define check(A, M, ...) \
+		do { \
+			if(!(A)) { \
+				fprintf(stderr, "Check failed at %s:%d: " M "\n", __FILE__, __LINE__, ##__VA_ARGS__); \
+				goto error; \
+			} \
+		} while(0)
+
+#define USB_BULK_MAX_PACKET_SIZE	512
+
+#define CAMERA_VENDOR				0x07ca
+#define CAMERA_PRODUCT				0x0875
+#define CAMERA_CONFIGURATION		1
+#define CAMERA_INTERACE				0
+
+#define CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE		0x81
+#define CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL		0x02
+#define CAMERA_ENDPOINT_ADDRESS_CONTROL				0x04
+#define CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE		0x83
+
+// Register 0x0800 is the video ready handshake, 07 00 01 00 once the encoder runs
+#define CAMERA_REGISTER_VIDEO_READY		0x0800
+#define CAMERA_VIDEO_READY_VALUE		0x00010007
+
+// Encoder bitrate, written by the init sequence and kept until the device powers down
+#define CAMERA_REGISTER_ENCODER_BITRATE	0x06ec
+
+// Size of one bulk read on the video endpoint (EP. 81)
+#define VIDEO_TRANSFER_SIZE		32768
+
+#define TIMEOUT		1000
+
+// Command payloads on stderr, build with -DDEBUG=1 to see them
+#ifndef DEBUG
+#define DEBUG		0
+#endif
+
+// Monotonic clock in nanoseconds, used for all the timing statistics.
+static inline uint64_t lgp_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,150 @@
+#include "metrics.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <poll.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+static const struct {
+    const char *endpoint;
+    const char *path;
+} metrics_names[METRICS_SERIES] = {
+    [METRICS_COMMAND] = { "0x04", "command" },
+    [METRICS_STATUS] = { "0x83", "status" },
+    [METRICS_ROUNDTRIP] = { "0x04-0x83", "roundtrip" },
+    [METRICS_FIRMWARE] = { "0x02", "firmware" },
+    [METRICS_VIDEO] = { "0x81", "video" },
+    [METRICS_QUEUE] = { "0x04", "queue" },
+};
+
+static const char *metrics_statusnames[METRICS_STATUSES] = { "ok", "timeout", "error" };
+
+static const double metrics_quantiles[] = { 0.5, 0.9, 0.99, 0.999 };
+
+void metrics_init(struct metrics *m) {
+    memset(m, 0, sizeof (struct metrics));
+    unixserver_init(&m->server);
+    m->started = lgp_now_ns();
+}
+
+// Largest value that falls in bucket.
+static uint64_t metrics_bucketmax(unsigned int bucket) {
+    if (bucket < (1U << METRICS_SUBBITS))
+        return bucket;
+    unsigned int shift = (bucket >> METRICS_SUBBITS) - 1;
+    uint64_t sub = bucket & ((1U << METRICS_SUBBITS) - 1);
+    return (((1ULL << METRICS_SUBBITS) + sub + 1) << shift) - 1;
+}
+
+uint64_t metrics_quantile(struct metrics_histogram *h, double quantile) {
+    uint64_t total = 0;
+    uint64_t counts[METRICS_BUCKETS];
+
+    // Buckets are summed instead of trusting count, which may be a few events ahead
+    for (unsigned int i = 0; i < METRICS_BUCKETS; i++) {
+        counts[i] = atomic_load_explicit(&h->buckets[i], memory_order_relaxed);
+        total += counts[i];
+    }
+    if (total == 0)
+        return 0;
+
+    uint64_t rank = (uint64_t) (quantile * total + 0.5);
+    if (rank == 0)
+        rank = 1;
+    uint64_t seen = 0;
+    for (unsigned int i = 0; i < METRICS_BUCKETS; i++) {
+        seen += counts[i];
+        if (seen >= rank) {
+            uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+            uint64_t value = metrics_bucketmax(i);
+            return value < max ? value : max;
+        }
+    }
+    return atomic_load_explicit(&h->max, memory_order_relaxed);
+}
+
+void metrics_write(struct metrics *m, FILE *out) {
+    fprintf(out, "# HELP lgp_uptime_seconds Time since the metrics were set up.\n");
+    fprintf(out, "# TYPE lgp_uptime_seconds gauge\n");
+    fprintf(out, "lgp_uptime_seconds %.3f\n", (lgp_now_ns() - m->started) / 1e9);
+
+    fprintf(out, "# HELP lgp_transfers_total USB transfers by endpoint and outcome.\n");
+    fprintf(out, "# TYPE lgp_transfers_total counter\n");
+    for (int s = 0; s < METRICS_SERIES; s++) {
+        for (int status = 0; status < METRICS_STATUSES; status++)
+            fprintf(out, "lgp_transfers_total{endpoint=\"%s\",path=\"%s\",status=\"%s\"} %llu\n",
+                    metrics_names[s].endpoint, metrics_names[s].path, metrics_statusnames[status],
+                    (unsigned long long) atomic_load_explicit(&m->series[s].transfers[status], memory_order_relaxed));
+    }
+
+    fprintf(out, "# HELP lgp_transfer_bytes_total Payload bytes moved by endpoint.\n");
+    fprintf(out, "# TYPE lgp_transfer_bytes_total counter\n");
+    for (int s = 0; s < METRICS_SERIES; s++) {
+        if (s == METRICS_ROUNDTRIP || s == METRICS_QUEUE)
+            continue;
+        fprintf(out, "lgp_transfer_bytes_total{endpoint=\"%s\",path=\"%s\"} %llu\n", metrics_names[s].endpoint, metrics_names[s].path,
+                (unsigned long long) atomic_load_explicit(&m->series[s].bytes, memory_order_relaxed));
+    }
+
+    fprintf(out, "# HELP lgp_transfer_latency_seconds Latency of the successful transfers, from submission to completion (path \"queue\": time waited in the command scheduler).\n");
+    fprintf(out, "# TYPE lgp_transfer_latency_seconds summary\n");
+    for (int s = 0; s < METRICS_SERIES; s++) {
+        struct metrics_histogram *h = &m->series[s].latency;
+        const char *endpoint = metrics_names[s].endpoint;
+        const char *path = metrics_names[s].path;
+
+        for (size_t q = 0; q < sizeof (metrics_quantiles) / sizeof (metrics_quantiles[0]); q++)
+            fprintf(out, "lgp_transfer_latency_seconds{endpoint=\"%s\",path=\"%s\",quantile=\"%g\"} %.9f\n",
+                    endpoint, path, metrics_quantiles[q], metrics_quantile(h, metrics_quantiles[q]) / 1e9);
+        fprintf(out, "lgp_transfer_latency_seconds{endpoint=\"%s\",path=\"%s\",quantile=\"1\"} %.9f\n",
+                endpoint, path, atomic_load_explicit(&h->max, memory_order_relaxed) / 1e9);
+        fprintf(out, "lgp_transfer_latency_seconds_sum{endpoint=\"%s\",path=\"%s\"} %.9f\n",
+                endpoint, path, atomic_load_explicit(&h->sum, memory_order_relaxed) / 1e9);
+        fprintf(out, "lgp_transfer_latency_seconds_count{endpoint=\"%s\",path=\"%s\"} %llu\n",
+                endpoint, path, (unsigned long long) atomic_load_explicit(&h->count, memory_order_relaxed));
+    }
+}
+
+// Answers one scraper: HTTP for Prometheus and curl, the bare text for anything
+// that sends no request within a moment (socat, nc).
+static void metrics_answer(struct metrics *m, int client) {
+    char request[1024];
+    struct pollfd pfd = { .fd = client, .events = POLLIN };
+    int http = 0;
+
+    if (poll(&pfd, 1, 100) == 1) {
+        ssize_t length = read(client, request, sizeof (request) - 1);
+        http = length >= 4 && memcmp(request, "GET ", 4) == 0;
+    }
+
+    char *body = NULL;
+    size_t size = 0;
+    FILE *out = open_memstream(&body, &size);
+    if (out == NULL)
+        return;
+    metrics_write(m, out);
+    fclose(out);
+
+    char header[128];
+    int headerlength = 0;
+    if (http)
+        headerlength = snprintf(header, sizeof (header), "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: %zu\r\n\r\n", size);
+    if (write(client, header, headerlength) != headerlength || write(client, body, size) != (ssize_t) size)
+        fprintf(stderr, "Failed to send the metrics: %s\n", strerror(errno));
+    free(body);
+}
+
+static void metrics_client(void *userdata, int client) {
+    metrics_answer((struct metrics*) userdata, client);
+}
+
+int metrics_serve(struct metrics *m, const char *socketpath) {
+    return unixserver_start(&m->server, socketpath, "metrics", metrics_client, m);
+}
+
+void metrics_stop(struct metrics *m) {
+    unixserver_stop(&m->server);
+}
@@ -0,0 +1,107 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "unixserver.h"
+
+// Counters and latency histograms of every exchange with the camera, served
+// in the Prometheus text format on a Unix socket:
+//   curl --unix-socket <socket> http://localhost/metrics
+//
+// The series are shared by every device and written from several threads at
+// once: the main thread during bring-up, the scheduler thread once streaming,
+// the capture event threads for EP. 81, and the loop thread for a device coming
+// back. Recording is relaxed atomic adds, and a compare and swap for the
+// maximum. The serving thread reads them while they change; a scrape can be
+// off by the events recorded during it, never by more.
+
+enum metrics_series {
+    METRICS_COMMAND,		// EP. 04 writes
+    METRICS_STATUS,			// EP. 83 reads
+    METRICS_ROUNDTRIP,		// EP. 04 command to its EP. 83 answer
+    METRICS_FIRMWARE,		// EP. 02 writes, firmware and video control
+    METRICS_VIDEO,			// EP. 81 reads and capture completions
+    METRICS_QUEUE,			// EP. 04 commands waiting for their turn in the scheduler
+    METRICS_SERIES
+};
+
+enum metrics_status {
+    METRICS_OK,
+    METRICS_TIMEOUT,
+    METRICS_ERROR,
+    METRICS_STATUSES
+};
+
+// Log-linear buckets in ns, as in HdrHistogram: values below 2^METRICS_SUBBITS
+// are exact, above that every power of two is split in 2^METRICS_SUBBITS
+// buckets, about 6% wide. Anything from 2^(METRICS_MAXBITS + 1) ns (137 s)
+// up lands in the last bucket.
+#define METRICS_SUBBITS		4
+#define METRICS_MAXBITS		36
+#define METRICS_BUCKETS		((METRICS_MAXBITS - METRICS_SUBBITS + 2) << METRICS_SUBBITS)
+
+struct metrics_histogram {
+    atomic_uint_least64_t count;
+    atomic_uint_least64_t sum;		// ns
+    atomic_uint_least64_t max;		// ns
+    atomic_uint_least64_t buckets[METRICS_BUCKETS];
+};
+
+struct metrics_endpoint {
+    atomic_uint_least64_t transfers[METRICS_STATUSES];
+    atomic_uint_least64_t bytes;
+    struct metrics_histogram latency;
+};
+
+struct metrics {
+    struct metrics_endpoint series[METRICS_SERIES];
+    uint64_t started;				// ns
+
+    struct unixserver server;
+};
+
+void metrics_init(struct metrics *m);
+int metrics_serve(struct metrics *m, const char *socketpath);
+void metrics_stop(struct metrics *m);
+
+static inline void metrics_add(atomic_uint_least64_t *counter, uint64_t value) {
+    atomic_fetch_add_explicit(counter, value, memory_order_relaxed);
+}
+
+static inline unsigned int metrics_bucket(uint64_t value) {
+    if (value < (1ULL << METRICS_SUBBITS))
+        return (unsigned int) value;
+    unsigned int msb = 63 - __builtin_clzll(value);
+    if (msb > METRICS_MAXBITS)
+        return METRICS_BUCKETS - 1;
+    return ((msb - METRICS_SUBBITS + 1) << METRICS_SUBBITS) + ((value >> (msb - METRICS_SUBBITS)) & ((1U << METRICS_SUBBITS) - 1));
+}
+
+static inline void metrics_latency(struct metrics_histogram *h, uint64_t ns) {
+    metrics_add(&h->count, 1);
+    metrics_add(&h->sum, ns);
+    metrics_add(&h->buckets[metrics_bucket(ns)], 1);
+    uint64_t max = atomic_load_explicit(&h->max, memory_order_relaxed);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(&h->max, &max, ns, memory_order_relaxed, memory_order_relaxed))
+        ;
+}
+
+static inline void metrics_record(struct metrics *m, enum metrics_series series, enum metrics_status status, uint64_t bytes, uint64_t ns) {
+    struct metrics_endpoint *e = &m->series[series];
+    metrics_add(&e->transfers[status], 1);
+    metrics_add(&e->bytes, bytes);
+    if (status == METRICS_OK)
+        metrics_latency(&e->latency, ns);
+}
+
+// Largest value of the bucket holding the given quantile, 0 without samples.
+uint64_t metrics_quantile(struct metrics_histogram *h, double quantile);
+
+// Writes every series in the Prometheus text exposition format.
+void metrics_write(struct metrics *m, FILE *out);
+
+#endif
@@ -0,0 +1,747 @@
+#include "mp4mux.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#define MP4MUX_SAMPLE_SYNC		0x02000000	// sample_depends_on 2
+#define MP4MUX_SAMPLE_NONSYNC	0x01010000	// sample_depends_on 1, sample_is_non_sync_sample
+
+// iovecs per writev(), IOV_MAX on Linux
+#define MP4MUX_IOV_BATCH		1024
+
+// Default duration when there is nothing to measure it from, 30 fps
+#define MP4MUX_DEFAULT_DURATION	33333333ULL
+
+struct boxbuffer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+    int failed;
+};
+
+static void put(struct boxbuffer *b, const void *data, size_t size) {
+    if (b->size + size > b->capacity) {
+        size_t capacity = b->capacity ? b->capacity : 1024;
+        while (capacity < b->size + size)
+            capacity *= 2;
+        unsigned char *grown = (unsigned char*) realloc(b->data, capacity);
+        if (grown == NULL) {
+            b->failed = 1;
+            return;
+        }
+        b->data = grown;
+        b->capacity = capacity;
+    }
+    memcpy(b->data + b->size, data, size);
+    b->size += size;
+}
+
+static void put8(struct boxbuffer *b, uint8_t v) {
+    put(b, &v, 1);
+}
+
+static void put16(struct boxbuffer *b, uint16_t v) {
+    unsigned char p[2] = {v >> 8, v & 0xff};
+    put(b, p, 2);
+}
+
+static void put32(struct boxbuffer *b, uint32_t v) {
+    unsigned char p[4] = {v >> 24, (v >> 16) & 0xff, (v >> 8) & 0xff, v & 0xff};
+    put(b, p, 4);
+}
+
+static void put64(struct boxbuffer *b, uint64_t v) {
+    put32(b, v >> 32);
+    put32(b, v & 0xffffffff);
+}
+
+static void putzero(struct boxbuffer *b, size_t size) {
+    static const unsigned char zero[64];
+    while (size > 0) {
+        size_t chunk = size < sizeof (zero) ? size : sizeof (zero);
+        put(b, zero, chunk);
+        size -= chunk;
+    }
+}
+
+static void patch32(struct boxbuffer *b, size_t position, uint32_t v) {
+    if (b->failed)
+        return;
+    b->data[position] = v >> 24;
+    b->data[position + 1] = (v >> 16) & 0xff;
+    b->data[position + 2] = (v >> 8) & 0xff;
+    b->data[position + 3] = v & 0xff;
+}
+
+static size_t box(struct boxbuffer *b, const char *type) {
+    size_t position = b->size;
+    put32(b, 0);
+    put(b, type, 4);
+    return position;
+}
+
+static size_t fullbox(struct boxbuffer *b, const char *type, uint8_t version, uint32_t flags) {
+    size_t position = box(b, type);
+    put32(b, ((uint32_t) version << 24) | flags);
+    return position;
+}
+
+static void boxend(struct boxbuffer *b, size_t position) {
+    patch32(b, position, b->size - position);
+}
+
+static void putmatrix(struct boxbuffer *b) {
+    static const uint32_t matrix[9] = {0x00010000, 0, 0, 0, 0x00010000, 0, 0, 0, 0x40000000};
+    for (int i = 0; i < 9; i++)
+        put32(b, matrix[i]);
+}
+
+struct bitreader {
+    const unsigned char *data;
+    size_t size;
+    size_t bit;
+};
+
+static unsigned int bits_get(struct bitreader *br, int count) {
+    unsigned int v = 0;
+    for (int i = 0; i < count; i++) {
+        size_t byte = br->bit / 8;
+        int bit = byte < br->size ? (br->data[byte] >> (7 - br->bit % 8)) & 1 : 0;
+        v = (v << 1) | bit;
+        br->bit++;
+    }
+    return v;
+}
+
+static unsigned int bits_ue(struct bitreader *br) {
+    int zeros = 0;
+    while (bits_get(br, 1) == 0 && zeros < 32 && br->bit < br->size * 8)
+        zeros++;
+    return ((1u << zeros) - 1) + bits_get(br, zeros);
+}
+
+static int bits_se(struct bitreader *br) {
+    unsigned int v = bits_ue(br);
+    return v & 1 ? (int) ((v + 1) / 2) : -(int) (v / 2);
+}
+
+static void bits_skipscaling(struct bitreader *br, int size) {
+    int last = 8, next = 8;
+    for (int i = 0; i < size; i++) {
+        if (next != 0)
+            next = (last + bits_se(br) + 256) % 256;
+        last = next == 0 ? last : next;
+    }
+}
+
+// Picture size from the SPS, header byte included.
+static int parsesps(const unsigned char *nal, size_t size, unsigned int *width, unsigned int *height) {
+    unsigned char rbsp[256];
+    size_t length = 0;
+    int zeros = 0;
+
+    // Drop the emulation prevention bytes
+    for (size_t i = 1; i < size && length < sizeof (rbsp); i++) {
+        if (zeros >= 2 && nal[i] == 3) {
+            zeros = 0;
+            continue;
+        }
+        rbsp[length++] = nal[i];
+        zeros = nal[i] == 0 ? zeros + 1 : 0;
+    }
+
+    struct bitreader br = {rbsp, length, 0};
+    unsigned int profile = bits_get(&br, 8);
+    bits_get(&br, 16);		// constraint flags, level_idc
+    bits_ue(&br);			// seq_parameter_set_id
+
+    unsigned int chroma = 1;
+    if (profile == 100 || profile == 110 || profile == 122 || profile == 244 || profile == 44 || profile == 83 ||
+            profile == 86 || profile == 118 || profile == 128 || profile == 138 || profile == 139 || profile == 134 || profile == 135) {
+        chroma = bits_ue(&br);
+        if (chroma == 3)
+            bits_get(&br, 1);	// separate_colour_plane_flag
+        bits_ue(&br);			// bit_depth_luma_minus8
+        bits_ue(&br);			// bit_depth_chroma_minus8
+        bits_get(&br, 1);		// qpprime_y_zero_transform_bypass_flag
+        if (bits_get(&br, 1)) {
+            for (int i = 0; i < (chroma != 3 ? 8 : 12); i++) {
+                if (bits_get(&br, 1))
+                    bits_skipscaling(&br, i < 6 ? 16 : 64);
+            }
+        }
+    }
+
+    bits_ue(&br);			// log2_max_frame_num_minus4
+    unsigned int poctype = bits_ue(&br);
+    if (poctype == 0) {
+        bits_ue(&br);
+    } else if (poctype == 1) {
+        bits_get(&br, 1);
+        bits_se(&br);
+        bits_se(&br);
+        unsigned int cycle = bits_ue(&br);
+        for (unsigned int i = 0; i < cycle && i < 256; i++)
+            bits_se(&br);
+    }
+    bits_ue(&br);			// max_num_ref_frames
+    bits_get(&br, 1);		// gaps_in_frame_num_value_allowed_flag
+    unsigned int mbwidth = bits_ue(&br) + 1;
+    unsigned int mapheight = bits_ue(&br) + 1;
+    unsigned int framembsonly = bits_get(&br, 1);
+    if (!framembsonly)
+        bits_get(&br, 1);	// mb_adaptive_frame_field_flag
+    bits_get(&br, 1);		// direct_8x8_inference_flag
+
+    unsigned int cropleft = 0, cropright = 0, croptop = 0, cropbottom = 0;
+    if (bits_get(&br, 1)) {
+        cropleft = bits_ue(&br);
+        cropright = bits_ue(&br);
+        croptop = bits_ue(&br);
+        cropbottom = bits_ue(&br);
+    }
+    if (br.bit > length * 8)
+        return -1;
+
+    unsigned int cropx = chroma == 0 || chroma == 3 ? 1 : 2;
+    unsigned int cropy = (chroma == 1 ? 2 : 1) * (2 - framembsonly);
+    *width = mbwidth * 16 - (cropleft + cropright) * cropx;
+    *height = (2 - framembsonly) * mapheight * 16 - (croptop + cropbottom) * cropy;
+    return 0;
+}
+
+// Held buffer holding the stream offset, heldcount when it is gone or not there yet.
+static size_t mp4mux_locate(struct mp4mux *mux, uint64_t offset) {
+    size_t low = 0, high = mux->heldcount;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        struct mp4mux_held *held = &mux->held[middle];
+        if (offset < held->offset)
+            high = middle;
+        else if (offset >= held->offset + held->buffer->length)
+            low = middle + 1;
+        else
+            return middle;
+    }
+    return mux->heldcount;
+}
+
+static int mp4mux_byte(struct mp4mux *mux, uint64_t offset) {
+    size_t i = mp4mux_locate(mux, offset);
+    if (i == mux->heldcount)
+        return -1;
+    return mux->held[i].buffer->data[offset - mux->held[i].offset];
+}
+
+static size_t mp4mux_copy(struct mp4mux *mux, uint64_t offset, size_t size, unsigned char *destination) {
+    size_t copied = 0;
+    size_t i = mp4mux_locate(mux, offset);
+    while (copied < size && i < mux->heldcount) {
+        struct mp4mux_held *held = &mux->held[i];
+        size_t start = offset + copied - held->offset;
+        size_t chunk = held->buffer->length - start;
+        if (chunk > size - copied)
+            chunk = size - copied;
+        memcpy(destination + copied, held->buffer->data + start, chunk);
+        copied += chunk;
+        i++;
+    }
+    return copied;
+}
+
+static int insample(unsigned char type) {
+    // Parameter sets go in the sample description, access unit delimiters nowhere
+    return type != 7 && type != 8 && type != 9;
+}
+
+// The last NAL ends where the next start code begins, without the zero bytes before it.
+static void mp4mux_endnal(struct mp4mux *mux, uint64_t end) {
+    if (mux->nalcount == 0)
+        return;
+    struct mp4mux_nal *nal = &mux->nals[mux->nalcount - 1];
+    if (nal->end != 0)
+        return;
+    while (end > nal->offset + 1 && mp4mux_byte(mux, end - 1) == 0)
+        end--;
+    nal->end = end;
+
+    size_t size = end - nal->offset;
+    if (nal->type == 7 && mux->spssize == 0 && size <= sizeof (mux->sps) && size >= 4) {
+        mux->spssize = mp4mux_copy(mux, nal->offset, size, mux->sps);
+        if (parsesps(mux->sps, mux->spssize, &mux->width, &mux->height) != 0)
+            fprintf(stderr, "MP4: could not read the picture size from the SPS!\n");
+    } else if (nal->type == 8 && mux->ppssize == 0 && size <= sizeof (mux->pps)) {
+        mux->ppssize = mp4mux_copy(mux, nal->offset, size, mux->pps);
+    }
+}
+
+static int writeall(int fd, struct iovec *iov, size_t count) {
+    while (count > 0) {
+        int batch = count < MP4MUX_IOV_BATCH ? (int) count : MP4MUX_IOV_BATCH;
+        ssize_t written = writev(fd, iov, batch);
+        if (written < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        // Skip what went out, a partial write leaves the rest of an iovec
+        while (count > 0 && (size_t) written >= iov->iov_len) {
+            written -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = (unsigned char*) iov->iov_base + written;
+            iov->iov_len -= written;
+        }
+    }
+    return 0;
+}
+
+static int mp4mux_writeheader(struct mp4mux *mux) {
+    struct boxbuffer b = {NULL, 0, 0, 0};
+
+    size_t ftyp = box(&b, "ftyp");
+    put(&b, "isom", 4);
+    put32(&b, 0x200);
+    put(&b, "isomiso6avc1mp41", 16);
+    boxend(&b, ftyp);
+
+    size_t moov = box(&b, "moov");
+    size_t mvhd = fullbox(&b, "mvhd", 0, 0);
+    put32(&b, 0);				// creation_time
+    put32(&b, 0);				// modification_time
+    put32(&b, 1000);			// timescale
+    put32(&b, 0);				// duration, unknown while fragments come
+    put32(&b, 0x00010000);		// rate
+    put16(&b, 0x0100);			// volume
+    putzero(&b, 10);
+    putmatrix(&b);
+    putzero(&b, 24);
+    put32(&b, 2);				// next_track_ID
+    boxend(&b, mvhd);
+
+    size_t trak = box(&b, "trak");
+    size_t tkhd = fullbox(&b, "tkhd", 0, 3);	// enabled, in movie
+    put32(&b, 0);
+    put32(&b, 0);
+    put32(&b, 1);				// track_ID
+    put32(&b, 0);
+    put32(&b, 0);				// duration
+    putzero(&b, 8);
+    put16(&b, 0);				// layer
+    put16(&b, 0);				// alternate_group
+    put16(&b, 0);				// volume
+    put16(&b, 0);
+    putmatrix(&b);
+    put32(&b, mux->width << 16);
+    put32(&b, mux->height << 16);
+    boxend(&b, tkhd);
+
+    size_t mdia = box(&b, "mdia");
+    size_t mdhd = fullbox(&b, "mdhd", 0, 0);
+    put32(&b, 0);
+    put32(&b, 0);
+    put32(&b, MP4MUX_TIMESCALE);
+    put32(&b, 0);
+    put16(&b, 0x55c4);			// "und"
+    put16(&b, 0);
+    boxend(&b, mdhd);
+
+    size_t hdlr = fullbox(&b, "hdlr", 0, 0);
+    put32(&b, 0);
+    put(&b, "vide", 4);
+    putzero(&b, 12);
+    put(&b, "VideoHandler", 13);
+    boxend(&b, hdlr);
+
+    size_t minf = box(&b, "minf");
+    size_t vmhd = fullbox(&b, "vmhd", 0, 1);
+    putzero(&b, 8);
+    boxend(&b, vmhd);
+
+    size_t dinf = box(&b, "dinf");
+    size_t dref = fullbox(&b, "dref", 0, 0);
+    put32(&b, 1);
+    size_t url = fullbox(&b, "url ", 0, 1);	// data in this file
+    boxend(&b, url);
+    boxend(&b, dref);
+    boxend(&b, dinf);
+
+    size_t stbl = box(&b, "stbl");
+    size_t stsd = fullbox(&b, "stsd", 0, 0);
+    put32(&b, 1);
+    size_t avc1 = box(&b, "avc1");
+    putzero(&b, 6);
+    put16(&b, 1);				// data_reference_index
+    putzero(&b, 16);
+    put16(&b, mux->width);
+    put16(&b, mux->height);
+    put32(&b, 0x00480000);		// 72 dpi
+    put32(&b, 0x00480000);
+    put32(&b, 0);
+    put16(&b, 1);				// frame_count
+    putzero(&b, 32);			// compressorname
+    put16(&b, 0x0018);			// depth
+    put16(&b, 0xffff);
+    size_t avcc = box(&b, "avcC");
+    put8(&b, 1);
+    put8(&b, mux->sps[1]);		// profile
+    put8(&b, mux->sps[2]);		// compatibility
+    put8(&b, mux->sps[3]);		// level
+    put8(&b, 0xff);				// 4 byte NAL lengths
+    put8(&b, 0xe1);				// one SPS
+    put16(&b, mux->spssize);
+    put(&b, mux->sps, mux->spssize);
+    put8(&b, 1);				// one PPS
+    put16(&b, mux->ppssize);
+    put(&b, mux->pps, mux->ppssize);
+    boxend(&b, avcc);
+    boxend(&b, avc1);
+    boxend(&b, stsd);
+
+    // Empty sample tables, every sample is in the fragments
+    size_t stts = fullbox(&b, "stts", 0, 0);
+    put32(&b, 0);
+    boxend(&b, stts);
+    size_t stsc = fullbox(&b, "stsc", 0, 0);
+    put32(&b, 0);
+    boxend(&b, stsc);
+    size_t stsz = fullbox(&b, "stsz", 0, 0);
+    put32(&b, 0);
+    put32(&b, 0);
+    boxend(&b, stsz);
+    size_t stco = fullbox(&b, "stco", 0, 0);
+    put32(&b, 0);
+    boxend(&b, stco);
+    boxend(&b, stbl);
+    boxend(&b, minf);
+    boxend(&b, mdia);
+    boxend(&b, trak);
+
+    size_t mvex = box(&b, "mvex");
+    size_t trex = fullbox(&b, "trex", 0, 0);
+    put32(&b, 1);				// track_ID
+    put32(&b, 1);				// default_sample_description_index
+    put32(&b, 0);
+    put32(&b, 0);
+    put32(&b, 0);
+    boxend(&b, trex);
+    boxend(&b, mvex);
+    boxend(&b, moov);
+
+    int err = -1;
+    if (!b.failed) {
+        struct iovec iov = {b.data, b.size};
+        err = writeall(mux->fd, &iov, 1);
+        mux->stats.bytes += b.size;
+    }
+    free(b.data);
+    mux->headerwritten = err == 0;
+    return err;
+}
+
+static uint64_t ticks(struct mp4mux *mux, uint64_t timestamp) {
+    if (timestamp <= mux->firsttimestamp)
+        return 0;
+    return (timestamp - mux->firsttimestamp) * 9 / 100000;	// ns to 90 kHz
+}
+
+// Gives back every held buffer entirely before the oldest NAL still needed. The
+// newest buffer is kept unless everything goes, the scanner may still be on it.
+static void mp4mux_trim(struct mp4mux *mux, int everything) {
+    uint64_t needed = UINT64_MAX;
+    if (!everything) {
+        if (mux->nalcount > 0)
+            needed = mux->nals[0].offset;
+        if (mux->heldcount > 0 && mux->held[mux->heldcount - 1].offset < needed)
+            needed = mux->held[mux->heldcount - 1].offset;
+    }
+
+    size_t released = 0;
+    while (released < mux->heldcount && mux->held[released].offset + mux->held[released].buffer->length <= needed) {
+        mux->release(mux->releasedata, mux->held[released].buffer);
+        released++;
+    }
+    if (released > 0) {
+        memmove(mux->held, mux->held + released, (mux->heldcount - released) * sizeof (struct mp4mux_held));
+        mux->heldcount -= released;
+    }
+}
+
+// Forgets the first count samples and their NALs.
+static void mp4mux_drop(struct mp4mux *mux, size_t count) {
+    // NALs of the access unit in progress stay
+    struct mp4mux_sample *last = &mux->samples[count - 1];
+    size_t nals = last->firstnal + last->nalcount;
+
+    memmove(mux->nals, mux->nals + nals, (mux->nalcount - nals) * sizeof (struct mp4mux_nal));
+    mux->nalcount -= nals;
+    memmove(mux->samples, mux->samples + count, (mux->samplecount - count) * sizeof (struct mp4mux_sample));
+    mux->samplecount -= count;
+    for (size_t i = 0; i < mux->samplecount; i++)
+        mux->samples[i].firstnal -= nals;
+}
+
+// Writes the first count samples as one fragment, nexttimestamp is when the one after starts.
+static int mp4mux_flush(struct mp4mux *mux, size_t count, uint64_t nexttimestamp) {
+    struct boxbuffer b = {NULL, 0, 0, 0};
+    struct iovec *iov = NULL;
+    uint32_t *lengths = NULL;
+    uint64_t *dts = NULL;
+    size_t iovcount = 0;
+    uint64_t payload = 0;
+    int err = -1;
+
+    if (count == 0 || count > mux->samplecount)
+        return 0;
+    if (mux->stats.samples == 0)
+        mux->firsttimestamp = mux->samples[0].timestamp;
+
+    // Host timestamps are per transfer, access units sharing one are spread up to the next
+    dts = (uint64_t*) malloc((count + 1) * sizeof (uint64_t));
+    check(dts != NULL, "MP4: out of memory!");
+    for (size_t i = 0; i < count;) {
+        size_t j = i;
+        while (j < count && mux->samples[j].timestamp == mux->samples[i].timestamp)
+            j++;
+        uint64_t start = ticks(mux, mux->samples[i].timestamp);
+        uint64_t next = ticks(mux, j < count ? mux->samples[j].timestamp : nexttimestamp);
+        for (size_t k = i; k < j; k++)
+            dts[k] = next > start ? start + (next - start) * (k - i) / (j - i) : start;
+        i = j;
+    }
+    dts[count] = ticks(mux, nexttimestamp);
+    if (dts[0] < mux->decodetime)
+        dts[0] = mux->decodetime;
+    for (size_t i = 1; i <= count; i++) {
+        if (dts[i] <= dts[i - 1])
+            dts[i] = dts[i - 1] + 1;
+    }
+
+    // A length and a first piece for every NAL, plus one more piece per buffer boundary crossed
+    size_t nalcount = mux->samples[count - 1].firstnal + mux->samples[count - 1].nalcount;
+    size_t iovcapacity = 1 + 2 * nalcount + mux->heldcount;
+    iov = (struct iovec*) malloc(iovcapacity * sizeof (struct iovec));
+    lengths = (uint32_t*) malloc((nalcount + 1) * sizeof (uint32_t));
+    check(iov != NULL && lengths != NULL, "MP4: out of memory!");
+
+    size_t moof = box(&b, "moof");
+    size_t mfhd = fullbox(&b, "mfhd", 0, 0);
+    put32(&b, ++mux->sequence);
+    boxend(&b, mfhd);
+    size_t traf = box(&b, "traf");
+    size_t tfhd = fullbox(&b, "tfhd", 0, 0x020000);	// default-base-is-moof
+    put32(&b, 1);
+    boxend(&b, tfhd);
+    size_t tfdt = fullbox(&b, "tfdt", 1, 0);
+    put64(&b, dts[0]);
+    boxend(&b, tfdt);
+    size_t trun = fullbox(&b, "trun", 0, 0x000701);	// data offset, duration, size, flags
+    put32(&b, count);
+    size_t dataoffset = b.size;
+    put32(&b, 0);
+    for (size_t i = 0; i < count; i++) {
+        put32(&b, dts[i + 1] - dts[i]);
+        put32(&b, mux->samples[i].size);
+        put32(&b, mux->samples[i].sync ? MP4MUX_SAMPLE_SYNC : MP4MUX_SAMPLE_NONSYNC);
+        payload += mux->samples[i].size;
+    }
+    boxend(&b, trun);
+    boxend(&b, traf);
+    boxend(&b, moof);
+    patch32(&b, dataoffset, b.size + 8);
+    put32(&b, 8 + payload);
+    put(&b, "mdat", 4);
+    check(!b.failed, "MP4: out of memory!");
+
+    // Length prefixes and the payload straight from the transfer buffers
+    iov[iovcount++] = (struct iovec) {b.data, b.size};
+    for (size_t i = 0; i < nalcount; i++) {
+        struct mp4mux_nal *nal = &mux->nals[i];
+        if (!insample(nal->type))
+            continue;
+        uint32_t size = nal->end - nal->offset;
+        unsigned char *length = (unsigned char*) &lengths[i];
+        length[0] = size >> 24;
+        length[1] = (size >> 16) & 0xff;
+        length[2] = (size >> 8) & 0xff;
+        length[3] = size & 0xff;
+        iov[iovcount++] = (struct iovec) {length, 4};
+
+        uint64_t offset = nal->offset;
+        for (size_t h = mp4mux_locate(mux, offset); offset < nal->end && h < mux->heldcount; h++) {
+            struct mp4mux_held *held = &mux->held[h];
+            size_t start = offset - held->offset;
+            size_t chunk = held->buffer->length - start;
+            if (chunk > nal->end - offset)
+                chunk = nal->end - offset;
+            iov[iovcount++] = (struct iovec) {held->buffer->data + start, chunk};
+            offset += chunk;
+        }
+        check(offset == nal->end, "MP4: NAL at %llu is no longer held!", (unsigned long long) nal->offset);
+    }
+
+    check(writeall(mux->fd, iov, iovcount) == 0, "MP4: write failed!");
+    mux->stats.bytes += b.size + payload;
+    mux->stats.fragments++;
+    mux->stats.samples += count;
+    mux->decodetime = dts[count];
+    err = 0;
+
+error:
+    if (err != 0)
+        mux->failed = 1;
+    free(b.data);
+    free(iov);
+    free(lengths);
+    free(dts);
+    mp4mux_drop(mux, count);
+    mp4mux_trim(mux, 0);
+    return err;
+}
+
+static void mp4mux_onnal(void *userdata, uint64_t offset, unsigned char header) {
+    struct mp4mux *mux = (struct mp4mux*) userdata;
+
+    mp4mux_endnal(mux, offset - 3);
+    if (mux->nalcount == mux->nalcapacity) {
+        size_t capacity = mux->nalcapacity ? mux->nalcapacity * 2 : 256;
+        struct mp4mux_nal *nals = (struct mp4mux_nal*) realloc(mux->nals, capacity * sizeof (struct mp4mux_nal));
+        if (nals == NULL) {
+            mux->failed = 1;
+            return;
+        }
+        mux->nals = nals;
+        mux->nalcapacity = capacity;
+    }
+    mux->nals[mux->nalcount++] = (struct mp4mux_nal) {offset, 0, header & 0x1f};
+}
+
+static void mp4mux_onau(void *userdata, const struct nalscan_au *au) {
+    struct mp4mux *mux = (struct mp4mux*) userdata;
+
+    mp4mux_endnal(mux, au->offset + au->size);
+
+    size_t first = mux->nalcount;
+    while (first > 0 && mux->nals[first - 1].offset >= au->offset)
+        first--;
+
+    struct mp4mux_sample sample = {first, mux->nalcount - first, 0, au->timestamp, (au->flags & NALSCAN_IDR) != 0};
+    for (size_t i = first; i < mux->nalcount; i++) {
+        if (insample(mux->nals[i].type))
+            sample.size += 4 + mux->nals[i].end - mux->nals[i].offset;
+    }
+
+    // The file starts with an IDR once the decoder configuration is known
+    if (!mux->headerwritten) {
+        if (!sample.sync || mux->spssize == 0 || mux->ppssize == 0 || mp4mux_writeheader(mux) != 0) {
+            mux->stats.skipped++;
+            mux->nalcount = first;
+            return;
+        }
+    }
+
+    // One fragment per GOP
+    if (sample.sync && mux->samplecount > 0)
+        mp4mux_flush(mux, mux->samplecount, sample.timestamp);
+    sample.firstnal = mux->nalcount - sample.nalcount;
+
+    if (mux->samplecount == mux->samplecapacity) {
+        size_t capacity = mux->samplecapacity ? mux->samplecapacity * 2 : 64;
+        struct mp4mux_sample *samples = (struct mp4mux_sample*) realloc(mux->samples, capacity * sizeof (struct mp4mux_sample));
+        if (samples == NULL) {
+            mux->failed = 1;
+            return;
+        }
+        mux->samples = samples;
+        mux->samplecapacity = capacity;
+    }
+    mux->samples[mux->samplecount++] = sample;
+}
+
+int mp4mux_open(struct mp4mux *mux, const char *path, size_t maxheld, mp4mux_release release, void *releasedata) {
+    memset(mux, 0, sizeof (struct mp4mux));
+    mux->release = release;
+    mux->releasedata = releasedata;
+    mux->maxheld = maxheld > 1 ? maxheld : 2;
+
+    mux->held = (struct mp4mux_held*) calloc(mux->maxheld + 1, sizeof (struct mp4mux_held));
+    mux->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (mux->held == NULL || mux->fd < 0) {
+        fprintf(stderr, "Failed to create MP4 file %s!\n", path);
+        if (mux->fd >= 0)
+            close(mux->fd);
+        free(mux->held);
+        mux->held = NULL;
+        mux->fd = -1;
+        return -1;
+    }
+
+    nalscan_init(&mux->scanner, mp4mux_onau, mux);
+    nalscan_setnalcallback(&mux->scanner, mp4mux_onnal);
+    return 0;
+}
+
+int mp4mux_push(struct mp4mux *mux, struct streambuffer *buffer) {
+    mux->held[mux->heldcount++] = (struct mp4mux_held) {buffer, mux->scanner.offset};
+    if (mux->heldcount > mux->stats.maxheld)
+        mux->stats.maxheld = mux->heldcount;
+
+    nalscan_push(&mux->scanner, buffer->data, buffer->length, buffer->timestamp);
+
+    // Out of buffers before the next IDR, cut the GOP short at the last access unit
+    if (mux->heldcount >= mux->maxheld && mux->samplecount > 0) {
+        mux->stats.capped++;
+        mp4mux_flush(mux, mux->samplecount, mux->scanner.au.timestamp);
+    }
+    mp4mux_trim(mux, 0);
+
+    // Still full, the access unit in progress alone is bigger than that: it is lost
+    if (mux->heldcount >= mux->maxheld) {
+        mux->stats.skipped++;
+        mux->nalcount = 0;
+        mux->scanner.auopen = 0;
+        mp4mux_trim(mux, 1);
+    }
+    return mux->failed ? -1 : 0;
+}
+
+int mp4mux_close(struct mp4mux *mux) {
+    int err = 0;
+
+    if (mux->fd < 0)
+        return -1;
+
+    nalscan_finish(&mux->scanner);
+    if (mux->samplecount > 0) {
+        struct mp4mux_sample *first = &mux->samples[0];
+        struct mp4mux_sample *last = &mux->samples[mux->samplecount - 1];
+        uint64_t duration = mux->samplecount > 1 ? (last->timestamp - first->timestamp) / (mux->samplecount - 1) : MP4MUX_DEFAULT_DURATION;
+        err = mp4mux_flush(mux, mux->samplecount, last->timestamp + (duration ? duration : MP4MUX_DEFAULT_DURATION));
+    }
+    mp4mux_trim(mux, 1);
+
+    if (close(mux->fd) != 0 || mux->failed)
+        err = -1;
+    mux->fd = -1;
+    free(mux->held);
+    free(mux->nals);
+    free(mux->samples);
+    mux->held = NULL;
+    mux->nals = NULL;
+    mux->samples = NULL;
+    return err;
+}
+
+void mp4mux_report(struct mp4mux *mux, FILE *out) {
+    fprintf(out, "MP4: %ux%u, %llu fragments (%llu cut short), %llu samples, %llu skipped, %llu bytes, up to %zu buffers held\n",
+            mux->width, mux->height, (unsigned long long) mux->stats.fragments, (unsigned long long) mux->stats.capped,
+            (unsigned long long) mux->stats.samples, (unsigned long long) mux->stats.skipped,
+            (unsigned long long) mux->stats.bytes, mux->stats.maxheld);
+}
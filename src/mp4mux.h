@@ -0,0 +1,93 @@
+#ifndef MP4MUX_H
+#define MP4MUX_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "capture.h"
+#include "nalscan.h"
+
+#define MP4MUX_TIMESCALE	90000
+
+// Gives a buffer the muxer kept back to its owner.
+typedef void (*mp4mux_release)(void *userdata, struct streambuffer *buffer);
+
+struct mp4mux_nal {
+    uint64_t offset;		// stream offset of the header byte
+    uint64_t end;			// 0 until the next NAL starts
+    unsigned char type;
+};
+
+struct mp4mux_sample {
+    size_t firstnal;		// in nals
+    size_t nalcount;
+    uint32_t size;			// with the 4 byte length of every NAL
+    uint64_t timestamp;		// ns, host time of the transfer it started in
+    int sync;
+};
+
+struct mp4mux_held {
+    struct streambuffer *buffer;
+    uint64_t offset;		// stream offset of its first byte
+};
+
+struct mp4mux_stats {
+    uint64_t fragments;
+    uint64_t samples;
+    uint64_t bytes;			// written to the file
+    uint64_t capped;		// fragments cut before the next IDR to give buffers back
+    uint64_t skipped;		// samples before the first IDR with SPS and PPS
+    size_t maxheld;			// most buffers held at once
+};
+
+// Fragmented MP4 muxer for the Annex-B stream of EP. 81. Transfers are held
+// by reference until the fragment they belong to is written with writev(),
+// start codes are replaced by NAL lengths on the way out without copying the
+// payload. A fragment is cut at every IDR, or before maxheld buffers pile up.
+// The file is playable from the first fragment on while it is still growing.
+struct mp4mux {
+    int fd;
+    struct nalscan scanner;
+
+    mp4mux_release release;
+    void *releasedata;
+    size_t maxheld;
+
+    struct mp4mux_held *held;
+    size_t heldcount;
+
+    struct mp4mux_nal *nals;
+    size_t nalcount;
+    size_t nalcapacity;
+
+    struct mp4mux_sample *samples;
+    size_t samplecount;
+    size_t samplecapacity;
+
+    // Decoder configuration from the first SPS and PPS
+    unsigned char sps[256];
+    size_t spssize;
+    unsigned char pps[256];
+    size_t ppssize;
+    unsigned int width;
+    unsigned int height;
+    int headerwritten;
+
+    uint64_t firsttimestamp;	// ns, of the first sample written
+    uint64_t decodetime;		// MP4MUX_TIMESCALE, end of the last fragment
+    uint32_t sequence;
+
+    int failed;
+    struct mp4mux_stats stats;
+};
+
+// maxheld must be lower than the number of buffers the owner can spare.
+int mp4mux_open(struct mp4mux *mux, const char *path, size_t maxheld, mp4mux_release release, void *releasedata);
+// Takes the buffer, it comes back through the release callback. Returns -1 once writing failed.
+int mp4mux_push(struct mp4mux *mux, struct streambuffer *buffer);
+// Writes what is left and gives every buffer back.
+int mp4mux_close(struct mp4mux *mux);
+
+void mp4mux_report(struct mp4mux *mux, FILE *out);
+
+#endif
@@ -0,0 +1,295 @@
+#include "nalscan.h"
+#include "lgp.h"
+
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NALSCAN_X86 1
+#endif
+
+static size_t find_scalar(const unsigned char *data, size_t length, size_t i) {
+    while (i + 3 <= length) {
+        // A third byte above 1 rules out a start code at i, i + 1 and i + 2
+        if (data[i + 2] > 1)
+            i += 3;
+        else if (data[i + 2] == 1 && data[i + 1] == 0 && data[i] == 0)
+            return i;
+        else
+            i++;
+    }
+    return length;
+}
+
+#if defined(__SSE2__)
+static size_t find_sse2(const unsigned char *data, size_t length, size_t i) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+
+    for (; i + 18 <= length; i += 16) {
+        __m128i a = _mm_loadu_si128((const __m128i*) (data + i));
+        __m128i b = _mm_loadu_si128((const __m128i*) (data + i + 1));
+        __m128i c = _mm_loadu_si128((const __m128i*) (data + i + 2));
+        __m128i m = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)), _mm_cmpeq_epi8(c, one));
+        int mask = _mm_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return find_scalar(data, length, i);
+}
+#endif
+
+#if defined(NALSCAN_X86)
+__attribute__((target("avx2")))
+static size_t find_avx2(const unsigned char *data, size_t length, size_t i) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+
+    for (; i + 34 <= length; i += 32) {
+        __m256i a = _mm256_loadu_si256((const __m256i*) (data + i));
+        __m256i b = _mm256_loadu_si256((const __m256i*) (data + i + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i*) (data + i + 2));
+        __m256i m = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)), _mm256_cmpeq_epi8(c, one));
+        unsigned int mask = (unsigned int) _mm256_movemask_epi8(m);
+        if (mask != 0)
+            return i + __builtin_ctz(mask);
+    }
+    return find_scalar(data, length, i);
+}
+#endif
+
+typedef size_t (*findfunction)(const unsigned char *data, size_t length, size_t from);
+
+static findfunction find = NULL;
+static const char *findname = "scalar";
+
+static void nalscan_select(void) {
+    find = find_scalar;
+#if defined(__SSE2__)
+    find = find_sse2;
+    findname = "sse2";
+#endif
+#if defined(NALSCAN_X86)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        find = find_avx2;
+        findname = "avx2";
+    }
+#endif
+}
+
+size_t nalscan_find(const unsigned char *data, size_t length, size_t from) {
+    if (find == NULL)
+        nalscan_select();
+    return find(data, length, from);
+}
+
+const char *nalscan_simd(void) {
+    if (find == NULL)
+        nalscan_select();
+    return findname;
+}
+
+static int isvcl(unsigned char header) {
+    int type = header & 0x1f;
+    return type >= 1 && type <= 5;
+}
+
+static void nalscan_emit(struct nalscan *s, uint64_t end) {
+    s->au.size = end - s->au.offset;
+    s->stats.accessunits++;
+    if (s->au.flags & NALSCAN_IDR)
+        s->stats.idrs++;
+    if (s->callback != NULL)
+        s->callback(s->userdata, &s->au);
+}
+
+// A NAL with its header complete: decides whether it opens a new access unit.
+static void nalscan_nal(struct nalscan *s) {
+    int type = s->header[0] & 0x1f;
+    int vcl = isvcl(s->header[0]);
+    int startsau;
+
+    if (vcl) {
+        // first_mb_in_slice is ue(v), 0 is coded as a single 1 bit
+        startsau = (s->header[1] & 0x80) != 0;
+    } else {
+        // SEI, SPS, PPS, AUD and 14 to 18 can only come before the slices of an access unit
+        startsau = type == 6 || (type >= 7 && type <= 9) || (type >= 14 && type <= 18);
+    }
+
+    s->stats.nals++;
+    if (!s->auopen || (s->auvcl && startsau)) {
+        if (s->auopen)
+            nalscan_emit(s, s->naloffset);
+        memset(&s->au, 0, sizeof (struct nalscan_au));
+        s->au.offset = s->naloffset;
+        s->au.timestamp = s->naltimestamp;
+        s->auopen = 1;
+        s->auvcl = 0;
+    }
+
+    s->au.nals++;
+    if (type == 5)
+        s->au.flags |= NALSCAN_IDR;
+    else if (type == 7)
+        s->au.flags |= NALSCAN_SPS;
+    else if (type == 8)
+        s->au.flags |= NALSCAN_PPS;
+    if (vcl)
+        s->auvcl = 1;
+
+    if (s->nalcallback != NULL)
+        s->nalcallback(s->userdata, s->naloffset + 3, s->header[0]);
+}
+
+// Collects the header of the current NAL from data[position], one byte or two for a slice.
+static void nalscan_collect(struct nalscan *s, const unsigned char *data, size_t length, size_t position) {
+    while (position < length) {
+        s->header[s->headerlength++] = data[position++];
+        if (s->headerlength == 2 || !isvcl(s->header[0])) {
+            nalscan_nal(s);
+            s->headerlength = 0;
+            return;
+        }
+    }
+    // Ran out of data, the rest comes with the next transfer
+    s->collecting = 1;
+    s->stats.split++;
+}
+
+static void nalscan_startcode(struct nalscan *s, uint64_t offset, uint64_t timestamp) {
+    s->naloffset = offset;
+    s->naltimestamp = timestamp;
+    s->headerlength = 0;
+    s->collecting = 0;
+}
+
+void nalscan_init(struct nalscan *s, nalscan_callback callback, void *userdata) {
+    memset(s, 0, sizeof (struct nalscan));
+    s->callback = callback;
+    s->userdata = userdata;
+}
+
+void nalscan_setnalcallback(struct nalscan *s, nalscan_nalcallback callback) {
+    s->nalcallback = callback;
+}
+
+void nalscan_push(struct nalscan *s, const unsigned char *data, size_t length, uint64_t timestamp) {
+    uint64_t start = lgp_now_ns();
+    size_t position = 0;
+
+    if (length == 0)
+        return;
+
+    // Header of a NAL whose start code ended the previous transfer
+    if (s->collecting) {
+        s->collecting = 0;
+        nalscan_collect(s, data, length, 0);
+    }
+
+    // Start codes beginning in the previous transfer and ending in this one
+    if (s->taillength > 0) {
+        unsigned char joined[4];
+        size_t head = length < 2 ? length : 2;
+        memcpy(joined, s->tail + 2 - s->taillength, s->taillength);
+        memcpy(joined + s->taillength, data, head);
+        size_t joinedlength = s->taillength + head;
+
+        for (size_t j = 0; j < s->taillength && j + 3 <= joinedlength; j++) {
+            if (joined[j] == 0 && joined[j + 1] == 0 && joined[j + 2] == 1) {
+                s->stats.split++;
+                nalscan_startcode(s, s->offset - s->taillength + j, timestamp);
+                position = j + 3 - s->taillength;
+                nalscan_collect(s, data, length, position);
+                break;
+            }
+        }
+    }
+
+    while ((position = nalscan_find(data, length, position)) < length) {
+        nalscan_startcode(s, s->offset + position, timestamp);
+        position += 3;
+        nalscan_collect(s, data, length, position);
+    }
+
+    // Keep the last two bytes for a start code split by the transfer boundary
+    if (length >= 2) {
+        memcpy(s->tail, data + length - 2, 2);
+        s->taillength = 2;
+    } else {
+        s->tail[0] = s->tail[1];
+        s->tail[1] = data[0];
+        s->taillength = s->taillength < 2 ? s->taillength + 1 : 2;
+    }
+
+    s->offset += length;
+    s->stats.bytes += length;
+    s->stats.scantime += lgp_now_ns() - start;
+}
+
+void nalscan_finish(struct nalscan *s) {
+    if (s->auopen)
+        nalscan_emit(s, s->offset);
+    s->auopen = 0;
+}
+
+void nalscan_report(struct nalscan *s, FILE *out) {
+    double seconds = s->stats.scantime / 1e9;
+    double mbps = seconds > 0 ? s->stats.bytes / seconds / (1024.0 * 1024.0) : 0;
+    fprintf(out, "NAL scan (%s): %llu bytes, %llu NALs, %llu access units, %llu IDR, %llu split across transfers, %.0f MB/s\n",
+            nalscan_simd(), (unsigned long long) s->stats.bytes, (unsigned long long) s->stats.nals,
+            (unsigned long long) s->stats.accessunits, (unsigned long long) s->stats.idrs,
+            (unsigned long long) s->stats.split, mbps);
+}
+
+static int nalindex_writeheader(struct nalindex *idx) {
+    struct nalindex_header header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, NALINDEX_MAGIC, 8);
+    header.version = NALINDEX_VERSION;
+    header.entrysize = sizeof (struct nalindex_entry);
+    header.count = idx->count;
+    return fwrite(&header, sizeof (header), 1, idx->file) == 1 ? 0 : -1;
+}
+
+int nalindex_open(struct nalindex *idx, const char *path) {
+    memset(idx, 0, sizeof (struct nalindex));
+    idx->file = fopen(path, "w+b");
+    if (idx->file == NULL || nalindex_writeheader(idx) != 0) {
+        fprintf(stderr, "Failed to create index file %s!\n", path);
+        if (idx->file != NULL)
+            fclose(idx->file);
+        idx->file = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void nalindex_add(void *userdata, const struct nalscan_au *au) {
+    struct nalindex *idx = (struct nalindex*) userdata;
+    struct nalindex_entry entry;
+
+    entry.offset = au->offset;
+    entry.timestamp = au->timestamp;
+    entry.size = (uint32_t) au->size;
+    entry.flags = au->flags;
+    entry.nals = au->nals;
+    if (idx->file != NULL && fwrite(&entry, sizeof (entry), 1, idx->file) == 1) {
+        idx->count++;
+        if (au->flags & NALSCAN_IDR)
+            idx->idrs++;
+    }
+}
+
+int nalindex_close(struct nalindex *idx) {
+    int err = 0;
+    if (idx->file == NULL)
+        return -1;
+    if (fseek(idx->file, 0L, SEEK_SET) != 0 || nalindex_writeheader(idx) != 0)
+        err = -1;
+    if (fclose(idx->file) != 0)
+        err = -1;
+    idx->file = NULL;
+    return err;
+}
@@ -0,0 +1,112 @@
+#ifndef NALSCAN_H
+#define NALSCAN_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Access unit flags
+#define NALSCAN_IDR		0x0001
+#define NALSCAN_SPS		0x0002
+#define NALSCAN_PPS		0x0004
+
+// One H.264 access unit (a frame) of the Annex-B stream
+struct nalscan_au {
+    uint64_t offset;		// stream offset of the 00 00 01 of its first NAL, a leading zero byte stays with the previous one
+    uint64_t size;			// up to the next access unit
+    uint64_t timestamp;		// ns, host time of the transfer its first NAL came in
+    uint16_t flags;
+    uint16_t nals;
+};
+
+// Called for every access unit once the next one started, in stream order.
+typedef void (*nalscan_callback)(void *userdata, const struct nalscan_au *au);
+// Called for every NAL with the stream offset of its header byte, after the
+// access unit callback when the NAL starts a new one.
+typedef void (*nalscan_nalcallback)(void *userdata, uint64_t offset, unsigned char header);
+
+struct nalscan_stats {
+    uint64_t bytes;
+    uint64_t nals;
+    uint64_t accessunits;
+    uint64_t idrs;
+    uint64_t split;			// start codes or NAL headers split across two transfers
+    uint64_t scantime;		// ns
+};
+
+// Streaming Annex-B parser fed one transfer at a time. Start codes and
+// NAL headers may be split across transfers, the few bytes needed are
+// carried over to the next one.
+struct nalscan {
+    uint64_t offset;		// stream offset of the next byte pushed
+    unsigned char tail[2];	// last bytes of the previous transfer
+    size_t taillength;
+
+    // NAL whose header did not fit in the previous transfer
+    unsigned char header[2];
+    size_t headerlength;
+    int collecting;
+    uint64_t naloffset;
+    uint64_t naltimestamp;
+
+    struct nalscan_au au;	// access unit in progress
+    int auopen;
+    int auvcl;				// it has a slice already
+
+    nalscan_callback callback;
+    nalscan_nalcallback nalcallback;
+    void *userdata;
+
+    struct nalscan_stats stats;
+};
+
+void nalscan_init(struct nalscan *s, nalscan_callback callback, void *userdata);
+// Same userdata as the access unit callback.
+void nalscan_setnalcallback(struct nalscan *s, nalscan_nalcallback callback);
+void nalscan_push(struct nalscan *s, const unsigned char *data, size_t length, uint64_t timestamp);
+// Emits the last access unit, it ends with the stream.
+void nalscan_finish(struct nalscan *s);
+
+// Offset of the first 00 00 01 at or after from, length when there is none.
+// Uses AVX2 or SSE2 when the CPU has them.
+size_t nalscan_find(const unsigned char *data, size_t length, size_t from);
+const char *nalscan_simd(void);
+
+void nalscan_report(struct nalscan *s, FILE *out);
+
+// Access unit index written next to the recording, so tools can seek
+// and cut without scanning it again. All fields little endian:
+//   header     struct nalindex_header
+//   entries    struct nalindex_entry[count]
+// count is only set when the index is closed, a reader of an index
+// still being written goes by the file size.
+
+#define NALINDEX_MAGIC		"LGPIDX\r\n"
+#define NALINDEX_VERSION	1
+
+struct nalindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t entrysize;
+    uint64_t count;
+};
+
+struct nalindex_entry {
+    uint64_t offset;
+    uint64_t timestamp;		// ns, host monotonic clock
+    uint32_t size;
+    uint16_t flags;			// NALSCAN_*
+    uint16_t nals;
+};
+
+struct nalindex {
+    FILE *file;
+    uint64_t count;
+    uint64_t idrs;
+};
+
+int nalindex_open(struct nalindex *idx, const char *path);
+// nalscan_callback appending the access unit to the index.
+void nalindex_add(void *userdata, const struct nalscan_au *au);
+int nalindex_close(struct nalindex *idx);
+
+#endif
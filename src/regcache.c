@@ -0,0 +1,206 @@
+#include "regcache.h"
+#include "lgp.h"
+
+#include <string.h>
+
+// Policies the bring-up starts with; everything is volatile unless a caller that knows
+// only the host changes a register opts it in with regcache_setpolicy().
+static const struct {
+    uint32_t address;
+    enum regcache_policy policy;
+} regcache_defaults[] = {
+    // Handshakes and status the firmware changes under us
+    { CAMERA_REGISTER_VIDEO_READY, REGCACHE_VOLATILE },
+    { 0x06cc, REGCACHE_VOLATILE },
+    // Device status the UTL005 sequence polls until it changes
+    { 0x0610, REGCACHE_VOLATILE },
+    { 0x0618, REGCACHE_VOLATILE },
+};
+
+static uint32_t readle32(const unsigned char *p) {
+    return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t) p[3] << 24);
+}
+
+static void writele32(unsigned char *p, uint32_t value) {
+    p[0] = value & 0xff;
+    p[1] = (value >> 8) & 0xff;
+    p[2] = (value >> 16) & 0xff;
+    p[3] = (value >> 24) & 0xff;
+}
+
+// Entry of address, NULL if it has none and create is not set or the table is full.
+static struct regcache_entry *regcache_find(struct regcache *rc, uint32_t address, int create) {
+    // Registers are word aligned, the low bits carry nothing
+    uint32_t hash = (address >> 2) * 2654435761U;
+    for (unsigned int probe = 0; probe < REGCACHE_SLOTS; probe++) {
+        struct regcache_entry *entry = &rc->entries[(hash + probe) & (REGCACHE_SLOTS - 1)];
+        if (entry->used && entry->address == address)
+            return entry;
+        if (!entry->used) {
+            if (!create)
+                return NULL;
+            memset(entry, 0, sizeof (struct regcache_entry));
+            entry->used = 1;
+            entry->address = address;
+            entry->policy = REGCACHE_VOLATILE;
+            return entry;
+        }
+    }
+    return NULL;
+}
+
+void regcache_init(struct regcache *rc, struct transport *transport) {
+    memset(rc, 0, sizeof (struct regcache));
+    rc->transport = transport;
+    pthread_mutex_init(&rc->lock, NULL);
+    for (size_t i = 0; i < sizeof (regcache_defaults) / sizeof (regcache_defaults[0]); i++)
+        regcache_setpolicy(rc, regcache_defaults[i].address, regcache_defaults[i].policy);
+}
+
+void regcache_destroy(struct regcache *rc) {
+    pthread_mutex_destroy(&rc->lock);
+}
+
+void regcache_setscheduler(struct regcache *rc, struct scheduler *sched) {
+    pthread_mutex_lock(&rc->lock);
+    rc->scheduler = sched;
+    pthread_mutex_unlock(&rc->lock);
+}
+
+int regcache_setpolicy(struct regcache *rc, uint32_t address, enum regcache_policy policy) {
+    pthread_mutex_lock(&rc->lock);
+    struct regcache_entry *entry = regcache_find(rc, address, 1);
+    if (entry != NULL) {
+        entry->policy = policy;
+        entry->valid = 0;
+    }
+    pthread_mutex_unlock(&rc->lock);
+    if (entry == NULL) {
+        fprintf(stderr, "Register cache is full, 0x%.4x stays volatile!\n", address);
+        return -1;
+    }
+    return 0;
+}
+
+void regcache_invalidate(struct regcache *rc) {
+    pthread_mutex_lock(&rc->lock);
+    for (unsigned int i = 0; i < REGCACHE_SLOTS; i++)
+        rc->entries[i].valid = 0;
+    pthread_mutex_unlock(&rc->lock);
+}
+
+int regcache_lookup(struct regcache *rc, uint32_t address, uint32_t *value) {
+    int err = -1;
+
+    pthread_mutex_lock(&rc->lock);
+    struct regcache_entry *entry = regcache_find(rc, address, 0);
+    if (entry == NULL || entry->policy != REGCACHE_CACHEABLE) {
+        rc->stats.volatilereads++;
+    } else if (!entry->valid) {
+        rc->stats.misses++;
+    } else {
+        rc->stats.hits++;
+        *value = entry->value;
+        err = 0;
+    }
+    pthread_mutex_unlock(&rc->lock);
+    return err;
+}
+
+void regcache_update(struct regcache *rc, uint32_t address, size_t count, const unsigned char *data) {
+    pthread_mutex_lock(&rc->lock);
+    for (size_t i = 0; i < count; i++) {
+        struct regcache_entry *entry = regcache_find(rc, address + i * 4, 0);
+        if (entry != NULL && entry->policy == REGCACHE_CACHEABLE) {
+            entry->value = readle32(data + i * 4);
+            entry->valid = 1;
+        }
+    }
+    pthread_mutex_unlock(&rc->lock);
+}
+
+// A command and, when answer is set, its answer: queued behind the sync
+// traffic once the scheduler runs, straight on the transport before.
+static int regcache_exchange(struct regcache *rc, unsigned char *command, int length, unsigned char *answer, int answersize, int *answered) {
+    int transferred = 0;
+
+    if (rc->scheduler != NULL)
+        return scheduler_exchange(rc->scheduler, rc->transport, SCHEDULER_COMMAND, command, length, answer, answersize, answered);
+
+    int err = transport_bulk_transfer(rc->transport, CAMERA_ENDPOINT_ADDRESS_CONTROL, command, length, &transferred, TIMEOUT);
+    if (err == 0 && transferred != length) {
+        fprintf(stderr, "Short command to register 0x%.4x: %i of %i bytes!\n", readle32(command + 4), transferred, length);
+        err = LIBUSB_ERROR_IO;
+    }
+    if (err == 0 && answer != NULL)
+        err = transport_bulk_transfer(rc->transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, answer, answersize, answered, TIMEOUT);
+    return err;
+}
+
+int read_reg(struct regcache *rc, uint32_t address, uint32_t *value) {
+    unsigned char command[8] = { 0x01, 0x00, 0x01, 0x00 };
+    unsigned char response[USB_BULK_MAX_PACKET_SIZE];
+    int transferred = 0;
+
+    if (regcache_lookup(rc, address, value) == 0)
+        return 0;
+
+    writele32(command + 4, address);
+    int err = regcache_exchange(rc, command, sizeof (command), response, sizeof (response), &transferred);
+    if (err != 0)
+        return err;
+    if (transferred < 4) {
+        fprintf(stderr, "Short answer reading register 0x%.4x: %i bytes!\n", address, transferred);
+        return LIBUSB_ERROR_IO;
+    }
+
+    regcache_update(rc, address, 1, response);
+    *value = readle32(response);
+    return 0;
+}
+
+int write_reg(struct regcache *rc, uint32_t address, uint32_t value) {
+    struct regwrite write = { address, value };
+    return write_regs(rc, &write, 1);
+}
+
+int write_regs(struct regcache *rc, const struct regwrite *writes, size_t count) {
+    unsigned char command[8 + REGCACHE_MAX_BATCH * 4];
+
+    size_t i = 0;
+    while (i < count) {
+        // Longest run of consecutive words starting at writes[i]
+        size_t run = 1;
+        while (i + run < count && run < REGCACHE_MAX_BATCH && writes[i + run].address == writes[i].address + run * 4)
+            run++;
+
+        command[0] = 0x01;
+        command[1] = 0x01;
+        command[2] = run & 0xff;
+        command[3] = (run >> 8) & 0xff;
+        writele32(command + 4, writes[i].address);
+        for (size_t j = 0; j < run; j++)
+            writele32(command + 8 + j * 4, writes[i + j].value);
+
+        int err = regcache_exchange(rc, command, 8 + run * 4, NULL, 0, NULL);
+        if (err != 0)
+            return err;
+
+        regcache_update(rc, writes[i].address, run, command + 8);
+        pthread_mutex_lock(&rc->lock);
+        rc->stats.writes += run;
+        rc->stats.commands++;
+        pthread_mutex_unlock(&rc->lock);
+        i += run;
+    }
+    return 0;
+}
+
+void regcache_report(struct regcache *rc, FILE *out) {
+    struct regcache_stats *s = &rc->stats;
+    uint64_t cacheable = s->hits + s->misses;
+
+    fprintf(out, "Register cache: %llu reads answered locally, %llu misses (%.1f%% hits), %llu volatile reads, %llu registers written in %llu commands\n",
+            (unsigned long long) s->hits, (unsigned long long) s->misses, cacheable > 0 ? 100.0 * s->hits / cacheable : 0.0,
+            (unsigned long long) s->volatilereads, (unsigned long long) s->writes, (unsigned long long) s->commands);
+}
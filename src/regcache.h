@@ -0,0 +1,87 @@
+#ifndef REGCACHE_H
+#define REGCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "scheduler.h"
+#include "transport.h"
+
+// Register access on EP. 04, answers on EP. 83:
+//   read     01 00 <count16> <addr32>                   answered with count words
+//   write    01 01 <count16> <addr32> <value32>...     no answer
+// Everything little endian.
+//
+// A shadow copy of the registers marked cacheable saves the round trip of
+// reading them again: the device never changes them on its own, so the last
+// value read or written is still the one it holds. Caching is opt-in per
+// register with regcache_setpolicy(); all others are volatile and always
+// read from the device.
+//
+// Once the devices stream, reads and writes wait for their turn in the
+// command scheduler, and may come from the control thread as well as the
+// main one: the shadow copy has a lock of its own.
+
+#define REGCACHE_SLOTS			256		// power of two
+#define REGCACHE_MAX_BATCH		64		// words in one write command
+
+enum regcache_policy {
+    REGCACHE_VOLATILE,		// status and handshakes, always read from the device
+    REGCACHE_CACHEABLE,
+};
+
+struct regcache_entry {
+    uint32_t address;
+    uint32_t value;
+    uint8_t used;
+    uint8_t policy;
+    uint8_t valid;			// value holds what the device has
+};
+
+struct regcache_stats {
+    uint64_t hits;			// reads answered from the cache
+    uint64_t misses;		// reads of cacheable registers that went to the device
+    uint64_t volatilereads;
+    uint64_t writes;		// registers written
+    uint64_t commands;		// write commands sent, several registers each with write_regs()
+};
+
+struct regcache {
+    struct transport *transport;
+    struct scheduler *scheduler;	// NULL to use the transport directly
+    pthread_mutex_t lock;			// entries and stats
+    struct regcache_entry entries[REGCACHE_SLOTS];
+    struct regcache_stats stats;
+};
+
+struct regwrite {
+    uint32_t address;
+    uint32_t value;
+};
+
+// Starts with the policies of the registers the bring-up is known to use.
+void regcache_init(struct regcache *rc, struct transport *transport);
+void regcache_destroy(struct regcache *rc);
+// Exchanges from now on go through sched, at SCHEDULER_COMMAND priority.
+void regcache_setscheduler(struct regcache *rc, struct scheduler *sched);
+int regcache_setpolicy(struct regcache *rc, uint32_t address, enum regcache_policy policy);
+// Forgets every cached value, after a reset or a firmware upload.
+void regcache_invalidate(struct regcache *rc);
+
+// Cached value of a cacheable register, counted as a hit. Returns -1 when the device has to be asked.
+// This and regcache_update() take the lock, the init executor calls them between its own exchanges.
+int regcache_lookup(struct regcache *rc, uint32_t address, uint32_t *value);
+// Records count consecutive words the device answered or was written, from little endian data.
+void regcache_update(struct regcache *rc, uint32_t address, size_t count, const unsigned char *data);
+
+// Errors are libusb error codes, a read nobody answered is LIBUSB_ERROR_TIMEOUT.
+int read_reg(struct regcache *rc, uint32_t address, uint32_t *value);
+int write_reg(struct regcache *rc, uint32_t address, uint32_t value);
+// Consecutive addresses go out as a single command.
+int write_regs(struct regcache *rc, const struct regwrite *writes, size_t count);
+
+void regcache_report(struct regcache *rc, FILE *out);
+
+#endif
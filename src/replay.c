@@ -0,0 +1,257 @@
+#include "replay.h"
+#include "lgp.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define REPLAY_PIECE	(256 * 1024)
+
+static struct replay_keyframe *replay_keyframeat(struct replay *r, size_t i) {
+    return &r->keyframes[(r->keyhead + i) % REPLAY_KEYFRAMES];
+}
+
+static void replay_dumppath(struct replay *r, unsigned int number, char *path, size_t size) {
+    snprintf(path, size, "%s-replay-%.4u%s", r->stem, number, r->extension);
+}
+
+// Oldest keyframe the dump can start from, with the lock held. Returns -1 when there is none yet.
+static int replay_start(struct replay *r, uint64_t head, uint64_t *start) {
+    uint64_t oldest = head > r->capacity ? head - r->capacity : 0;
+    uint64_t safe = oldest + r->capacity / REPLAY_MARGIN_DIVISOR;
+    uint64_t last = atomic_load_explicit(&r->lasttimestamp, memory_order_relaxed);
+
+    for (size_t i = 0; i < r->keycount; i++) {
+        struct replay_keyframe *k = replay_keyframeat(r, i);
+        if (k->offset >= head)
+            break;
+        if (oldest > 0 && k->offset < safe)
+            continue;
+        if (r->window > 0 && k->timestamp + r->window < last)
+            continue;
+        *start = k->offset;
+        return 0;
+    }
+    return -1;
+}
+
+// Writes [start, end) of the stream from the ring, -1 if the writer got to it first
+static int replay_copy(struct replay *r, struct storage *st, uint64_t start, uint64_t end) {
+    uint64_t position = start;
+
+    while (position < end) {
+        size_t index = position % r->capacity;
+        size_t length = end - position;
+        if (length > REPLAY_PIECE)
+            length = REPLAY_PIECE;
+        if (length > r->capacity - index)
+            length = r->capacity - index;
+
+        if (storage_write(st, r->data + index, length, 0, STORAGE_NOCUT) != 0)
+            return -1;
+        // The storage copied it, it was still ours if no push wrapped over it meanwhile
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&r->claimed, memory_order_relaxed) > position + r->capacity) {
+            fprintf(stderr, "Replay: the ring wrapped over the dump, the disk is too slow for %zu MiB\n", r->capacity >> 20);
+            return -1;
+        }
+        position += length;
+    }
+    return 0;
+}
+
+static void replay_dump(struct replay *r, unsigned int number, uint64_t requestedat) {
+    struct storage st;
+    char path[sizeof (r->stem) + sizeof (r->extension) + 16];
+    uint64_t start = 0;
+    uint64_t end = atomic_load_explicit(&r->head, memory_order_acquire);
+
+    replay_dumppath(r, number, path, sizeof (path));
+    pthread_mutex_lock(&r->lock);
+    int found = replay_start(r, end, &start);
+    pthread_mutex_unlock(&r->lock);
+    if (found != 0) {
+        fprintf(stderr, "Replay: no keyframe in the ring yet, nothing to write to %s\n", path);
+        r->stats.failed++;
+        return;
+    }
+
+    struct storage_config config = r->storage;
+    config.preallocate = end - start;
+    config.segmentbytes = 0;
+    config.segmentduration = 0;
+    if (storage_open(&st, path, &config) != 0) {
+        r->stats.failed++;
+        return;
+    }
+    int err = replay_copy(r, &st, start, end);
+    if (storage_close(&st) != 0)
+        err = -1;
+    if (err != 0) {
+        unlink(path);
+        r->stats.failed++;
+        return;
+    }
+
+    r->stats.dumps++;
+    r->stats.dumpedbytes += end - start;
+    r->stats.lastduration = lgp_now_ns() - requestedat;
+    fprintf(stderr, "Replay: %s, %llu bytes in %.1f ms\n", path, (unsigned long long) (end - start), r->stats.lastduration / 1e6);
+}
+
+static void *replay_thread(void *arg) {
+    struct replay *r = (struct replay*) arg;
+
+    pthread_mutex_lock(&r->lock);
+    for (;;) {
+        while (r->running && r->done == r->requested)
+            pthread_cond_wait(&r->wakeup, &r->lock);
+        if (r->done == r->requested)
+            break;
+        unsigned int number = ++r->done;
+        uint64_t requestedat = r->requestedat[number % REPLAY_PENDING];
+        pthread_mutex_unlock(&r->lock);
+        replay_dump(r, number, requestedat);
+        pthread_mutex_lock(&r->lock);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return NULL;
+}
+
+int replay_init(struct replay *r, const char *path, size_t capacity, uint64_t window, const struct storage_config *storage) {
+    memset(r, 0, sizeof (struct replay));
+    r->capacity = capacity > 0 ? capacity : REPLAY_DEFAULT_BYTES;
+    r->window = window;
+    r->storage = *storage;
+
+    const char *extension = strrchr(path, '.');
+    int stem = extension != NULL ? (int) (extension - path) : (int) strlen(path);
+    snprintf(r->stem, sizeof (r->stem), "%.*s", stem, path);
+    snprintf(r->extension, sizeof (r->extension), "%s", extension != NULL ? extension : "");
+
+    r->data = (unsigned char*) malloc(r->capacity);
+    if (r->data == NULL) {
+        fprintf(stderr, "Failed to allocate the %zu MiB replay ring!\n", r->capacity >> 20);
+        return -1;
+    }
+    // Touched now, the writer thread never faults on it
+    memset(r->data, 0, r->capacity);
+
+    pthread_mutex_init(&r->lock, NULL);
+    pthread_cond_init(&r->wakeup, NULL);
+    r->running = 1;
+    if (pthread_create(&r->thread, NULL, replay_thread, r) != 0) {
+        fprintf(stderr, "Failed to start the replay thread!\n");
+        r->running = 0;
+        pthread_cond_destroy(&r->wakeup);
+        pthread_mutex_destroy(&r->lock);
+        free(r->data);
+        r->data = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+void replay_stop(struct replay *r) {
+    if (r->data == NULL || !r->running)
+        return;
+    pthread_mutex_lock(&r->lock);
+    r->running = 0;
+    pthread_cond_signal(&r->wakeup);
+    pthread_mutex_unlock(&r->lock);
+    pthread_join(r->thread, NULL);
+}
+
+void replay_free(struct replay *r) {
+    if (r->data == NULL)
+        return;
+    replay_stop(r);
+
+    pthread_cond_destroy(&r->wakeup);
+    pthread_mutex_destroy(&r->lock);
+    free(r->data);
+    r->data = NULL;
+}
+
+void replay_push(struct replay *r, const unsigned char *data, size_t length, uint64_t timestamp) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+
+    // Only the end of something larger than the ring would survive anyway
+    if (length > r->capacity) {
+        data += length - r->capacity;
+        head += length - r->capacity;
+        length = r->capacity;
+    }
+    atomic_store_explicit(&r->claimed, head + length, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    size_t index = head % r->capacity;
+    size_t first = length < r->capacity - index ? length : r->capacity - index;
+    memcpy(r->data + index, data, first);
+    memcpy(r->data, data + first, length - first);
+    atomic_store_explicit(&r->head, head + length, memory_order_release);
+    atomic_store_explicit(&r->lasttimestamp, timestamp, memory_order_relaxed);
+
+    // Keyframes overwritten are forgotten, only this thread changes them so the peek needs no lock
+    if (r->keycount > 0 && head + length > r->capacity && replay_keyframeat(r, 0)->offset < head + length - r->capacity) {
+        pthread_mutex_lock(&r->lock);
+        while (r->keycount > 0 && replay_keyframeat(r, 0)->offset < head + length - r->capacity) {
+            r->keyhead = (r->keyhead + 1) % REPLAY_KEYFRAMES;
+            r->keycount--;
+        }
+        pthread_mutex_unlock(&r->lock);
+    }
+}
+
+void replay_keyframe(struct replay *r, uint64_t offset, uint64_t timestamp) {
+    pthread_mutex_lock(&r->lock);
+    if (r->keycount == REPLAY_KEYFRAMES) {
+        r->keyhead = (r->keyhead + 1) % REPLAY_KEYFRAMES;
+        r->keycount--;
+    }
+    struct replay_keyframe *k = replay_keyframeat(r, r->keycount);
+    k->offset = offset;
+    k->timestamp = timestamp;
+    r->keycount++;
+    pthread_mutex_unlock(&r->lock);
+}
+
+int replay_requestdump(struct replay *r, char *path, size_t size) {
+    int err = 0;
+
+    pthread_mutex_lock(&r->lock);
+    // Only so many are remembered, a burst of requests beyond that gets the ones already queued
+    if (r->requested - r->done >= REPLAY_PENDING || !r->running) {
+        err = -1;
+    } else {
+        r->requested++;
+        r->requestedat[r->requested % REPLAY_PENDING] = lgp_now_ns();
+        if (path != NULL)
+            replay_dumppath(r, r->requested, path, size);
+        pthread_cond_signal(&r->wakeup);
+    }
+    pthread_mutex_unlock(&r->lock);
+    return err;
+}
+
+void replay_report(struct replay *r, FILE *out) {
+    uint64_t head = atomic_load_explicit(&r->head, memory_order_acquire);
+    uint64_t last = atomic_load_explicit(&r->lasttimestamp, memory_order_relaxed);
+    uint64_t start = 0;
+    double held = 0;
+
+    pthread_mutex_lock(&r->lock);
+    size_t keyframes = r->keycount;
+    if (replay_start(r, head, &start) == 0) {
+        for (size_t i = 0; i < r->keycount; i++) {
+            if (replay_keyframeat(r, i)->offset == start) {
+                held = (last - replay_keyframeat(r, i)->timestamp) / 1e9;
+                break;
+            }
+        }
+    }
+    pthread_mutex_unlock(&r->lock);
+
+    fprintf(out, "Replay: %zu MiB ring, %.1f s from %zu keyframes ready to dump, %llu dumps (%llu MiB, last %.1f ms), %llu failed\n",
+            r->capacity >> 20, held, keyframes, (unsigned long long) r->stats.dumps, (unsigned long long) (r->stats.dumpedbytes >> 20),
+            r->stats.lastduration / 1e6, (unsigned long long) r->stats.failed);
+}
@@ -0,0 +1,80 @@
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "storage.h"
+
+// Instant replay: the stream is only kept in a ring allocated once, the
+// last stretch of it is written out on request. Dumps start at an SPS so
+// they always decode, and are written by a thread of their own while the
+// writer thread keeps filling the ring; a dump the ring laps before it is
+// written out is abandoned rather than written with newer data in it.
+
+#define REPLAY_DEFAULT_BYTES	(64 * 1024 * 1024)
+#define REPLAY_KEYFRAMES		1024
+// Keyframes this close to being overwritten are not dumped from, the dump would lose the race
+#define REPLAY_MARGIN_DIVISOR	8
+// Dumps queued at once, more requests than that are turned down
+#define REPLAY_PENDING			8
+
+struct replay_keyframe {
+    uint64_t offset;		// stream offset of the 00 00 01 of its SPS
+    uint64_t timestamp;		// ns, host time of the transfer it came in
+};
+
+struct replay_stats {
+    uint64_t dumps;
+    uint64_t dumpedbytes;
+    uint64_t failed;		// lapped by the ring or write errors
+    uint64_t lastduration;	// ns, from the request to the file closed
+};
+
+struct replay {
+    unsigned char *data;
+    size_t capacity;
+    uint64_t window;		// ns, 0 for whatever the ring holds
+    struct storage_config storage;
+    char stem[128];			// capture-0 of capture-0.h264, dumps are capture-0-replay-0001.h264
+    char extension[16];
+
+    atomic_uint_least64_t head;			// stream bytes pushed since the start
+    atomic_uint_least64_t claimed;		// head once the push being copied is done
+    atomic_uint_least64_t lasttimestamp;
+
+    // Written by the writer thread, read by the dump thread, both under lock
+    pthread_mutex_t lock;
+    pthread_cond_t wakeup;
+    struct replay_keyframe keyframes[REPLAY_KEYFRAMES];
+    size_t keyhead;
+    size_t keycount;
+
+    pthread_t thread;
+    int running;
+    unsigned int requested;
+    unsigned int done;
+    uint64_t requestedat[REPLAY_PENDING];	// ns, of the dumps not done yet
+
+    struct replay_stats stats;
+};
+
+// Allocates and touches the whole ring, nothing is allocated afterwards.
+int replay_init(struct replay *r, const char *path, size_t capacity, uint64_t window, const struct storage_config *storage);
+// Waits for the dumps already requested, later requests are refused.
+void replay_stop(struct replay *r);
+// Stops as replay_stop() does if it was not, then frees the ring.
+void replay_free(struct replay *r);
+
+// From the writer thread, stream data then the SPS found in it.
+void replay_push(struct replay *r, const unsigned char *data, size_t length, uint64_t timestamp);
+void replay_keyframe(struct replay *r, uint64_t offset, uint64_t timestamp);
+
+// Queues a dump of the window as it is now, path gets the file it goes to. Not from a signal handler.
+int replay_requestdump(struct replay *r, char *path, size_t size);
+
+void replay_report(struct replay *r, FILE *out);
+
+#endif
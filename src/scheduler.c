@@ -0,0 +1,265 @@
+#include "scheduler.h"
+#include "lgp.h"
+
+#include <string.h>
+
+static const char *scheduler_names[SCHEDULER_PRIORITIES] = { "sync", "command", "housekeeping" };
+
+// A command and its answer with the wire held. queuedat is when the exchange
+// was asked for, 0 when it is part of a task and does not wait on its own.
+static int scheduler_run(struct scheduler *sched, struct transport *transport, enum scheduler_priority priority,
+        const unsigned char *command, int length, unsigned char *answer, int answersize, int *answered, uint64_t queuedat) {
+    struct scheduler_stats *stats = &sched->stats[priority];
+    unsigned int timeout = priority == SCHEDULER_HOUSEKEEPING ? SCHEDULER_HOUSEKEEPING_TIMEOUT : TIMEOUT;
+    int transferred = 0;
+    int received = 0;
+
+    pthread_mutex_lock(&sched->wire);
+    uint64_t start = lgp_now_ns();
+    if (transport->lateanswer) {
+        // Housekeeping stopped waiting for its answer; if it came meanwhile it is not this command's
+        unsigned char late[USB_BULK_MAX_PACKET_SIZE];
+        int dropped = 0;
+        transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, late, sizeof (late), &dropped, SCHEDULER_HOUSEKEEPING_TIMEOUT);
+        transport->lateanswer = 0;
+    }
+    int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_CONTROL, (unsigned char*) command, length, &transferred, timeout);
+    if (err == 0 && transferred != length) {
+        fprintf(stderr, "Short command on EP. 04: %i of %i bytes!\n", transferred, length);
+        err = LIBUSB_ERROR_IO;
+    }
+    if (err == 0 && answer != NULL) {
+        err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, answer, answersize, &received, timeout);
+        transport->lateanswer = err == LIBUSB_ERROR_TIMEOUT && priority == SCHEDULER_HOUSEKEEPING;
+    }
+
+    stats->exchanges++;
+    if (err != 0)
+        stats->errors++;
+    if (queuedat != 0) {
+        metrics_latency(&stats->wait, start - queuedat);
+        if (sched->metrics != NULL)
+            metrics_record(sched->metrics, METRICS_QUEUE, err == 0 ? METRICS_OK : err == LIBUSB_ERROR_TIMEOUT ? METRICS_TIMEOUT : METRICS_ERROR,
+                    0, start - queuedat);
+    }
+    pthread_mutex_unlock(&sched->wire);
+
+    if (answered != NULL)
+        *answered = received;
+    return err;
+}
+
+// Due task of the priority that waited the longest, NULL if none is due.
+static struct scheduler_periodic *scheduler_due(struct scheduler *sched, enum scheduler_priority priority, uint64_t now, uint64_t *next) {
+    struct scheduler_periodic *due = NULL;
+
+    for (size_t i = 0; i < sched->taskcount; i++) {
+        struct scheduler_periodic *t = &sched->tasks[i];
+        if (t->priority != priority || t->paused)
+            continue;
+        if (t->due > now) {
+            if (t->due < *next)
+                *next = t->due;
+        } else if (due == NULL || t->due < due->due) {
+            due = t;
+        }
+    }
+    return due;
+}
+
+static void *scheduler_thread(void *arg) {
+    struct scheduler *sched = (struct scheduler*) arg;
+
+    pthread_mutex_lock(&sched->lock);
+    while (!sched->stopping) {
+        uint64_t now = lgp_now_ns();
+        uint64_t next = now + SCHEDULER_IDLE * 1000000ULL;
+        struct scheduler_job *job = NULL;
+        struct scheduler_periodic *task = NULL;
+
+        // Most urgent first, jobs of a priority before its tasks
+        for (int p = 0; p < SCHEDULER_PRIORITIES && job == NULL && task == NULL; p++) {
+            job = sched->heads[p];
+            if (job != NULL) {
+                sched->heads[p] = job->next;
+                if (sched->heads[p] == NULL)
+                    sched->tails[p] = NULL;
+            } else {
+                task = scheduler_due(sched, (enum scheduler_priority) p, now, &next);
+            }
+        }
+
+        if (job != NULL) {
+            pthread_mutex_unlock(&sched->lock);
+            job->err = scheduler_run(sched, job->transport, job->priority, job->command, job->length, job->answer, job->answersize,
+                    &job->answered, job->queuedat);
+            pthread_mutex_lock(&sched->lock);
+            job->done = 1;
+            pthread_cond_broadcast(&sched->done);
+        } else if (task != NULL) {
+            struct scheduler_stats *stats = &sched->stats[task->priority];
+            uint64_t due = task->due;
+            // Late runs are not made up for, the next one is a period away
+            task->due = due + task->period > now ? due + task->period : now + task->period;
+            pthread_mutex_unlock(&sched->lock);
+            metrics_latency(&stats->wait, now - due);
+            stats->runs++;
+            task->task(sched, task->userdata);
+            pthread_mutex_lock(&sched->lock);
+        } else {
+            // The condition variable uses CLOCK_MONOTONIC, see scheduler_init()
+            struct timespec ts = { (time_t) (next / 1000000000ULL), (long) (next % 1000000000ULL) };
+            pthread_cond_timedwait(&sched->wake, &sched->lock, &ts);
+        }
+    }
+
+    // Nobody is left to send what is still queued
+    for (int p = 0; p < SCHEDULER_PRIORITIES; p++) {
+        for (struct scheduler_job *job = sched->heads[p]; job != NULL; job = job->next) {
+            job->err = LIBUSB_ERROR_INTERRUPTED;
+            job->done = 1;
+        }
+        sched->heads[p] = NULL;
+        sched->tails[p] = NULL;
+    }
+    pthread_cond_broadcast(&sched->done);
+    pthread_mutex_unlock(&sched->lock);
+    return NULL;
+}
+
+void scheduler_init(struct scheduler *sched, struct metrics *metrics) {
+    pthread_condattr_t attr;
+
+    memset(sched, 0, sizeof (struct scheduler));
+    sched->metrics = metrics;
+    pthread_mutex_init(&sched->lock, NULL);
+    pthread_mutex_init(&sched->wire, NULL);
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_cond_init(&sched->wake, &attr);
+    pthread_condattr_destroy(&attr);
+    pthread_cond_init(&sched->done, NULL);
+}
+
+int scheduler_start(struct scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    sched->stopping = 0;
+    sched->started = pthread_create(&sched->thread, NULL, scheduler_thread, sched) == 0;
+    pthread_mutex_unlock(&sched->lock);
+    if (!sched->started) {
+        fprintf(stderr, "Failed to start the command scheduler!\n");
+        return -1;
+    }
+    return 0;
+}
+
+void scheduler_stop(struct scheduler *sched) {
+    pthread_mutex_lock(&sched->lock);
+    if (!sched->started) {
+        pthread_mutex_unlock(&sched->lock);
+        return;
+    }
+    sched->stopping = 1;
+    pthread_cond_signal(&sched->wake);
+    pthread_mutex_unlock(&sched->lock);
+
+    pthread_join(sched->thread, NULL);
+    pthread_mutex_lock(&sched->lock);
+    sched->started = 0;
+    sched->stopping = 0;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+void scheduler_destroy(struct scheduler *sched) {
+    scheduler_stop(sched);
+    pthread_cond_destroy(&sched->done);
+    pthread_cond_destroy(&sched->wake);
+    pthread_mutex_destroy(&sched->wire);
+    pthread_mutex_destroy(&sched->lock);
+}
+
+int scheduler_exchange(struct scheduler *sched, struct transport *transport, enum scheduler_priority priority,
+        const unsigned char *command, int length, unsigned char *answer, int answersize, int *answered) {
+    struct scheduler_job job;
+
+    pthread_mutex_lock(&sched->lock);
+    if (!sched->started || sched->stopping || pthread_equal(pthread_self(), sched->thread)) {
+        // Tasks send theirs in place, they already had their turn
+        int own = sched->started && pthread_equal(pthread_self(), sched->thread);
+        pthread_mutex_unlock(&sched->lock);
+        return scheduler_run(sched, transport, priority, command, length, answer, answersize, answered, own ? 0 : lgp_now_ns());
+    }
+
+    memset(&job, 0, sizeof (job));
+    job.transport = transport;
+    job.priority = priority;
+    job.command = command;
+    job.length = length;
+    job.answer = answer;
+    job.answersize = answersize;
+    job.queuedat = lgp_now_ns();
+    if (sched->tails[priority] != NULL)
+        sched->tails[priority]->next = &job;
+    else
+        sched->heads[priority] = &job;
+    sched->tails[priority] = &job;
+    pthread_cond_signal(&sched->wake);
+
+    while (!job.done)
+        pthread_cond_wait(&sched->done, &sched->lock);
+    pthread_mutex_unlock(&sched->lock);
+
+    if (answered != NULL)
+        *answered = job.answered;
+    return job.err;
+}
+
+int scheduler_every(struct scheduler *sched, const char *name, enum scheduler_priority priority, unsigned int period,
+        scheduler_task task, void *userdata) {
+    int index = -1;
+
+    pthread_mutex_lock(&sched->lock);
+    if (sched->taskcount < SCHEDULER_MAX_TASKS && period > 0) {
+        struct scheduler_periodic *t = &sched->tasks[sched->taskcount];
+        t->name = name;
+        t->priority = priority;
+        t->period = period * 1000000ULL;
+        t->due = lgp_now_ns() + t->period;
+        t->task = task;
+        t->userdata = userdata;
+        t->paused = 0;
+        index = (int) sched->taskcount++;
+        pthread_cond_signal(&sched->wake);
+    }
+    pthread_mutex_unlock(&sched->lock);
+    if (index < 0 && period > 0)
+        fprintf(stderr, "No room left for the %s task in the command scheduler!\n", name);
+    return index;
+}
+
+void scheduler_pause(struct scheduler *sched, int task, int paused) {
+    if (task < 0)
+        return;
+    pthread_mutex_lock(&sched->lock);
+    struct scheduler_periodic *t = &sched->tasks[task];
+    if (t->paused && !paused)
+        t->due = lgp_now_ns() + t->period;
+    t->paused = paused;
+    pthread_mutex_unlock(&sched->lock);
+}
+
+const char *scheduler_priorityname(enum scheduler_priority priority) {
+    return priority < SCHEDULER_PRIORITIES ? scheduler_names[priority] : "?";
+}
+
+void scheduler_report(struct scheduler *sched, FILE *out) {
+    fprintf(out, "Scheduler:");
+    for (int p = 0; p < SCHEDULER_PRIORITIES; p++) {
+        struct scheduler_stats *stats = &sched->stats[p];
+        struct metrics_histogram *wait = &stats->wait;
+        fprintf(out, "%s %s %llu exchanges (%llu errors, %llu task runs), queued p50 %.2f p99 %.2f max %.2f ms", p > 0 ? ";" : "",
+                scheduler_names[p], (unsigned long long) stats->exchanges, (unsigned long long) stats->errors, (unsigned long long) stats->runs,
+                metrics_quantile(wait, 0.5) / 1e6, metrics_quantile(wait, 0.99) / 1e6, atomic_load_explicit(&wait->max, memory_order_relaxed) / 1e6);
+    }
+    fprintf(out, "\n");
+}
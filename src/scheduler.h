@@ -0,0 +1,115 @@
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+#include "transport.h"
+
+// Commands on EP. 04 and their answers on EP. 83 once the devices stream.
+// The capture loop keeps EP. 81 busy on the event thread; this thread owns
+// the command endpoints of every device, so nothing has to stop streaming
+// for a command to go out. Exchanges wait in a queue per priority: keyframe
+// sync before the commands asked for on the control socket, both before the
+// housekeeping (LED, status polls). A command and its answer go out back to
+// back, no other exchange of the device in between, so answers never end up
+// with the wrong caller.
+//
+// There is one thread for every device, so an exchange that stalls holds up
+// the others: housekeeping gives up after SCHEDULER_HOUSEKEEPING_TIMEOUT, not
+// the TIMEOUT of the rest, and one unanswered LED command or status poll
+// delays the keyframe sync of another device by that much at most.
+//
+// Until the scheduler is started, and once stopped, exchanges run on the
+// thread asking for them, as during the bring-up.
+
+#define SCHEDULER_MAX_TASKS		(3 * 16)	// sync, LED and status poll of every device
+#define SCHEDULER_IDLE			100			// ms the thread sleeps at most with nothing due
+#define SCHEDULER_HOUSEKEEPING_TIMEOUT	50	// ms for each transfer of an LED command or status poll
+
+enum scheduler_priority {
+    SCHEDULER_SYNC,			// keyframe sync, bound by the stream
+    SCHEDULER_COMMAND,		// register access, encoder switches
+    SCHEDULER_HOUSEKEEPING,	// LED, status polls
+    SCHEDULER_PRIORITIES
+};
+
+struct scheduler;
+
+// Runs on the scheduler thread when due, its exchanges go out right away.
+typedef void (*scheduler_task)(struct scheduler *sched, void *userdata);
+
+// An exchange asked for by another thread, on the stack of the caller waiting for it
+struct scheduler_job {
+    struct transport *transport;
+    enum scheduler_priority priority;
+    const unsigned char *command;
+    int length;
+    unsigned char *answer;		// NULL for a command without answer
+    int answersize;
+    int answered;
+    int err;
+    int done;
+    uint64_t queuedat;			// ns
+    struct scheduler_job *next;
+};
+
+struct scheduler_periodic {
+    const char *name;
+    enum scheduler_priority priority;
+    uint64_t period;			// ns
+    uint64_t due;				// ns
+    scheduler_task task;
+    void *userdata;
+    int paused;
+};
+
+struct scheduler_stats {
+    uint64_t exchanges;
+    uint64_t errors;
+    uint64_t runs;				// periodic tasks run
+    struct metrics_histogram wait;	// ns from queued, or due, to on the wire
+};
+
+struct scheduler {
+    pthread_t thread;
+    pthread_mutex_t lock;		// queues, tasks and the started state
+    pthread_cond_t wake;
+    pthread_cond_t done;		// a job came back
+    pthread_mutex_t wire;		// held for a command and its answer
+    int started;
+    int stopping;
+
+    struct scheduler_job *heads[SCHEDULER_PRIORITIES];
+    struct scheduler_job *tails[SCHEDULER_PRIORITIES];
+    struct scheduler_periodic tasks[SCHEDULER_MAX_TASKS];
+    size_t taskcount;
+
+    struct scheduler_stats stats[SCHEDULER_PRIORITIES];
+    struct metrics *metrics;	// NULL unless the queue time is served
+};
+
+void scheduler_init(struct scheduler *sched, struct metrics *metrics);
+int scheduler_start(struct scheduler *sched);
+// Jobs still queued fail with LIBUSB_ERROR_INTERRUPTED, later ones run on their caller's thread.
+void scheduler_stop(struct scheduler *sched);
+void scheduler_destroy(struct scheduler *sched);
+
+// Sends command on EP. 04 of transport and, unless answer is NULL, reads its
+// answer on EP. 83. Waits for its turn. Errors are libusb error codes.
+int scheduler_exchange(struct scheduler *sched, struct transport *transport, enum scheduler_priority priority,
+        const unsigned char *command, int length, unsigned char *answer, int answersize, int *answered);
+
+// task every period ms, the first time one period from now. Returns its index, -1 when full.
+int scheduler_every(struct scheduler *sched, const char *name, enum scheduler_priority priority, unsigned int period,
+        scheduler_task task, void *userdata);
+// A paused task is skipped until resumed, from one period after that.
+void scheduler_pause(struct scheduler *sched, int task, int paused);
+
+const char *scheduler_priorityname(enum scheduler_priority priority);
+void scheduler_report(struct scheduler *sched, FILE *out);
+
+#endif
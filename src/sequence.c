@@ -0,0 +1,357 @@
+#include "sequence.h"
+
+#include <ctype.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+struct growbuffer {
+    unsigned char *data;
+    size_t size;
+    size_t capacity;
+};
+
+static int grow(struct growbuffer *b, size_t extra) {
+    if (b->size + extra <= b->capacity)
+        return 0;
+    size_t capacity = b->capacity ? b->capacity : 4096;
+    while (capacity < b->size + extra)
+        capacity *= 2;
+    unsigned char *data = (unsigned char*) realloc(b->data, capacity);
+    if (data == NULL)
+        return -1;
+    b->data = data;
+    b->capacity = capacity;
+    return 0;
+}
+
+static int hexdigit(int c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
+// Reads the next hex token of the line, one or two hex digits. Returns -1 at the
+// end of the line and -2 for anything else than such a token.
+static long nexttoken(const char **cursor, const char *end) {
+    const char *p = *cursor;
+    while (p < end && (*p == ' ' || *p == '\t' || *p == '\r'))
+        p++;
+    *cursor = p;
+    if (p == end || *p == '\n' || *p == '#')
+        return -1;
+
+    long value = 0;
+    int digits = 0;
+    int digit;
+    while (p < end && (digit = hexdigit(*p)) >= 0) {
+        value = value * 16 + digit;
+        digits++;
+        p++;
+    }
+    if (digits == 0 || digits > 2 || (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n' && *p != '#'))
+        return -2;
+    *cursor = p;
+    return value;
+}
+
+static int validate(const struct sequence *seq, size_t size) {
+    if (size < sizeof (struct sequence_header))
+        return -1;
+    if (memcmp(seq->header->magic, SEQUENCE_MAGIC, 8) != 0 || seq->header->version != SEQUENCE_VERSION)
+        return -1;
+
+    size_t tablesize = (size_t) seq->header->count * sizeof (struct sequence_entry);
+    if (sizeof (struct sequence_header) + tablesize + seq->header->arenasize > size)
+        return -1;
+
+    for (size_t i = 0; i < seq->header->count; i++) {
+        if ((size_t) seq->entries[i].offset + seq->entries[i].size > seq->header->arenasize)
+            return -1;
+    }
+    return 0;
+}
+
+static int sequence_attach(struct sequence *seq, void *data, size_t size) {
+    seq->data = data;
+    seq->datasize = size;
+    seq->header = (const struct sequence_header*) data;
+    seq->entries = (const struct sequence_entry*) ((const unsigned char*) data + sizeof (struct sequence_header));
+    if (validate(seq, size) != 0)
+        return -1;
+    seq->count = seq->header->count;
+    seq->arena = (const unsigned char*) (seq->entries + seq->count);
+    return 0;
+}
+
+int sequence_compile(const char *textpath, unsigned char **image, size_t *imagesize) {
+    struct growbuffer entries = {NULL, 0, 0};
+    struct growbuffer arena = {NULL, 0, 0};
+    struct stat st;
+    char *text = MAP_FAILED;
+    int fd = -1;
+
+    fd = open(textpath, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open sequence file %s!\n", textpath);
+        goto error;
+    }
+    if (st.st_size > 0) {
+        text = (char*) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED)
+            goto error;
+    }
+
+    const char *cursor = text == MAP_FAILED ? NULL : text;
+    const char *end = cursor + st.st_size;
+    size_t line = 0;
+    while (cursor != NULL && cursor < end) {
+        line++;
+        long expectanswer = nexttoken(&cursor, end);
+        if (expectanswer == -2 || expectanswer > 1) {
+            fprintf(stderr, "Sequence %s:%zu: invalid expect answer flag, 0 or 1!\n", textpath, line);
+            goto error;
+        }
+
+        if (expectanswer >= 0) {
+            long endpoint = nexttoken(&cursor, end);
+            if (endpoint < 0) {
+                fprintf(stderr, "Sequence %s:%zu: missing or invalid endpoint!\n", textpath, line);
+                goto error;
+            }
+
+            struct sequence_entry entry;
+            memset(&entry, 0, sizeof (entry));
+            entry.offset = arena.size;
+            entry.endpoint = (uint8_t) endpoint;
+            entry.expectanswer = expectanswer != 0;
+
+            long byte;
+            while ((byte = nexttoken(&cursor, end)) >= 0) {
+                if (grow(&arena, 1) != 0)
+                    goto error;
+                arena.data[arena.size++] = (unsigned char) byte;
+            }
+            if (byte == -2) {
+                fprintf(stderr, "Sequence %s:%zu: invalid byte, one or two hex digits!\n", textpath, line);
+                goto error;
+            }
+            entry.size = arena.size - entry.offset;
+
+            if (grow(&entries, sizeof (entry)) != 0)
+                goto error;
+            memcpy(entries.data + entries.size, &entry, sizeof (entry));
+            entries.size += sizeof (entry);
+        }
+
+        // Next line
+        while (cursor < end && *cursor != '\n')
+            cursor++;
+        cursor++;
+    }
+
+    struct sequence_header header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, SEQUENCE_MAGIC, 8);
+    header.version = SEQUENCE_VERSION;
+    header.count = entries.size / sizeof (struct sequence_entry);
+    header.arenasize = arena.size;
+
+    *imagesize = sizeof (header) + entries.size + arena.size;
+    *image = (unsigned char*) malloc(*imagesize);
+    if (*image == NULL)
+        goto error;
+    memcpy(*image, &header, sizeof (header));
+    if (entries.size > 0)
+        memcpy(*image + sizeof (header), entries.data, entries.size);
+    if (arena.size > 0)
+        memcpy(*image + sizeof (header) + entries.size, arena.data, arena.size);
+
+    free(entries.data);
+    free(arena.data);
+    munmap(text, st.st_size);
+    close(fd);
+    return 0;
+
+error:
+    free(entries.data);
+    free(arena.data);
+    if (text != MAP_FAILED)
+        munmap(text, st.st_size);
+    if (fd >= 0)
+        close(fd);
+    return -1;
+}
+
+int sequence_convert(const char *textpath, const char *binarypath) {
+    unsigned char *image = NULL;
+    size_t imagesize = 0;
+
+    if (sequence_compile(textpath, &image, &imagesize) != 0)
+        return -1;
+
+    FILE *f = fopen(binarypath, "wb");
+    if (f == NULL || fwrite(image, imagesize, 1, f) != 1) {
+        fprintf(stderr, "Failed to write sequence file %s!\n", binarypath);
+        if (f != NULL)
+            fclose(f);
+        free(image);
+        return -1;
+    }
+    fclose(f);
+    free(image);
+    return 0;
+}
+
+int sequence_writeheader(const char *textpath, const char *headerpath, const char *name) {
+    unsigned char *image = NULL;
+    size_t imagesize = 0;
+    struct sequence seq;
+
+    if (sequence_compile(textpath, &image, &imagesize) != 0)
+        return -1;
+    if (sequence_attach(&seq, image, imagesize) != 0) {
+        free(image);
+        return -1;
+    }
+
+    FILE *f = fopen(headerpath, "w");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to write sequence header %s!\n", headerpath);
+        free(image);
+        return -1;
+    }
+
+    fprintf(f, "// Generated by lgp_seqc from %s, do not edit.\n", textpath);
+    char guard[128];
+    size_t length = 0;
+    for (; name[length] != '\0' && length < sizeof (guard) - 1; length++)
+        guard[length] = toupper((unsigned char) name[length]);
+    guard[length] = '\0';
+    fprintf(f, "#ifndef SEQUENCE_%s_H\n#define SEQUENCE_%s_H\n\n", guard, guard);
+    fprintf(f, "#include \"sequence.h\"\n\n");
+    fprintf(f, "// offset in the arena, size, endpoint, expect answer\n");
+    fprintf(f, "static const struct sequence_entry %s_entries[%zu] = {\n", name, seq.count > 0 ? seq.count : 1);
+    for (size_t i = 0; i < seq.count; i++)
+        fprintf(f, "    { %u, %u, 0x%.2x, %u, 0 },\n", seq.entries[i].offset, seq.entries[i].size, seq.entries[i].endpoint, seq.entries[i].expectanswer);
+    fprintf(f, "};\n\n");
+
+    size_t arenasize = seq.header->arenasize;
+    fprintf(f, "static const unsigned char %s_arena[%zu] = {", name, arenasize > 0 ? arenasize : 1);
+    for (size_t i = 0; i < arenasize; i++)
+        fprintf(f, "%s0x%.2x,", i % 16 == 0 ? "\n    " : " ", seq.arena[i]);
+    fprintf(f, "\n};\n\n");
+    fprintf(f, "enum { %s_count = %zu, %s_arenasize = %zu };\n\n#endif\n", name, seq.count, name, arenasize);
+
+    int err = ferror(f) ? -1 : 0;
+    if (fclose(f) != 0 || err != 0) {
+        fprintf(stderr, "Failed to write sequence header %s!\n", headerpath);
+        err = -1;
+    }
+    free(image);
+    return err;
+}
+
+int sequence_embedded(struct sequence *seq, const struct sequence_entry *entries, size_t count, const unsigned char *arena, size_t arenasize) {
+    memset(seq, 0, sizeof (struct sequence));
+    for (size_t i = 0; i < count; i++) {
+        if ((size_t) entries[i].offset + entries[i].size > arenasize)
+            return -1;
+    }
+    seq->entries = entries;
+    seq->count = count;
+    seq->arena = arena;
+    return 0;
+}
+
+int sequence_copy(struct sequence *copy, const struct sequence *seq) {
+    size_t arenasize = 0;
+
+    memset(copy, 0, sizeof (struct sequence));
+    for (size_t i = 0; i < seq->count; i++) {
+        if ((size_t) seq->entries[i].offset + seq->entries[i].size > arenasize)
+            arenasize = (size_t) seq->entries[i].offset + seq->entries[i].size;
+    }
+
+    size_t tablesize = seq->count * sizeof (struct sequence_entry);
+    size_t imagesize = sizeof (struct sequence_header) + tablesize + arenasize;
+    unsigned char *image = (unsigned char*) malloc(imagesize);
+    if (image == NULL)
+        return -1;
+
+    struct sequence_header header;
+    memset(&header, 0, sizeof (header));
+    memcpy(header.magic, SEQUENCE_MAGIC, 8);
+    header.version = SEQUENCE_VERSION;
+    header.count = (uint32_t) seq->count;
+    header.arenasize = (uint32_t) arenasize;
+    memcpy(image, &header, sizeof (header));
+    memcpy(image + sizeof (header), seq->entries, tablesize);
+    memcpy(image + sizeof (header) + tablesize, seq->arena, arenasize);
+    if (sequence_attach(copy, image, imagesize) != 0) {
+        sequence_close(copy);
+        return -1;
+    }
+    return 0;
+}
+
+int sequence_open(struct sequence *seq, const char *path) {
+    struct stat st;
+    char magic[8];
+
+    memset(seq, 0, sizeof (struct sequence));
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        fprintf(stderr, "Failed to open sequence file %s!\n", path);
+        if (fd >= 0)
+            close(fd);
+        return -1;
+    }
+
+    if (st.st_size >= (off_t) sizeof (struct sequence_header) && pread(fd, magic, 8, 0) == 8 && memcmp(magic, SEQUENCE_MAGIC, 8) == 0) {
+        void *data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        close(fd);
+        if (data == MAP_FAILED) {
+            fprintf(stderr, "Failed to map sequence file %s!\n", path);
+            return -1;
+        }
+        seq->mapped = 1;
+        if (sequence_attach(seq, data, st.st_size) != 0) {
+            fprintf(stderr, "Sequence file %s is corrupted!\n", path);
+            sequence_close(seq);
+            return -1;
+        }
+        return 0;
+    }
+    close(fd);
+
+    // Not compiled, fall back to the text format
+    unsigned char *image = NULL;
+    size_t imagesize = 0;
+    if (sequence_compile(path, &image, &imagesize) != 0)
+        return -1;
+    if (sequence_attach(seq, image, imagesize) != 0) {
+        sequence_close(seq);
+        return -1;
+    }
+    return 0;
+}
+
+void sequence_close(struct sequence *seq) {
+    if (seq->data != NULL) {
+        if (seq->mapped)
+            munmap(seq->data, seq->datasize);
+        else
+            free(seq->data);
+    }
+    memset(seq, 0, sizeof (struct sequence));
+}
@@ -0,0 +1,69 @@
+#ifndef SEQUENCE_H
+#define SEQUENCE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Compiled command sequence, loaded with mmap and used in place.
+//
+// Layout, all fields little endian:
+//   header     struct sequence_header
+//   entries    struct sequence_entry[count]
+//   arena      packed command bytes, arenasize bytes
+//
+// The text format it is compiled from has one command per line:
+//   <expect answer> <endpoint> <byte> <byte> ...
+// with the flag 0 or 1, the endpoint and the bytes in hex of one or two digits
+// ("4", "81", "0B"...); any other token fails the line. Anything after
+// a '#' is a comment.
+
+#define SEQUENCE_MAGIC		"LGPSEQ\r\n"
+#define SEQUENCE_VERSION	1
+
+struct sequence_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint32_t arenasize;
+    uint32_t reserved;
+};
+
+struct sequence_entry {
+    uint32_t offset;		// in the arena
+    uint32_t size;			// 0 for a read without command
+    uint8_t endpoint;		// USB endpoint address, 0x04, 0x02, 0x81, 0x83
+    uint8_t expectanswer;
+    uint16_t reserved;
+};
+
+struct sequence {
+    const struct sequence_header *header;
+    const struct sequence_entry *entries;
+    const unsigned char *arena;
+    size_t count;
+
+    void *data;				// NULL for a sequence built into the binary
+    size_t datasize;
+    int mapped;			// data comes from mmap, otherwise from malloc
+};
+
+// Maps a compiled sequence; a text sequence is compiled in memory instead.
+int sequence_open(struct sequence *seq, const char *path);
+// Uses the tables of a header written by sequence_writeheader() in place, nothing is allocated.
+int sequence_embedded(struct sequence *seq, const struct sequence_entry *entries, size_t count, const unsigned char *arena, size_t arenasize);
+// Copy in memory of any sequence, its commands can be changed in place.
+int sequence_copy(struct sequence *copy, const struct sequence *seq);
+void sequence_close(struct sequence *seq);
+
+// Compiles a text sequence into a malloc'd image of the binary format.
+int sequence_compile(const char *textpath, unsigned char **image, size_t *imagesize);
+int sequence_convert(const char *textpath, const char *binarypath);
+// Compiles a text sequence into a C header of static const tables, <name>_entries and
+// <name>_arena, to build it into the binary.
+int sequence_writeheader(const char *textpath, const char *headerpath, const char *name);
+
+static inline const unsigned char *sequence_command(const struct sequence *seq, size_t i) {
+    return seq->arena + seq->entries[i].offset;
+}
+
+#endif
@@ -0,0 +1,932 @@
+#include "session.h"
+#include "firmware.h"
+#include "lgp.h"
+
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+
+// LED blink at the start of the init, I2C write of 0x0b, 0x03 then 0x05 in register 0x2c
+static const unsigned char ledcommands[][10] = {
+    { 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x0b },
+    { 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x03 },
+    { 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x05 },
+};
+
+// Keyframe sync, as the capture of UTL005 does it between reads of EP. 81:
+// the key data of the encoder (7 words from 0x06B0), 0x06C8 cleared, then
+// command 0x09 carrying part of it back. The first one carries 00 80 where
+// the later ones carry the second part of the key data.
+static void session_keyframesync(struct scheduler *sched, void *userdata) {
+    struct session *s = (struct session*) userdata;
+    struct session_periodic *p = &s->periodic;
+    unsigned char request[8] = { 0x01, 0x00, 0x07, 0x00, 0xb0, 0x06, 0x00, 0x00 };
+    unsigned char clear[12] = { 0x01, 0x01, 0x01, 0x00, 0xc8, 0x06, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00 };
+    unsigned char sync[16] = { 0x09, 0x00, 0x08, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x80, 0x00, 0x00 };
+    unsigned char answer[USB_BULK_MAX_PACKET_SIZE];
+    int answered = 0;
+
+    if (s->detached)
+        return;
+    if (scheduler_exchange(sched, &s->transport, SCHEDULER_SYNC, request, sizeof (request), answer, sizeof (answer), &answered) != 0 || answered < 18) {
+        p->syncfailures++;
+        return;
+    }
+    memcpy(sync + 8, answer + 8, 3);
+    if (p->syncs > 0)
+        memcpy(sync + 12, answer + 16, 2);
+    if (scheduler_exchange(sched, &s->transport, SCHEDULER_SYNC, clear, sizeof (clear), NULL, 0, NULL) != 0
+            || scheduler_exchange(sched, &s->transport, SCHEDULER_SYNC, sync, sizeof (sync), answer, sizeof (answer), &answered) != 0) {
+        p->syncfailures++;
+        return;
+    }
+    p->syncs++;
+}
+
+// One LED command per run, the same cycle as at the bring-up
+static void session_blink(struct scheduler *sched, void *userdata) {
+    struct session *s = (struct session*) userdata;
+    unsigned char answer[USB_BULK_MAX_PACKET_SIZE];
+    int answered = 0;
+
+    if (s->detached)
+        return;
+    size_t step = s->periodic.ledstep++ % (sizeof (ledcommands) / sizeof (ledcommands[0]));
+    scheduler_exchange(sched, &s->transport, SCHEDULER_HOUSEKEEPING, ledcommands[step], sizeof (ledcommands[step]), answer, sizeof (answer), &answered);
+}
+
+// The video ready handshake still holds
+static void session_poll(struct scheduler *sched, void *userdata) {
+    struct session *s = (struct session*) userdata;
+    struct session_periodic *p = &s->periodic;
+    unsigned char request[8] = { 0x01, 0x00, 0x01, 0x00, 0x00, 0x08, 0x00, 0x00 };
+    unsigned char answer[USB_BULK_MAX_PACKET_SIZE];
+    int answered = 0;
+
+    if (s->detached)
+        return;
+    p->polls++;
+    if (scheduler_exchange(sched, &s->transport, SCHEDULER_HOUSEKEEPING, request, sizeof (request), answer, sizeof (answer), &answered) != 0 || answered < 4) {
+        p->pollfailures++;
+        return;
+    }
+    p->status = answer[0] | (answer[1] << 8) | (answer[2] << 16) | ((uint32_t) answer[3] << 24);
+    if (p->status != CAMERA_VIDEO_READY_VALUE)
+        p->pollfailures++;
+}
+
+static void session_pauseperiodic(struct session *s, int paused) {
+    if (s->scheduler == NULL)
+        return;
+    scheduler_pause(s->scheduler, s->periodic.synctask, paused);
+    scheduler_pause(s->scheduler, s->periodic.ledtask, paused);
+    scheduler_pause(s->scheduler, s->periodic.polltask, paused);
+}
+
+static void releasebuffer(void *userdata, struct streambuffer *buffer) {
+    struct session *s = (struct session*) userdata;
+
+    // The head of a split buffer is only a view of it, the writer gets the buffer itself back
+    if (buffer != &s->recording.head)
+        writer_release(&s->writer, buffer);
+}
+
+static void indexunit(void *userdata, const struct nalscan_au *au) {
+    struct recording *recording = (struct recording*) userdata;
+    if (recording->indexing)
+        nalindex_add(&recording->index, au);
+}
+
+// A segment or a replay may start with an SPS, the access unit it opens decodes on its own
+static void findkeyframe(void *userdata, uint64_t offset, unsigned char header) {
+    struct recording *recording = (struct recording*) userdata;
+
+    if ((header & 0x1f) != 7)
+        return;
+    if (recording->replaying) {
+        replay_keyframe(&recording->replay, offset - 3, recording->buffertimestamp);
+        return;
+    }
+    // A start code split with the previous buffer is left alone, the next SPS will do
+    if (recording->cut != STORAGE_NOCUT || offset < recording->bufferoffset + 3)
+        return;
+    recording->cut = offset - 3 - recording->bufferoffset;
+}
+
+// Where the next access unit starts in the buffer, with the SEI, AUD, SPS or PPS
+// before its first slice; the first SPS only for a keyframe. STORAGE_NOCUT when
+// there is none, start codes split with the next buffer are not looked for.
+static size_t findboundary(const unsigned char *data, size_t length, int keyframe) {
+    size_t leading = STORAGE_NOCUT;
+
+    for (size_t i = nalscan_find(data, length, 0); i + 4 < length; i = nalscan_find(data, length, i + 3)) {
+        int type = data[i + 3] & 0x1f;
+        if (keyframe) {
+            if (type == 7)
+                return i;
+        } else if (type >= 1 && type <= 5) {
+            // first_mb_in_slice 0, coded as a single 1 bit
+            if (data[i + 4] & 0x80)
+                return leading != STORAGE_NOCUT ? leading : i;
+            leading = STORAGE_NOCUT;
+        } else if (leading == STORAGE_NOCUT && ((type >= 6 && type <= 9) || (type >= 14 && type <= 18))) {
+            leading = i;
+        }
+    }
+    return STORAGE_NOCUT;
+}
+
+// Bare stream and its index, or the replay ring
+static int recording_write(struct recording *recording, const unsigned char *data, size_t length, uint64_t timestamp) {
+    // Scanned on the writer thread so the event thread only ever swaps buffers
+    recording->cut = STORAGE_NOCUT;
+    recording->bufferoffset = recording->scanner.offset;
+    recording->buffertimestamp = timestamp;
+    recording->bytes += length;
+    if (recording->replaying) {
+        // In the ring before its keyframes are, a dump never starts past what it holds
+        replay_push(&recording->replay, data, length, timestamp);
+        nalscan_push(&recording->scanner, data, length, timestamp);
+        return 0;
+    }
+    nalscan_push(&recording->scanner, data, length, timestamp);
+    return storage_write(&recording->storage, data, length, timestamp, recording->cut);
+}
+
+// The buffer from offset from on. The muxer takes it whole, it skips what comes before an IDR anyway.
+static int recording_push(struct recording *recording, struct streambuffer *buffer, size_t from) {
+    if (recording->muxing) {
+        recording->bytes += buffer->length;
+        return mp4mux_push(&recording->mux, buffer) == 0 ? WRITER_SINK_KEPT : -1;
+    }
+    return recording_write(recording, buffer->data + from, buffer->length - from, buffer->timestamp);
+}
+
+// The buffer up to cut, as the last of a recording about to be closed
+static int recording_pushhead(struct recording *recording, struct streambuffer *buffer, size_t cut) {
+    if (cut == 0)
+        return 0;
+    if (!recording->muxing)
+        return recording_write(recording, buffer->data, cut, buffer->timestamp);
+
+    recording->head = *buffer;
+    recording->head.length = cut;
+    recording->bytes += cut;
+    return mp4mux_push(&recording->mux, &recording->head);
+}
+
+// Sinks of one recording to s->output: the replay ring, the bare stream with its index, or MP4.
+static int recording_open(struct session *s) {
+    const struct session_config *config = s->config;
+    struct recording *recording = &s->recording;
+
+    if (config->replaybytes > 0) {
+        check(replay_init(&recording->replay, s->output, config->replaybytes, config->replaywindow, &config->storage) == 0, "Failed to set up the replay ring!");
+        recording->replaying = 1;
+        nalscan_init(&recording->scanner, NULL, recording);
+        nalscan_setnalcallback(&recording->scanner, findkeyframe);
+    } else if (config->rawstream) {
+        check(storage_open(&recording->storage, s->output, &config->storage) == 0, "Failed to open capture file %s, obviously - aborting!", s->output);
+        recording->storing = 1;
+
+        // Access unit index next to it, the recording is still usable without one
+        char indexpath[sizeof (s->output) + 4];
+        snprintf(indexpath, sizeof (indexpath), "%s.idx", s->output);
+        nalscan_init(&recording->scanner, indexunit, recording);
+        nalscan_setnalcallback(&recording->scanner, findkeyframe);
+        recording->indexing = nalindex_open(&recording->index, indexpath) == 0;
+    } else {
+        // Half the backlog at most waits for its fragment, the rest absorbs storage hiccups
+        size_t backlog = s->writer.buffercount - s->writer.depth;
+        check(mp4mux_open(&recording->mux, s->output, backlog > 2 ? backlog / 2 : 1, releasebuffer, s) == 0, "Failed to open capture file %s, obviously - aborting!", s->output);
+        recording->muxing = 1;
+    }
+    recording->bytes = 0;
+    recording->markcount = 0;
+    recording->startedat = lgp_now_ns();
+    recording->active = 1;
+    return 0;
+
+error:
+    return -1;
+}
+
+static void recording_close(struct session *s) {
+    struct recording *recording = &s->recording;
+
+    // The muxer gives its buffers back to the writer, it goes before it
+    if (recording->muxing) {
+        if (mp4mux_close(&recording->mux) != 0)
+            fprintf(stderr, "Error while finishing %s!\n", s->output);
+        mp4mux_report(&recording->mux, stderr);
+        recording->muxing = 0;
+    }
+
+    if (recording->indexing) {
+        nalscan_finish(&recording->scanner);
+        nalscan_report(&recording->scanner, stderr);
+        fprintf(stderr, "Index: %llu access units, %llu IDR\n", (unsigned long long) recording->index.count, (unsigned long long) recording->index.idrs);
+        nalindex_close(&recording->index);
+        recording->indexing = 0;
+    }
+
+    if (recording->storing) {
+        fprintf(stderr, "Closing %s...\n", recording->storage.segmentpath);
+        if (storage_close(&recording->storage) != 0)
+            fprintf(stderr, "Error while finishing %s!\n", recording->storage.segmentpath);
+        storage_report(&recording->storage, stderr);
+        recording->storing = 0;
+    }
+
+    // Dumps already asked for are still written
+    if (recording->replaying) {
+        replay_stop(&recording->replay);
+        replay_report(&recording->replay, stderr);
+        replay_free(&recording->replay);
+        recording->replaying = 0;
+    }
+
+    if (recording->marks != NULL)
+        fclose(recording->marks);
+    recording->marks = NULL;
+    recording->active = 0;
+}
+
+// Seconds into the recording and stream offset, one line per mark in <output>.marks
+static int recording_mark(struct session *s, const char *label) {
+    struct recording *recording = &s->recording;
+
+    if (recording->marks == NULL) {
+        char path[sizeof (s->output) + 8];
+        snprintf(path, sizeof (path), "%s.marks", s->output);
+        recording->marks = fopen(path, "w");
+        if (recording->marks == NULL)
+            return -1;
+    }
+    fprintf(recording->marks, "%.3f %llu %s\n", (lgp_now_ns() - recording->startedat) / 1e9, (unsigned long long) recording->bytes, label);
+    fflush(recording->marks);
+    recording->markcount++;
+    return 0;
+}
+
+static void session_formatname(struct session *s, const char *stem, char *output, size_t size) {
+    if (s->numbered)
+        snprintf(output, size, "%s-%zu.%s", stem, s->index, s->extension);
+    else
+        snprintf(output, size, "%s.%s", stem, s->extension);
+}
+
+static void session_name(struct session *s, const char *stem) {
+    session_formatname(s, stem, s->output, sizeof (s->output));
+}
+
+int session_nametaken(struct session *s, const char *stem) {
+    char output[sizeof (s->output)];
+    char segment[sizeof (s->output) + 8];
+
+    // The first segment too, in case the recording is cut in segments
+    session_formatname(s, stem, output, sizeof (output));
+    const char *extension = strrchr(output, '.');
+    snprintf(segment, sizeof (segment), "%.*s-0000%s", (int) (extension - output), output, extension);
+    return access(output, F_OK) == 0 || access(segment, F_OK) == 0;
+}
+
+// With the request lock held
+static void session_complete(struct session *s, int result, const char *format, ...) {
+    va_list args;
+
+    va_start(args, format);
+    vsnprintf(s->requestreply, sizeof (s->requestreply), format, args);
+    va_end(args);
+    s->requestresult = result;
+    atomic_store_explicit(&s->requested, SESSION_REQUEST_NONE, memory_order_release);
+    pthread_cond_broadcast(&s->requestdone);
+}
+
+// Carries out the request of the control thread once the buffer has the boundary it waits for.
+// Returns what the writer sink does, the buffer goes on to the recording open after the request.
+static int session_apply(struct session *s, struct streambuffer *buffer) {
+    struct recording *recording = &s->recording;
+    int err = 0;
+
+    pthread_mutex_lock(&s->requestlock);
+    int request = atomic_load_explicit(&s->requested, memory_order_acquire);
+    size_t cut = 0;
+
+    if (request == SESSION_REQUEST_NONE) {
+        // Timed out meanwhile
+    } else if (request == SESSION_REQUEST_MARK) {
+        if (!recording->active)
+            session_complete(s, -1, "device %zu: not recording", s->index);
+        else if (recording_mark(s, s->requestname) != 0)
+            session_complete(s, -1, "device %zu: failed to write the marks of %s", s->index, s->output);
+        else
+            session_complete(s, 0, "device %zu: mark %llu at %llu bytes", s->index, (unsigned long long) recording->markcount, (unsigned long long) recording->bytes);
+        request = SESSION_REQUEST_NONE;
+    } else if ((request == SESSION_REQUEST_START) == recording->active) {
+        session_complete(s, -1, "device %zu: %s", s->index, recording->active ? "already recording" : "not recording");
+        request = SESSION_REQUEST_NONE;
+    } else if (request == SESSION_REQUEST_ROTATE && recording->replaying) {
+        session_complete(s, -1, "device %zu: nothing to rotate in replay mode", s->index);
+        request = SESSION_REQUEST_NONE;
+    } else {
+        // The muxer finds its first IDR by itself, a start goes right away
+        if (request == SESSION_REQUEST_START && !s->config->rawstream && s->config->replaybytes == 0)
+            cut = 0;
+        else
+            cut = findboundary(buffer->data, buffer->length, request == SESSION_REQUEST_ROTATE);
+        // Not in this buffer, the request waits for the next one
+        if (cut == STORAGE_NOCUT)
+            request = SESSION_REQUEST_NONE;
+    }
+
+    if (request == SESSION_REQUEST_STOP || request == SESSION_REQUEST_ROTATE) {
+        if (recording_pushhead(recording, buffer, cut) != 0)
+            err = -1;
+        recording_close(s);
+        if (request == SESSION_REQUEST_STOP)
+            session_complete(s, err, "device %zu: stopped %s, %llu bytes", s->index, s->output, (unsigned long long) recording->bytes);
+    }
+    if (request == SESSION_REQUEST_START || request == SESSION_REQUEST_ROTATE) {
+        char previous[sizeof (s->output)];
+        snprintf(previous, sizeof (previous), "%s", s->output);
+        session_name(s, s->requestname);
+        if (recording_open(s) != 0) {
+            session_complete(s, -1, "device %zu: failed to open %s", s->index, s->output);
+        } else {
+            if (request == SESSION_REQUEST_START) {
+                s->startlatency = lgp_now_ns() - s->requestedat;
+                session_complete(s, 0, "device %zu: recording %s, first byte %.1f ms after the request", s->index, s->output, s->startlatency / 1e6);
+            } else {
+                session_complete(s, 0, "device %zu: rotated %s to %s", s->index, previous, s->output);
+            }
+        }
+    }
+    pthread_mutex_unlock(&s->requestlock);
+
+    if (!recording->active)
+        return err;
+    int sunk = recording_push(recording, buffer, cut == STORAGE_NOCUT ? 0 : cut);
+    // Kept by the new muxer whatever became of the old recording
+    return err != 0 && sunk == 0 ? -1 : sunk;
+}
+
+static int writestream(void *userdata, struct streambuffer *buffer) {
+    struct session *s = (struct session*) userdata;
+    struct recording *recording = &s->recording;
+
+    // Copied out first, the muxer may keep the buffer
+    if (recording->publishing)
+        shmring_publish(&recording->ring, buffer);
+    if (recording->segmenting)
+        hls_push(&recording->hls, buffer->data, buffer->length, buffer->timestamp);
+
+    if (atomic_load_explicit(&s->requested, memory_order_acquire) != SESSION_REQUEST_NONE)
+        return session_apply(s, buffer);
+    // Let go until the daemon is asked to start a recording
+    if (!recording->active)
+        return 0;
+    return recording_push(recording, buffer, 0);
+}
+
+// devicekey is NULL when there is no way to tell the device apart, like with the emulator.
+static int load_firmware(struct transport *transport, const char *file, const char *devicekey, int force) {
+    struct firmware_stats stats;
+
+    int err = firmware_load(transport, file, FIRMWARE_DEFAULT_STATEFILE, devicekey, force, &stats);
+    if (err != 0) {
+        fprintf(stderr, "Failed to load firmware %s!\n", file);
+        return -1;
+    }
+    firmware_report(&stats, stderr);
+    return 0;
+}
+
+void session_init(struct session *s, size_t index, size_t count, const struct session_config *config,
+        const struct bringup *started, const char *publishsocket) {
+    memset(s, 0, sizeof (struct session));
+    s->index = index;
+    s->config = config;
+    s->bringup = *started;
+
+    s->extension = config->rawstream || config->replaybytes > 0 ? "h264" : "mp4";
+    s->numbered = count > 1;
+    session_name(s, "capture");
+    s->capturedepth = config->capturedepth;
+    s->transfersize = config->transfersize;
+    if (config->profile != NULL)
+        s->profile = *config->profile;
+    regcache_init(&s->registers, &s->transport);
+    s->periodic.synctask = -1;
+    s->periodic.ledtask = -1;
+    s->periodic.polltask = -1;
+    pthread_mutex_init(&s->requestlock, NULL);
+    pthread_cond_init(&s->requestdone, NULL);
+    pthread_mutex_init(&s->profilelock, NULL);
+
+    if (publishsocket != NULL && count > 1)
+        snprintf(s->publishsocket, sizeof (s->publishsocket), "%s-%zu", publishsocket, index);
+    else if (publishsocket != NULL)
+        snprintf(s->publishsocket, sizeof (s->publishsocket), "%s", publishsocket);
+}
+
+int session_bringup(struct session *s) {
+    struct transport *transport = &s->transport;
+
+    fprintf(stderr, "Device %zu (%s): bring-up, recording to %s\n", s->index, s->key[0] != '\0' ? s->key : transport->name, s->config->daemon ? "files named on request" : s->output);
+    bringup_enter(&s->bringup, BRINGUP_CONFIGURE);
+
+    // 6. Initialization sequence
+
+	fprintf(stderr,"Init procedure started...\n");
+    // Every buffer a transfer of the device may use, command and firmware ones included
+    if (s->config->dmapool && !s->pooling) {
+        size_t blocksize = s->transfersize > VIDEO_TRANSFER_SIZE ? s->transfersize : VIDEO_TRANSFER_SIZE;
+        size_t blocks = s->capturedepth + (s->config->writerbacklog > 0 ? s->config->writerbacklog : WRITER_DEFAULT_BACKLOG) + FIRMWARE_DEPTH + 2;
+        if (blocksize < FIRMWARE_CHUNK_SIZE)
+            blocksize = FIRMWARE_CHUNK_SIZE;
+        if (dmapool_init(&s->pool, s->handle, blocksize, blocks) == 0) {
+            s->pooling = 1;
+            transport->pool = &s->pool;
+        }
+    }
+
+    // Brought up again after the device came back blank
+    if (s->executing)
+        initexec_free(&s->initexecutor);
+    s->executing = 0;
+    check(initexec_init(&s->initexecutor, transport, INITEXEC_MAX_INFLIGHT) == 0, "Failed to set up the init executor!");
+    s->executing = 1;
+    // Nothing the device held before is known any more
+    regcache_invalidate(&s->registers);
+    initexec_setregcache(&s->initexecutor, &s->registers);
+
+	// Make the LED blink
+	fprintf(stderr,"Blinking LED...\n");
+    initexec_begin(&s->initexecutor, "led");
+
+    // Every LED command is acknowledged on EP. 83, no need to wait any longer between them.
+    // A failing device is left out, the others go on: no helper here that ends the process.
+    for (size_t i = 0; i < sizeof (ledcommands) / sizeof (ledcommands[0]); i++) {
+        unsigned char answer[USB_BULK_MAX_PACKET_SIZE];
+        int transferred = 0;
+        int err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_CONTROL, (unsigned char*) ledcommands[i], sizeof (ledcommands[i]), &transferred, TIMEOUT);
+        check(err == 0, "Device %zu: LED command failed: '%s'", s->index, libusb_error_name(err));
+        err = transport_bulk_transfer(transport, CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE, answer, sizeof (answer), &transferred, TIMEOUT);
+        check(err == 0 || err == LIBUSB_ERROR_TIMEOUT, "Device %zu: no status for the LED command: '%s'", s->index, libusb_error_name(err));
+    }
+
+    initexec_end(&s->initexecutor);
+	fprintf(stderr, "End of LED Blinking...\n");
+
+	// Sequence initiating the device -- experimental
+    // Commands without answer are pipelined, status reads are the only sync points
+
+    check(initexec_run(&s->initexecutor, "utl005", s->config->initsequence) == 0, "Init sequence failed!");
+	fprintf(stderr, "End of Device Init - pre-firmware \n");
+
+    // The device is ready for the firmware once it answers register reads again
+    check(bringup_waitresponsive(&s->bringup, transport) == 0, "The device stopped answering after the init sequence!");
+    bringup_enter(&s->bringup, BRINGUP_FIRMWARE);
+
+	// Loading the firmware to the device.
+    initexec_begin(&s->initexecutor, "firmware");
+    // Recorded for this enumeration of the device only, a replugged or power cycled one is blank
+    char instance[128];
+    if (s->key[0] != '\0')
+        hotplug_instance(libusb_get_device(s->handle), s->key, instance, sizeof (instance));
+    check(load_firmware(transport, s->config->firmwarefile, s->key[0] != '\0' ? instance : NULL, s->config->forcefirmware || s->firmwarelost) == 0, "Firmware upload failed!");
+    s->firmwarelost = 0;
+    initexec_end(&s->initexecutor);
+    // The firmware starts over with its own register values
+    regcache_invalidate(&s->registers);
+    initexec_report(&s->initexecutor, stderr);
+    regcache_report(&s->registers, stderr);
+    bringup_enter(&s->bringup, BRINGUP_VIDEOREADY);
+
+    // Handshake: register 0x0800 reads 07 00 01 00 once the video is ready
+    check(bringup_waitvideoready(&s->bringup, transport) == 0, "Video never got ready!");
+
+    // The sequence set up the encoder as configured, not as switched to since
+    if (s->profileswitched && encoder_apply(&s->registers, &s->profile) != 0)
+        fprintf(stderr, "Device %zu: failed to switch the encoder back to %s, streaming as configured\n", s->index, s->profile.name);
+
+    // What the probe expects back after a replug, if the device still has it
+    if (read_reg(&s->registers, CAMERA_REGISTER_ENCODER_BITRATE, &s->bitrate) != 0)
+        s->bitrate = 0;
+    return 0;
+
+error:
+    bringup_enter(&s->bringup, BRINGUP_FAILED);
+    return -1;
+}
+
+int session_start(struct session *s, struct capture_loop *loop, struct scheduler *sched) {
+    const struct session_config *config = s->config;
+    struct recording *recording = &s->recording;
+
+    // Disk writes happen on their own thread, the USB side only swaps buffers
+    check(writer_init(&s->writer, s->capturedepth, config->writerbacklog, s->transfersize, s->pooling ? &s->pool : NULL, writestream, s) == 0, "Failed to set up the writer buffers!");
+    s->writing = 1;
+
+    if (!config->daemon)
+        check(recording_open(s) == 0, "Device %zu has nothing to record to!", s->index);
+    if (config->hls.directory != NULL) {
+        // Named after the output, capture-1.mp4 plays as capture-1.m3u8
+        char stem[sizeof (s->output)];
+        snprintf(stem, sizeof (stem), "%s", s->output);
+        char *extension = strrchr(stem, '.');
+        if (extension != NULL)
+            *extension = '\0';
+        check(hls_open(&recording->hls, &config->hls, stem) == 0, "Failed to set up the HLS segmenter!");
+        recording->segmenting = 1;
+    }
+    if (s->publishsocket[0] != '\0') {
+        check(shmring_create(&recording->ring, SHMRING_DEFAULT_SLOTS, s->transfersize) == 0, "Failed to set up the shared ring!");
+        recording->publishing = 1;
+        check(shmring_serve(&recording->ring, s->publishsocket) == 0, "Failed to serve the shared ring!");
+    }
+    check(writer_start(&s->writer) == 0, "Failed to start the writer!");
+
+    check(capture_init(&s->cap, &s->transport, s->capturedepth, s->transfersize, writer_capturebuffers(&s->writer), writer_push, &s->writer) == 0, "Failed to set up the capture transfers!");
+    s->capturing = 1;
+    check(capture_loop_add(loop, &s->cap) == 0, "Failed to join the event loop!");
+    bringup_enter(&s->bringup, BRINGUP_STREAMING);
+    if (capture_start(&s->cap) != 0) {
+        fprintf(stderr, "ERROR WITH STREAM CAPTURE, ABORT!\n");
+        bringup_enter(&s->bringup, BRINGUP_FAILED);
+        return -1;
+    }
+
+    // EP. 04 and 83 belong to the scheduler from now on
+    s->scheduler = sched;
+    regcache_setscheduler(&s->registers, sched);
+    s->periodic.synctask = scheduler_every(sched, "keyframe sync", SCHEDULER_SYNC, config->syncperiod, session_keyframesync, s);
+    s->periodic.ledtask = scheduler_every(sched, "LED", SCHEDULER_HOUSEKEEPING, config->ledperiod, session_blink, s);
+    s->periodic.polltask = scheduler_every(sched, "status poll", SCHEDULER_HOUSEKEEPING, config->pollperiod, session_poll, s);
+    return 0;
+
+error:
+    bringup_enter(&s->bringup, BRINGUP_FAILED);
+    return -1;
+}
+
+int session_waitfirstframe(struct session *s) {
+    if (s->bringup.state != BRINGUP_STREAMING || !s->cap.running)
+        return 0;
+
+    if (s->cap.stats.first_data != 0) {
+        bringup_firstframe(&s->bringup, s->cap.stats.first_data);
+        bringup_report(&s->bringup, stderr);
+        return 0;
+    }
+    if (lgp_now_ns() - s->bringup.entered > BRINGUP_FIRSTFRAME_DEADLINE * 1000000ULL) {
+        fprintf(stderr, "Device %zu: no data on EP. 81 within %u ms, still waiting...\n", s->index, BRINGUP_FIRSTFRAME_DEADLINE);
+        bringup_report(&s->bringup, stderr);
+        return 0;
+    }
+    return 1;
+}
+
+int session_running(struct session *s) {
+    return s->capturing && (s->cap.running || s->detached);
+}
+
+int session_checkdetached(struct session *s) {
+    if (!s->config->resume || !s->capturing || s->detached || !s->cap.disconnected)
+        return 0;
+
+    // Collects the transfers failing on the dead handle, the buffers stay with the capture
+    capture_stop(&s->cap);
+    // A profile switch under way finishes first, later ones are refused until the device is back
+    pthread_mutex_lock(&s->profilelock);
+    s->detached = 1;
+    s->resuming = 0;
+    pthread_mutex_unlock(&s->profilelock);
+    session_pauseperiodic(s, 1);
+    s->lostat = s->cap.stats.last_data;
+    s->recovery.detaches++;
+    fprintf(stderr, "Device %zu: gone, keeping %s open until it is back\n", s->index, s->output);
+    return 1;
+}
+
+int session_matches(struct session *s, const struct hotplug_event *event) {
+    // Real devices get a new address when plugged again, the port stays
+    if (s->key[0] != '\0')
+        return strcmp(s->key, event->key) == 0;
+    return event->key[0] == '\0' && event->busnum == s->transport.busnum && event->devnum == s->transport.devnum;
+}
+
+// Minimal handshake: the video is still ready and the encoder has the bitrate of the bring-up.
+static int session_probe(struct session *s) {
+    uint32_t ready = 0;
+    uint32_t bitrate = 0;
+
+    // Nothing read before the device went away can be trusted
+    regcache_invalidate(&s->registers);
+    if (read_reg(&s->registers, CAMERA_REGISTER_VIDEO_READY, &ready) != 0 || ready != CAMERA_VIDEO_READY_VALUE)
+        return -1;
+    if (s->bitrate != 0 && (read_reg(&s->registers, CAMERA_REGISTER_ENCODER_BITRATE, &bitrate) != 0 || bitrate != s->bitrate))
+        return -1;
+    return 0;
+}
+
+int session_resume(struct session *s, libusb_device_handle *handle) {
+    struct transport *transport = &s->transport;
+
+    if (!s->detached)
+        return 0;
+
+    if (handle != NULL) {
+        // The transfers go on with the same buffers, copied by the kernel again as they are not the new handle's memory.
+        // Let go of the old usbfs mappings before their handle is closed, as session_close does.
+        if (s->pooling)
+            dmapool_detach(&s->pool);
+        // The old handle died with the device; updated in place, the capture and the executor point at the transport
+        if (s->handle != NULL)
+            libusb_close(s->handle);
+        s->handle = handle;
+        transport->handle = handle;
+        transport->busnum = libusb_get_bus_number(libusb_get_device(handle));
+        transport->devnum = libusb_get_device_address(libusb_get_device(handle));
+        // An answer still owed by the old handle never comes
+        transport->lateanswer = 0;
+    }
+
+    uint64_t start = lgp_now_ns();
+    s->resumedfast = session_probe(s) == 0;
+    if (s->resumedfast) {
+        fprintf(stderr, "Device %zu: back with its configuration, probed in %.1f ms\n", s->index, (lgp_now_ns() - start) / 1e6);
+    } else {
+        fprintf(stderr, "Device %zu: back without its configuration, bringing it up again\n", s->index);
+        s->firmwarelost = 1;
+        check(session_bringup(s) == 0, "Device %zu failed its bring-up, waiting for it to come back again.", s->index);
+        bringup_enter(&s->bringup, BRINGUP_RUNNING);
+    }
+
+    if (capture_resume(&s->cap) != 0) {
+        // Collects what was queued, the session keeps waiting
+        capture_stop(&s->cap);
+        fprintf(stderr, "Failed to queue the capture transfers of device %zu again!\n", s->index);
+        return -1;
+    }
+    pthread_mutex_lock(&s->profilelock);
+    s->detached = 0;
+    s->resuming = 1;
+    pthread_mutex_unlock(&s->profilelock);
+    session_pauseperiodic(s, 0);
+    if (s->resumedfast)
+        s->recovery.fastresumes++;
+    else
+        s->recovery.reinits++;
+    return 0;
+
+error:
+    // Still waiting for the device, a later arrival tries again
+    return -1;
+}
+
+void session_checkresumed(struct session *s) {
+    struct session_recovery *r = &s->recovery;
+
+    if (!s->resuming || s->cap.stats.resumed_data == 0)
+        return;
+    pthread_mutex_lock(&s->profilelock);
+    s->resuming = 0;
+    pthread_mutex_unlock(&s->profilelock);
+
+    uint64_t gap = s->cap.stats.resumed_data - (s->lostat != 0 ? s->lostat : s->cap.stats.resumed);
+    r->gaps++;
+    r->lastgap = gap;
+    r->totalgap += gap;
+    if (gap > r->maxgap)
+        r->maxgap = gap;
+    fprintf(stderr, "Device %zu: streaming again after a %.1f ms gap (%s)\n", s->index, gap / 1e6, s->resumedfast ? "fast resume" : "full bring-up");
+}
+
+static void session_periodicreport(struct session *s, FILE *out) {
+    struct session_periodic *p = &s->periodic;
+
+    if (p->synctask < 0 && p->ledtask < 0 && p->polltask < 0)
+        return;
+    fprintf(out, "Periodic: %llu keyframe syncs (%llu failed), %u LED commands, %llu status polls (%llu failed, last %.8x)\n",
+            (unsigned long long) p->syncs, (unsigned long long) p->syncfailures, p->ledstep,
+            (unsigned long long) p->polls, (unsigned long long) p->pollfailures, p->status);
+}
+
+static void session_recoveryreport(struct session *s, FILE *out) {
+    struct session_recovery *r = &s->recovery;
+
+    fprintf(out, "Recovery: %llu detaches, %llu fast resumes, %llu full bring-ups, gaps last %.1f ms, max %.1f ms, mean %.1f ms%s\n",
+            (unsigned long long) r->detaches, (unsigned long long) r->fastresumes, (unsigned long long) r->reinits,
+            r->lastgap / 1e6, r->maxgap / 1e6, r->gaps > 0 ? r->totalgap / 1e6 / r->gaps : 0.0, s->detached ? ", device gone" : "");
+}
+
+// Stream bitrate since the last report against the one asked of the encoder
+static void session_meter(struct session *s, FILE *out) {
+    uint64_t now = lgp_now_ns();
+    uint64_t bytes = s->cap.stats.bytes;
+    char profile[128];
+
+    pthread_mutex_lock(&s->profilelock);
+    if (s->meterat != 0 && !s->detached && now > s->meterat && bytes >= s->meterbytes) {
+        s->measuredbitrate = (uint32_t) ((bytes - s->meterbytes) * 8000000ULL / (now - s->meterat));
+        encoder_describe(&s->profile, profile, sizeof (profile));
+        fprintf(out, "Encoder: %s, measured %u kbit/s, %.1f%% of the request\n", profile, s->measuredbitrate,
+                s->profile.bitrate > 0 ? 100.0 * s->measuredbitrate / s->profile.bitrate : 0.0);
+    }
+    s->meterbytes = bytes;
+    s->meterat = now;
+    pthread_mutex_unlock(&s->profilelock);
+}
+
+void session_report(struct session *s, FILE *out) {
+    if (s->bringup.state == BRINGUP_STREAMING && s->cap.stats.first_data != 0) {
+        bringup_firstframe(&s->bringup, s->cap.stats.first_data);
+        bringup_report(&s->bringup, out);
+    }
+    if (s->capturing) {
+        capture_report(&s->cap, out);
+        session_meter(s, out);
+        session_periodicreport(s, out);
+    }
+    if (s->writing)
+        writer_report(&s->writer, out);
+    if (s->pooling)
+        dmapool_report(&s->pool, out);
+    if (s->recording.publishing)
+        shmring_report(&s->recording.ring, out);
+    if (s->recording.segmenting)
+        hls_report(&s->recording.hls, out);
+    if (s->recording.storing)
+        storage_report(&s->recording.storage, out);
+    if (s->recording.replaying)
+        replay_report(&s->recording.replay, out);
+    if (s->recovery.detaches > 0)
+        session_recoveryreport(s, out);
+}
+
+void session_stop(struct session *s) {
+    struct recording *recording = &s->recording;
+
+    // Nothing more to send to a device that stops
+    session_pauseperiodic(s, 1);
+    if (s->capturing) {
+        // A detached capture was stopped when its device went away
+        if (!s->detached)
+            capture_stop(&s->cap);
+        if (s->cap.failed && !s->detached)
+            fprintf(stderr, "ERROR WITH STREAM CAPTURE, ABORT!\n");
+        capture_report(&s->cap, stderr);
+    }
+    if (s->recovery.detaches > 0)
+        session_recoveryreport(s, stderr);
+
+    if (s->writing)
+        writer_stop(&s->writer);
+
+    if (recording->active)
+        recording_close(s);
+
+    if (recording->segmenting) {
+        if (hls_close(&recording->hls) != 0)
+            fprintf(stderr, "Error while finishing the HLS playlist!\n");
+        hls_report(&recording->hls, stderr);
+        recording->segmenting = 0;
+    }
+
+    if (recording->publishing) {
+        shmring_report(&recording->ring, stderr);
+        shmring_destroy(&recording->ring);
+        recording->publishing = 0;
+    }
+
+    if (s->writing)
+        writer_report(&s->writer, stderr);
+    if (s->pooling)
+        dmapool_report(&s->pool, stderr);
+}
+
+int session_setprofile(struct session *s, const struct encoder_profile *profile, char *reply, size_t size) {
+    char text[128];
+    int err = -1;
+
+    // The main thread brings a device that came back up with the registers and the profile, not while they change
+    pthread_mutex_lock(&s->profilelock);
+    if (!s->capturing || s->detached || s->bringup.state == BRINGUP_FAILED) {
+        snprintf(reply, size, "device %zu: not streaming", s->index);
+        goto done;
+    }
+    if (s->resuming) {
+        snprintf(reply, size, "device %zu: coming back, try again once it streams", s->index);
+        goto done;
+    }
+    if (!encoder_compatible(&s->profile, profile)) {
+        snprintf(reply, size, "device %zu: streaming %ux%u at %u fps, the size and frame rate only change with a new bring-up (-P)",
+                s->index, s->profile.width, s->profile.height, s->profile.fps);
+        goto done;
+    }
+    if (encoder_apply(&s->registers, profile) != 0) {
+        snprintf(reply, size, "device %zu: the encoder did not take %s, still %s", s->index, profile->name, s->profile.name);
+        goto done;
+    }
+
+    s->profile = *profile;
+    s->profileswitched = 1;
+    // The probe after a replug expects the new rate
+    if (read_reg(&s->registers, CAMERA_REGISTER_ENCODER_BITRATE, &s->bitrate) != 0)
+        s->bitrate = 0;
+    // Measured from now on
+    s->meterbytes = s->cap.stats.bytes;
+    s->meterat = lgp_now_ns();
+    encoder_describe(profile, text, sizeof (text));
+    snprintf(reply, size, "device %zu: encoder now %s", s->index, text);
+    err = 0;
+
+done:
+    pthread_mutex_unlock(&s->profilelock);
+    return err;
+}
+
+int session_dump(struct session *s, char *path, size_t size) {
+    if (!s->recording.replaying)
+        return -1;
+    return replay_requestdump(&s->recording.replay, path, size);
+}
+
+int session_request(struct session *s, enum session_request request, const char *name, char *reply, size_t size) {
+    struct timespec deadline;
+    // A rotation waits for the next keyframe
+    long timeout = SESSION_REQUEST_TIMEOUT + (s->profile.fps > 0 ? 1000L * s->profile.keyframeinterval / s->profile.fps : 0);
+    int err = 0;
+
+    if (!s->writing) {
+        snprintf(reply, size, "device %zu: not streaming", s->index);
+        return -1;
+    }
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout / 1000;
+    deadline.tv_nsec += (timeout % 1000) * 1000000L;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+
+    pthread_mutex_lock(&s->requestlock);
+    snprintf(s->requestname, sizeof (s->requestname), "%s", name != NULL ? name : "");
+    s->requestedat = lgp_now_ns();
+    atomic_store_explicit(&s->requested, request, memory_order_release);
+    while (atomic_load_explicit(&s->requested, memory_order_acquire) != SESSION_REQUEST_NONE && err == 0)
+        err = pthread_cond_timedwait(&s->requestdone, &s->requestlock, &deadline);
+
+    if (atomic_load_explicit(&s->requested, memory_order_acquire) != SESSION_REQUEST_NONE) {
+        // Taken back, the writer thread checks again under the lock
+        atomic_store_explicit(&s->requested, SESSION_REQUEST_NONE, memory_order_release);
+        snprintf(reply, size, "device %zu: timed out waiting for %s", s->index, request == SESSION_REQUEST_ROTATE ? "an SPS" : "the stream");
+        err = -1;
+    } else {
+        snprintf(reply, size, "%s", s->requestreply);
+        err = s->requestresult;
+    }
+    pthread_mutex_unlock(&s->requestlock);
+    return err;
+}
+
+int session_recording(struct session *s, char *output, size_t size) {
+    pthread_mutex_lock(&s->requestlock);
+    snprintf(output, size, "%s", s->recording.active || !s->config->daemon || s->recording.startedat != 0 ? s->output : "");
+    int active = s->recording.active;
+    pthread_mutex_unlock(&s->requestlock);
+    return active;
+}
+
+void session_close(struct session *s) {
+    // Transfers go before the transport they were allocated from
+    if (s->capturing)
+        capture_free(&s->cap);
+    s->capturing = 0;
+    if (s->writing)
+        writer_free(&s->writer);
+    s->writing = 0;
+    if (s->executing)
+        initexec_free(&s->initexecutor);
+    s->executing = 0;
+    // usbfs memory goes back before the handle it belongs to is closed
+    if (s->pooling)
+        dmapool_destroy(&s->pool);
+    s->pooling = 0;
+    s->transport.pool = NULL;
+
+    if (s->transportopen)
+        transport_close(&s->transport);
+    s->transportopen = 0;
+    if (s->handle != NULL) {
+        libusb_release_interface(s->handle, CAMERA_INTERACE);
+        libusb_close(s->handle);
+    }
+    s->handle = NULL;
+    regcache_destroy(&s->registers);
+    pthread_cond_destroy(&s->requestdone);
+    pthread_mutex_destroy(&s->requestlock);
+    pthread_mutex_destroy(&s->profilelock);
+}
@@ -0,0 +1,247 @@
+#ifndef SESSION_H
+#define SESSION_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "bringup.h"
+#include "capture.h"
+#include "dmapool.h"
+#include "encoder.h"
+#include "hls.h"
+#include "hotplug.h"
+#include "initexec.h"
+#include "mp4mux.h"
+#include "nalscan.h"
+#include "regcache.h"
+#include "replay.h"
+#include "scheduler.h"
+#include "sequence.h"
+#include "shmring.h"
+#include "storage.h"
+#include "transport.h"
+#include "writer.h"
+
+#define SESSION_MAX_DEVICES		CAPTURE_LOOP_MAX
+// ms a recording request waits for the writer thread, a rotation waits for the next SPS
+#define SESSION_REQUEST_TIMEOUT	3000
+// ms between two polls of the video ready handshake while streaming, unless configured otherwise
+#define SESSION_POLL_PERIOD		1000
+
+// Settings shared by every device
+struct session_config {
+    const struct sequence *initsequence;
+    const struct encoder_profile *profile;	// what the init sequence sets the encoder up for
+    const char *firmwarefile;
+    int forcefirmware;
+    size_t capturedepth;
+    size_t transfersize;
+    size_t writerbacklog;
+    int rawstream;				// bare H.264 with its access unit index instead of MP4
+    struct storage_config storage;	// how the bare stream is written
+    int resume;					// a device going away is waited for instead of ending its capture
+    int dmapool;				// transfer buffers from a pool of usbfs or locked memory per device
+    size_t replaybytes;			// only keep this much of the stream in memory, written out on request
+    uint64_t replaywindow;		// ns, how far back a dump goes, 0 for as far as the ring holds
+    struct hls_config hls;		// live HLS next to the recording, no directory for none
+    int daemon;					// devices stay up and streaming, recordings start and stop on request
+    // ms between keyframe syncs, LED blinks and status polls while streaming, 0 for none
+    unsigned int syncperiod;
+    unsigned int ledperiod;
+    unsigned int pollperiod;
+};
+
+// What the daemon asks of the writer thread
+enum session_request {
+    SESSION_REQUEST_NONE,
+    SESSION_REQUEST_START,		// at the next access unit
+    SESSION_REQUEST_STOP,		// at the next access unit
+    SESSION_REQUEST_ROTATE,		// at the next SPS, without a byte lost in between
+    SESSION_REQUEST_MARK		// right away
+};
+
+// Devices going away and coming back, gaps from the last data before to the first data after
+struct session_recovery {
+    uint64_t detaches;
+    uint64_t fastresumes;		// the probe found the encoder still configured
+    uint64_t reinits;			// it came back blank, full bring-up again
+    uint64_t gaps;
+    uint64_t lastgap;			// ns
+    uint64_t maxgap;			// ns
+    uint64_t totalgap;			// ns
+};
+
+// Commands the scheduler sends to the device while it streams, run on its thread
+struct session_periodic {
+    int synctask;				// scheduler tasks, -1 when not scheduled
+    int ledtask;
+    int polltask;
+    uint64_t syncs;
+    uint64_t syncfailures;
+    unsigned int ledstep;
+    uint64_t polls;
+    uint64_t pollfailures;		// not answered, or the video not ready
+    uint32_t status;			// 0x0800 at the last poll
+};
+
+// What the writer thread does with the stream, owned by it once the writer started
+struct recording {
+    // Bare stream, cut in segments where an SPS starts
+    struct storage storage;
+    int storing;
+    size_t cut;					// offset of the first SPS in the buffer being written, STORAGE_NOCUT if none
+    uint64_t bufferoffset;		// stream offset of that buffer
+    uint64_t buffertimestamp;
+
+    // Nothing but the last stretch of the stream in memory, instead of the bare stream on disk
+    struct replay replay;
+    int replaying;
+
+    // Index offsets are those of the whole stream, the segments put back together
+    struct nalscan scanner;
+    struct nalindex index;
+    int indexing;
+
+    // MP4 instead of the raw stream, it keeps the buffers until their fragment is written
+    struct mp4mux mux;
+    int muxing;
+
+    // And to the HLS segmenter
+    struct hls hls;
+    int segmenting;
+
+    // Every chunk also goes to the local consumers attached to the shared ring
+    struct shmring ring;
+    int publishing;
+
+    // The sinks above going to a file are open, always once started unless in daemon mode
+    int active;
+    uint64_t bytes;				// stream bytes of the recording so far
+    uint64_t startedat;			// ns
+    FILE *marks;				// <output>.marks, opened with the first mark
+    uint64_t markcount;
+    // First part of a buffer split for a stop or rotation, the muxer gives it back but the writer never sees it
+    struct streambuffer head;
+};
+
+// One capture unit, from its init sequence to its own output files. Sessions
+// only share the USB context (or emulator bus) and the capture event thread,
+// every one of them has its own writer thread and sinks.
+struct session {
+    size_t index;
+    const struct session_config *config;
+    char key[64];				// "usb-<bus>-<port>...", empty when the device cannot be told apart
+    char output[128];			// capture.mp4, or capture-<index>.mp4 with several devices
+    const char *extension;
+    int numbered;				// one of several devices, the index goes in the output names
+    char publishsocket[108];	// empty when not publishing
+
+    struct transport transport;
+    int transportopen;
+    struct dmapool pool;
+    int pooling;
+    libusb_device_handle *handle;	// NULL for the emulator
+    // EP. 81 transfers, those of the config unless tuned for the controller of the device
+    size_t capturedepth;
+    size_t transfersize;
+
+    struct initexec initexecutor;
+    int executing;
+    struct regcache registers;
+    struct scheduler *scheduler;	// EP. 04 and 83 once streaming, NULL before
+    struct session_periodic periodic;
+    struct bringup bringup;
+    uint32_t bitrate;			// encoder rate register once the video was ready, 0 if unread
+    struct encoder_profile profile;	// the one the encoder runs with
+    int profileswitched;		// at runtime, it is sent again after a full bring-up
+    uint64_t meterbytes;		// captured at the last report
+    uint64_t meterat;			// ns
+    uint32_t measuredbitrate;	// kbit/s between the last two reports
+    int firmwarelost;			// came back blank, the firmware state file is out of date
+
+    // The control thread switching the encoder against the main thread losing and bringing back the device:
+    // profile, profileswitched, bitrate, the meter, detached and resuming change with it held
+    pthread_mutex_t profilelock;
+    int detached;				// waiting for the device to come back, the outputs stay open
+    int resuming;				// until the first data after coming back
+    int resumedfast;
+    uint64_t lostat;			// ns, last data before the device went away
+    struct session_recovery recovery;
+
+    struct writer writer;
+    int writing;
+    struct recording recording;
+    struct capture cap;
+    int capturing;
+
+    // One request at a time from the control thread, carried out between two buffers by the writer thread
+    pthread_mutex_t requestlock;	// also guards output
+    pthread_cond_t requestdone;
+    atomic_int requested;		// enum session_request
+    char requestname[96];		// output stem of a start or rotation, label of a mark
+    char requestreply[160];
+    int requestresult;
+    uint64_t requestedat;		// ns
+    uint64_t startlatency;		// ns, last start request to the first byte of its recording
+};
+
+// started carries the enumeration time over from the process start. Names the
+// outputs after index, unless the session is the only one of count.
+void session_init(struct session *s, size_t index, size_t count, const struct session_config *config,
+        const struct bringup *started, const char *publishsocket);
+
+// LED, init sequence, firmware upload, until the video is ready.
+int session_bringup(struct session *s);
+
+// Sets up the writer and the sinks, queues the capture transfers and leaves
+// their events to loop, which must not have started yet. Commands from then
+// on go through sched, the periodic ones of the config are added to it. In
+// daemon mode the stream is let go until a start request.
+int session_start(struct session *s, struct capture_loop *loop, struct scheduler *sched);
+
+// 1 while the first frame is still awaited, leaves BRINGUP_STREAMING once it came or took too long.
+int session_waitfirstframe(struct session *s);
+// Detached sessions count as running, they wait for their device.
+int session_running(struct session *s);
+void session_report(struct session *s, FILE *out);
+
+// Device going away and coming back, when the config allows resuming.
+// session_checkdetached() returns 1 when the capture just lost its device
+// and the session now waits for it, the writer and sinks staying open.
+int session_checkdetached(struct session *s);
+// Whether the hotplug event is about the device of the session.
+int session_matches(struct session *s, const struct hotplug_event *event);
+// Takes the device back, behind handle for a real one that was opened, configured
+// and claimed again, NULL for the emulator. A probe of register 0x0800 and of
+// the encoder bitrate tells whether the firmware and the configuration survived:
+// then the capture goes on right away, otherwise after a full bring-up.
+int session_resume(struct session *s, libusb_device_handle *handle);
+// Accounts the gap once the first data after a resume came in.
+void session_checkresumed(struct session *s);
+
+// Switches the encoder of a streaming device to profile, from the control
+// thread. Only the bitrate and the keyframe interval change while streaming,
+// the size and frame rate of the stream are in the SPS recordings started with.
+int session_setprofile(struct session *s, const struct encoder_profile *profile, char *reply, size_t size);
+
+// Queues a dump of the replay ring, path gets the file it goes to. -1 when not in replay mode.
+int session_dump(struct session *s, char *path, size_t size);
+
+// Start, stop, rotate or mark the recording of a started session, from the
+// control thread. name is the output stem of a start or rotation, the label
+// of a mark. Waits for the writer thread to carry it out, reply says what
+// became of it. -1 when it failed or timed out.
+int session_request(struct session *s, enum session_request request, const char *name, char *reply, size_t size);
+// 1 when a recording named stem would overwrite a file, one left by an earlier run.
+int session_nametaken(struct session *s, const char *stem);
+// Output of the current or last recording, empty if none yet. 1 while recording.
+int session_recording(struct session *s, char *output, size_t size);
+
+// Cancels the capture and drains the writer, then closes the output files.
+void session_stop(struct session *s);
+// Closes the transport and gives the device back.
+void session_close(struct session *s);
+
+#endif
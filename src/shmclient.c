@@ -0,0 +1,205 @@
+#include "shmclient.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+// Receives the memfd the capture sends to everyone connecting.
+static int shmclient_receive(const char *socketpath) {
+    struct sockaddr_un address;
+    int fd = -1;
+
+    if (strlen(socketpath) >= sizeof (address.sun_path))
+        return -1;
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketpath);
+
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock < 0)
+        return -1;
+    if (connect(sock, (struct sockaddr*) &address, sizeof (address)) != 0) {
+        close(sock);
+        return -1;
+    }
+
+    char payload;
+    struct iovec iov = { .iov_base = &payload, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof (int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof (message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof (control.space);
+
+    if (recvmsg(sock, &message, MSG_CMSG_CLOEXEC) == 1) {
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            memcpy(&fd, CMSG_DATA(cmsg), sizeof (int));
+    }
+    close(sock);
+    return fd;
+}
+
+// Takes a free consumer entry, or one left by a consumer that died without detaching.
+static struct shmring_consumer *shmclient_claim(struct shmring_header *header) {
+    int self = (int) getpid();
+
+    for (int i = 0; i < SHMRING_MAX_CONSUMERS; i++) {
+        struct shmring_consumer *consumer = &header->consumers[i];
+        int pid = atomic_load(&consumer->pid);
+        if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+            continue;
+        if (atomic_compare_exchange_strong(&consumer->pid, &pid, self))
+            return consumer;
+    }
+    return NULL;
+}
+
+int shmclient_attach(struct shmclient *c, const char *socketpath) {
+    struct stat st;
+
+    memset(c, 0, sizeof (struct shmclient));
+    c->fd = shmclient_receive(socketpath);
+    if (c->fd < 0) {
+        fprintf(stderr, "Failed to get the shared ring from %s: %s\n", socketpath, strerror(errno));
+        return -1;
+    }
+
+    if (fstat(c->fd, &st) != 0 || (size_t) st.st_size < SHMRING_HEADER_SIZE)
+        goto error;
+    c->mapsize = st.st_size;
+    c->header = (struct shmring_header*) mmap(NULL, c->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, c->fd, 0);
+    if (c->header == MAP_FAILED) {
+        c->header = NULL;
+        goto error;
+    }
+
+    if (memcmp(c->header->magic, SHMRING_MAGIC, 8) != 0 || c->header->version != SHMRING_VERSION ||
+            c->header->slotcount == 0 || SHMRING_HEADER_SIZE + c->header->slotcount * c->header->slotstride > c->mapsize) {
+        fprintf(stderr, "%s does not serve a shared ring this client understands!\n", socketpath);
+        goto error;
+    }
+
+    c->consumer = shmclient_claim(c->header);
+    if (c->consumer == NULL) {
+        fprintf(stderr, "All %d consumer entries of the shared ring are taken!\n", SHMRING_MAX_CONSUMERS);
+        goto error;
+    }
+    c->cursor = atomic_load(&c->header->head);
+    atomic_store(&c->consumer->cursor, c->cursor);
+    atomic_store(&c->consumer->skipped, 0);
+    return 0;
+
+error:
+    shmclient_detach(c);
+    return -1;
+}
+
+void shmclient_detach(struct shmclient *c) {
+    if (c->consumer != NULL)
+        atomic_store(&c->consumer->pid, 0);
+    if (c->header != NULL)
+        munmap(c->header, c->mapsize);
+    if (c->fd >= 0)
+        close(c->fd);
+    c->consumer = NULL;
+    c->header = NULL;
+    c->fd = -1;
+}
+
+// Jumps over what the capture overwrote. Not to the oldest chunk left: that
+// one is about to go too, half a ring of slack lets a slow reader catch up.
+static void shmclient_skip(struct shmclient *c, uint64_t head) {
+    uint64_t target = head - c->header->slotcount / 2;
+    if (target <= c->cursor)
+        target = c->cursor + 1;
+    c->stats.skipped += target - c->cursor;
+    c->stats.skips++;
+    atomic_fetch_add(&c->consumer->skipped, target - c->cursor);
+    c->cursor = target;
+}
+
+int shmclient_read(struct shmclient *c, struct shmchunk *chunk, int timeout) {
+    struct shmring_header *header = c->header;
+
+    while (1) {
+        uint64_t head = atomic_load_explicit(&header->head, memory_order_acquire);
+
+        if (head == c->cursor) {
+            unsigned int futex = atomic_load(&header->futex);
+            // Published between the two loads, the futex already moved on
+            if (atomic_load(&header->head) != c->cursor)
+                continue;
+            if (atomic_load(&header->producerpid) == 0)
+                return -1;
+
+            struct timespec ts = { .tv_sec = timeout / 1000, .tv_nsec = (timeout % 1000) * 1000000L };
+            atomic_fetch_add(&header->waiters, 1);
+            long err = syscall(SYS_futex, &header->futex, FUTEX_WAIT, futex, timeout >= 0 ? &ts : NULL, NULL, 0);
+            int waiterrno = errno;
+            atomic_fetch_sub(&header->waiters, 1);
+            if (err != 0 && waiterrno == ETIMEDOUT)
+                return 0;
+            continue;
+        }
+
+        if (head - c->cursor > header->slotcount) {
+            shmclient_skip(c, head);
+            continue;
+        }
+
+        struct shmring_slot *slot = shmring_slot(header, c->cursor);
+        if (atomic_load_explicit(&slot->sequence, memory_order_acquire) != 2 * c->cursor + 2) {
+            // Overwritten since head was read
+            shmclient_skip(c, atomic_load(&header->head));
+            continue;
+        }
+
+        chunk->data = shmring_slotdata(slot);
+        chunk->length = slot->length < header->slotsize ? slot->length : header->slotsize;
+        chunk->timestamp = slot->timestamp;
+        chunk->streamoffset = slot->streamoffset;
+        chunk->sequence = c->cursor;
+        // Lets the capture see how far behind this consumer is
+        atomic_store_explicit(&c->consumer->cursor, c->cursor, memory_order_relaxed);
+        return 1;
+    }
+}
+
+int shmclient_release(struct shmclient *c, const struct shmchunk *chunk) {
+    struct shmring_slot *slot = shmring_slot(c->header, chunk->sequence);
+
+    atomic_thread_fence(memory_order_acquire);
+    int intact = atomic_load_explicit(&slot->sequence, memory_order_relaxed) == 2 * chunk->sequence + 2;
+
+    c->cursor = chunk->sequence + 1;
+    atomic_store_explicit(&c->consumer->cursor, c->cursor, memory_order_relaxed);
+    if (!intact) {
+        c->stats.torn++;
+        return -1;
+    }
+    c->stats.chunks++;
+    c->stats.bytes += chunk->length;
+    return 0;
+}
+
+void shmclient_report(struct shmclient *c, FILE *out) {
+    fprintf(out, "Shared ring consumer: %llu chunks, %llu bytes, %llu skipped in %llu jumps, %llu torn\n",
+            (unsigned long long) c->stats.chunks, (unsigned long long) c->stats.bytes,
+            (unsigned long long) c->stats.skipped, (unsigned long long) c->stats.skips,
+            (unsigned long long) c->stats.torn);
+}
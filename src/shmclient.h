@@ -0,0 +1,54 @@
+#ifndef SHMCLIENT_H
+#define SHMCLIENT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "shmring.h"
+
+// Consumer side of the shared ring, for preview, archive and restream
+// processes running next to the capture. Chunks are read in place; a consumer
+// falling behind loses the oldest ones instead of slowing the capture down.
+
+struct shmchunk {
+    const unsigned char *data;	// in the shared memory, valid until shmclient_release
+    size_t length;
+    uint64_t timestamp;		// ns, host time of the transfer
+    uint64_t streamoffset;
+    uint64_t sequence;		// chunk number, gaps are chunks skipped
+};
+
+struct shmclient_stats {
+    uint64_t chunks;
+    uint64_t bytes;
+    uint64_t skipped;		// chunks overwritten before they were read
+    uint64_t skips;			// times it had to jump forward
+    uint64_t torn;			// chunks overwritten while they were being used
+};
+
+struct shmclient {
+    int fd;
+    struct shmring_header *header;
+    size_t mapsize;
+    struct shmring_consumer *consumer;
+    uint64_t cursor;
+
+    struct shmclient_stats stats;
+};
+
+// Gets the ring from the capture serving on socketpath and takes a consumer
+// entry. Reading starts at the newest chunk.
+int shmclient_attach(struct shmclient *c, const char *socketpath);
+void shmclient_detach(struct shmclient *c);
+
+// 1 with the next chunk, 0 when none came within timeout ms (-1 waits for
+// ever), -1 once the capture stopped and everything was read.
+int shmclient_read(struct shmclient *c, struct shmchunk *chunk, int timeout);
+// Done with chunk: 0 when it stayed intact, -1 when the capture overwrote it
+// while it was used and what was read cannot be trusted.
+int shmclient_release(struct shmclient *c, const struct shmchunk *chunk);
+
+void shmclient_report(struct shmclient *c, FILE *out);
+
+#endif
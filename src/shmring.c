@@ -0,0 +1,160 @@
+#define _GNU_SOURCE		// memfd_create and file seals
+
+#include "shmring.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+static void shmring_wake(struct shmring_header *header) {
+    syscall(SYS_futex, &header->futex, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+int shmring_create(struct shmring *ring, size_t slotcount, size_t slotsize) {
+    memset(ring, 0, sizeof (struct shmring));
+    ring->fd = -1;
+    unixserver_init(&ring->server);
+
+    size_t slotstride = (sizeof (struct shmring_slot) + slotsize + 63) & ~(size_t) 63;
+    ring->mapsize = SHMRING_HEADER_SIZE + slotcount * slotstride;
+
+    ring->fd = memfd_create("lgp-stream", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (ring->fd < 0 || ftruncate(ring->fd, ring->mapsize) != 0)
+        goto error;
+    // Consumers map it with the size they see, it must not change under them
+    if (fcntl(ring->fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0)
+        goto error;
+
+    ring->header = (struct shmring_header*) mmap(NULL, ring->mapsize, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+    if (ring->header == MAP_FAILED) {
+        ring->header = NULL;
+        goto error;
+    }
+
+    // A new memfd reads as zeroes, only the geometry needs filling in
+    memcpy(ring->header->magic, SHMRING_MAGIC, 8);
+    ring->header->version = SHMRING_VERSION;
+    ring->header->slotcount = slotcount;
+    ring->header->slotsize = slotsize;
+    ring->header->slotstride = slotstride;
+    atomic_store(&ring->header->producerpid, (int) getpid());
+    return 0;
+
+error:
+    fprintf(stderr, "Failed to create a shared ring of %zu slots of %zu bytes: %s\n", slotcount, slotsize, strerror(errno));
+    shmring_destroy(ring);
+    return -1;
+}
+
+static void shmring_answer(void *userdata, int client) {
+    struct shmring *ring = (struct shmring*) userdata;
+
+    // One byte of payload, the memfd rides along as ancillary data
+    char payload = 'L';
+    struct iovec iov = { .iov_base = &payload, .iov_len = 1 };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof (int))];
+    } control;
+    struct msghdr message;
+    memset(&message, 0, sizeof (message));
+    memset(&control, 0, sizeof (control));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control.space;
+    message.msg_controllen = sizeof (control.space);
+
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof (int));
+    memcpy(CMSG_DATA(cmsg), &ring->fd, sizeof (int));
+
+    if (sendmsg(client, &message, MSG_NOSIGNAL) != 1)
+        fprintf(stderr, "Failed to hand the shared ring to a consumer: %s\n", strerror(errno));
+}
+
+int shmring_serve(struct shmring *ring, const char *socketpath) {
+    return unixserver_start(&ring->server, socketpath, "shared ring", shmring_answer, ring);
+}
+
+void shmring_destroy(struct shmring *ring) {
+    unixserver_stop(&ring->server);
+
+    if (ring->header != NULL) {
+        // Consumers keep their mapping, they see the producer is gone and stop
+        atomic_store(&ring->header->producerpid, 0);
+        atomic_fetch_add(&ring->header->futex, 1);
+        shmring_wake(ring->header);
+        munmap(ring->header, ring->mapsize);
+    }
+    if (ring->fd >= 0)
+        close(ring->fd);
+    ring->header = NULL;
+    ring->fd = -1;
+}
+
+void shmring_publish(struct shmring *ring, const struct streambuffer *buffer) {
+    struct shmring_header *header = ring->header;
+    uint64_t chunk = atomic_load_explicit(&header->head, memory_order_relaxed);
+    struct shmring_slot *slot = shmring_slot(header, chunk);
+    size_t length = buffer->length;
+
+    if (length > header->slotsize) {
+        length = header->slotsize;
+        ring->stats.truncated++;
+    }
+
+    // Odd while the data changes, a consumer reading it meanwhile sees it torn
+    atomic_store_explicit(&slot->sequence, 2 * chunk + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    slot->length = length;
+    slot->timestamp = buffer->timestamp;
+    slot->streamoffset = ring->streamoffset;
+    memcpy(shmring_slotdata(slot), buffer->data, length);
+    atomic_store_explicit(&slot->sequence, 2 * chunk + 2, memory_order_release);
+    atomic_store_explicit(&header->head, chunk + 1, memory_order_release);
+
+    ring->streamoffset += buffer->length;
+    ring->stats.published++;
+    ring->stats.bytes += length;
+
+    atomic_fetch_add(&header->futex, 1);
+    if (atomic_load(&header->waiters) > 0) {
+        shmring_wake(header);
+        ring->stats.wakeups++;
+    }
+
+    // Nobody is waited for, a consumer a full ring behind lost data and skips forward on its next read
+    for (int i = 0; i < SHMRING_MAX_CONSUMERS; i++) {
+        struct shmring_consumer *consumer = &header->consumers[i];
+        if (atomic_load_explicit(&consumer->pid, memory_order_relaxed) == 0)
+            continue;
+        if (chunk + 1 - atomic_load_explicit(&consumer->cursor, memory_order_relaxed) == (uint64_t) header->slotcount + 1)
+            ring->stats.lagging++;
+    }
+}
+
+void shmring_report(struct shmring *ring, FILE *out) {
+    int consumers = 0;
+    for (int i = 0; i < SHMRING_MAX_CONSUMERS; i++) {
+        int pid = atomic_load(&ring->header->consumers[i].pid);
+        // An entry left behind by a consumer that died is taken over by the next one attaching
+        if (pid != 0 && (kill(pid, 0) == 0 || errno != ESRCH))
+            consumers++;
+    }
+
+    fprintf(out, "Shared ring: %llu chunks, %llu bytes, %d consumers, %llu wakeups, %llu times a consumer fell a ring behind, %llu truncated\n",
+            (unsigned long long) ring->stats.published, (unsigned long long) ring->stats.bytes, consumers,
+            (unsigned long long) ring->stats.wakeups, (unsigned long long) ring->stats.lagging,
+            (unsigned long long) ring->stats.truncated);
+}
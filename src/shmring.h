@@ -0,0 +1,98 @@
+#ifndef SHMRING_H
+#define SHMRING_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "capture.h"
+#include "unixserver.h"
+
+// Stream chunks published to other processes through a memfd. The producer
+// never waits for anyone: it overwrites the oldest slot, and a consumer that
+// fell more than a ring behind skips forward to the oldest chunk still there.
+//
+// Layout of the shared memory:
+//   header     struct shmring_header, SHMRING_HEADER_SIZE bytes
+//   slots      slotcount x (struct shmring_slot + slotsize bytes of data)
+//
+// Every slot is a seqlock: its sequence is 2 * chunk + 1 while the producer
+// writes it and 2 * chunk + 2 once chunk is in there. Consumers check it
+// again after reading to know the data was not overwritten meanwhile.
+//
+// The memfd is handed out on a Unix socket with SCM_RIGHTS, see shmclient.h.
+
+#define SHMRING_MAGIC			"LGPSHM\r\n"
+#define SHMRING_VERSION			1
+#define SHMRING_MAX_CONSUMERS	16
+#define SHMRING_HEADER_SIZE		4096
+#define SHMRING_DEFAULT_SLOTS	256
+
+struct shmring_consumer {
+    _Alignas(64) atomic_int pid;				// 0 when the entry is free
+    atomic_uint_least64_t cursor;				// next chunk it reads
+    atomic_uint_least64_t skipped;				// chunks it lost by falling behind
+};
+
+struct shmring_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t slotcount;
+    uint64_t slotsize;
+    uint64_t slotstride;	// struct shmring_slot plus the data, cache line aligned
+
+    _Alignas(64) atomic_uint_least64_t head;	// next chunk the producer writes
+    atomic_uint futex;							// bumped on every publish, consumers wait on it
+    atomic_uint waiters;						// consumers asleep on futex
+    atomic_int producerpid;						// 0 once the producer is gone
+
+    struct shmring_consumer consumers[SHMRING_MAX_CONSUMERS];
+};
+
+struct shmring_slot {
+    atomic_uint_least64_t sequence;
+    uint64_t length;
+    uint64_t timestamp;		// ns, host time of the transfer
+    uint64_t streamoffset;	// of its first byte in the stream
+};
+
+struct shmring_stats {
+    uint64_t published;
+    uint64_t bytes;
+    uint64_t truncated;		// chunks larger than a slot
+    uint64_t wakeups;
+    uint64_t lagging;		// times a consumer was found a full ring behind
+};
+
+struct shmring {
+    int fd;
+    struct shmring_header *header;
+    size_t mapsize;
+    uint64_t streamoffset;
+
+    struct unixserver server;	// hands out the memfd
+
+    struct shmring_stats stats;
+};
+
+static inline struct shmring_slot *shmring_slot(struct shmring_header *header, uint64_t chunk) {
+    return (struct shmring_slot*) ((unsigned char*) header + SHMRING_HEADER_SIZE + (chunk % header->slotcount) * header->slotstride);
+}
+
+static inline unsigned char *shmring_slotdata(struct shmring_slot *slot) {
+    return (unsigned char*) (slot + 1);
+}
+
+int shmring_create(struct shmring *ring, size_t slotcount, size_t slotsize);
+// Starts handing the memfd out to whoever connects to socketpath.
+int shmring_serve(struct shmring *ring, const char *socketpath);
+void shmring_destroy(struct shmring *ring);
+
+// Copies the chunk in the next slot, never blocks.
+void shmring_publish(struct shmring *ring, const struct streambuffer *buffer);
+
+void shmring_report(struct shmring *ring, FILE *out);
+
+#endif
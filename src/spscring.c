@@ -0,0 +1,60 @@
+#include "spscring.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+int spscring_init(struct spscring *ring, size_t capacity) {
+    size_t size = 1;
+    while (size < capacity)
+        size <<= 1;
+
+    memset(ring, 0, sizeof (struct spscring));
+    ring->slots = (void**) calloc(size, sizeof (void*));
+    if (ring->slots == NULL)
+        return -1;
+
+    ring->capacity = size;
+    ring->mask = size - 1;
+    atomic_init(&ring->head, 0);
+    atomic_init(&ring->tail, 0);
+    return 0;
+}
+
+void spscring_free(struct spscring *ring) {
+    free(ring->slots);
+    ring->slots = NULL;
+    ring->capacity = 0;
+}
+
+int spscring_push(struct spscring *ring, void *item) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+
+    if (head - tail >= ring->capacity)
+        return -1;
+
+    ring->slots[head & ring->mask] = item;
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+
+    if (head + 1 - tail > ring->highwater)
+        ring->highwater = head + 1 - tail;
+    return 0;
+}
+
+void *spscring_pop(struct spscring *ring) {
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+
+    if (tail == head)
+        return NULL;
+
+    void *item = ring->slots[tail & ring->mask];
+    atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+    return item;
+}
+
+size_t spscring_count(struct spscring *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    return head - tail;
+}
@@ -0,0 +1,30 @@
+#ifndef SPSCRING_H
+#define SPSCRING_H
+
+#include <stdatomic.h>
+#include <stddef.h>
+
+#define SPSCRING_CACHELINE	64
+
+// Bounded single-producer / single-consumer ring of pointers.
+// push() must only be called from one thread and pop() from one (other) thread.
+struct spscring {
+    _Alignas(SPSCRING_CACHELINE) atomic_size_t head;	// next slot to write, owned by the producer
+    _Alignas(SPSCRING_CACHELINE) atomic_size_t tail;	// next slot to read, owned by the consumer
+    _Alignas(SPSCRING_CACHELINE) size_t capacity;		// power of two
+    size_t mask;
+    void **slots;
+    size_t highwater;	// highest occupancy seen by the producer
+};
+
+// Capacity is rounded up to the next power of two.
+int spscring_init(struct spscring *ring, size_t capacity);
+void spscring_free(struct spscring *ring);
+
+// Returns 0 on success, -1 when the ring is full.
+int spscring_push(struct spscring *ring, void *item);
+// Returns NULL when the ring is empty.
+void *spscring_pop(struct spscring *ring);
+size_t spscring_count(struct spscring *ring);
+
+#endif
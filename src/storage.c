@@ -0,0 +1,453 @@
+#define _GNU_SOURCE		// O_DIRECT and fallocate
+#include "storage.h"
+#include "lgp.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/falloc.h>
+#include <linux/io_uring.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+// No liburing, the three system calls are all it takes
+
+static int uring_setup(unsigned int entries, struct io_uring_params *params) {
+    return (int) syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd, unsigned int submit, unsigned int complete, unsigned int flags) {
+    return (int) syscall(__NR_io_uring_enter, fd, submit, complete, flags, NULL, 0);
+}
+
+static int storage_uringopen(struct storage_uring *ring, unsigned int entries) {
+    struct io_uring_params params;
+
+    memset(ring, 0, sizeof (struct storage_uring));
+    memset(&params, 0, sizeof (params));
+    ring->fd = uring_setup(entries, &params);
+    if (ring->fd < 0)
+        return -1;
+
+    ring->sqsize = params.sq_off.array + params.sq_entries * sizeof (unsigned int);
+    ring->cqsize = params.cq_off.cqes + params.cq_entries * sizeof (struct io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring->cqsize > ring->sqsize)
+            ring->sqsize = ring->cqsize;
+        ring->cqsize = 0;
+    }
+
+    ring->sqring = mmap(NULL, ring->sqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+    if (ring->sqring == MAP_FAILED)
+        goto error;
+    ring->cqring = ring->sqring;
+    if (ring->cqsize > 0) {
+        ring->cqring = mmap(NULL, ring->cqsize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+        if (ring->cqring == MAP_FAILED)
+            goto error;
+    }
+    ring->sqessize = params.sq_entries * sizeof (struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqessize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+    if (ring->sqes == MAP_FAILED)
+        goto error;
+
+    unsigned char *sq = (unsigned char*) ring->sqring;
+    unsigned char *cq = (unsigned char*) ring->cqring;
+    ring->sqtail = (unsigned int*) (sq + params.sq_off.tail);
+    ring->sqmask = (unsigned int*) (sq + params.sq_off.ring_mask);
+    ring->sqarray = (unsigned int*) (sq + params.sq_off.array);
+    ring->cqhead = (unsigned int*) (cq + params.cq_off.head);
+    ring->cqtail = (unsigned int*) (cq + params.cq_off.tail);
+    ring->cqmask = (unsigned int*) (cq + params.cq_off.ring_mask);
+    ring->cqes = cq + params.cq_off.cqes;
+    return 0;
+
+error:
+    if (ring->sqring != NULL && ring->sqring != MAP_FAILED)
+        munmap(ring->sqring, ring->sqsize);
+    if (ring->cqsize > 0 && ring->cqring != NULL && ring->cqring != MAP_FAILED)
+        munmap(ring->cqring, ring->cqsize);
+    close(ring->fd);
+    memset(ring, 0, sizeof (struct storage_uring));
+    ring->fd = -1;
+    return -1;
+}
+
+static void storage_uringclose(struct storage_uring *ring) {
+    if (ring->fd < 0)
+        return;
+    munmap(ring->sqes, ring->sqessize);
+    if (ring->cqsize > 0)
+        munmap(ring->cqring, ring->cqsize);
+    munmap(ring->sqring, ring->sqsize);
+    close(ring->fd);
+    ring->fd = -1;
+}
+
+void storage_defaults(struct storage_config *config) {
+    memset(config, 0, sizeof (struct storage_config));
+    config->backend = STORAGE_URING;
+    config->direct = 1;
+    config->chunksize = STORAGE_DEFAULT_CHUNK;
+    config->depth = STORAGE_DEFAULT_DEPTH;
+    config->preallocate = STORAGE_DEFAULT_PREALLOCATE;
+}
+
+const char *storage_backendname(enum storage_backend backend) {
+    return backend == STORAGE_URING ? "io_uring" : "pwrite";
+}
+
+// Synchronous write of the whole range, what pwrite() and a short io_uring write end up with.
+static int storage_pwriteall(int fd, const unsigned char *data, size_t length, uint64_t offset) {
+    while (length > 0) {
+        ssize_t written = pwrite(fd, data, length, offset);
+        if (written < 0 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            return -1;
+        data += written;
+        length -= written;
+        offset += written;
+    }
+    return 0;
+}
+
+// Bytes actually written for chunk, O_DIRECT wants whole blocks.
+static size_t storage_padded(struct storage *st, struct storage_chunk *chunk) {
+    if (!st->direct)
+        return chunk->length;
+    return (chunk->length + STORAGE_ALIGNMENT - 1) / STORAGE_ALIGNMENT * STORAGE_ALIGNMENT;
+}
+
+static void storage_completed(struct storage *st, struct storage_chunk *chunk, size_t size) {
+    uint64_t now = lgp_now_ns();
+
+    metrics_latency(&st->stats.latency, now - chunk->submitted);
+    st->stats.inflight -= size;
+    st->stats.bytes += chunk->length;
+    st->stats.writes++;
+    chunk->busy = 0;
+    chunk->length = 0;
+}
+
+// Rest of a short write. It starts wherever the write stopped, which O_DIRECT
+// refuses, so it goes through a second, buffered descriptor then.
+static int storage_writetail(struct storage *st, const unsigned char *data, size_t length, uint64_t offset) {
+    if (!st->direct)
+        return storage_pwriteall(st->fd, data, length, offset);
+
+    int fd = open(st->segmentpath, O_WRONLY | O_CLOEXEC);
+    if (fd < 0)
+        return -1;
+    int err = storage_pwriteall(fd, data, length, offset);
+    if (close(fd) != 0)
+        err = -1;
+    return err;
+}
+
+// Takes every completion there is, waits for one first when wait is set. A failed
+// write marks the storage failed, -1 is only for the ring itself.
+static int storage_reap(struct storage *st, int wait) {
+    struct storage_uring *ring = &st->ring;
+
+    if (wait && uring_enter(ring->fd, 0, 1, IORING_ENTER_GETEVENTS) < 0 && errno != EINTR) {
+        fprintf(stderr, "Storage: waiting on io_uring failed: %s\n", strerror(errno));
+        return -1;
+    }
+
+    unsigned int head = *ring->cqhead;
+    unsigned int tail = __atomic_load_n(ring->cqtail, __ATOMIC_ACQUIRE);
+    for (; head != tail; head++) {
+        struct io_uring_cqe *cqe = &((struct io_uring_cqe*) ring->cqes)[head & *ring->cqmask];
+        struct storage_chunk *chunk = &st->chunks[cqe->user_data];
+        size_t size = storage_padded(st, chunk);
+        int err = 0;
+
+        if ((cqe->res == -EINVAL || cqe->res == -EOPNOTSUPP) && (st->stats.writes == 0 || st->backend == STORAGE_PWRITE)) {
+            // Writes through io_uring are newer than io_uring itself, pwrite() from now on
+            if (st->backend == STORAGE_URING)
+                fprintf(stderr, "Storage: io_uring cannot write here (%s), falling back to pwrite\n", strerror(-cqe->res));
+            st->backend = STORAGE_PWRITE;
+            err = storage_pwriteall(st->fd, chunk->data, size, chunk->offset);
+        } else if (cqe->res < 0) {
+            fprintf(stderr, "Storage: write to %s failed: %s\n", st->segmentpath, strerror(-cqe->res));
+            err = -1;
+        } else if ((size_t) cqe->res < size) {
+            // Out of space or interrupted, the rest goes synchronously
+            err = storage_writetail(st, chunk->data + cqe->res, size - cqe->res, chunk->offset + cqe->res);
+        }
+        if (err != 0) {
+            st->stats.errors++;
+            st->failed = 1;
+        }
+        storage_completed(st, chunk, size);
+    }
+    __atomic_store_n(ring->cqhead, head, __ATOMIC_RELEASE);
+    return 0;
+}
+
+static int storage_submit(struct storage *st, struct storage_chunk *chunk) {
+    size_t size = storage_padded(st, chunk);
+
+    // Zeros up to the block, cut off again when the segment is closed
+    if (size > chunk->length)
+        memset(chunk->data + chunk->length, 0, size - chunk->length);
+    chunk->submitted = lgp_now_ns();
+    st->stats.inflight += size;
+    if (st->stats.inflight > st->stats.maxinflight)
+        st->stats.maxinflight = st->stats.inflight;
+
+    if (st->backend == STORAGE_PWRITE) {
+        int err = storage_pwriteall(st->fd, chunk->data, size, chunk->offset);
+        storage_completed(st, chunk, size);
+        if (err != 0) {
+            fprintf(stderr, "Storage: write to %s failed: %s\n", st->segmentpath, strerror(errno));
+            st->stats.errors++;
+        }
+        return err;
+    }
+
+    struct storage_uring *ring = &st->ring;
+    unsigned int tail = *ring->sqtail;
+    unsigned int index = tail & *ring->sqmask;
+    struct io_uring_sqe *sqe = &((struct io_uring_sqe*) ring->sqes)[index];
+    memset(sqe, 0, sizeof (struct io_uring_sqe));
+    sqe->opcode = IORING_OP_WRITE;
+    sqe->fd = st->fd;
+    sqe->addr = (uint64_t) (uintptr_t) chunk->data;
+    sqe->len = size;
+    sqe->off = chunk->offset;
+    sqe->user_data = chunk - st->chunks;
+    ring->sqarray[index] = index;
+    __atomic_store_n(ring->sqtail, tail + 1, __ATOMIC_RELEASE);
+    chunk->busy = 1;
+
+    if (uring_enter(ring->fd, 1, 0, 0) != 1) {
+        fprintf(stderr, "Storage: io_uring submission failed: %s\n", strerror(errno));
+        st->stats.errors++;
+        // Without SQPOLL the kernel only takes entries in io_uring_enter(), this one it did not:
+        // withdrawn, or closing the segment would wait for a completion that never comes
+        __atomic_store_n(ring->sqtail, tail, __ATOMIC_RELEASE);
+        chunk->busy = 0;
+        st->stats.inflight -= size;
+        return -1;
+    }
+    return 0;
+}
+
+// Reserves the next stretch of the segment before the writes get there.
+static void storage_reserve(struct storage *st, uint64_t upto) {
+    if (st->config.preallocate == 0 || upto <= st->reserved)
+        return;
+    uint64_t length = st->config.preallocate;
+    if (st->config.segmentbytes > 0 && st->reserved == 0)
+        length = st->config.segmentbytes + st->config.chunksize;
+    // The size stays that of the data, a crash leaves no zeros at the end
+    if (fallocate(st->fd, FALLOC_FL_KEEP_SIZE, st->reserved, length) != 0) {
+        if (st->reserved == 0)
+            fprintf(stderr, "Storage: no preallocation on %s (%s)\n", st->segmentpath, strerror(errno));
+        st->config.preallocate = 0;
+        return;
+    }
+    st->reserved += length;
+    st->stats.preallocated += length;
+}
+
+static int storage_opensegment(struct storage *st) {
+    if (st->config.segmentbytes == 0 && st->config.segmentduration == 0) {
+        snprintf(st->segmentpath, sizeof (st->segmentpath), "%s", st->path);
+    } else {
+        // capture.h264 is cut in capture-0000.h264, capture-0001.h264...
+        const char *extension = strrchr(st->path, '.');
+        int stem = extension != NULL ? (int) (extension - st->path) : (int) strlen(st->path);
+        snprintf(st->segmentpath, sizeof (st->segmentpath), "%.*s-%.4u%s", stem, st->path, st->segment, extension != NULL ? extension : "");
+    }
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    st->fd = open(st->segmentpath, flags | (st->direct ? O_DIRECT : 0), 0644);
+    if (st->fd < 0 && st->direct && errno == EINVAL) {
+        fprintf(stderr, "Storage: no O_DIRECT on the filesystem of %s, going through the page cache\n", st->segmentpath);
+        st->direct = 0;
+        st->fd = open(st->segmentpath, flags, 0644);
+    }
+    if (st->fd < 0) {
+        fprintf(stderr, "Failed to open capture file %s: %s\n", st->segmentpath, strerror(errno));
+        return -1;
+    }
+
+    st->segmentlength = 0;
+    st->segmentstart = 0;
+    st->reserved = 0;
+    st->stats.segments++;
+    storage_reserve(st, 1);
+    return 0;
+}
+
+// Writes the last chunk, waits for the segment and cuts the padding off.
+static int storage_closesegment(struct storage *st) {
+    struct storage_chunk *chunk = &st->chunks[st->current];
+    int err = 0;
+
+    if (chunk->length > 0 && storage_submit(st, chunk) != 0)
+        err = -1;
+    // Every write still in flight lands before the file is cut and closed, even
+    // when the last one failed. Writes submitted before a fallback to pwrite()
+    // still come back through the ring too.
+    while (st->stats.inflight > 0) {
+        if (storage_reap(st, 1) != 0) {
+            err = -1;
+            break;
+        }
+    }
+    if (st->failed)
+        err = -1;
+    if (ftruncate(st->fd, st->segmentlength) != 0)
+        err = -1;
+    if (close(st->fd) != 0)
+        err = -1;
+    st->fd = -1;
+    return err;
+}
+
+int storage_open(struct storage *st, const char *path, const struct storage_config *config) {
+    memset(st, 0, sizeof (struct storage));
+    st->config = *config;
+    st->fd = -1;
+    st->ring.fd = -1;
+    snprintf(st->path, sizeof (st->path), "%s", path);
+
+    if (st->config.chunksize < STORAGE_ALIGNMENT)
+        st->config.chunksize = STORAGE_DEFAULT_CHUNK;
+    st->config.chunksize = st->config.chunksize / STORAGE_ALIGNMENT * STORAGE_ALIGNMENT;
+    if (st->config.depth == 0)
+        st->config.depth = STORAGE_DEFAULT_DEPTH;
+    st->backend = config->backend;
+    st->direct = config->direct;
+
+    if (st->backend == STORAGE_URING && storage_uringopen(&st->ring, st->config.depth) != 0) {
+        fprintf(stderr, "Storage: no io_uring (%s), falling back to pwrite\n", strerror(errno));
+        st->backend = STORAGE_PWRITE;
+    }
+    // pwrite() only ever has the chunk being filled and the one written
+    if (st->backend == STORAGE_PWRITE)
+        st->config.depth = 1;
+
+    st->chunks = (struct storage_chunk*) calloc(st->config.depth, sizeof (struct storage_chunk));
+    check(st->chunks != NULL, "Failed to allocate the storage chunks!");
+    for (size_t i = 0; i < st->config.depth; i++) {
+        check(posix_memalign((void**) &st->chunks[i].data, STORAGE_ALIGNMENT, st->config.chunksize) == 0, "Failed to allocate %zu storage chunks of %zu bytes!", st->config.depth, st->config.chunksize);
+        // Touched now, the writer thread never faults on them
+        memset(st->chunks[i].data, 0, st->config.chunksize);
+    }
+
+    check(storage_opensegment(st) == 0, "Failed to open %s!", path);
+    return 0;
+
+error:
+    storage_close(st);
+    return -1;
+}
+
+static int storage_due(struct storage *st, uint64_t timestamp) {
+    if (st->segmentlength == 0)
+        return 0;
+    if (st->config.segmentbytes > 0 && st->segmentlength >= st->config.segmentbytes)
+        return 1;
+    return st->config.segmentduration > 0 && timestamp - st->segmentstart >= st->config.segmentduration;
+}
+
+static int storage_append(struct storage *st, const unsigned char *data, size_t length) {
+    while (length > 0) {
+        struct storage_chunk *chunk = &st->chunks[st->current];
+
+        if (chunk->length == 0)
+            chunk->offset = st->segmentlength;
+        size_t copied = st->config.chunksize - chunk->length;
+        if (copied > length)
+            copied = length;
+        memcpy(chunk->data + chunk->length, data, copied);
+        chunk->length += copied;
+        st->segmentlength += copied;
+        data += copied;
+        length -= copied;
+
+        if (chunk->length < st->config.chunksize)
+            break;
+        storage_reserve(st, st->segmentlength + st->config.chunksize);
+        if (storage_submit(st, chunk) != 0)
+            return -1;
+
+        // Next chunk, once its previous write is done
+        st->current = (st->current + 1) % st->config.depth;
+        if (st->chunks[st->current].busy)
+            st->stats.waits++;
+        while (st->chunks[st->current].busy) {
+            if (storage_reap(st, 1) != 0)
+                return -1;
+        }
+    }
+
+    // Completions of the writes still going are taken without waiting
+    if (st->stats.inflight > 0 && storage_reap(st, 0) != 0)
+        return -1;
+    return st->failed ? -1 : 0;
+}
+
+int storage_write(struct storage *st, const unsigned char *data, size_t length, uint64_t timestamp, size_t cut) {
+    if (st->failed || st->fd < 0)
+        return -1;
+
+    if (cut <= length && storage_due(st, timestamp)) {
+        int err = storage_append(st, data, cut);
+        if (err == 0)
+            err = storage_closesegment(st);
+        st->segment++;
+        if (err == 0)
+            err = storage_opensegment(st);
+        if (err != 0) {
+            st->failed = 1;
+            return -1;
+        }
+        data += cut;
+        length -= cut;
+    }
+
+    if (st->segmentstart == 0)
+        st->segmentstart = timestamp;
+    if (storage_append(st, data, length) != 0) {
+        st->failed = 1;
+        return -1;
+    }
+    return 0;
+}
+
+int storage_close(struct storage *st) {
+    int err = st->failed ? -1 : 0;
+
+    if (st->fd >= 0 && storage_closesegment(st) != 0)
+        err = -1;
+    storage_uringclose(&st->ring);
+    // With the ring broken the kernel may still read from the chunks, they are left to it
+    if (st->chunks != NULL && st->stats.inflight == 0) {
+        for (size_t i = 0; i < st->config.depth; i++)
+            free(st->chunks[i].data);
+        free(st->chunks);
+    }
+    st->chunks = NULL;
+    return err;
+}
+
+void storage_report(struct storage *st, FILE *out) {
+    struct metrics_histogram *h = &st->stats.latency;
+    uint64_t count = atomic_load_explicit(&h->count, memory_order_relaxed);
+
+    fprintf(out, "Storage (%s%s): %llu bytes in %llu writes of %zu KiB, %llu segments, %llu bytes in flight (max %llu), %llu waits, %llu MiB preallocated, latency p50 %.2f ms p99 %.2f ms max %.2f ms, segment %u\n",
+            storage_backendname(st->backend), st->direct ? ", O_DIRECT" : "",
+            (unsigned long long) st->stats.bytes, (unsigned long long) st->stats.writes, st->config.chunksize / 1024,
+            (unsigned long long) st->stats.segments, (unsigned long long) st->stats.inflight, (unsigned long long) st->stats.maxinflight,
+            (unsigned long long) st->stats.waits, (unsigned long long) (st->stats.preallocated >> 20),
+            count > 0 ? metrics_quantile(h, 0.5) / 1e6 : 0.0, count > 0 ? metrics_quantile(h, 0.99) / 1e6 : 0.0,
+            atomic_load_explicit(&h->max, memory_order_relaxed) / 1e6, st->segment);
+}
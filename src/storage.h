@@ -0,0 +1,112 @@
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "metrics.h"
+
+// Recording sink writing the stream around the page cache: data is copied
+// into aligned chunks written with O_DIRECT, several at once through an
+// io_uring, or one after the other with pwrite() where the kernel has no
+// io_uring for us. Space is reserved with fallocate() ahead of the writes,
+// and the recording is cut in segments by size or duration. Segments only
+// start where the caller says a new one may, so that every one of them
+// plays on its own; nothing is dropped at a cut, the segments put back
+// together are the stream.
+
+#define STORAGE_ALIGNMENT			4096
+#define STORAGE_DEFAULT_CHUNK		(1024 * 1024)
+#define STORAGE_DEFAULT_DEPTH		4
+#define STORAGE_DEFAULT_PREALLOCATE	(64ULL * 1024 * 1024)
+
+// No segment may start in this write
+#define STORAGE_NOCUT		SIZE_MAX
+
+enum storage_backend {
+    STORAGE_URING,
+    STORAGE_PWRITE
+};
+
+struct storage_config {
+    enum storage_backend backend;	// io_uring falls back to pwrite() when the kernel refuses it
+    int direct;						// O_DIRECT, falls back to the page cache when the filesystem refuses it
+    size_t chunksize;				// multiple of STORAGE_ALIGNMENT
+    size_t depth;					// chunks written at once, io_uring only
+    uint64_t preallocate;			// bytes reserved ahead of the writes, 0 for none
+    uint64_t segmentbytes;			// cut after this much, 0 for never
+    uint64_t segmentduration;		// ns, cut after this long, 0 for never
+};
+
+struct storage_chunk {
+    unsigned char *data;
+    size_t length;			// stream bytes, the write is padded to the alignment
+    uint64_t offset;		// in the segment
+    uint64_t submitted;		// ns
+    int busy;
+};
+
+struct storage_uring {
+    int fd;
+    void *sqring;
+    size_t sqsize;
+    void *cqring;
+    size_t cqsize;
+    void *sqes;
+    size_t sqessize;
+    unsigned int *sqtail;
+    unsigned int *sqmask;
+    unsigned int *sqarray;
+    unsigned int *cqhead;
+    unsigned int *cqtail;
+    unsigned int *cqmask;
+    void *cqes;
+};
+
+struct storage_stats {
+    uint64_t bytes;			// stream bytes written
+    uint64_t writes;
+    uint64_t segments;
+    uint64_t inflight;		// bytes submitted and not completed yet
+    uint64_t maxinflight;
+    uint64_t waits;			// no chunk free, waited for a write to complete
+    uint64_t errors;
+    uint64_t preallocated;	// bytes reserved with fallocate()
+    struct metrics_histogram latency;	// submission to completion of every write
+};
+
+struct storage {
+    struct storage_config config;
+    enum storage_backend backend;
+    int direct;
+    char path[128];			// as given, segments are named after it
+    char segmentpath[144];
+
+    int fd;
+    unsigned int segment;
+    uint64_t segmentlength;	// stream bytes, written or in a chunk
+    uint64_t segmentstart;	// ns, timestamp of its first data, 0 until then
+    uint64_t reserved;		// end of the space reserved in the segment
+
+    struct storage_chunk *chunks;
+    size_t current;			// chunk being filled
+    struct storage_uring ring;
+
+    int failed;
+    struct storage_stats stats;
+};
+
+void storage_defaults(struct storage_config *config);
+
+// Opens the first segment, path itself when the recording is not cut.
+int storage_open(struct storage *st, const char *path, const struct storage_config *config);
+// Appends length bytes of stream data with the host time they came in. A new
+// segment may start at cut, an offset in data, once the current one is due.
+int storage_write(struct storage *st, const unsigned char *data, size_t length, uint64_t timestamp, size_t cut);
+// Writes what is left and waits for every write.
+int storage_close(struct storage *st);
+
+const char *storage_backendname(enum storage_backend backend);
+void storage_report(struct storage *st, FILE *out);
+
+#endif
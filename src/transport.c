@@ -0,0 +1,70 @@
+#include "transport.h"
+
+#include <string.h>
+
+static int libusb_backend_bulk_transfer(struct transport *t, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    return libusb_bulk_transfer(t->handle, endpoint, data, length, transferred, timeout);
+}
+
+static struct libusb_transfer *libusb_backend_alloc_transfer(struct transport *t) {
+    (void) t;
+    return libusb_alloc_transfer(0);
+}
+
+static void libusb_backend_free_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    (void) t;
+    libusb_free_transfer(transfer);
+}
+
+static int libusb_backend_submit_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    (void) t;
+    return libusb_submit_transfer(transfer);
+}
+
+static int libusb_backend_cancel_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    (void) t;
+    return libusb_cancel_transfer(transfer);
+}
+
+static int libusb_backend_handle_events(struct transport *t, struct timeval *tv) {
+    return libusb_handle_events_timeout_completed(t->context, tv, NULL);
+}
+
+static int libusb_backend_wait_events(struct transport *t, struct timeval *tv) {
+    // Woken whenever the thread holding the event lock is done with a round of events
+    libusb_lock_event_waiters(t->context);
+    libusb_wait_for_event(t->context, tv);
+    libusb_unlock_event_waiters(t->context);
+    return 0;
+}
+
+static void libusb_backend_close(struct transport *t) {
+    (void) t;
+    // The handle belongs to whoever opened the device
+}
+
+static const struct transport_ops libusb_backend_ops = {
+    .bulk_transfer = libusb_backend_bulk_transfer,
+    .alloc_transfer = libusb_backend_alloc_transfer,
+    .free_transfer = libusb_backend_free_transfer,
+    .submit_transfer = libusb_backend_submit_transfer,
+    .cancel_transfer = libusb_backend_cancel_transfer,
+    .handle_events = libusb_backend_handle_events,
+    .wait_events = libusb_backend_wait_events,
+    .close = libusb_backend_close,
+};
+
+int transport_open_libusb(struct transport *t, libusb_context *context, libusb_device_handle *handle) {
+    memset(t, 0, sizeof (struct transport));
+    t->ops = &libusb_backend_ops;
+    t->name = "libusb";
+    t->context = context;
+    t->handle = handle;
+    return 0;
+}
+
+void transport_close(struct transport *t) {
+    if (t->ops != NULL && t->ops->close != NULL)
+        t->ops->close(t);
+    t->ops = NULL;
+}
@@ -0,0 +1,151 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <libusb-1.0/libusb.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+#include "dmapool.h"
+#include "lgp.h"
+#include "metrics.h"
+#include "usbtrace.h"
+
+// Every exchange with the C875 goes through a transport, so the same code
+// can drive the real device through libusb or the in-process emulator.
+// Errors are libusb error codes and async transfers are libusb_transfer
+// structures for both backends, but they must be allocated, submitted and
+// cancelled through the transport.
+
+struct transport;
+
+struct transport_ops {
+    int (*bulk_transfer)(struct transport *t, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout);
+    struct libusb_transfer *(*alloc_transfer)(struct transport *t);
+    void (*free_transfer)(struct transport *t, struct libusb_transfer *transfer);
+    int (*submit_transfer)(struct transport *t, struct libusb_transfer *transfer);
+    int (*cancel_transfer)(struct transport *t, struct libusb_transfer *transfer);
+    // Runs the completion callbacks of finished async transfers, waits at most tv.
+    int (*handle_events)(struct transport *t, struct timeval *tv);
+    // Waits at most tv for the thread handling the events to run some callbacks, without handling any.
+    int (*wait_events)(struct transport *t, struct timeval *tv);
+    void (*close)(struct transport *t);
+};
+
+struct transport {
+    const struct transport_ops *ops;
+    const char *name;
+    libusb_context *context;		// libusb backend only
+    libusb_device_handle *handle;	// libusb backend only
+    void *priv;						// backend state
+    struct metrics *metrics;		// NULL unless the exchanges are measured
+    uint64_t commandsent;			// ns, start of the last EP. 04 command of this device not answered yet
+    int lateanswer;					// an EP. 83 answer was given up on and may still come, see scheduler_run()
+    struct usbtrace *trace;			// NULL unless the transfers are traced
+    struct dmapool *pool;			// NULL when transfer buffers come from the heap
+    atomic_int pumped;				// another thread handles the events, see transport_await()
+    uint16_t busnum;				// USB address the traces show, 0 when unknown
+    uint8_t devnum;
+};
+
+// Wraps a device handle already configured and claimed.
+int transport_open_libusb(struct transport *t, libusb_context *context, libusb_device_handle *handle);
+void transport_close(struct transport *t);
+
+static inline enum metrics_series transport_series(unsigned char endpoint) {
+    switch (endpoint) {
+        case CAMERA_ENDPOINT_ADDRESS_CONTROL:
+            return METRICS_COMMAND;
+        case CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE:
+            return METRICS_STATUS;
+        case CAMERA_ENDPOINT_ADDRESS_VIDEO_CONTROL:
+            return METRICS_FIRMWARE;
+        default:
+            return METRICS_VIDEO;
+    }
+}
+
+static inline int transport_bulk_transfer(struct transport *t, unsigned char endpoint, unsigned char *data, int length, int *transferred, unsigned int timeout) {
+    if (t->metrics == NULL && t->trace == NULL)
+        return t->ops->bulk_transfer(t, endpoint, data, length, transferred, timeout);
+
+    uint64_t start = lgp_now_ns();
+    int err = t->ops->bulk_transfer(t, endpoint, data, length, transferred, timeout);
+    uint64_t end = lgp_now_ns();
+    if (t->trace != NULL)
+        usbtrace_add(t->trace, t->busnum, t->devnum, endpoint, data, length, *transferred, usbtrace_errno(err), start, end);
+    if (t->metrics == NULL)
+        return err;
+
+    enum metrics_status status = err == 0 ? METRICS_OK : err == LIBUSB_ERROR_TIMEOUT ? METRICS_TIMEOUT : METRICS_ERROR;
+    metrics_record(t->metrics, transport_series(endpoint), status, *transferred, end - start);
+
+    // A command answered on EP. 83 closes its round trip, from the start of the command
+    if (endpoint == CAMERA_ENDPOINT_ADDRESS_CONTROL && err == 0) {
+        t->commandsent = start;
+    } else if (endpoint == CAMERA_ENDPOINT_ADDRESS_STATUS_RESPONSE && t->commandsent != 0 && *transferred > 0) {
+        metrics_record(t->metrics, METRICS_ROUNDTRIP, METRICS_OK, 0, end - t->commandsent);
+        t->commandsent = 0;
+    }
+    return err;
+}
+
+// Buffers handed to transfers, from the DMA pool of the device when it has one.
+static inline unsigned char *transport_alloc_buffer(struct transport *t, size_t size) {
+    return t->pool != NULL ? dmapool_get(t->pool, size) : (unsigned char*) malloc(size);
+}
+
+static inline void transport_free_buffer(struct transport *t, unsigned char *buffer, size_t size) {
+    if (t->pool != NULL)
+        dmapool_put(t->pool, buffer, size);
+    else
+        free(buffer);
+}
+
+static inline struct libusb_transfer *transport_alloc_transfer(struct transport *t) {
+    return t->ops->alloc_transfer(t);
+}
+
+static inline void transport_free_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    t->ops->free_transfer(t, transfer);
+}
+
+static inline void transport_fill_bulk_transfer(struct transport *t, struct libusb_transfer *transfer, unsigned char endpoint,
+        unsigned char *buffer, int length, libusb_transfer_cb_fn callback, void *userdata, unsigned int timeout) {
+    libusb_fill_bulk_transfer(transfer, t->handle, endpoint, buffer, length, callback, userdata, timeout);
+}
+
+static inline int transport_submit_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    return t->ops->submit_transfer(t, transfer);
+}
+
+static inline int transport_cancel_transfer(struct transport *t, struct libusb_transfer *transfer) {
+    return t->ops->cancel_transfer(t, transfer);
+}
+
+// Records an async transfer from its completion callback, queued at submitted and done at now.
+static inline void transport_record(struct transport *t, struct libusb_transfer *transfer, uint64_t submitted, uint64_t now) {
+    if (t->trace != NULL)
+        usbtrace_add(t->trace, t->busnum, t->devnum, transfer->endpoint, transfer->buffer, transfer->length, transfer->actual_length,
+                usbtrace_transfererrno(transfer->status), submitted, now);
+    if (t->metrics == NULL || transfer->status == LIBUSB_TRANSFER_CANCELLED)
+        return;
+    enum metrics_status status = transfer->status == LIBUSB_TRANSFER_COMPLETED ? METRICS_OK :
+            transfer->status == LIBUSB_TRANSFER_TIMED_OUT ? METRICS_TIMEOUT : METRICS_ERROR;
+    metrics_record(t->metrics, transport_series(transfer->endpoint), status, transfer->actual_length, now - submitted);
+}
+
+static inline int transport_handle_events(struct transport *t, struct timeval *tv) {
+    return t->ops->handle_events(t, tv);
+}
+
+// Lets async transfers complete for at most tv: handles the events, unless the
+// capture already has a thread doing it. Its callbacks then stay on that thread,
+// a second one handling events would run them here as well.
+static inline int transport_await(struct transport *t, struct timeval *tv) {
+    if (atomic_load(&t->pumped))
+        return t->ops->wait_events(t, tv);
+    return t->ops->handle_events(t, tv);
+}
+
+#endif
@@ -0,0 +1,245 @@
+#include "tuning.h"
+#include "lgp.h"
+
+#include <limits.h>
+#include <math.h>
+#include <stdatomic.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+static const size_t sizes[TUNING_SIZES] = { 16384, 32768, 65536, 131072, TUNING_MAX_TRANSFER };
+static const size_t depths[TUNING_DEPTHS] = { 2, 4, 8, 16, TUNING_MAX_DEPTH };
+
+// Filled on the event thread of the capture, read once it is stopped
+struct tuning_meter {
+    atomic_int measuring;
+    uint64_t bytes;			// after the first completion measured
+    uint64_t completions;
+    uint64_t first;			// ns, first completion measured, 0 until then
+    uint64_t last;			// ns
+    uint64_t gaps;
+    double mean;			// ns, of the gaps so far
+    double squares;			// sum of the squared deviations from the mean, Welford
+    uint64_t maxgap;		// ns
+};
+
+static struct streambuffer *tuning_count(void *userdata, struct streambuffer *buffer) {
+    struct tuning_meter *meter = (struct tuning_meter*) userdata;
+
+    if (!atomic_load_explicit(&meter->measuring, memory_order_relaxed))
+        return buffer;
+    meter->completions++;
+    if (meter->first == 0)
+        meter->first = buffer->timestamp;
+    else
+        meter->bytes += buffer->length;
+    if (meter->last != 0) {
+        uint64_t gap = buffer->timestamp - meter->last;
+        double delta = gap - meter->mean;
+        meter->gaps++;
+        meter->mean += delta / meter->gaps;
+        meter->squares += delta * (gap - meter->mean);
+        if (gap > meter->maxgap)
+            meter->maxgap = gap;
+    }
+    meter->last = buffer->timestamp;
+    return buffer;
+}
+
+static double tuning_cputime(const struct rusage *usage) {
+    return usage->ru_utime.tv_sec * 1e3 + usage->ru_utime.tv_usec / 1e3 + usage->ru_stime.tv_sec * 1e3 + usage->ru_stime.tv_usec / 1e3;
+}
+
+void tuning_identify(struct transport *transport, char *host, size_t hostsize, char *controller, size_t controllersize) {
+    char path[64];
+    char resolved[PATH_MAX];
+    char link[PATH_MAX + 8];
+    char driver[PATH_MAX];
+
+    if (gethostname(host, hostsize) != 0 || host[0] == '\0')
+        snprintf(host, hostsize, "localhost");
+    host[hostsize - 1] = '\0';
+
+    if (transport->handle == NULL) {
+        snprintf(controller, controllersize, "%s", transport->name);
+        return;
+    }
+
+    // The root hub of the bus sits in the sysfs directory of its controller: .../0000:00:14.0/usb1
+    unsigned int bus = libusb_get_bus_number(libusb_get_device(transport->handle));
+    snprintf(controller, controllersize, "bus%u", bus);
+    snprintf(path, sizeof (path), "/sys/bus/usb/devices/usb%u", bus);
+    if (realpath(path, resolved) == NULL)
+        return;
+    char *slash = strrchr(resolved, '/');
+    if (slash == NULL)
+        return;
+    *slash = '\0';
+    const char *address = strrchr(resolved, '/');
+    address = address != NULL ? address + 1 : resolved;
+
+    snprintf(link, sizeof (link), "%s/driver", resolved);
+    ssize_t length = readlink(link, driver, sizeof (driver) - 1);
+    if (length <= 0)
+        return;
+    driver[length] = '\0';
+    const char *name = strrchr(driver, '/');
+    snprintf(controller, controllersize, "%s@%s", name != NULL ? name + 1 : driver, address);
+}
+
+void tuning_init(struct tuning *tn) {
+    memset(tn, 0, sizeof (struct tuning));
+    for (size_t i = 0; i < TUNING_SIZES; i++) {
+        for (size_t j = 0; j < TUNING_DEPTHS; j++) {
+            struct tuning_result *result = &tn->results[tn->count++];
+            result->transfersize = sizes[i];
+            result->depth = depths[j];
+        }
+    }
+    tn->best = -1;
+}
+
+int tuning_measure(struct tuning_result *result, struct transport *transport, unsigned int dwell) {
+    struct tuning_meter meter;
+    struct capture cap;
+    struct rusage before, after;
+
+    memset(&meter, 0, sizeof (meter));
+    result->measured = 0;
+    result->failed = 1;
+    if (capture_init(&cap, transport, result->depth, result->transfersize, NULL, tuning_count, &meter) != 0)
+        return -1;
+    if (capture_start(&cap) != 0) {
+        capture_stop(&cap);
+        capture_free(&cap);
+        return -1;
+    }
+
+    usleep(TUNING_WARMUP * 1000);
+    getrusage(RUSAGE_SELF, &before);
+    uint64_t start = lgp_now_ns();
+    atomic_store(&meter.measuring, 1);
+    usleep(dwell * 1000);
+    atomic_store(&meter.measuring, 0);
+    uint64_t elapsed = lgp_now_ns() - start;
+    getrusage(RUSAGE_SELF, &after);
+
+    int err = capture_stop(&cap);
+    double cpu = tuning_cputime(&after) - tuning_cputime(&before);
+    result->measured = 1;
+    result->failed = err != 0 || cap.stats.errors > 0;
+    // From the first completion to the last, whatever the transfer size a window of dwell cuts no transfer in half
+    result->throughput = meter.last > meter.first ? meter.bytes / ((meter.last - meter.first) / 1e9) : 0;
+    result->interval = meter.mean;
+    result->jitter = meter.gaps > 1 ? sqrt(meter.squares / (meter.gaps - 1)) : 0;
+    result->maxgap = meter.maxgap;
+    result->cpu = cpu / (elapsed / 1e6);
+    result->cpupermib = meter.bytes > 0 ? cpu / (meter.bytes / 1048576.0) : 0;
+    result->completions = meter.completions;
+    capture_free(&cap);
+    return result->failed || meter.bytes == 0 ? -1 : 0;
+}
+
+static int tuning_usable(const struct tuning_result *result) {
+    return result->measured && !result->failed && result->throughput > 0;
+}
+
+static int tuning_eligible(const struct tuning_result *result, double fastest, double interval) {
+    return tuning_usable(result) && result->throughput >= fastest * (1 - TUNING_MARGIN) && result->interval <= interval;
+}
+
+int tuning_pick(struct tuning *tn) {
+    double fastest = 0;
+    double interval = INFINITY;
+    int bestscore = 0;
+
+    for (size_t i = 0; i < tn->count; i++) {
+        if (tuning_usable(&tn->results[i]) && tn->results[i].throughput > fastest)
+            fastest = tn->results[i].throughput;
+    }
+    // Transfers filling up slower than the capture tells a gap from would hold the stream back, unless all do
+    for (size_t i = 0; i < tn->count; i++) {
+        if (tuning_eligible(&tn->results[i], fastest, INFINITY) && tn->results[i].interval <= TUNING_MAX_INTERVAL)
+            interval = TUNING_MAX_INTERVAL;
+    }
+
+    // Score: how many of the others do better in jitter, plus in CPU time
+    tn->best = -1;
+    for (size_t i = 0; i < tn->count; i++) {
+        const struct tuning_result *r = &tn->results[i];
+        if (!tuning_eligible(r, fastest, interval))
+            continue;
+
+        int score = 0;
+        for (size_t j = 0; j < tn->count; j++) {
+            const struct tuning_result *other = &tn->results[j];
+            if (!tuning_eligible(other, fastest, interval))
+                continue;
+            score += other->jitter < r->jitter;
+            score += other->cpupermib < r->cpupermib;
+        }
+
+        const struct tuning_result *best = tn->best >= 0 ? &tn->results[tn->best] : NULL;
+        if (best == NULL || score < bestscore
+                || (score == bestscore && r->transfersize * r->depth < best->transfersize * best->depth)) {
+            tn->best = (int) i;
+            bestscore = score;
+        }
+    }
+    return tn->best;
+}
+
+void tuning_print(const struct tuning_result *result, FILE *out) {
+    fprintf(out, "Tuning: depth %zu x %zu bytes, %.2f MB/s, a completion every %.2f ms, jitter %.2f ms, max gap %.2f ms, CPU %.1f%% (%.3f ms per MiB), %llu completions%s\n",
+            result->depth, result->transfersize, result->throughput / (1024.0 * 1024.0), result->interval / 1e6, result->jitter / 1e6, result->maxgap / 1e6,
+            result->cpu * 100, result->cpupermib, (unsigned long long) result->completions, result->failed ? ", failed" : "");
+}
+
+int tuning_load(const char *path, const char *host, const char *controller, struct tuning_entry *entry) {
+    struct tuning_entry line;
+    int found = -1;
+
+    FILE *f = fopen(path, "r");
+    if (f == NULL)
+        return -1;
+    while (fscanf(f, "%63s %127s %zu %zu %lf %lf %lf", line.host, line.controller, &line.transfersize, &line.depth,
+            &line.throughput, &line.jitter, &line.cpu) == 7) {
+        if (strcmp(line.host, host) == 0 && strcmp(line.controller, controller) == 0 && line.transfersize > 0 && line.depth > 0) {
+            *entry = line;
+            found = 0;
+        }
+    }
+    fclose(f);
+    return found;
+}
+
+int tuning_store(const char *path, const struct tuning_entry *entry) {
+    struct tuning_entry line;
+    char temppath[4096];
+
+    snprintf(temppath, sizeof (temppath), "%s.tmp", path);
+    FILE *out = fopen(temppath, "w");
+    if (out == NULL)
+        return -1;
+
+    FILE *in = fopen(path, "r");
+    if (in != NULL) {
+        while (fscanf(in, "%63s %127s %zu %zu %lf %lf %lf", line.host, line.controller, &line.transfersize, &line.depth,
+                &line.throughput, &line.jitter, &line.cpu) == 7) {
+            if (strcmp(line.host, entry->host) != 0 || strcmp(line.controller, entry->controller) != 0)
+                fprintf(out, "%s %s %zu %zu %.2f %.3f %.1f\n", line.host, line.controller, line.transfersize, line.depth,
+                        line.throughput, line.jitter, line.cpu);
+        }
+        fclose(in);
+    }
+    fprintf(out, "%s %s %zu %zu %.2f %.3f %.1f\n", entry->host, entry->controller, entry->transfersize, entry->depth,
+            entry->throughput, entry->jitter, entry->cpu);
+
+    if (fclose(out) != 0 || rename(temppath, path) != 0) {
+        unlink(temppath);
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,80 @@
+#ifndef TUNING_H
+#define TUNING_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "capture.h"
+#include "transport.h"
+
+// Transfer size and depth of the EP. 81 stream, measured instead of guessed.
+// Every setting of a grid streams for a while on its own capture; what the
+// host controller makes of it is the throughput, how regularly the transfers
+// complete (the standard deviation of the time between two completions) and
+// the CPU time of the process per MiB. The best setting is kept in a file,
+// one line per host and controller, which later runs look theirs up in.
+
+#define TUNING_DEFAULT_FILE		"lgp_tuning.state"
+#define TUNING_DEFAULT_DWELL	1000		// ms measured per setting
+#define TUNING_WARMUP			250			// ms streamed before measuring, the queue fills up
+#define TUNING_MARGIN			0.02		// throughput this close to the best counts as the best
+#define TUNING_MAX_INTERVAL		CAPTURE_DEFAULT_GAP_THRESHOLD	// ns a transfer may take to fill up, the stream is late otherwise
+
+// 16 to 256 KiB, all multiples of USB_BULK_MAX_PACKET_SIZE, times 2 to 32 transfers in flight
+#define TUNING_SIZES			5
+#define TUNING_DEPTHS			5
+#define TUNING_SETTINGS			(TUNING_SIZES * TUNING_DEPTHS)
+#define TUNING_MAX_TRANSFER		(256 * 1024)
+#define TUNING_MAX_DEPTH		32
+
+struct tuning_result {
+    size_t transfersize;
+    size_t depth;
+    int measured;
+    int failed;				// the capture stopped, or a transfer failed
+    double throughput;		// bytes/s
+    double interval;		// ns, mean time between two completions
+    double jitter;			// ns, standard deviation of it
+    uint64_t maxgap;		// ns
+    double cpu;				// share of one core
+    double cpupermib;		// ms
+    uint64_t completions;
+};
+
+struct tuning {
+    struct tuning_result results[TUNING_SETTINGS];
+    size_t count;
+    int best;				// index in results, -1 until picked
+};
+
+// What a later run on the same host and controller starts with
+struct tuning_entry {
+    char host[64];
+    char controller[128];	// "<driver>@<PCI address>" of the host controller, "emulator", or "bus<n>"
+    size_t transfersize;
+    size_t depth;
+    double throughput;		// MB/s, as measured
+    double jitter;			// ms
+    double cpu;				// %
+};
+
+// Host name and the controller the device of transport hangs off.
+void tuning_identify(struct transport *transport, char *host, size_t hostsize, char *controller, size_t controllersize);
+
+// Every setting of the sweep, none measured yet.
+void tuning_init(struct tuning *tn);
+// Streams with one setting for TUNING_WARMUP and then dwell ms, on a capture and event thread of its own.
+int tuning_measure(struct tuning_result *result, struct transport *transport, unsigned int dwell);
+// Of the settings within TUNING_MARGIN of the best throughput, and completing at least every
+// TUNING_MAX_INTERVAL if any does, the one ranking best in jitter and CPU time per MiB together;
+// ties go to the one with the least memory in flight. -1 if none.
+int tuning_pick(struct tuning *tn);
+void tuning_print(const struct tuning_result *result, FILE *out);
+
+// 0 with the entry of host and controller, -1 if path has none.
+int tuning_load(const char *path, const char *host, const char *controller, struct tuning_entry *entry);
+// Rewrites path with the line of the host and controller of entry replaced.
+int tuning_store(const char *path, const struct tuning_entry *entry);
+
+#endif
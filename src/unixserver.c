@@ -0,0 +1,94 @@
+#include "unixserver.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static void *unixserver_thread(void *arg) {
+    struct unixserver *server = (struct unixserver*) arg;
+
+    while (server->serving) {
+        int client = accept(server->listener, NULL, NULL);
+        if (client < 0) {
+            if (errno == EINTR || errno == ECONNABORTED)
+                continue;
+            break;
+        }
+        server->handler(server->userdata, client);
+        close(client);
+    }
+    return NULL;
+}
+
+void unixserver_init(struct unixserver *server) {
+    memset(server, 0, sizeof (struct unixserver));
+    server->listener = -1;
+}
+
+int unixserver_start(struct unixserver *server, const char *socketpath, const char *what, unixserver_handler handler, void *userdata) {
+    struct sockaddr_un address;
+    struct stat st;
+
+    if (strlen(socketpath) >= sizeof (address.sun_path)) {
+        fprintf(stderr, "Socket path %s is too long!\n", socketpath);
+        return -1;
+    }
+    memset(&address, 0, sizeof (address));
+    address.sun_family = AF_UNIX;
+    strcpy(address.sun_path, socketpath);
+    server->handler = handler;
+    server->userdata = userdata;
+    server->what = what;
+
+    // Left over by a previous run that did not get to clean up; a mistyped path to a file stays as it is
+    if (lstat(socketpath, &st) == 0) {
+        if (!S_ISSOCK(st.st_mode)) {
+            fprintf(stderr, "Failed to serve the %s on %s: there is a file that is not a socket there\n", what, socketpath);
+            return -1;
+        }
+        unlink(socketpath);
+    }
+
+    server->listener = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (server->listener < 0)
+        goto error;
+    if (bind(server->listener, (struct sockaddr*) &address, sizeof (address)) != 0 || listen(server->listener, 8) != 0)
+        goto error;
+    strcpy(server->socketpath, socketpath);
+
+    server->serving = 1;
+    if (pthread_create(&server->thread, NULL, unixserver_thread, server) != 0) {
+        server->serving = 0;
+        goto error;
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "Failed to serve the %s on %s: %s\n", what, socketpath, strerror(errno));
+    if (server->listener >= 0)
+        close(server->listener);
+    if (server->socketpath[0] != '\0')
+        unlink(server->socketpath);
+    server->listener = -1;
+    server->socketpath[0] = '\0';
+    return -1;
+}
+
+void unixserver_stop(struct unixserver *server) {
+    if (server->serving) {
+        server->serving = 0;
+        // Wakes the accept() of the serving thread
+        shutdown(server->listener, SHUT_RDWR);
+        pthread_join(server->thread, NULL);
+    }
+    if (server->listener >= 0)
+        close(server->listener);
+    if (server->socketpath[0] != '\0')
+        unlink(server->socketpath);
+    server->listener = -1;
+    server->socketpath[0] = '\0';
+}
@@ -0,0 +1,30 @@
+#ifndef UNIXSERVER_H
+#define UNIXSERVER_H
+
+#include <pthread.h>
+
+// A listening Unix socket and the thread answering it, one connection at a
+// time: the shared ring, the metrics and the control socket are served so.
+
+// Called on the serving thread for every connection, client is closed once it returns.
+typedef void (*unixserver_handler)(void *userdata, int client);
+
+struct unixserver {
+    int listener;			// -1 when not serving
+    char socketpath[108];
+    pthread_t thread;
+    volatile int serving;
+
+    unixserver_handler handler;
+    void *userdata;
+    const char *what;		// what is served, for the messages
+};
+
+void unixserver_init(struct unixserver *server);
+// Listens on socketpath. A socket left there by a run that did not get to clean
+// up is replaced; anything else at that path is left alone and fails the start.
+int unixserver_start(struct unixserver *server, const char *socketpath, const char *what, unixserver_handler handler, void *userdata);
+// Wakes the thread out of accept(), joins it and removes the socket.
+void unixserver_stop(struct unixserver *server);
+
+#endif
@@ -0,0 +1,197 @@
+#include "usbtrace.h"
+#include "lgp.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+// pcapng blocks, in host byte order as the section header announces it
+#define PCAPNG_SECTION_HEADER		0x0a0d0d0a
+#define PCAPNG_INTERFACE			0x00000001
+#define PCAPNG_ENHANCED_PACKET		0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC		0x1a2b3c4d
+#define PCAPNG_OPTION_TSRESOL		9
+
+// LINKTYPE_USB_LINUX_MMAPPED, usbmon packets with the 64 bytes header
+#define USBTRACE_LINKTYPE			220
+
+// struct mon_bin_hdr of the kernel, drivers/usb/mon/mon_bin.c
+struct usbmon_header {
+    uint64_t id;
+    uint8_t type;				// 'S'ubmission, 'C'ompletion
+    uint8_t transfertype;		// 3 for bulk
+    uint8_t epnum;				// with the direction bit
+    uint8_t devnum;
+    uint16_t busnum;
+    int8_t flagsetup;			// '-', no setup packet
+    int8_t flagdata;			// 0 when data follows, '<' or '>' otherwise
+    int64_t seconds;
+    int32_t microseconds;
+    int32_t status;
+    uint32_t length;			// of the URB
+    uint32_t captured;			// data bytes following the header
+    unsigned char setup[8];
+    int32_t interval;
+    int32_t startframe;
+    uint32_t transferflags;
+    uint32_t descriptors;
+};
+
+int usbtrace_init(struct usbtrace *trace, size_t records) {
+    struct timespec realtime;
+
+    memset(trace, 0, sizeof (struct usbtrace));
+    size_t capacity = 1;
+    while (capacity < records)
+        capacity *= 2;
+
+    // Every page is touched now, recording never faults
+    trace->records = (struct usbtrace_record*) calloc(capacity, sizeof (struct usbtrace_record));
+    if (trace->records == NULL) {
+        fprintf(stderr, "Failed to allocate the USB trace of %zu transfers!\n", capacity);
+        return -1;
+    }
+    memset(trace->records, 0, capacity * sizeof (struct usbtrace_record));
+    trace->mask = capacity - 1;
+
+    clock_gettime(CLOCK_REALTIME, &realtime);
+    uint64_t now = lgp_now_ns();
+    trace->realtimeoffset = (int64_t) ((uint64_t) realtime.tv_sec * 1000000000ULL + realtime.tv_nsec) - (int64_t) now;
+    return 0;
+}
+
+void usbtrace_free(struct usbtrace *trace) {
+    free(trace->records);
+    trace->records = NULL;
+}
+
+static int writeblock(FILE *f, uint32_t type, const void *body, size_t size, const void *data, size_t datasize) {
+    static const unsigned char padding[4];
+    size_t pad = (4 - datasize % 4) % 4;
+    uint32_t total = 12 + size + datasize + pad;
+
+    if (fwrite(&type, 4, 1, f) != 1 || fwrite(&total, 4, 1, f) != 1 || fwrite(body, size, 1, f) != 1)
+        return -1;
+    if (datasize > 0 && fwrite(data, datasize, 1, f) != 1)
+        return -1;
+    if (pad > 0 && fwrite(padding, pad, 1, f) != 1)
+        return -1;
+    return fwrite(&total, 4, 1, f) == 1 ? 0 : -1;
+}
+
+// One usbmon event of record, type 'S' or 'C'.
+static int writeevent(FILE *f, struct usbtrace *trace, const struct usbtrace_record *record, uint64_t id, char type) {
+    struct usbmon_header header;
+    unsigned char packet[sizeof (struct usbmon_header) + USBTRACE_SNAPLEN];
+    int in = (record->endpoint & 0x80) != 0;
+    int submission = type == 'S';
+
+    // Data travels with the submission going out and with the completion coming in
+    int hasdata = submission != in;
+    uint32_t length = submission ? record->length : record->actual;
+    uint32_t captured = hasdata ? record->captured : 0;
+
+    uint64_t timestamp = (submission ? record->submitted : record->completed) + trace->realtimeoffset;
+
+    memset(&header, 0, sizeof (header));
+    header.id = id;
+    header.type = type;
+    header.transfertype = 3;
+    header.epnum = record->endpoint;
+    header.devnum = record->devnum;
+    header.busnum = record->busnum;
+    header.flagsetup = '-';
+    header.flagdata = hasdata ? 0 : (in ? '<' : '>');
+    header.seconds = timestamp / 1000000000ULL;
+    header.microseconds = (timestamp % 1000000000ULL) / 1000;
+    header.status = submission ? -EINPROGRESS : record->status;
+    header.length = length;
+    header.captured = captured;
+    memcpy(packet, &header, sizeof (header));
+    memcpy(packet + sizeof (header), record->payload, captured);
+
+    struct {
+        uint32_t interface;
+        uint32_t timestamphigh;
+        uint32_t timestamplow;
+        uint32_t captured;
+        uint32_t original;
+    } body = {
+        0, (uint32_t) (timestamp >> 32), (uint32_t) timestamp,
+        (uint32_t) (sizeof (header) + captured), (uint32_t) (sizeof (header) + (hasdata ? length : 0)),
+    };
+    return writeblock(f, PCAPNG_ENHANCED_PACKET, &body, sizeof (body), packet, sizeof (header) + captured);
+}
+
+int usbtrace_writepcapng(struct usbtrace *trace, const char *path) {
+    FILE *f = fopen(path, "wb");
+    if (f == NULL) {
+        fprintf(stderr, "Failed to open trace file %s!\n", path);
+        return -1;
+    }
+
+    struct {
+        uint32_t magic;
+        uint16_t major;
+        uint16_t minor;
+        int64_t sectionlength;
+    } section = { PCAPNG_BYTE_ORDER_MAGIC, 1, 0, -1 };
+
+    // Timestamps in ns, then the end of the options
+    struct {
+        uint16_t linktype;
+        uint16_t reserved;
+        uint32_t snaplen;
+        uint16_t tsresolcode;
+        uint16_t tsresollength;
+        uint8_t tsresol;
+        uint8_t padding[3];
+        uint32_t endofoptions;
+    } interface = { USBTRACE_LINKTYPE, 0, sizeof (struct usbmon_header) + USBTRACE_SNAPLEN, PCAPNG_OPTION_TSRESOL, 1, 9, {0, 0, 0}, 0 };
+
+    int err = writeblock(f, PCAPNG_SECTION_HEADER, &section, sizeof (section), NULL, 0);
+    if (err == 0)
+        err = writeblock(f, PCAPNG_INTERFACE, &interface, sizeof (interface), NULL, 0);
+
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+    uint64_t capacity = trace->mask + 1;
+    uint64_t first = head > capacity ? head - capacity : 0;
+    size_t written = 0, torn = 0;
+    for (uint64_t index = first; index < head && err == 0; index++) {
+        struct usbtrace_record record;
+        struct usbtrace_record *slot = &trace->records[index & trace->mask];
+
+        // Copied out and checked again, a writer may have lapped us meanwhile
+        uint64_t sequence = atomic_load_explicit(&slot->sequence, memory_order_acquire);
+        memcpy((unsigned char*) &record + sizeof (record.sequence), (unsigned char*) slot + sizeof (slot->sequence),
+                sizeof (record) - sizeof (record.sequence));
+        atomic_thread_fence(memory_order_acquire);
+        if (sequence != 2 * index + 2 || atomic_load_explicit(&slot->sequence, memory_order_relaxed) != sequence) {
+            torn++;
+            continue;
+        }
+
+        err = writeevent(f, trace, &record, index, 'S');
+        if (err == 0)
+            err = writeevent(f, trace, &record, index, 'C');
+        written++;
+    }
+
+    if (fclose(f) != 0)
+        err = -1;
+    if (err != 0) {
+        fprintf(stderr, "Failed to write trace file %s!\n", path);
+        return -1;
+    }
+    fprintf(stderr, "Trace: %zu transfers written to %s", written, path);
+    if (first > 0 || torn > 0)
+        fprintf(stderr, " (%llu older ones overwritten, %zu skipped while written)", (unsigned long long) first, torn);
+    fprintf(stderr, "\n");
+    return 0;
+}
+
+void usbtrace_report(struct usbtrace *trace, FILE *out) {
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint64_t capacity = trace->mask + 1;
+    fprintf(out, "Trace: %llu transfers recorded, last %llu kept, %zu bytes of ring\n",
+            (unsigned long long) head, (unsigned long long) (head < capacity ? head : capacity), (size_t) capacity * sizeof (struct usbtrace_record));
+}
@@ -0,0 +1,123 @@
+#ifndef USBTRACE_H
+#define USBTRACE_H
+
+#include <errno.h>
+#include <libusb-1.0/libusb.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+
+// Binary trace of every USB transfer, kept in a preallocated ring that wraps
+// around and written out as pcapng with the Linux usbmon link type, so
+// Wireshark decodes it like a capture of usbmon:
+//   wireshark trace.pcapng
+//
+// A transfer costs a slot claimed with one atomic add and a single memcpy of
+// at most USBTRACE_SNAPLEN bytes of payload, nothing is formatted or written
+// while the device runs. Commands go out from the main thread while EP. 81
+// completes on the capture event thread, both can add at the same time. Every
+// slot carries a sequence number, odd while it is written, the export skips
+// the ones caught half written.
+
+#define USBTRACE_SNAPLEN			64			// payload bytes kept per transfer
+#define USBTRACE_DEFAULT_RECORDS	16384		// power of two
+
+struct usbtrace_record {
+    atomic_uint_least64_t sequence;		// 2 * index + 1 while written, 2 * index + 2 once done
+    uint64_t submitted;					// ns, CLOCK_MONOTONIC
+    uint64_t completed;					// ns, CLOCK_MONOTONIC
+    int32_t status;						// 0 or a negative errno, as usbmon reports it
+    uint32_t length;					// requested
+    uint32_t actual;					// transferred
+    uint16_t busnum;
+    uint8_t devnum;
+    uint8_t endpoint;
+    uint8_t captured;					// payload bytes kept
+    uint8_t reserved[3];
+    unsigned char payload[USBTRACE_SNAPLEN];
+};
+
+struct usbtrace {
+    struct usbtrace_record *records;
+    size_t mask;
+    atomic_uint_least64_t head;			// transfers recorded since the start
+    int64_t realtimeoffset;				// ns from CLOCK_MONOTONIC to the wall clock
+};
+
+// Allocates and touches the whole ring, records is rounded up to a power of two.
+int usbtrace_init(struct usbtrace *trace, size_t records);
+void usbtrace_free(struct usbtrace *trace);
+
+// Writes the transfers still in the ring, oldest first.
+int usbtrace_writepcapng(struct usbtrace *trace, const char *path);
+void usbtrace_report(struct usbtrace *trace, FILE *out);
+
+// usbmon status of a libusb error code.
+static inline int32_t usbtrace_errno(int err) {
+    switch (err) {
+        case 0:
+            return 0;
+        case LIBUSB_ERROR_TIMEOUT:
+            return -ETIMEDOUT;
+        case LIBUSB_ERROR_PIPE:
+            return -EPIPE;
+        case LIBUSB_ERROR_OVERFLOW:
+            return -EOVERFLOW;
+        case LIBUSB_ERROR_NO_DEVICE:
+            return -ENODEV;
+        default:
+            return -EIO;
+    }
+}
+
+// usbmon status of an async transfer.
+static inline int32_t usbtrace_transfererrno(enum libusb_transfer_status status) {
+    switch (status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            return 0;
+        case LIBUSB_TRANSFER_TIMED_OUT:
+            return -ETIMEDOUT;
+        case LIBUSB_TRANSFER_CANCELLED:
+            return -ECONNRESET;
+        case LIBUSB_TRANSFER_STALL:
+            return -EPIPE;
+        case LIBUSB_TRANSFER_NO_DEVICE:
+            return -ENODEV;
+        case LIBUSB_TRANSFER_OVERFLOW:
+            return -EOVERFLOW;
+        default:
+            return -EIO;
+    }
+}
+
+// Records a finished transfer of the device at busnum:devnum. OUT transfers keep what was sent, IN ones what came back.
+static inline void usbtrace_add(struct usbtrace *trace, uint16_t busnum, uint8_t devnum, unsigned char endpoint, const unsigned char *data, int length, int actual,
+        int32_t status, uint64_t submitted, uint64_t completed) {
+    uint64_t index = atomic_fetch_add_explicit(&trace->head, 1, memory_order_relaxed);
+    struct usbtrace_record *record = &trace->records[index & trace->mask];
+
+    atomic_store_explicit(&record->sequence, 2 * index + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    int kept = (endpoint & 0x80) ? actual : length;
+    if (kept > USBTRACE_SNAPLEN)
+        kept = USBTRACE_SNAPLEN;
+    if (kept < 0 || data == NULL)
+        kept = 0;
+    record->submitted = submitted;
+    record->completed = completed;
+    record->status = status;
+    record->length = length;
+    record->actual = actual;
+    record->busnum = busnum;
+    record->devnum = devnum;
+    record->endpoint = endpoint;
+    record->captured = kept;
+    if (kept > 0)
+        memcpy(record->payload, data, kept);
+
+    atomic_store_explicit(&record->sequence, 2 * index + 2, memory_order_release);
+}
+
+#endif
@@ -0,0 +1,156 @@
+#include "writer.h"
+#include "lgp.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline void cpu_relax(void) {
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#endif
+}
+
+static void *writer_thread(void *arg) {
+    struct writer *w = (struct writer*) arg;
+
+    while (1) {
+        struct streambuffer *buffer = (struct streambuffer*) spscring_pop(&w->filled);
+        if (buffer == NULL) {
+            if (w->stopping)
+                break;
+            sem_wait(&w->wakeup);
+            continue;
+        }
+
+        uint64_t start = lgp_now_ns();
+        int err = w->sink(w->sinkdata, buffer);
+        if (err < 0)
+            w->stats.sink_errors++;
+        uint64_t elapsed = lgp_now_ns() - start;
+        if (elapsed > w->stats.max_sink_time)
+            w->stats.max_sink_time = elapsed;
+
+        w->stats.buffers++;
+        w->stats.bytes += buffer->length;
+
+        // Cannot fail, the ring holds every buffer of the pool
+        if (err == WRITER_SINK_KEPT)
+            w->stats.kept++;
+        else
+            spscring_push(&w->spare, buffer);
+    }
+    return NULL;
+}
+
+int writer_init(struct writer *w, size_t depth, size_t backlog, size_t buffersize, struct dmapool *pool, writer_sink sink, void *sinkdata) {
+    memset(w, 0, sizeof (struct writer));
+    w->depth = depth;
+    w->buffercount = depth + (backlog > 0 ? backlog : WRITER_DEFAULT_BACKLOG);
+    w->sink = sink;
+    w->sinkdata = sinkdata;
+    w->pool = pool;
+
+    if (sem_init(&w->wakeup, 0, 0) != 0)
+        return -1;
+
+    if (spscring_init(&w->filled, w->buffercount) != 0 || spscring_init(&w->spare, w->buffercount) != 0)
+        goto error;
+
+    w->buffers = (struct streambuffer*) calloc(w->buffercount, sizeof (struct streambuffer));
+    w->lent = (struct streambuffer**) calloc(depth, sizeof (struct streambuffer*));
+    if (w->buffers == NULL || w->lent == NULL)
+        goto error;
+
+    for (size_t i = 0; i < w->buffercount; i++) {
+        w->buffers[i].data = pool != NULL ? dmapool_get(pool, buffersize) : (unsigned char*) malloc(buffersize);
+        w->buffers[i].capacity = buffersize;
+        if (w->buffers[i].data == NULL)
+            goto error;
+        // The first depth buffers go to the capture transfers
+        if (i < depth)
+            w->lent[i] = &w->buffers[i];
+        else
+            spscring_push(&w->spare, &w->buffers[i]);
+    }
+    return 0;
+
+error:
+    fprintf(stderr, "Failed to allocate %zu writer buffers of %zu bytes!\n", w->buffercount, buffersize);
+    writer_free(w);
+    return -1;
+}
+
+int writer_start(struct writer *w) {
+    w->stopping = 0;
+    if (pthread_create(&w->thread, NULL, writer_thread, w) != 0) {
+        fprintf(stderr, "Failed to start the writer thread!\n");
+        return -1;
+    }
+    return 0;
+}
+
+void writer_stop(struct writer *w) {
+    w->stopping = 1;
+    sem_post(&w->wakeup);
+    pthread_join(w->thread, NULL);
+}
+
+void writer_free(struct writer *w) {
+    if (w->buffers != NULL) {
+        for (size_t i = 0; i < w->buffercount; i++) {
+            if (w->pool != NULL)
+                dmapool_put(w->pool, w->buffers[i].data, w->buffers[i].capacity);
+            else
+                free(w->buffers[i].data);
+        }
+        free(w->buffers);
+        w->buffers = NULL;
+    }
+    free(w->lent);
+    w->lent = NULL;
+    spscring_free(&w->filled);
+    spscring_free(&w->spare);
+    sem_destroy(&w->wakeup);
+}
+
+struct streambuffer **writer_capturebuffers(struct writer *w) {
+    return w->lent;
+}
+
+void writer_release(struct writer *w, struct streambuffer *buffer) {
+    w->stats.kept--;
+    spscring_push(&w->spare, buffer);
+}
+
+struct streambuffer *writer_push(void *userdata, struct streambuffer *buffer) {
+    struct writer *w = (struct writer*) userdata;
+
+    struct streambuffer *spare = (struct streambuffer*) spscring_pop(&w->spare);
+    if (spare == NULL) {
+        // Storage is behind, give it a very short chance to hand a buffer back
+        w->stats.producer_waits++;
+        for (int i = 0; i < WRITER_PRODUCER_SPINS && spare == NULL; i++) {
+            cpu_relax();
+            spare = (struct streambuffer*) spscring_pop(&w->spare);
+        }
+        if (spare == NULL) {
+            // Never stall the endpoint: drop this transfer and reuse its buffer
+            w->stats.dropped++;
+            w->stats.dropped_bytes += buffer->length;
+            return buffer;
+        }
+    }
+
+    spscring_push(&w->filled, buffer);
+    sem_post(&w->wakeup);
+    return spare;
+}
+
+void writer_report(struct writer *w, FILE *out) {
+    fprintf(out, "Writer: %llu buffers, %llu bytes, ring %zu/%zu (high-water %zu), %llu producer waits, %llu dropped (%llu bytes), %llu sink errors, %llu kept by the sink, max sink time %.2f ms\n",
+            (unsigned long long) w->stats.buffers, (unsigned long long) w->stats.bytes,
+            spscring_count(&w->filled), w->buffercount - w->depth, w->filled.highwater,
+            (unsigned long long) w->stats.producer_waits, (unsigned long long) w->stats.dropped,
+            (unsigned long long) w->stats.dropped_bytes, (unsigned long long) w->stats.sink_errors,
+            (unsigned long long) w->stats.kept, w->stats.max_sink_time / 1e6);
+}
@@ -0,0 +1,80 @@
+#ifndef WRITER_H
+#define WRITER_H
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include "capture.h"
+#include "dmapool.h"
+#include "spscring.h"
+
+// Extra buffers on top of the transfers in flight, this is how much stream
+// data can pile up while the storage is slower than the USB side.
+#define WRITER_DEFAULT_BACKLOG		256
+
+// How long the producer spins for a spare buffer before dropping a transfer
+#define WRITER_PRODUCER_SPINS		256
+
+// Sink return value when it keeps the buffer, it gives it back later with writer_release()
+#define WRITER_SINK_KEPT	1
+
+// Called from the writer thread for every buffer, in capture order.
+// Returns 0 once done with the buffer, WRITER_SINK_KEPT or -1 on error.
+typedef int (*writer_sink)(void *userdata, struct streambuffer *buffer);
+
+struct writer_stats {
+    uint64_t buffers;
+    uint64_t bytes;
+    uint64_t producer_waits;	// times the producer found no spare buffer right away
+    uint64_t dropped;			// transfers dropped because storage was too slow
+    uint64_t dropped_bytes;
+    uint64_t sink_errors;
+    uint64_t max_sink_time;		// ns
+    uint64_t kept;				// buffers the sink holds right now
+};
+
+// Hands completed capture buffers over to a dedicated writer thread.
+// The event thread pushes filled buffers on one ring and takes spare ones
+// back from a second ring, so stream data is never copied.
+struct writer {
+    struct spscring filled;		// capture -> writer
+    struct spscring spare;		// writer -> capture
+
+    struct streambuffer *buffers;
+    size_t buffercount;
+    size_t depth;				// buffers lent to the capture transfers
+    struct streambuffer **lent;
+    struct dmapool *pool;		// where the buffers came from, NULL for the heap
+
+    writer_sink sink;
+    void *sinkdata;
+
+    sem_t wakeup;
+    pthread_t thread;
+    volatile int stopping;
+
+    struct writer_stats stats;
+};
+
+// Allocates depth + backlog buffers of buffersize bytes, from pool unless it is NULL:
+// every one of them ends up in a capture transfer sooner or later.
+int writer_init(struct writer *w, size_t depth, size_t backlog, size_t buffersize, struct dmapool *pool, writer_sink sink, void *sinkdata);
+int writer_start(struct writer *w);
+// Drains every pending buffer before returning.
+void writer_stop(struct writer *w);
+void writer_free(struct writer *w);
+
+// Buffers to give to capture_init(), depth of them.
+struct streambuffer **writer_capturebuffers(struct writer *w);
+
+// Gives back a buffer the sink kept, from the sink or once the writer stopped.
+void writer_release(struct writer *w, struct streambuffer *buffer);
+
+// capture_callback pushing the buffers to the writer thread.
+struct streambuffer *writer_push(void *userdata, struct streambuffer *buffer);
+
+void writer_report(struct writer *w, FILE *out);
+
+#endif
@@ -0,0 +1,534 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "lgp.h"
+#include "capture.h"
+#include "command.h"
+#include "emulator.h"
+#include "nalscan.h"
+#include "sequence.h"
+#include "writer.h"
+
+// Microbenchmarks of the hot paths, against the emulator where a device is
+// needed. Every benchmark runs warmup repetitions, then timed ones of ops
+// operations each; the percentiles are over the time per operation of every
+// repetition. Results go to a JSON file that can be compared with the
+// baseline checked in under bench/.
+
+#define BENCH_MAX_REPETITIONS	1000
+#define BENCH_STREAM_SIZE		(8 * 1024 * 1024)
+#define BENCH_CAPTURE_SIZE		(32 * 1024 * 1024)
+#define BENCH_BASELINE_MAX		64
+
+struct benchcontext {
+    const char *textsequence;
+    char compiledsequence[64];
+    char outputpath[64];
+
+    // Synthetic H.264 taken from the emulator, the input of the stream benchmarks
+    unsigned char *stream;
+    size_t streamlength;
+
+    struct transport transport;
+    int transportopen;
+    int savedstderr;
+
+    FILE *output;
+    struct writer writer;
+    int writing;
+    int writerrunning;
+    struct capture cap;
+    int capturing;
+    uint64_t dropped;		// by the writer, in the repetitions so far
+};
+
+struct benchmark {
+    const char *name;
+    const char *unit;		// what one operation is
+    size_t ops;				// operations per repetition
+    size_t bytes;			// per operation, 0 when throughput means nothing
+    // setup and teardown run around every repetition and are not timed
+    int (*setup)(struct benchcontext *ctx);
+    int (*run)(struct benchcontext *ctx, size_t ops);
+    void (*teardown)(struct benchcontext *ctx);
+};
+
+struct benchresult {
+    const struct benchmark *bench;
+    double mean;			// ns per operation
+    double min;
+    double p50;
+    double p90;
+    double p99;
+    double max;
+    double dropped;			// transfers the writer dropped, per repetition
+};
+
+struct baseline {
+    char name[64];
+    double p50;
+};
+
+// Sequences
+
+static int bench_sequence_compile(struct benchcontext *ctx, size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        struct sequence seq;
+        if (sequence_open(&seq, ctx->textsequence) != 0)
+            return -1;
+        sequence_close(&seq);
+    }
+    return 0;
+}
+
+static int bench_sequence_map(struct benchcontext *ctx, size_t ops) {
+    volatile size_t total = 0;
+    for (size_t i = 0; i < ops; i++) {
+        struct sequence seq;
+        if (sequence_open(&seq, ctx->compiledsequence) != 0)
+            return -1;
+        // Walks it like the executor does, the pages have to come in
+        for (size_t j = 0; j < seq.count; j++)
+            total += sequence_command(&seq, j)[0] + seq.entries[j].size;
+        sequence_close(&seq);
+    }
+    return 0;
+}
+
+// stderr goes to /dev/null while the library prints what the benchmarks do not care about
+static void bench_quiet(struct benchcontext *ctx) {
+    fflush(stderr);
+    ctx->savedstderr = dup(STDERR_FILENO);
+    int null = open("/dev/null", O_WRONLY);
+    if (null >= 0) {
+        dup2(null, STDERR_FILENO);
+        close(null);
+    }
+}
+
+static void bench_loud(struct benchcontext *ctx) {
+    if (ctx->savedstderr >= 0) {
+        fflush(stderr);
+        dup2(ctx->savedstderr, STDERR_FILENO);
+        close(ctx->savedstderr);
+    }
+    ctx->savedstderr = -1;
+}
+
+// An emulator streaming at ratescale times the real bitrate, 0 for as fast as it can.
+// It describes its stream when it starts, once is enough.
+static int bench_openemulator(struct benchcontext *ctx, double ratescale) {
+    struct emulator_config config;
+    emulator_defaults(&config);
+    config.ratescale = ratescale;
+
+    int loud = ctx->savedstderr < 0;
+    if (loud)
+        bench_quiet(ctx);
+    int err = transport_open_emulator(&ctx->transport, &config);
+    if (loud)
+        bench_loud(ctx);
+    ctx->transportopen = err == 0;
+    return err;
+}
+
+static void bench_closetransport(struct benchcontext *ctx) {
+    if (ctx->transportopen)
+        transport_close(&ctx->transport);
+    ctx->transportopen = 0;
+}
+
+// Commands, on the emulator. writecommand() and readstatus() print every
+// command, stderr goes to /dev/null meanwhile but the printing is measured.
+
+static int bench_command_setup(struct benchcontext *ctx) {
+    if (bench_openemulator(ctx, 1.0) != 0)
+        return -1;
+    bench_quiet(ctx);
+    return 0;
+}
+
+static void bench_command_teardown(struct benchcontext *ctx) {
+    bench_closetransport(ctx);
+    bench_loud(ctx);
+}
+
+static int bench_command_roundtrip(struct benchcontext *ctx, size_t ops) {
+    for (size_t i = 0; i < ops; i++) {
+        // LED blink, acknowledged on EP. 83
+        writecommand_va(&ctx->transport, 10, 0x0b, 0x01, 0x02, 0x00, 0x15, 0x00, 0x00, 0x00, 0x2c, 0x0b);
+        readstatus(&ctx->transport);
+    }
+    return 0;
+}
+
+// Stream
+
+static int bench_nalscan(struct benchcontext *ctx, size_t ops) {
+    struct nalscan scanner;
+    nalscan_init(&scanner, NULL, NULL);
+    for (size_t i = 0; i < ops; i++) {
+        size_t offset = (i * VIDEO_TRANSFER_SIZE) % (ctx->streamlength - VIDEO_TRANSFER_SIZE + 1);
+        nalscan_push(&scanner, ctx->stream + offset, VIDEO_TRANSFER_SIZE, 0);
+    }
+    nalscan_finish(&scanner);
+    return 0;
+}
+
+static int writetofile(void *userdata, struct streambuffer *buffer) {
+    FILE *output = (FILE*) userdata;
+    return fwrite(buffer->data, 1, buffer->length, output) == buffer->length ? 0 : -1;
+}
+
+static int bench_output_open(struct benchcontext *ctx) {
+    ctx->output = fopen(ctx->outputpath, "w+b");
+    return ctx->output != NULL ? 0 : -1;
+}
+
+static int bench_writer_setup(struct benchcontext *ctx) {
+    if (bench_output_open(ctx) != 0)
+        return -1;
+    if (writer_init(&ctx->writer, CAPTURE_DEFAULT_DEPTH, WRITER_DEFAULT_BACKLOG, VIDEO_TRANSFER_SIZE, NULL, writetofile, ctx->output) != 0)
+        return -1;
+    ctx->writing = 1;
+    // As if every buffer had been filled by a transfer already
+    for (size_t i = 0; i < ctx->writer.buffercount; i++)
+        memcpy(ctx->writer.buffers[i].data, ctx->stream + (i * VIDEO_TRANSFER_SIZE) % (ctx->streamlength - VIDEO_TRANSFER_SIZE + 1), VIDEO_TRANSFER_SIZE);
+    if (writer_start(&ctx->writer) != 0)
+        return -1;
+    ctx->writerrunning = 1;
+    return 0;
+}
+
+static void bench_writer_stop(struct benchcontext *ctx) {
+    if (ctx->writerrunning)
+        writer_stop(&ctx->writer);
+    ctx->writerrunning = 0;
+}
+
+static void bench_writer_teardown(struct benchcontext *ctx) {
+    if (ctx->capturing)
+        capture_free(&ctx->cap);
+    ctx->capturing = 0;
+    bench_writer_stop(ctx);
+    if (ctx->writing) {
+        ctx->dropped += ctx->writer.stats.dropped;
+        writer_free(&ctx->writer);
+    }
+    ctx->writing = 0;
+    bench_closetransport(ctx);
+    if (ctx->output != NULL)
+        fclose(ctx->output);
+    ctx->output = NULL;
+}
+
+// The capture side of the writer: hands buffers over and takes spare ones back.
+// The backlog holds a whole repetition, nothing is dropped however slow the disk.
+static int bench_writer(struct benchcontext *ctx, size_t ops) {
+    struct streambuffer **lent = writer_capturebuffers(&ctx->writer);
+    for (size_t i = 0; i < ops; i++) {
+        struct streambuffer *buffer = lent[i % ctx->writer.depth];
+        buffer->length = VIDEO_TRANSFER_SIZE;
+        buffer->sequence = i;
+        lent[i % ctx->writer.depth] = writer_push(&ctx->writer, buffer);
+    }
+    bench_writer_stop(ctx);
+    return fflush(ctx->output) == 0 ? 0 : -1;
+}
+
+// End to end: unthrottled emulator, capture transfers, writer thread, file.
+static int bench_capture_setup(struct benchcontext *ctx) {
+    if (bench_openemulator(ctx, 0) != 0)
+        return -1;
+
+    if (bench_output_open(ctx) != 0)
+        return -1;
+    if (writer_init(&ctx->writer, CAPTURE_DEFAULT_DEPTH, WRITER_DEFAULT_BACKLOG, VIDEO_TRANSFER_SIZE, NULL, writetofile, ctx->output) != 0)
+        return -1;
+    ctx->writing = 1;
+    if (writer_start(&ctx->writer) != 0)
+        return -1;
+    ctx->writerrunning = 1;
+    if (capture_init(&ctx->cap, &ctx->transport, CAPTURE_DEFAULT_DEPTH, VIDEO_TRANSFER_SIZE, writer_capturebuffers(&ctx->writer), writer_push, &ctx->writer) != 0)
+        return -1;
+    ctx->capturing = 1;
+    return 0;
+}
+
+static int bench_capture(struct benchcontext *ctx, size_t ops) {
+    if (capture_start(&ctx->cap) == 0) {
+        while (ctx->cap.running && ctx->cap.stats.bytes < ops * VIDEO_TRANSFER_SIZE)
+            usleep(100);
+    }
+    capture_stop(&ctx->cap);
+    bench_writer_stop(ctx);
+    if (ctx->cap.failed)
+        return -1;
+    return fflush(ctx->output) == 0 ? 0 : -1;
+}
+
+static const struct benchmark benchmarks[] = {
+    { "sequence_compile", "sequence", 5, 0, NULL, bench_sequence_compile, NULL },
+    { "sequence_map", "sequence", 200, 0, NULL, bench_sequence_map, NULL },
+    { "command_roundtrip", "command", 2000, 0, bench_command_setup, bench_command_roundtrip, bench_command_teardown },
+    { "nalscan", "transfer", BENCH_STREAM_SIZE / VIDEO_TRANSFER_SIZE, VIDEO_TRANSFER_SIZE, NULL, bench_nalscan, NULL },
+    { "writer_disk", "transfer", WRITER_DEFAULT_BACKLOG, VIDEO_TRANSFER_SIZE, bench_writer_setup, bench_writer, bench_writer_teardown },
+    { "capture_emulated", "transfer", BENCH_CAPTURE_SIZE / VIDEO_TRANSFER_SIZE, VIDEO_TRANSFER_SIZE, bench_capture_setup, bench_capture, bench_writer_teardown },
+};
+
+#define BENCH_COUNT	(sizeof (benchmarks) / sizeof (benchmarks[0]))
+
+static int comparedouble(const void *a, const void *b) {
+    double x = *(const double*) a;
+    double y = *(const double*) b;
+    return x < y ? -1 : x > y;
+}
+
+// Nearest rank on sorted samples.
+static double percentile(const double *sorted, size_t count, double p) {
+    size_t rank = (size_t) (p * count + 0.999999);
+    if (rank == 0)
+        rank = 1;
+    return sorted[(rank > count ? count : rank) - 1];
+}
+
+static int runbenchmark(struct benchcontext *ctx, const struct benchmark *bench, size_t warmup, size_t repetitions, struct benchresult *result) {
+    double samples[BENCH_MAX_REPETITIONS];
+
+    for (size_t r = 0; r < warmup + repetitions; r++) {
+        // Only the timed repetitions count
+        if (r == warmup)
+            ctx->dropped = 0;
+        if (bench->setup != NULL && bench->setup(ctx) != 0) {
+            if (bench->teardown != NULL)
+                bench->teardown(ctx);
+            return -1;
+        }
+        uint64_t start = lgp_now_ns();
+        int err = bench->run(ctx, bench->ops);
+        uint64_t elapsed = lgp_now_ns() - start;
+        if (bench->teardown != NULL)
+            bench->teardown(ctx);
+        if (err != 0)
+            return -1;
+        if (r >= warmup)
+            samples[r - warmup] = (double) elapsed / bench->ops;
+    }
+
+    double total = 0;
+    for (size_t i = 0; i < repetitions; i++)
+        total += samples[i];
+    qsort(samples, repetitions, sizeof (double), comparedouble);
+
+    result->bench = bench;
+    result->mean = total / repetitions;
+    result->min = samples[0];
+    result->p50 = percentile(samples, repetitions, 0.50);
+    result->p90 = percentile(samples, repetitions, 0.90);
+    result->p99 = percentile(samples, repetitions, 0.99);
+    result->max = samples[repetitions - 1];
+    result->dropped = (double) ctx->dropped / repetitions;
+    return 0;
+}
+
+static double megabytespersecond(const struct benchresult *result) {
+    return result->bench->bytes > 0 ? result->bench->bytes / result->p50 * 1e9 / (1024.0 * 1024.0) : 0;
+}
+
+static void writejson(FILE *out, const struct benchresult *results, size_t count, size_t warmup, size_t repetitions) {
+    fprintf(out, "{\n");
+    fprintf(out, "  \"tool\": \"lgp_bench\",\n");
+    fprintf(out, "  \"simd\": \"%s\",\n", nalscan_simd());
+    fprintf(out, "  \"warmup\": %zu,\n", warmup);
+    fprintf(out, "  \"repetitions\": %zu,\n", repetitions);
+    fprintf(out, "  \"benchmarks\": [\n");
+    // One benchmark per line, the baseline reader depends on it
+    for (size_t i = 0; i < count; i++) {
+        const struct benchresult *r = &results[i];
+        fprintf(out, "    {\"name\": \"%s\", \"unit\": \"%s\", \"ops\": %zu, \"bytes_per_op\": %zu, "
+                "\"mean_ns\": %.1f, \"min_ns\": %.1f, \"p50_ns\": %.1f, \"p90_ns\": %.1f, \"p99_ns\": %.1f, \"max_ns\": %.1f, \"mb_per_s\": %.1f, \"dropped\": %.1f}%s\n",
+                r->bench->name, r->bench->unit, r->bench->ops, r->bench->bytes,
+                r->mean, r->min, r->p50, r->p90, r->p99, r->max, megabytespersecond(r), r->dropped, i + 1 < count ? "," : "");
+    }
+    fprintf(out, "  ]\n");
+    fprintf(out, "}\n");
+}
+
+// Reads back the name and median of every benchmark of a file writejson() wrote.
+static int readbaseline(const char *path, struct baseline *baselines, size_t *count) {
+    char line[1024];
+    FILE *in = fopen(path, "r");
+    if (in == NULL) {
+        fprintf(stderr, "Failed to open baseline %s!\n", path);
+        return -1;
+    }
+
+    *count = 0;
+    while (fgets(line, sizeof (line), in) != NULL && *count < BENCH_BASELINE_MAX) {
+        char *name = strstr(line, "\"name\": \"");
+        char *p50 = strstr(line, "\"p50_ns\": ");
+        if (name == NULL || p50 == NULL)
+            continue;
+        struct baseline *b = &baselines[*count];
+        if (sscanf(name + 9, "%63[^\"]", b->name) == 1 && sscanf(p50 + 10, "%lf", &b->p50) == 1)
+            (*count)++;
+    }
+    fclose(in);
+    return 0;
+}
+
+// Returns the number of benchmarks slower than the baseline by more than tolerance percent.
+static int compare(const struct benchresult *results, size_t count, const struct baseline *baselines, size_t baselinecount, double tolerance) {
+    int regressions = 0;
+
+    fprintf(stderr, "\n%-20s %14s %14s %9s\n", "vs. baseline", "baseline p50", "p50", "change");
+    for (size_t i = 0; i < count; i++) {
+        const struct baseline *b = NULL;
+        for (size_t j = 0; j < baselinecount; j++) {
+            if (strcmp(baselines[j].name, results[i].bench->name) == 0)
+                b = &baselines[j];
+        }
+        if (b == NULL || b->p50 <= 0) {
+            fprintf(stderr, "%-20s %14s %14.1f\n", results[i].bench->name, "-", results[i].p50);
+            continue;
+        }
+
+        double change = (results[i].p50 - b->p50) / b->p50 * 100.0;
+        int regressed = change > tolerance;
+        regressions += regressed;
+        fprintf(stderr, "%-20s %14.1f %14.1f %+8.1f%%%s\n", results[i].bench->name, b->p50, results[i].p50, change, regressed ? "  REGRESSION" : "");
+    }
+    return regressions;
+}
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-s text sequence] [-w warmup repetitions] [-n repetitions] [-f benchmark name filter] [-j json output, - for stdout] [-c baseline json] [-t tolerance %%]\n", name);
+}
+
+int main(int argc, char **argv) {
+    struct benchcontext ctx;
+    struct benchresult results[BENCH_COUNT];
+    size_t resultcount = 0;
+    size_t warmup = 3;
+    size_t repetitions = 30;
+    const char *filter = NULL;
+    const char *jsonpath = NULL;
+    const char *baselinepath = NULL;
+    double tolerance = 15.0;
+    int err = 0;
+    int opt;
+
+    memset(&ctx, 0, sizeof (ctx));
+    ctx.textsequence = "capture_sequence";
+    ctx.savedstderr = -1;
+
+    while ((opt = getopt(argc, argv, "s:w:n:f:j:c:t:")) != -1) {
+        switch (opt) {
+            case 's':
+                ctx.textsequence = optarg;
+                break;
+            case 'w':
+                warmup = strtoul(optarg, NULL, 0);
+                break;
+            case 'n':
+                repetitions = strtoul(optarg, NULL, 0);
+                break;
+            case 'f':
+                filter = optarg;
+                break;
+            case 'j':
+                jsonpath = optarg;
+                break;
+            case 'c':
+                baselinepath = optarg;
+                break;
+            case 't':
+                tolerance = strtod(optarg, NULL);
+                break;
+            default:
+                usage(argv[0]);
+                return -1;
+        }
+    }
+    if (repetitions == 0 || repetitions > BENCH_MAX_REPETITIONS) {
+        fprintf(stderr, "Repetitions must be between 1 and %d.\n", BENCH_MAX_REPETITIONS);
+        return -1;
+    }
+
+    snprintf(ctx.compiledsequence, sizeof (ctx.compiledsequence), "/tmp/lgp_bench_%d.seq", (int) getpid());
+    snprintf(ctx.outputpath, sizeof (ctx.outputpath), "/tmp/lgp_bench_%d.h264", (int) getpid());
+    if (sequence_convert(ctx.textsequence, ctx.compiledsequence) != 0) {
+        fprintf(stderr, "Failed to compile %s, give the capture sequence with -s.\n", ctx.textsequence);
+        return -1;
+    }
+
+    // Stream input, from the emulator without pacing
+    ctx.stream = (unsigned char*) malloc(BENCH_STREAM_SIZE);
+    if (ctx.stream == NULL || bench_openemulator(&ctx, 0) != 0) {
+        fprintf(stderr, "Failed to get a stream from the emulator!\n");
+        err = -1;
+        goto cleanup;
+    }
+    while (ctx.streamlength < BENCH_STREAM_SIZE) {
+        int transferred = 0;
+        if (transport_bulk_transfer(&ctx.transport, CAMERA_ENDPOINT_ADDRESS_VIDEO_CAPTURE, ctx.stream + ctx.streamlength, VIDEO_TRANSFER_SIZE, &transferred, TIMEOUT) != 0)
+            break;
+        ctx.streamlength += transferred;
+    }
+    bench_closetransport(&ctx);
+    if (ctx.streamlength < BENCH_STREAM_SIZE) {
+        fprintf(stderr, "Failed to get a stream from the emulator!\n");
+        err = -1;
+        goto cleanup;
+    }
+
+    fprintf(stderr, "%-20s %-9s %12s %12s %12s %12s %12s %10s %8s\n", "benchmark", "per", "min ns", "p50 ns", "p90 ns", "p99 ns", "max ns", "MB/s", "dropped");
+    for (size_t i = 0; i < BENCH_COUNT; i++) {
+        if (filter != NULL && strstr(benchmarks[i].name, filter) == NULL)
+            continue;
+        struct benchresult *r = &results[resultcount];
+        if (runbenchmark(&ctx, &benchmarks[i], warmup, repetitions, r) != 0) {
+            fprintf(stderr, "%-20s failed!\n", benchmarks[i].name);
+            err = -1;
+            continue;
+        }
+        resultcount++;
+        fprintf(stderr, "%-20s %-9s %12.1f %12.1f %12.1f %12.1f %12.1f %10.1f %8.1f\n", r->bench->name, r->bench->unit,
+                r->min, r->p50, r->p90, r->p99, r->max, megabytespersecond(r), r->dropped);
+    }
+
+    if (jsonpath != NULL) {
+        FILE *out = strcmp(jsonpath, "-") == 0 ? stdout : fopen(jsonpath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Failed to create %s!\n", jsonpath);
+            err = -1;
+        } else {
+            writejson(out, results, resultcount, warmup, repetitions);
+            if (out != stdout)
+                fclose(out);
+        }
+    }
+
+    if (baselinepath != NULL) {
+        struct baseline baselines[BENCH_BASELINE_MAX];
+        size_t baselinecount = 0;
+        if (readbaseline(baselinepath, baselines, &baselinecount) != 0) {
+            err = -1;
+        } else {
+            int regressions = compare(results, resultcount, baselines, baselinecount, tolerance);
+            if (regressions > 0) {
+                fprintf(stderr, "%d benchmarks more than %.0f%% slower than the baseline.\n", regressions, tolerance);
+                err = 1;
+            }
+        }
+    }
+
+cleanup:
+    unlink(ctx.compiledsequence);
+    unlink(ctx.outputpath);
+    free(ctx.stream);
+    return err;
+}
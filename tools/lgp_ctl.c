@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "control.h"
+#include "lgp.h"
+
+static const struct {
+    const char *name;
+    uint8_t command;
+} commands[] = {
+    { "start", CONTROL_START },
+    { "stop", CONTROL_STOP },
+    { "mark", CONTROL_MARK },
+    { "rotate", CONTROL_ROTATE },
+    { "status", CONTROL_STATUS },
+    { "dump", CONTROL_DUMP },
+    { "profile", CONTROL_PROFILE },
+};
+
+static void usage(const char *name) {
+    fprintf(stderr, "Usage: %s [-t timeout ms] [-v] <socket> start [name] | stop | mark [label] | rotate [name] | status | dump | profile <profile>\n", name);
+}
+
+// Talks to a running lgp_gears -D: one command, its answer on stdout.
+// Exits with 1 when the daemon could not do it, 2 when it could not be reached.
+int main(int argc, char **argv) {
+    int timeout = 5000;
+    int verbose = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "t:v")) != -1) {
+        switch (opt) {
+            case 't':
+                timeout = atoi(optarg);
+                break;
+            case 'v':
+                // Round trip time on stderr
+                verbose = 1;
+                break;
+            default:
+                usage(argv[0]);
+                return 2;
+        }
+    }
+    if (argc - optind < 2 || argc - optind > 3) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    const char *socketpath = argv[optind];
+    const char *argument = argc - optind == 3 ? argv[optind + 2] : "";
+    size_t i;
+    for (i = 0; i < sizeof (commands) / sizeof (commands[0]); i++) {
+        if (strcmp(argv[optind + 1], commands[i].name) == 0)
+            break;
+    }
+    if (i == sizeof (commands) / sizeof (commands[0])) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    struct control_header reply;
+    unsigned char payload[CONTROL_MAX_PAYLOAD + 1];
+    uint64_t sent = lgp_now_ns();
+    if (control_request(socketpath, commands[i].command, argument, strlen(argument), &reply, payload, CONTROL_MAX_PAYLOAD, timeout) != 0)
+        return 2;
+    if (verbose)
+        fprintf(stderr, "%s: answered in %.2f ms\n", commands[i].name, (lgp_now_ns() - sent) / 1e6);
+
+    if (reply.status == CONTROL_OK && commands[i].command == CONTROL_STATUS) {
+        size_t count = reply.length / sizeof (struct control_devicestatus);
+        if (count == 0)
+            printf("no device\n");
+        for (size_t j = 0; j < count; j++) {
+            struct control_devicestatus status;
+            char line[256];
+            memcpy(&status, payload + j * sizeof (status), sizeof (status));
+            status.output[sizeof (status.output) - 1] = '\0';
+            control_formatstatus(&status, line, sizeof (line));
+            printf("%s\n", line);
+        }
+        return 0;
+    }
+
+    payload[reply.length] = '\0';
+    switch (reply.status) {
+        case CONTROL_OK:
+            printf("%s\n", (char*) payload);
+            return 0;
+        case CONTROL_FAILED:
+            printf("%s\n", (char*) payload);
+            return 1;
+        case CONTROL_UNKNOWN:
+            fprintf(stderr, "The daemon does not know %s, or takes line commands only\n", commands[i].name);
+            return 1;
+        default:
+            fprintf(stderr, "The daemon could not make sense of the request\n");
+            return 1;
+    }
+}
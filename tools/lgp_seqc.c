@@ -0,0 +1,35 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "sequence.h"
+
+// Compiles a text command sequence (capture_sequence format) into the binary
+// format loaded by lgp_gears with mmap, or with -c into a C header of static
+// const tables built into lgp_gears.
+int main(int argc, char **argv) {
+    if (argc == 5 && strcmp(argv[1], "-c") == 0) {
+        if (sequence_writeheader(argv[3], argv[4], argv[2]) != 0) {
+            fprintf(stderr, "Failed to compile %s!\n", argv[3]);
+            return -1;
+        }
+        return 0;
+    }
+
+    if (argc != 3) {
+        fprintf(stderr, "Usage: %s <text sequence> <compiled sequence>\n", argv[0]);
+        fprintf(stderr, "       %s -c <name> <text sequence> <header>\n", argv[0]);
+        return -1;
+    }
+
+    if (sequence_convert(argv[1], argv[2]) != 0) {
+        fprintf(stderr, "Failed to compile %s!\n", argv[1]);
+        return -1;
+    }
+
+    struct sequence seq;
+    if (sequence_open(&seq, argv[2]) != 0)
+        return -1;
+    fprintf(stderr, "%s: %zu commands, %u bytes of commands, %zu bytes total\n", argv[2], seq.count, seq.header->arenasize, seq.datasize);
+    sequence_close(&seq);
+    return 0;
+}
@@ -0,0 +1,74 @@
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "lgp.h"
+#include "shmclient.h"
+
+static volatile sig_atomic_t interrupted = 0;
+
+static void interrupt(int sig) {
+    (void) sig;
+    interrupted = 1;
+}
+
+// Reads the stream a running lgp_gears -p publishes, to stdout or just counted.
+// -w makes it a deliberately slow consumer, to watch it get skipped forward.
+int main(int argc, char **argv) {
+    int countonly = 0;
+    useconds_t delay = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "nw:")) != -1) {
+        switch (opt) {
+            case 'n':
+                countonly = 1;
+                break;
+            case 'w':
+                delay = strtoul(optarg, NULL, 0);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-n count only] [-w delay per chunk in us] <socket>\n", argv[0]);
+                return -1;
+        }
+    }
+    if (optind >= argc) {
+        fprintf(stderr, "Usage: %s [-n count only] [-w delay per chunk in us] <socket>\n", argv[0]);
+        return -1;
+    }
+    if (!countonly && isatty(STDOUT_FILENO)) {
+        fprintf(stderr, "Not writing the stream to a terminal, redirect it or use -n.\n");
+        return -1;
+    }
+
+    struct shmclient client;
+    if (shmclient_attach(&client, argv[optind]) != 0)
+        return -1;
+    signal(SIGINT, interrupt);
+    signal(SIGTERM, interrupt);
+
+    uint64_t lastreport = lgp_now_ns();
+    struct shmchunk chunk;
+    int err = 0;
+    while (!interrupted && (err = shmclient_read(&client, &chunk, 1000)) >= 0) {
+        if (err == 1) {
+            if (!countonly && fwrite(chunk.data, 1, chunk.length, stdout) != chunk.length) {
+                fprintf(stderr, "Failed to write to stdout!\n");
+                break;
+            }
+            if (delay > 0)
+                usleep(delay);
+            if (shmclient_release(&client, &chunk) != 0)
+                fprintf(stderr, "Chunk %llu was overwritten while being read!\n", (unsigned long long) chunk.sequence);
+        }
+        if (lgp_now_ns() - lastreport >= 1000000000ULL) {
+            shmclient_report(&client, stderr);
+            lastreport = lgp_now_ns();
+        }
+    }
+
+    shmclient_report(&client, stderr);
+    shmclient_detach(&client);
+    return 0;
+}